@@ -0,0 +1,548 @@
+/*
+ * aes.c - AES-256-GCM for encrypting archived segments
+ *
+ * Like sha256.c, this is a plain C implementation so we don't need a
+ * crypto library, with the AES-NI and PCLMULQDQ instructions used instead
+ * on x86-64 CPUs that have them. Those are many times faster, and unlike
+ * the table lookups of the plain C version, take the same time whatever
+ * the key and data, so they don't leak anything through the cache. Which
+ * to use is decided at runtime the first time anything is encrypted.
+ *
+ * Only what GCM needs is here: the forward cipher, counter mode, and
+ * GHASH, for 96-bit IVs.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <string.h>
+
+#include "pg_streamrecv.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && __GNUC__ >= 5
+#define USE_AES_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define AES256_ROUNDS	14
+
+static const unsigned char sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define XTIME(x)	((unsigned char) (((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0)))
+
+static void ctr_choose(const AESKey *key, const unsigned char *icb,
+					   const unsigned char *in, unsigned char *out, size_t len);
+static void ghash_choose(const unsigned char *h, unsigned char *y,
+						 const unsigned char *data, size_t len);
+
+static void (*ctr_crypt) (const AESKey *key, const unsigned char *icb,
+						  const unsigned char *in, unsigned char *out,
+						  size_t len) = ctr_choose;
+static void (*ghash) (const unsigned char *h, unsigned char *y,
+					  const unsigned char *data, size_t len) = ghash_choose;
+
+
+/*
+ * Expand a 256-bit key into the round keys, as in FIPS 197 section 5.2.
+ * The AES-NI version uses the same round keys, so this is shared.
+ */
+void
+aes256_init(AESKey *key, const unsigned char *k)
+{
+	unsigned char *w = key->rk;
+	unsigned char rcon = 1;
+	int			i,
+				j;
+
+	memcpy(w, k, 32);
+	for (i = 32; i < (AES256_ROUNDS + 1) * 16; i += 4)
+	{
+		unsigned char t[4];
+
+		memcpy(t, w + i - 4, 4);
+		if (i % 32 == 0)
+		{
+			unsigned char t0 = t[0];
+
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[t0];
+			rcon = XTIME(rcon);
+		}
+		else if (i % 32 == 16)
+		{
+			for (j = 0; j < 4; j++)
+				t[j] = sbox[t[j]];
+		}
+		for (j = 0; j < 4; j++)
+			w[i + j] = w[i - 32 + j] ^ t[j];
+	}
+}
+
+static void
+aes_encrypt_block_c(const AESKey *key, const unsigned char *in,
+					unsigned char *out)
+{
+	unsigned char s[16];
+	unsigned char t[16];
+	int			r,
+				c,
+				i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ key->rk[i];
+
+	for (r = 1; r <= AES256_ROUNDS; r++)
+	{
+		/* SubBytes and ShiftRows; the state is stored column by column */
+		for (c = 0; c < 4; c++)
+			for (i = 0; i < 4; i++)
+				t[c * 4 + i] = sbox[s[((c + i) % 4) * 4 + i]];
+
+		/* MixColumns, except in the last round */
+		if (r < AES256_ROUNDS)
+		{
+			for (c = 0; c < 4; c++)
+			{
+				unsigned char *a = t + c * 4;
+				unsigned char a0 = a[0],
+							a1 = a[1],
+							a2 = a[2],
+							a3 = a[3];
+
+				s[c * 4] = XTIME(a0) ^ XTIME(a1) ^ a1 ^ a2 ^ a3;
+				s[c * 4 + 1] = a0 ^ XTIME(a1) ^ XTIME(a2) ^ a2 ^ a3;
+				s[c * 4 + 2] = a0 ^ a1 ^ XTIME(a2) ^ XTIME(a3) ^ a3;
+				s[c * 4 + 3] = XTIME(a0) ^ a0 ^ a1 ^ a2 ^ XTIME(a3);
+			}
+		}
+		else
+			memcpy(s, t, 16);
+
+		for (i = 0; i < 16; i++)
+			s[i] ^= key->rk[r * 16 + i];
+	}
+	memcpy(out, s, 16);
+}
+
+/* Increment the last 32 bits of a counter block, big-endian */
+static void
+inc32(unsigned char *cb)
+{
+	int			i;
+
+	for (i = 15; i >= 12; i--)
+		if (++cb[i] != 0)
+			break;
+}
+
+static void
+ctr_crypt_c(const AESKey *key, const unsigned char *icb,
+			const unsigned char *in, unsigned char *out, size_t len)
+{
+	unsigned char cb[16];
+	unsigned char ks[16];
+	size_t		i;
+
+	memcpy(cb, icb, 16);
+	while (len > 0)
+	{
+		size_t		n = Min(len, 16);
+
+		aes_encrypt_block_c(key, cb, ks);
+		for (i = 0; i < n; i++)
+			out[i] = in[i] ^ ks[i];
+		inc32(cb);
+		in += n;
+		out += n;
+		len -= n;
+	}
+}
+
+static uint64
+load_be64(const unsigned char *p)
+{
+	uint64		v = 0;
+	int			i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static void
+store_be64(unsigned char *p, uint64 v)
+{
+	int			i;
+
+	for (i = 7; i >= 0; i--)
+	{
+		p[i] = (unsigned char) v;
+		v >>= 8;
+	}
+}
+
+/*
+ * GHASH one bit at a time, as in SP 800-38D algorithm 1. Slow, but only
+ * used on CPUs without PCLMULQDQ.
+ */
+static void
+ghash_c(const unsigned char *h, unsigned char *y, const unsigned char *data,
+		size_t len)
+{
+	uint64		hhi = load_be64(h),
+				hlo = load_be64(h + 8);
+
+	while (len > 0)
+	{
+		unsigned char x[16];
+		size_t		n = Min(len, 16);
+		uint64		xhi,
+					xlo,
+					zhi = 0,
+					zlo = 0,
+					vhi = hhi,
+					vlo = hlo;
+		int			i;
+
+		memset(x, 0, sizeof(x));
+		memcpy(x, data, n);
+		xhi = load_be64(y) ^ load_be64(x);
+		xlo = load_be64(y + 8) ^ load_be64(x + 8);
+
+		for (i = 0; i < 128; i++)
+		{
+			uint64		bit = i < 64 ? (xhi >> (63 - i)) & 1 : (xlo >> (127 - i)) & 1;
+			uint64		lsb = vlo & 1;
+
+			if (bit)
+			{
+				zhi ^= vhi;
+				zlo ^= vlo;
+			}
+			vlo = (vlo >> 1) | (vhi << 63);
+			vhi >>= 1;
+			if (lsb)
+				vhi ^= UINT64CONST(0xe100000000000000);
+		}
+		store_be64(y, zhi);
+		store_be64(y + 8, zlo);
+
+		data += n;
+		len -= n;
+	}
+}
+
+#ifdef USE_AES_NI
+__attribute__((target("aes,sse4.1")))
+static inline __m128i
+aes_encrypt_ni(const __m128i *rk, __m128i b)
+{
+	int			r;
+
+	b = _mm_xor_si128(b, rk[0]);
+	for (r = 1; r < AES256_ROUNDS; r++)
+		b = _mm_aesenc_si128(b, rk[r]);
+	return _mm_aesenclast_si128(b, rk[AES256_ROUNDS]);
+}
+
+/*
+ * Counter mode with AES-NI, four blocks at a time so the instructions for
+ * the different blocks overlap in the pipeline.
+ */
+__attribute__((target("aes,sse4.1")))
+static void
+ctr_crypt_ni(const AESKey *key, const unsigned char *icb,
+			 const unsigned char *in, unsigned char *out, size_t len)
+{
+	__m128i		rk[AES256_ROUNDS + 1];
+	unsigned char cb[16];
+	int			i;
+
+	for (i = 0; i <= AES256_ROUNDS; i++)
+		rk[i] = _mm_loadu_si128((const __m128i *) (key->rk + i * 16));
+	memcpy(cb, icb, 16);
+
+	while (len >= 64)
+	{
+		__m128i		b[4];
+		int			r;
+
+		for (i = 0; i < 4; i++)
+		{
+			b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) cb), rk[0]);
+			inc32(cb);
+		}
+		for (r = 1; r < AES256_ROUNDS; r++)
+			for (i = 0; i < 4; i++)
+				b[i] = _mm_aesenc_si128(b[i], rk[r]);
+		for (i = 0; i < 4; i++)
+		{
+			b[i] = _mm_aesenclast_si128(b[i], rk[AES256_ROUNDS]);
+			_mm_storeu_si128((__m128i *) (out + i * 16),
+							 _mm_xor_si128(b[i],
+										   _mm_loadu_si128((const __m128i *) (in + i * 16))));
+		}
+		in += 64;
+		out += 64;
+		len -= 64;
+	}
+	while (len > 0)
+	{
+		unsigned char ks[16];
+		size_t		n = Min(len, 16);
+
+		_mm_storeu_si128((__m128i *) ks,
+						 aes_encrypt_ni(rk, _mm_loadu_si128((const __m128i *) cb)));
+		for (i = 0; i < n; i++)
+			out[i] = in[i] ^ ks[i];
+		inc32(cb);
+		in += n;
+		out += n;
+		len -= n;
+	}
+}
+
+/*
+ * Multiply in GF(2^128) with carry-less multiplication, on byte-reversed
+ * operands, following the Intel white paper on GCM with PCLMULQDQ.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i
+gfmul(__m128i a, __m128i b)
+{
+	__m128i		t2,
+				t3,
+				t4,
+				t5,
+				t6,
+				t7,
+				t8,
+				t9;
+
+	t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	t6 = _mm_clmulepi64_si128(a, b, 0x11);
+	t4 = _mm_xor_si128(t4, t5);
+	t5 = _mm_slli_si128(t4, 8);
+	t4 = _mm_srli_si128(t4, 8);
+	t3 = _mm_xor_si128(t3, t5);
+	t6 = _mm_xor_si128(t6, t4);
+
+	/* Shift the 256-bit product left by one, since the operands are bit
+	 * reflected */
+	t7 = _mm_srli_epi32(t3, 31);
+	t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+
+	/* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+	t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+	return _mm_xor_si128(t6, t3);
+}
+
+__attribute__((target("pclmul,sse4.1,ssse3")))
+static void
+ghash_clmul(const unsigned char *h, unsigned char *y,
+			const unsigned char *data, size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+									   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i		hh = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) h), bswap);
+	__m128i		yy = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) y), bswap);
+
+	while (len >= 16)
+	{
+		__m128i		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data),
+										 bswap);
+
+		yy = gfmul(_mm_xor_si128(yy, x), hh);
+		data += 16;
+		len -= 16;
+	}
+	if (len > 0)
+	{
+		unsigned char last[16];
+
+		memset(last, 0, sizeof(last));
+		memcpy(last, data, len);
+		yy = gfmul(_mm_xor_si128(yy, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) last),
+													  bswap)), hh);
+	}
+	_mm_storeu_si128((__m128i *) y, _mm_shuffle_epi8(yy, bswap));
+}
+
+static int
+have_aes_ni(void)
+{
+	unsigned int eax,
+				ebx,
+				ecx,
+				edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_AES) && (ecx & bit_PCLMUL) &&
+		(ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+}
+#endif
+
+static void
+choose_implementation(void)
+{
+#ifdef USE_AES_NI
+	if (have_aes_ni())
+	{
+		ctr_crypt = ctr_crypt_ni;
+		ghash = ghash_clmul;
+		return;
+	}
+#endif
+	ctr_crypt = ctr_crypt_c;
+	ghash = ghash_c;
+}
+
+static void
+ctr_choose(const AESKey *key, const unsigned char *icb,
+		   const unsigned char *in, unsigned char *out, size_t len)
+{
+	choose_implementation();
+	ctr_crypt(key, icb, in, out, len);
+}
+
+static void
+ghash_choose(const unsigned char *h, unsigned char *y,
+			 const unsigned char *data, size_t len)
+{
+	choose_implementation();
+	ghash(h, y, data, len);
+}
+
+/*
+ * Compute the tag over the additional data and ciphertext, as in SP
+ * 800-38D algorithm 4 steps 5 and 6.
+ */
+static void
+gcm_tag(const AESKey *key, const unsigned char *j0, const unsigned char *aad,
+		size_t aadlen, const unsigned char *ct, size_t len,
+		unsigned char *tag)
+{
+	unsigned char zero[16];
+	unsigned char h[16];
+	unsigned char s[16];
+	unsigned char lens[16];
+	unsigned char ek[16];
+	int			i;
+
+	memset(zero, 0, sizeof(zero));
+	ctr_crypt(key, zero, zero, h, 16);	/* H = E(K, 0^128) */
+
+	memset(s, 0, sizeof(s));
+	ghash(h, s, aad, aadlen);
+	ghash(h, s, ct, len);
+	store_be64(lens, (uint64) aadlen * 8);
+	store_be64(lens + 8, (uint64) len * 8);
+	ghash(h, s, lens, 16);
+
+	ctr_crypt(key, j0, zero, ek, 16);
+	for (i = 0; i < 16; i++)
+		tag[i] = s[i] ^ ek[i];
+}
+
+/*
+ * Encrypt len bytes from in to out, which may be the same, and compute
+ * the tag over aad and the ciphertext. The IV is AES_GCM_IV_LEN bytes,
+ * and must never be used twice with the same key.
+ */
+void
+aes_gcm_encrypt(const AESKey *key, const unsigned char *iv,
+				const void *aad, size_t aadlen, const void *in, void *out,
+				size_t len, unsigned char *tag)
+{
+	unsigned char j0[16];
+	unsigned char icb[16];
+
+	memcpy(j0, iv, AES_GCM_IV_LEN);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+	memcpy(icb, j0, 16);
+	inc32(icb);
+
+	ctr_crypt(key, icb, in, out, len);
+	gcm_tag(key, j0, aad, aadlen, out, len, tag);
+}
+
+/*
+ * Check the tag, and decrypt len bytes from in to out if it matches.
+ * Returns 0 if the data or the additional data has been tampered with, or
+ * the key is wrong, in which case out is left alone.
+ */
+int
+aes_gcm_decrypt(const AESKey *key, const unsigned char *iv,
+				const void *aad, size_t aadlen, const void *in, void *out,
+				size_t len, const unsigned char *tag)
+{
+	unsigned char j0[16];
+	unsigned char icb[16];
+	unsigned char expected[AES_GCM_TAG_LEN];
+	unsigned char diff = 0;
+	int			i;
+
+	memcpy(j0, iv, AES_GCM_IV_LEN);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+	memcpy(icb, j0, 16);
+	inc32(icb);
+
+	gcm_tag(key, j0, aad, aadlen, in, len, expected);
+	for (i = 0; i < AES_GCM_TAG_LEN; i++)
+		diff |= expected[i] ^ tag[i];
+	if (diff != 0)
+		return 0;
+
+	ctr_crypt(key, icb, in, out, len);
+	return 1;
+}
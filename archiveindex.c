@@ -0,0 +1,778 @@
+/*
+ * archiveindex.c - index of the completed segments in the archive directory
+ *
+ * Every completed segment gets a fixed-size entry appended to the index
+ * file when it's moved into place, or inserted in order if it comes
+ * before the last one. Readers map the file and find the segment holding
+ * a WAL location with a binary search, instead of having to list and
+ * parse the whole directory. If the index is lost or damaged it is
+ * rebuilt from a directory scan.
+ *
+ * Whatever changes the index takes an exclusive flock() on it first, so
+ * that retention can remove entries while the receiver is appending.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+
+/*
+ * Compare two entries in index order - by location first, then by
+ * timeline, so that a segment on a later timeline sorts after the
+ * segment it forked from.
+ */
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const ArchiveIndexEntry *ea = a;
+	const ArchiveIndexEntry *eb = b;
+
+	if (XLByteLT(ea->startpoint, eb->startpoint))
+		return -1;
+	if (XLByteLT(eb->startpoint, ea->startpoint))
+		return 1;
+	if (ea->tli != eb->tli)
+		return (ea->tli < eb->tli) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Open the index file and lock it. Since the index is replaced by
+ * renaming a new one into place, make sure what got locked is still the
+ * current file. Returns -1 if there is no index.
+ */
+static int
+open_locked(const char *fn)
+{
+	struct stat st1,
+				st2;
+	int			f;
+
+	while (1)
+	{
+		f = open(fn, O_RDWR);
+		if (f == -1)
+		{
+			if (errno == ENOENT)
+				return -1;
+			fprintf(stderr, "Failed to open archive index %s: %m\n", fn);
+			exit(1);
+		}
+		if (flock(f, LOCK_EX) != 0)
+		{
+			fprintf(stderr, "Failed to lock archive index %s: %m\n", fn);
+			exit(1);
+		}
+		if (fstat(f, &st1) == 0 && stat(fn, &st2) == 0 &&
+			st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+			return f;
+		close(f);
+	}
+}
+
+/*
+ * Write a new index with the given entries to a temporary file, and
+ * rename it into place, so readers never see a half-written index.
+ */
+static void
+write_index(const char *dir, ArchiveIndexEntry *entries, int nentries)
+{
+	ArchiveIndexHeader hdr;
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	int			f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create archive index %s: %m\n", tmpfn);
+		exit(1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ARCHIVE_INDEX_MAGIC;
+	hdr.version = ARCHIVE_INDEX_VERSION;
+	hdr.entrysize = sizeof(ArchiveIndexEntry);
+	if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		(nentries > 0 &&
+		 write(f, entries, nentries * sizeof(ArchiveIndexEntry)) !=
+		 nentries * sizeof(ArchiveIndexEntry)))
+	{
+		fprintf(stderr, "Failed to write archive index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (fsync(f) != 0)
+	{
+		fprintf(stderr, "Failed to fsync archive index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (close(f) != 0)
+	{
+		fprintf(stderr, "Failed to close archive index %s: %m\n", tmpfn);
+		exit(1);
+	}
+
+	if (rename(tmpfn, fn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, fn);
+		exit(1);
+	}
+}
+
+/*
+ * Fill out the location fields of an index entry from the name of
+ * a segment file. Compression and CRC are left for the caller.
+ */
+void
+archive_index_fill_entry(ArchiveIndexEntry *entry, const char *filename,
+						 uint64 size)
+{
+	uint32		tli,
+				log,
+				seg;
+
+	memset(entry, 0, sizeof(ArchiveIndexEntry));
+	XLogFromFileName(filename, &tli, &log, &seg);
+
+	entry->tli = tli;
+	entry->startpoint.xlogid = log;
+	entry->startpoint.xrecoff = seg * XLogSegSize;
+	NextLogSeg(log, seg);
+	entry->endpoint.xlogid = log;
+	entry->endpoint.xrecoff = seg * XLogSegSize;
+	entry->size = size;
+	entry->compression = ARCHIVE_COMPRESSION_NONE;
+	strncpy(entry->path, filename, sizeof(entry->path) - 1);
+}
+
+/*
+ * Open and map the index in the given directory. Returns NULL if there
+ * is no index, or if it doesn't look like a valid one.
+ *
+ * A trailing partial entry, left by a crash in the middle of an append,
+ * is ignored.
+ */
+ArchiveIndex *
+archive_index_open(const char *dir)
+{
+	ArchiveIndex *idx;
+	ArchiveIndexHeader *hdr;
+	char		fn[MAXPGPATH];
+	struct stat st;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+
+	idx = malloc(sizeof(ArchiveIndex));
+	if (!idx)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(idx, 0, sizeof(ArchiveIndex));
+
+	idx->fd = open(fn, O_RDONLY);
+	if (idx->fd == -1)
+	{
+		free(idx);
+		return NULL;
+	}
+	if (fstat(idx->fd, &st) != 0 || st.st_size < sizeof(ArchiveIndexHeader))
+	{
+		close(idx->fd);
+		free(idx);
+		return NULL;
+	}
+
+	idx->mapsize = st.st_size;
+	idx->map = mmap(NULL, idx->mapsize, PROT_READ, MAP_SHARED, idx->fd, 0);
+	if (idx->map == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map archive index %s: %m\n", fn);
+		exit(1);
+	}
+
+	hdr = (ArchiveIndexHeader *) idx->map;
+	if (hdr->magic != ARCHIVE_INDEX_MAGIC ||
+		hdr->version != ARCHIVE_INDEX_VERSION ||
+		hdr->entrysize != sizeof(ArchiveIndexEntry))
+	{
+		if (verbose)
+			printf("Archive index %s has invalid header, ignoring\n", fn);
+		archive_index_close(idx);
+		return NULL;
+	}
+
+	idx->entries = (ArchiveIndexEntry *) (idx->map + sizeof(ArchiveIndexHeader));
+	idx->nentries = (idx->mapsize - sizeof(ArchiveIndexHeader)) /
+		sizeof(ArchiveIndexEntry);
+	return idx;
+}
+
+void
+archive_index_close(ArchiveIndex *idx)
+{
+	if (idx->map && idx->map != MAP_FAILED)
+		munmap(idx->map, idx->mapsize);
+	close(idx->fd);
+	free(idx);
+}
+
+/*
+ * Find the entry for the segment containing the given WAL location.
+ * If more than one timeline has a segment covering the location, the
+ * latest timeline wins. Returns NULL if the location isn't archived.
+ */
+ArchiveIndexEntry *
+archive_index_lookup(ArchiveIndex *idx, XLogRecPtr ptr)
+{
+	int			low = 0,
+				high = idx->nentries - 1,
+				found = -1;
+
+	/* Find the last entry starting at or before ptr */
+	while (low <= high)
+	{
+		int			mid = low + (high - low) / 2;
+
+		if (XLByteLE(idx->entries[mid].startpoint, ptr))
+		{
+			found = mid;
+			low = mid + 1;
+		}
+		else
+			high = mid - 1;
+	}
+
+	if (found < 0 || !XLByteLT(ptr, idx->entries[found].endpoint))
+		return NULL;
+	return &idx->entries[found];
+}
+
+/*
+ * Rebuild the index from scratch by scanning the directory. Only the
+ * directory entries are looked at, so this is fast even on a large
+ * archive, but it means the CRCs of the segments are not known.
+ * Segments stored compressed, stripped, deduplicated, chunked or
+ * encrypted are included too, with the size of the file they're in.
+ *
+ * The new index is written to a temporary file and renamed into place,
+ * so readers never see a half-written index.
+ */
+void
+archive_index_rebuild(const char *dir)
+{
+	DIR		   *d;
+	struct dirent *dirent;
+	ArchiveIndexEntry *entries = NULL;
+	VolumeEntry *packed;
+	int			nentries = 0,
+				maxentries = 0;
+	int			npacked;
+	char		fn[MAXPGPATH];
+	int			lock;
+
+	if (verbose)
+		printf("Rebuilding archive index in %s\n", dir);
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	lock = open_locked(fn);
+
+	d = opendir(dir);
+	if (!d)
+	{
+		fprintf(stderr, "Failed to open directory %s: %m\n", dir);
+		exit(1);
+	}
+	while ((dirent = readdir(d)) != NULL)
+	{
+		static const char *const suffixes[] = {
+			"", ".gz", STRIPPED_SUFFIX, DEDUP_SUFFIX, CHUNK_MANIFEST_SUFFIX,
+			ENCRYPTED_SUFFIX, NULL
+		};
+		char		segname[MAXFNAMELEN];
+		struct stat st;
+		int			i;
+
+		if (strlen(dirent->d_name) < 24)
+			continue;
+		memcpy(segname, dirent->d_name, 24);
+		segname[24] = '\0';
+		if (!is_segment_name(segname))
+			continue;
+		for (i = 0; suffixes[i]; i++)
+		{
+			if (strcmp(dirent->d_name + 24, suffixes[i]) == 0)
+				break;
+		}
+		if (!suffixes[i])
+			continue;
+
+		snprintf(fn, sizeof(fn), "%s/%s", dir, dirent->d_name);
+		if (stat(fn, &st) != 0)
+		{
+			fprintf(stderr, "Failed to stat file %s: %m\n", fn);
+			exit(1);
+		}
+
+		if (nentries == maxentries)
+		{
+			maxentries = maxentries ? maxentries * 2 : 1024;
+			entries = realloc(entries, maxentries * sizeof(ArchiveIndexEntry));
+			if (!entries)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		archive_index_fill_entry(&entries[nentries], segname, st.st_size);
+		if (i == 1)
+			entries[nentries].compression = ARCHIVE_COMPRESSION_GZIP;
+		else if (i > 1)
+			entries[nentries].compression = ARCHIVE_COMPRESSION_OTHER;
+		nentries++;
+	}
+	closedir(d);
+
+	/* Segments packed into volumes */
+	npacked = volume_list(dir, &packed);
+	if (npacked > 0)
+	{
+		int			i;
+
+		entries = realloc(entries, (nentries + npacked) * sizeof(ArchiveIndexEntry));
+		if (!entries)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < npacked; i++)
+		{
+			ArchiveIndexEntry *e = &entries[nentries++];
+
+			archive_index_fill_entry(e, packed[i].segname, packed[i].length);
+			e->compression = ARCHIVE_COMPRESSION_PACKED;
+			e->crc = packed[i].crc;
+			e->flags |= ARCHIVE_ENTRY_HAS_CRC;
+		}
+	}
+	if (npacked >= 0)
+		free(packed);
+
+	if (nentries > 0)
+	{
+		int			i,
+					n = 1;
+
+		qsort(entries, nentries, sizeof(ArchiveIndexEntry), entry_cmp);
+
+		/*
+		 * A segment can be there in more than one form. A file left over
+		 * from packing it wins, so the next pass packing cleans it up.
+		 */
+		for (i = 1; i < nentries; i++)
+		{
+			if (entry_cmp(&entries[n - 1], &entries[i]) != 0)
+				entries[n++] = entries[i];
+			else if (entries[n - 1].compression == ARCHIVE_COMPRESSION_PACKED)
+				entries[n - 1] = entries[i];
+		}
+		nentries = n;
+	}
+
+	write_index(dir, entries, nentries);
+	if (lock != -1)
+		close(lock);
+
+	if (verbose)
+		printf("Archive index rebuilt with %i segments\n", nentries);
+	free(entries);
+}
+
+/*
+ * Insert an entry where it belongs in the index, which is locked with f,
+ * by writing a new one. An entry for the same segment is replaced.
+ */
+static void
+insert_entry(const char *dir, int f, off_t size, ArchiveIndexEntry *entry)
+{
+	ArchiveIndexEntry *entries;
+	char		fn[MAXPGPATH];
+	int			nentries;
+	int			pos;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	nentries = (size - sizeof(ArchiveIndexHeader)) / sizeof(ArchiveIndexEntry);
+	entries = malloc((nentries + 1) * sizeof(ArchiveIndexEntry));
+	if (!entries)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (pread(f, entries, nentries * sizeof(ArchiveIndexEntry),
+			  sizeof(ArchiveIndexHeader)) != nentries * sizeof(ArchiveIndexEntry))
+	{
+		fprintf(stderr, "Failed to read archive index %s: %m\n", fn);
+		exit(1);
+	}
+
+	for (pos = nentries; pos > 0; pos--)
+	{
+		if (entry_cmp(&entries[pos - 1], entry) <= 0)
+			break;
+	}
+	if (pos > 0 && entry_cmp(&entries[pos - 1], entry) == 0)
+		entries[pos - 1] = *entry;
+	else
+	{
+		memmove(&entries[pos + 1], &entries[pos],
+				(nentries - pos) * sizeof(ArchiveIndexEntry));
+		entries[pos] = *entry;
+		nentries++;
+	}
+	write_index(dir, entries, nentries);
+	free(entries);
+}
+
+/*
+ * Append an entry for a newly completed segment. Since segments are
+ * normally completed in order this is a plain append. If it would break
+ * the ordering, which can happen after a timeline switch, the entry is
+ * inserted in its place instead, keeping what's known about the others.
+ * Only a missing or damaged index is rebuilt.
+ */
+void
+archive_index_append(const char *dir, ArchiveIndexEntry *entry)
+{
+	ArchiveIndexEntry last;
+	char		fn[MAXPGPATH];
+	int			f;
+	off_t		size;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	f = open_locked(fn);
+	if (f == -1)
+	{
+		archive_index_rebuild(dir);
+		return;
+	}
+
+	size = lseek(f, 0, SEEK_END);
+	if (size < sizeof(ArchiveIndexHeader) ||
+		(size - sizeof(ArchiveIndexHeader)) % sizeof(ArchiveIndexEntry) != 0)
+	{
+		close(f);
+		archive_index_rebuild(dir);
+		return;
+	}
+
+	if (size > sizeof(ArchiveIndexHeader))
+	{
+		if (pread(f, &last, sizeof(last), size - sizeof(last)) != sizeof(last))
+		{
+			fprintf(stderr, "Failed to read archive index %s: %m\n", fn);
+			exit(1);
+		}
+		if (entry_cmp(&last, entry) >= 0)
+		{
+			insert_entry(dir, f, size, entry);
+			close(f);
+			return;
+		}
+	}
+
+	if (pwrite(f, entry, sizeof(ArchiveIndexEntry), size) !=
+		sizeof(ArchiveIndexEntry))
+	{
+		fprintf(stderr, "Failed to append to archive index %s: %m\n", fn);
+		exit(1);
+	}
+	if (fsync(f) != 0)
+	{
+		fprintf(stderr, "Failed to fsync archive index %s: %m\n", fn);
+		exit(1);
+	}
+	close(f);
+}
+
+/*
+ * Remove the entries up to and including the given one from the index,
+ * once the segments have been removed from the archive. Entries appended
+ * in the meantime are kept.
+ */
+void
+archive_index_remove_upto(const char *dir, const ArchiveIndexEntry *upto)
+{
+	ArchiveIndexEntry *entries;
+	char		fn[MAXPGPATH];
+	off_t		size;
+	int			nentries;
+	int			first;
+	int			f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	f = open_locked(fn);
+	if (f == -1)
+		return;
+
+	size = lseek(f, 0, SEEK_END);
+	if (size < sizeof(ArchiveIndexHeader))
+	{
+		close(f);
+		return;
+	}
+	nentries = (size - sizeof(ArchiveIndexHeader)) / sizeof(ArchiveIndexEntry);
+	entries = malloc(Max(nentries, 1) * sizeof(ArchiveIndexEntry));
+	if (!entries)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (pread(f, entries, nentries * sizeof(ArchiveIndexEntry),
+			  sizeof(ArchiveIndexHeader)) != nentries * sizeof(ArchiveIndexEntry))
+	{
+		fprintf(stderr, "Failed to read archive index %s: %m\n", fn);
+		exit(1);
+	}
+
+	for (first = 0; first < nentries; first++)
+	{
+		if (entry_cmp(&entries[first], upto) > 0)
+			break;
+	}
+	if (first > 0)
+		write_index(dir, entries + first, nentries - first);
+
+	free(entries);
+	close(f);
+}
+
+/*
+ * Update the size and compression of a segment in the index, after it
+ * has been rewritten. The entry is overwritten in place. Returns 0 if
+ * the segment isn't in the index (any more).
+ */
+int
+archive_index_update(const char *dir, const ArchiveIndexEntry *entry)
+{
+	ArchiveIndexEntry cur;
+	char		fn[MAXPGPATH];
+	off_t		size;
+	int			low,
+				high;
+	int			f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+	f = open_locked(fn);
+	if (f == -1)
+		return 0;
+
+	size = lseek(f, 0, SEEK_END);
+	low = 0;
+	high = (size - (off_t) sizeof(ArchiveIndexHeader)) /
+		(off_t) sizeof(ArchiveIndexEntry) - 1;
+	while (low <= high)
+	{
+		int			mid = low + (high - low) / 2;
+		off_t		pos = sizeof(ArchiveIndexHeader) +
+		(off_t) mid * sizeof(ArchiveIndexEntry);
+		int			cmp;
+
+		if (pread(f, &cur, sizeof(cur), pos) != sizeof(cur))
+		{
+			fprintf(stderr, "Failed to read archive index %s: %m\n", fn);
+			exit(1);
+		}
+		cmp = entry_cmp(&cur, entry);
+		if (cmp == 0)
+		{
+			if (pwrite(f, entry, sizeof(ArchiveIndexEntry), pos) !=
+				sizeof(ArchiveIndexEntry) || fsync(f) != 0)
+			{
+				fprintf(stderr, "Failed to update archive index %s: %m\n", fn);
+				exit(1);
+			}
+			close(f);
+			return 1;
+		}
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	close(f);
+	return 0;
+}
+
+/*
+ * Make sure the index in the directory is usable, and covers all the
+ * segments there. Called at startup.
+ *
+ * The index is appended to right after a segment has been moved into
+ * place, so a crash in between can leave the index one or more segments
+ * behind. Rather than scanning the whole directory, probe for the
+ * segments following the last one in the index.
+ */
+void
+archive_index_check(const char *dir)
+{
+	ArchiveIndex *idx;
+	ArchiveIndexEntry entry;
+	char		fn[MAXPGPATH];
+	char		segname[MAXFNAMELEN];
+	struct stat st;
+	uint32		tli,
+				log,
+				seg;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		archive_index_rebuild(dir);
+		return;
+	}
+
+	/* Cut off any partially written entry at the end */
+	if ((idx->mapsize - sizeof(ArchiveIndexHeader)) % sizeof(ArchiveIndexEntry) != 0)
+	{
+		snprintf(fn, sizeof(fn), "%s/%s", dir, ARCHIVE_INDEX_FILENAME);
+		if (truncate(fn, sizeof(ArchiveIndexHeader) +
+					 idx->nentries * sizeof(ArchiveIndexEntry)) != 0)
+		{
+			fprintf(stderr, "Failed to truncate archive index %s: %m\n", fn);
+			exit(1);
+		}
+	}
+
+	if (idx->nentries == 0)
+	{
+		/* Nothing to probe from, so check the hard way */
+		archive_index_close(idx);
+		archive_index_rebuild(dir);
+		return;
+	}
+
+	XLogFromFileName(idx->entries[idx->nentries - 1].path, &tli, &log, &seg);
+	archive_index_close(idx);
+
+	while (1)
+	{
+		NextLogSeg(log, seg);
+		XLogFileName(segname, tli, log, seg);
+		snprintf(fn, sizeof(fn), "%s/%s", dir, segname);
+		if (stat(fn, &st) != 0)
+			break;
+
+		if (verbose)
+			printf("Adding segment %s missing from archive index\n", segname);
+		archive_index_fill_entry(&entry, segname, st.st_size);
+		archive_index_append(dir, &entry);
+	}
+}
+
+
+static void
+index_usage(void)
+{
+	printf("Usage: pg_streamrecv index -d <directory> [-r] [-v] [location ...]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv index" - list the archive index, or look up the segments
+ * holding the given WAL locations.
+ */
+int
+index_main(int argc, char *argv[])
+{
+	ArchiveIndex *idx;
+	ArchiveIndexEntry *entry;
+	int			rebuild = 0;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:rv")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'r':
+				rebuild = 1;
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				index_usage();
+		}
+	}
+	if (!basedir)
+		index_usage();
+
+	if (rebuild)
+		archive_index_rebuild(basedir);
+
+	idx = archive_index_open(basedir);
+	if (!idx)
+	{
+		fprintf(stderr, "No valid archive index in %s, use -r to rebuild it\n",
+				basedir);
+		exit(1);
+	}
+
+	if (optind == argc)
+	{
+		for (i = 0; i < idx->nentries; i++)
+		{
+			entry = &idx->entries[i];
+			printf("%s %X/%08X %X/%08X %lu",
+				   entry->path,
+				   entry->startpoint.xlogid, entry->startpoint.xrecoff,
+				   entry->endpoint.xlogid, entry->endpoint.xrecoff,
+				   (unsigned long) entry->size);
+			if (entry->flags & ARCHIVE_ENTRY_HAS_CRC)
+				printf(" %08X", entry->crc);
+			printf("\n");
+		}
+	}
+
+	for (i = optind; i < argc; i++)
+	{
+		XLogRecPtr	ptr;
+
+		if (sscanf(argv[i], "%X/%X", &ptr.xlogid, &ptr.xrecoff) != 2)
+		{
+			fprintf(stderr, "Invalid WAL location: %s\n", argv[i]);
+			exit(1);
+		}
+		entry = archive_index_lookup(idx, ptr);
+		if (entry)
+			printf("%s %s\n", argv[i], entry->path);
+		else
+			printf("%s not archived\n", argv[i]);
+	}
+
+	archive_index_close(idx);
+	return 0;
+}
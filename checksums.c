@@ -0,0 +1,240 @@
+/*
+ * checksums.c - checksum manifest for completed segments
+ *
+ * The receiver hashes each segment as it's written, and appends the
+ * result to the checksums file in the base directory when the segment is
+ * completed. Anything that later needs to check or upload a segment can
+ * look its hashes up here instead of reading the whole segment once more
+ * just to hash it.
+ *
+ * The file has one line per segment, in the order they were completed:
+ *
+ *	<segment name> <SHA-256 in hex> <XXH64 in hex>
+ *
+ * If a segment is received more than once, the last line for it wins.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pg_streamrecv.h"
+
+
+static void
+hex_encode(const unsigned char *data, int len, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	int			i;
+
+	for (i = 0; i < len; i++)
+	{
+		out[i * 2] = hex[data[i] >> 4];
+		out[i * 2 + 1] = hex[data[i] & 0x0f];
+	}
+	out[len * 2] = '\0';
+}
+
+static int
+hex_decode(const char *in, unsigned char *data, int len)
+{
+	int			i;
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned int b;
+
+		if (sscanf(in + i * 2, "%2x", &b) != 1)
+			return 0;
+		data[i] = b;
+	}
+	return 1;
+}
+
+/*
+ * Compute the checksums for a segment that's all in memory.
+ */
+void
+checksum_buffer(const char *segname, const char *buf, size_t len,
+				SegmentChecksum *cs)
+{
+	SHA256State sha;
+
+	snprintf(cs->segname, sizeof(cs->segname), "%s", segname);
+	sha256_init(&sha);
+	sha256_update(&sha, buf, len);
+	sha256_final(&sha, cs->sha256);
+	cs->xxh64 = xxh64(buf, len, 0);
+}
+
+void
+checksums_append(const char *dir, SegmentChecksum *cs)
+{
+	char		fn[MAXPGPATH];
+	char		hex[SHA256_LEN * 2 + 1];
+	FILE	   *f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, CHECKSUMS_FILENAME);
+	f = fopen(fn, "a");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open %s: %m\n", fn);
+		exit(1);
+	}
+	hex_encode(cs->sha256, SHA256_LEN, hex);
+	fprintf(f, "%s %s %016llx\n", cs->segname, hex,
+			(unsigned long long) cs->xxh64);
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", fn);
+		exit(1);
+	}
+}
+
+/*
+ * Look up the checksums for a segment. Returns 0 if there are none.
+ */
+int
+checksums_lookup(const char *dir, const char *segname, SegmentChecksum *cs)
+{
+	char		fn[MAXPGPATH];
+	char		line[256];
+	int			found = 0;
+	FILE	   *f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, CHECKSUMS_FILENAME);
+	f = fopen(fn, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char		name[MAXFNAMELEN];
+		char		hex[SHA256_LEN * 2 + 1];
+		unsigned long long x;
+
+		if (sscanf(line, "%63s %64s %llx", name, hex, &x) != 3 ||
+			strcmp(name, segname) != 0 ||
+			!hex_decode(hex, cs->sha256, SHA256_LEN))
+			continue;
+		snprintf(cs->segname, sizeof(cs->segname), "%s", name);
+		cs->xxh64 = x;
+		found = 1;
+	}
+	fclose(f);
+	return found;
+}
+
+typedef struct NumberedChecksum
+{
+	SegmentChecksum cs;
+	int			lineno;
+} NumberedChecksum;
+
+static int
+checksum_cmp(const void *a, const void *b)
+{
+	return strcmp(((const SegmentChecksum *) a)->segname,
+				  ((const SegmentChecksum *) b)->segname);
+}
+
+static int
+numbered_checksum_cmp(const void *a, const void *b)
+{
+	const NumberedChecksum *na = a;
+	const NumberedChecksum *nb = b;
+	int			r = strcmp(na->cs.segname, nb->cs.segname);
+
+	if (r != 0)
+		return r;
+	return na->lineno - nb->lineno;
+}
+
+/*
+ * Load the whole checksums file, for looking up many segments with
+ * checksums_find(). Returns an array sorted by segment name, with only
+ * the last line for each segment, and the number of entries in n.
+ */
+SegmentChecksum *
+checksums_load(const char *dir, int *n)
+{
+	char		fn[MAXPGPATH];
+	char		line[256];
+	NumberedChecksum *lines = NULL;
+	SegmentChecksum *cs;
+	int			nlines = 0,
+				maxlines = 0;
+	int			i;
+	FILE	   *f;
+
+	*n = 0;
+	snprintf(fn, sizeof(fn), "%s/%s", dir, CHECKSUMS_FILENAME);
+	f = fopen(fn, "r");
+	if (!f)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char		hex[SHA256_LEN * 2 + 1];
+		unsigned long long x;
+
+		if (nlines == maxlines)
+		{
+			maxlines = maxlines ? maxlines * 2 : 1024;
+			lines = realloc(lines, maxlines * sizeof(NumberedChecksum));
+			if (!lines)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		if (sscanf(line, "%63s %64s %llx", lines[nlines].cs.segname, hex,
+				   &x) != 3 ||
+			!hex_decode(hex, lines[nlines].cs.sha256, SHA256_LEN))
+			continue;
+		lines[nlines].cs.xxh64 = x;
+		lines[nlines].lineno = nlines;
+		nlines++;
+	}
+	fclose(f);
+
+	if (nlines == 0)
+	{
+		free(lines);
+		return NULL;
+	}
+	qsort(lines, nlines, sizeof(NumberedChecksum), numbered_checksum_cmp);
+
+	cs = malloc(nlines * sizeof(SegmentChecksum));
+	if (!cs)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nlines; i++)
+	{
+		if (i + 1 < nlines &&
+			strcmp(lines[i].cs.segname, lines[i + 1].cs.segname) == 0)
+			continue;
+		cs[(*n)++] = lines[i].cs;
+	}
+	free(lines);
+	return cs;
+}
+
+SegmentChecksum *
+checksums_find(SegmentChecksum *cs, int n, const char *segname)
+{
+	SegmentChecksum key;
+
+	if (n == 0)
+		return NULL;
+	snprintf(key.segname, sizeof(key.segname), "%s", segname);
+	return bsearch(&key, cs, n, sizeof(SegmentChecksum), checksum_cmp);
+}
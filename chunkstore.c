@@ -0,0 +1,952 @@
+/*
+ * chunkstore.c - content-defined chunk store for archived segments
+ *
+ * Clusters cloned from the same template write much of the same WAL,
+ * and archives of such clusters end up holding the same data many times
+ * over. To store it once, completed segments can be split into chunks
+ * and kept in a chunk store, which can be shared between the archives of
+ * any number of clusters by making the "chunkstore" directory in each
+ * base directory a symlink to the same place.
+ *
+ * Chunk boundaries are content-defined, using a gear rolling hash over
+ * the data, so that the same data gives the same chunks even when it's
+ * at a different offset in the segment. Each chunk is stored compressed
+ * in a file named by a 128-bit hash of its contents, with a header that
+ * holds the number of manifests referencing it. The reference count is
+ * only ever changed with the file locked, so several receivers can add
+ * to and remove from the store at the same time. A chunk is removed when
+ * its last reference goes away.
+ *
+ * A chunked segment is replaced by a manifest, stored with the suffix
+ * .chunks, listing the chunks that make it up. References are added
+ * before the manifest is written, and dropped after it's removed, so a
+ * crash can leak a reference but never leave a manifest pointing to a
+ * missing chunk. New chunks and added references are flushed before the
+ * manifest is written, and the manifest before the segment is removed.
+ * When putting a segment back together, the chunks are read by several
+ * processes in parallel.
+ *
+ * The receiver chunks each segment it completes in a child process, in
+ * the idle I/O class, so the stream is never held up by it. Segments
+ * completed while the previous child is still going are chunked by the
+ * next one. The queue only lives in memory, so when the receiver starts
+ * it looks for segments that were left waiting by the last one.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+/* Chunk size limits, and the average size as a power of two */
+#define CHUNK_MIN_SIZE			(8 * 1024)
+#define CHUNK_AVG_BITS			15
+#define CHUNK_MAX_SIZE			(128 * 1024)
+
+/*
+ * Gear hash masks. The hash is shifted left for each byte, so only the
+ * top bits depend on a full 64 byte window. A stricter mask is used
+ * below the average size and a looser one above it, which keeps chunk
+ * sizes closer to the average.
+ */
+#define GEAR_MASK(bits)			(~UINT64CONST(0) << (64 - (bits)))
+#define CHUNK_MASK_SMALL		GEAR_MASK(CHUNK_AVG_BITS + 2)
+#define CHUNK_MASK_LARGE		GEAR_MASK(CHUNK_AVG_BITS - 2)
+
+#define CHUNK_SEED1				UINT64CONST(0x43484e4b31)
+#define CHUNK_SEED2				UINT64CONST(0x43484e4b32)
+
+/* Processes used to read chunks when putting a segment back together */
+#define CHUNK_RESTORE_WORKERS	4
+
+typedef struct ChunkFileHeader
+{
+	uint32		refcount;		/* number of manifests using the chunk */
+	uint32		len;			/* uncompressed length */
+	uint32		zlen;			/* compressed length following */
+	uint32		reserved;
+} ChunkFileHeader;
+
+char	   *chunkstore = NULL;
+int			chunk_compress_level = Z_BEST_SPEED;
+
+/* Segments completed by the receiver that are waiting to be chunked */
+static char (*pending)[MAXFNAMELEN] = NULL;
+static int	npending = 0;
+static int	maxpending = 0;
+static pid_t chunk_pid = -1;
+static int	rescanned = 0;
+static uint64 last_poll = 0;
+
+/* How often the receiver checks if the chunking child is done, in msec */
+#define CHUNK_POLL_INTERVAL		1000
+
+static uint64 gear[256];
+static int	gear_initialized = 0;
+
+
+static void
+gear_init(void)
+{
+	int			i;
+
+	if (gear_initialized)
+		return;
+	for (i = 0; i < 256; i++)
+	{
+		unsigned char c = i;
+
+		gear[i] = xxh64(&c, 1, CHUNK_SEED1);
+	}
+	gear_initialized = 1;
+}
+
+/*
+ * Return the length of the chunk starting at data.
+ */
+static uint32
+next_chunk(const unsigned char *data, uint32 len)
+{
+	uint64		h = 0;
+	uint32		avg = 1 << CHUNK_AVG_BITS;
+	uint32		i;
+
+	if (len <= CHUNK_MIN_SIZE)
+		return len;
+	if (len > CHUNK_MAX_SIZE)
+		len = CHUNK_MAX_SIZE;
+	if (avg > len)
+		avg = len;
+
+	for (i = CHUNK_MIN_SIZE; i < avg; i++)
+	{
+		h = (h << 1) + gear[data[i]];
+		if (!(h & CHUNK_MASK_SMALL))
+			return i + 1;
+	}
+	for (; i < len; i++)
+	{
+		h = (h << 1) + gear[data[i]];
+		if (!(h & CHUNK_MASK_LARGE))
+			return i + 1;
+	}
+	return len;
+}
+
+static void
+chunk_path(char *path, size_t pathlen, const char *dir, ChunkRef *ref)
+{
+	snprintf(path, pathlen, "%s/%s/%02x/%016llx%016llx", dir, CHUNKSTORE_DIR,
+			 (unsigned int) (ref->h1 >> 56), (unsigned long long) ref->h1,
+			 (unsigned long long) ref->h2);
+}
+
+/*
+ * Open an existing chunk and lock it. Returns -1 if it doesn't exist.
+ */
+static int
+open_chunk_locked(const char *path)
+{
+	struct stat st;
+	int			f;
+
+	for (;;)
+	{
+		f = open(path, O_RDWR);
+		if (f == -1)
+		{
+			if (errno == ENOENT)
+				return -1;
+			fprintf(stderr, "Failed to open chunk %s: %m\n", path);
+			exit(1);
+		}
+		if (flock(f, LOCK_EX) != 0 || fstat(f, &st) != 0)
+		{
+			fprintf(stderr, "Failed to lock chunk %s: %m\n", path);
+			exit(1);
+		}
+		/* Removed by whoever held the lock before us, look again */
+		if (st.st_nlink > 0)
+			return f;
+		close(f);
+	}
+}
+
+/*
+ * Write the reference count of a chunk. An added reference is flushed
+ * right away, since a manifest is about to depend on it; a dropped one
+ * can only leak the chunk if it's lost.
+ */
+static void
+write_refcount(int f, const char *path, ChunkFileHeader *hdr, int flush)
+{
+	if (pwrite(f, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+		(flush && fsync(f) != 0))
+	{
+		fprintf(stderr, "Failed to update chunk %s: %m\n", path);
+		exit(1);
+	}
+}
+
+/*
+ * Add a reference to a chunk, storing it if it isn't in the store yet.
+ * Returns 1 if it was added to the store.
+ */
+static int
+store_chunk(const char *dir, const char *data, uint32 len, ChunkRef *ref)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH + 16];
+	char		subdir[MAXPGPATH];
+	ChunkFileHeader hdr;
+	struct stat st;
+	Bytef	   *zbuf;
+	uLongf		zlen;
+	int			f;
+
+	ref->len = len;
+	ref->reserved = 0;
+	ref->h1 = xxh64(data, len, CHUNK_SEED1);
+	ref->h2 = xxh64(data, len, CHUNK_SEED2);
+	chunk_path(path, sizeof(path), dir, ref);
+
+	for (;;)
+	{
+		f = open_chunk_locked(path);
+		if (f != -1)
+		{
+			if (pread(f, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+				hdr.len != len)
+			{
+				fprintf(stderr, "Chunk %s is corrupt\n", path);
+				exit(1);
+			}
+			hdr.refcount++;
+			write_refcount(f, path, &hdr, 1);
+			close(f);
+			return 0;
+		}
+
+		snprintf(subdir, sizeof(subdir), "%s/%s/%02x", dir, CHUNKSTORE_DIR,
+				 (unsigned int) (ref->h1 >> 56));
+		if (stat(subdir, &st) != 0 && mkdir(subdir, 0777) != 0 &&
+			errno != EEXIST)
+		{
+			fprintf(stderr, "Failed to create directory %s: %m\n", subdir);
+			exit(1);
+		}
+
+		zlen = compressBound(len);
+		zbuf = malloc(zlen);
+		if (!zbuf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (compress2(zbuf, &zlen, (const Bytef *) data, len,
+					  chunk_compress_level) != Z_OK)
+		{
+			fprintf(stderr, "Failed to compress chunk\n");
+			exit(1);
+		}
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.refcount = 1;
+		hdr.len = len;
+		hdr.zlen = zlen;
+
+		/*
+		 * Write it under a name of our own and link it in place, so that
+		 * if someone else stores the same chunk at the same time only one
+		 * of them wins, and the other takes a reference to it instead.
+		 */
+		snprintf(tmppath, sizeof(tmppath), "%s.%i.tmp", path, (int) getpid());
+		f = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (f == -1)
+		{
+			fprintf(stderr, "Failed to create %s: %m\n", tmppath);
+			exit(1);
+		}
+		if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(f, zbuf, zlen) != zlen || fsync(f) != 0 || close(f) != 0)
+		{
+			fprintf(stderr, "Failed to write %s: %m\n", tmppath);
+			exit(1);
+		}
+		free(zbuf);
+		io_throttle(sizeof(hdr) + zlen);
+
+		if (link(tmppath, path) == 0)
+		{
+			unlink(tmppath);
+			if (fsync_dir(subdir) != 0)
+			{
+				fprintf(stderr, "Failed to fsync directory %s: %m\n", subdir);
+				exit(1);
+			}
+			return 1;
+		}
+		if (errno != EEXIST)
+		{
+			fprintf(stderr, "Failed to link %s to %s: %m\n", tmppath, path);
+			exit(1);
+		}
+		unlink(tmppath);
+	}
+}
+
+/*
+ * Drop a reference to a chunk, removing it if it was the last one.
+ */
+static void
+release_chunk(const char *dir, ChunkRef *ref)
+{
+	char		path[MAXPGPATH];
+	ChunkFileHeader hdr;
+	int			f;
+
+	chunk_path(path, sizeof(path), dir, ref);
+	f = open_chunk_locked(path);
+	if (f == -1)
+	{
+		fprintf(stderr, "Chunk %s is already gone\n", path);
+		return;
+	}
+	if (pread(f, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+	{
+		fprintf(stderr, "Chunk %s is corrupt\n", path);
+		exit(1);
+	}
+	if (hdr.refcount <= 1)
+	{
+		/* Unlink while holding the lock, see open_chunk_locked() */
+		if (unlink(path) != 0)
+		{
+			fprintf(stderr, "Failed to remove chunk %s: %m\n", path);
+			exit(1);
+		}
+	}
+	else
+	{
+		hdr.refcount--;
+		write_refcount(f, path, &hdr, 0);
+	}
+	close(f);
+}
+
+/*
+ * Read a chunk into buf. Returns 0 if it's missing or corrupt.
+ */
+static int
+load_chunk(const char *dir, ChunkRef *ref, char *buf)
+{
+	char		path[MAXPGPATH];
+	ChunkFileHeader hdr;
+	Bytef	   *zbuf;
+	uLongf		len = ref->len;
+	int			f;
+	int			ok;
+
+	chunk_path(path, sizeof(path), dir, ref);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		fprintf(stderr, "Chunk %s is missing from the store: %m\n", path);
+		return 0;
+	}
+	if (read(f, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.len != ref->len ||
+		hdr.zlen > compressBound(CHUNK_MAX_SIZE))
+	{
+		fprintf(stderr, "Chunk %s is corrupt\n", path);
+		close(f);
+		return 0;
+	}
+	zbuf = malloc(hdr.zlen);
+	if (!zbuf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	ok = (read(f, zbuf, hdr.zlen) == hdr.zlen &&
+		  uncompress((Bytef *) buf, &len, zbuf, hdr.zlen) == Z_OK &&
+		  len == ref->len &&
+		  xxh64(buf, len, CHUNK_SEED1) == ref->h1 &&
+		  xxh64(buf, len, CHUNK_SEED2) == ref->h2);
+	free(zbuf);
+	close(f);
+	if (!ok)
+		fprintf(stderr, "Chunk %s is corrupt\n", path);
+	return ok;
+}
+
+/*
+ * Read a manifest. Returns the array of chunk references, or NULL if the
+ * manifest is invalid.
+ */
+static ChunkRef *
+read_manifest(const char *path, ChunkManifestHeader *hdr)
+{
+	ChunkRef   *refs;
+	uint64		total = 0;
+	uint32		i;
+	int			f;
+
+	f = open(path, O_RDONLY);
+	if (f == -1)
+		return NULL;
+	if (read(f, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+		hdr->magic != CHUNK_MANIFEST_MAGIC ||
+		hdr->version != CHUNK_MANIFEST_VERSION ||
+		hdr->size != XLogSegSize ||
+		hdr->nchunks > XLogSegSize / CHUNK_MIN_SIZE + 1)
+	{
+		close(f);
+		return NULL;
+	}
+	refs = malloc(hdr->nchunks * sizeof(ChunkRef) + 1);
+	if (!refs)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (read(f, refs, hdr->nchunks * sizeof(ChunkRef)) !=
+		hdr->nchunks * sizeof(ChunkRef))
+	{
+		free(refs);
+		close(f);
+		return NULL;
+	}
+	close(f);
+
+	for (i = 0; i < hdr->nchunks; i++)
+	{
+		if (refs[i].len > CHUNK_MAX_SIZE)
+			break;
+		total += refs[i].len;
+	}
+	if (i < hdr->nchunks || total != hdr->size)
+	{
+		free(refs);
+		return NULL;
+	}
+	return refs;
+}
+
+/*
+ * Put a chunked segment back together into buf, which must be able to
+ * hold XLogSegSize bytes. Returns 0 on failure.
+ *
+ * The chunks are split into ranges that are read by separate processes
+ * into shared memory. Each worker reports back through the shared memory
+ * too, since the caller may have SIGCHLD ignored, as serve mode does.
+ */
+int
+expand_chunked_segment(const char *dir, const char *path, char *buf)
+{
+	ChunkManifestHeader hdr;
+	ChunkRef   *refs;
+	uint32	   *offsets;
+	char	   *shared;
+	volatile int *results;
+	pid_t		pids[CHUNK_RESTORE_WORKERS];
+	int			nworkers;
+	int			ok = 1;
+	uint32		i;
+	int			w;
+
+	refs = read_manifest(path, &hdr);
+	if (!refs)
+	{
+		fprintf(stderr, "Invalid chunk manifest %s\n", path);
+		return 0;
+	}
+	offsets = malloc((hdr.nchunks + 1) * sizeof(uint32));
+	if (!offsets)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	offsets[0] = 0;
+	for (i = 0; i < hdr.nchunks; i++)
+		offsets[i + 1] = offsets[i] + refs[i].len;
+
+	nworkers = Min(CHUNK_RESTORE_WORKERS, hdr.nchunks / 16);
+	if (nworkers <= 1)
+	{
+		for (i = 0; i < hdr.nchunks && ok; i++)
+			ok = load_chunk(dir, &refs[i], buf + offsets[i]);
+		free(refs);
+		free(offsets);
+		return ok;
+	}
+
+	shared = mmap(NULL, XLogSegSize + CHUNK_RESTORE_WORKERS * sizeof(int),
+				  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	results = (volatile int *) (shared + XLogSegSize);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (w = 0; w < nworkers; w++)
+	{
+		uint32		first = (uint64) hdr.nchunks * w / nworkers;
+		uint32		last = (uint64) hdr.nchunks * (w + 1) / nworkers;
+
+		pids[w] = fork();
+		if (pids[w] == -1)
+		{
+			fprintf(stderr, "Failed to fork: %m\n");
+			exit(1);
+		}
+		if (pids[w] == 0)
+		{
+			for (i = first; i < last; i++)
+				if (!load_chunk(dir, &refs[i], shared + offsets[i]))
+					_exit(1);
+			results[w] = 1;
+			_exit(0);
+		}
+	}
+	for (w = 0; w < nworkers; w++)
+	{
+		while (waitpid(pids[w], NULL, 0) == -1 && errno == EINTR)
+			;
+		if (!results[w])
+			ok = 0;
+	}
+
+	if (ok)
+		memcpy(buf, shared, XLogSegSize);
+	munmap(shared, XLogSegSize + CHUNK_RESTORE_WORKERS * sizeof(int));
+	free(refs);
+	free(offsets);
+	return ok;
+}
+
+/*
+ * Split a segment in the archive into chunks, and replace it with a
+ * manifest. If keep is set, the segment itself is left in place.
+ */
+int
+chunk_segment(const char *dir, const char *segname, int keep)
+{
+	char		fn[MAXPGPATH];
+	char		manifest[MAXPGPATH + sizeof(CHUNK_MANIFEST_SUFFIX)];
+	char		tmpfn[MAXPGPATH + sizeof(CHUNK_MANIFEST_SUFFIX) + 4];
+	char		storedir[MAXPGPATH];
+	ChunkManifestHeader hdr;
+	ChunkManifestHeader oldhdr;
+	ChunkRef   *refs;
+	ChunkRef   *oldrefs;
+	char	   *buf;
+	struct stat st;
+	uint32		pos;
+	uint32		i;
+	int			added = 0;
+	int			f;
+
+	snprintf(storedir, sizeof(storedir), "%s/%s", dir, CHUNKSTORE_DIR);
+	if (stat(storedir, &st) != 0 && mkdir(storedir, 0777) != 0)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", storedir);
+		exit(1);
+	}
+	gear_init();
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, segname);
+	buf = malloc(XLogSegSize);
+	refs = malloc((XLogSegSize / CHUNK_MIN_SIZE + 1) * sizeof(ChunkRef));
+	if (!buf || !refs)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	f = open(fn, O_RDONLY);
+	if (f == -1 || read(f, buf, XLogSegSize) != XLogSegSize)
+	{
+		fprintf(stderr, "Failed to read segment %s: %m\n", fn);
+		exit(1);
+	}
+	close(f);
+	io_throttle(XLogSegSize);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CHUNK_MANIFEST_MAGIC;
+	hdr.version = CHUNK_MANIFEST_VERSION;
+	hdr.size = XLogSegSize;
+	for (pos = 0; pos < XLogSegSize; hdr.nchunks++)
+	{
+		uint32		len = next_chunk((unsigned char *) buf + pos,
+									 XLogSegSize - pos);
+
+		added += store_chunk(dir, buf + pos, len, &refs[hdr.nchunks]);
+		pos += len;
+	}
+
+	snprintf(manifest, sizeof(manifest), "%s%s", fn, CHUNK_MANIFEST_SUFFIX);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", manifest);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		write(f, refs, hdr.nchunks * sizeof(ChunkRef)) !=
+		hdr.nchunks * sizeof(ChunkRef) ||
+		fsync(f) != 0 || close(f) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", tmpfn);
+		exit(1);
+	}
+	/* The segment may have been chunked before, if it was received again */
+	oldrefs = read_manifest(manifest, &oldhdr);
+	if (rename(tmpfn, manifest) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, manifest);
+		exit(1);
+	}
+	if (fsync_dir(dir) != 0)
+	{
+		fprintf(stderr, "Failed to fsync directory %s: %m\n", dir);
+		exit(1);
+	}
+	if (oldrefs)
+	{
+		for (i = 0; i < oldhdr.nchunks; i++)
+			release_chunk(dir, &oldrefs[i]);
+		free(oldrefs);
+	}
+
+	if (!keep && unlink(fn) != 0)
+	{
+		fprintf(stderr, "Failed to remove %s: %m\n", fn);
+		exit(1);
+	}
+	if (verbose)
+		printf("Chunked %s: %u chunks, %i new\n", segname, hdr.nchunks, added);
+
+	free(buf);
+	free(refs);
+	return hdr.nchunks;
+}
+
+/*
+ * Start a child process chunking the segments waiting for it, unless the
+ * previous one is still going.
+ */
+static void
+start_chunking(const char *dir)
+{
+	int			status;
+	int			lock;
+	int			i;
+
+	if (chunk_pid != -1)
+	{
+		if (waitpid(chunk_pid, &status, WNOHANG) == 0)
+			return;
+		chunk_pid = -1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	chunk_pid = fork();
+	if (chunk_pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (chunk_pid == 0)
+	{
+		io_set_class(IO_CLASS_IDLE);
+
+		/*
+		 * After a takeover the old receiver's child may still be going,
+		 * with some of the same segments. Wait for it.
+		 */
+		lock = open(dir, O_RDONLY);
+		if (lock == -1 || flock(lock, LOCK_EX) != 0)
+		{
+			fprintf(stderr, "Failed to lock %s: %m\n", dir);
+			_exit(1);
+		}
+		for (i = 0; i < npending; i++)
+		{
+			char		fn[MAXPGPATH];
+
+			/* Compressed or removed meanwhile */
+			snprintf(fn, sizeof(fn), "%s/%s", dir, pending[i]);
+			if (access(fn, F_OK) == 0)
+				chunk_segment(dir, pending[i], 0);
+		}
+		fflush(stdout);
+		_exit(0);
+	}
+	npending = 0;
+}
+
+static void
+queue_segment(const char *segname)
+{
+	if (npending == maxpending)
+	{
+		maxpending = maxpending ? maxpending * 2 : 16;
+		pending = realloc(pending, maxpending * sizeof(*pending));
+		if (!pending)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	snprintf(pending[npending++], MAXFNAMELEN, "%s", segname);
+}
+
+/*
+ * Queue the segments in the base directory that haven't been chunked,
+ * because they were still waiting for it when the last receiver exited.
+ * Those with a manifest already were chunked with -k, and are left alone.
+ */
+static void
+queue_unchunked(const char *dir)
+{
+	DIR		   *d;
+	struct dirent *de;
+
+	d = opendir(dir);
+	if (!d)
+	{
+		fprintf(stderr, "Failed to open directory %s: %m\n", dir);
+		return;
+	}
+	while ((de = readdir(d)) != NULL)
+	{
+		char		manifest[MAXPGPATH + sizeof(CHUNK_MANIFEST_SUFFIX)];
+		struct stat st;
+
+		if (!is_segment_name(de->d_name))
+			continue;
+		snprintf(manifest, sizeof(manifest), "%s/%s%s", dir, de->d_name,
+				 CHUNK_MANIFEST_SUFFIX);
+		if (stat(manifest, &st) == 0)
+			continue;
+		queue_segment(de->d_name);
+	}
+	closedir(d);
+}
+
+/*
+ * Chunk a segment completed by the receiver in the background.
+ */
+void
+chunkstore_segment(const char *dir, const char *segname)
+{
+	queue_segment(segname);
+	start_chunking(dir);
+}
+
+/*
+ * Called regularly by the receiver, to chunk the segments that were
+ * completed while the last child was busy once it's done, and at the
+ * start those left over by the last receiver.
+ */
+void
+chunkstore_poll(const char *dir)
+{
+	uint64		now = now_msec();
+
+	if (now - last_poll < CHUNK_POLL_INTERVAL)
+		return;
+	last_poll = now;
+
+	if (!rescanned)
+	{
+		queue_unchunked(dir);
+		rescanned = 1;
+	}
+	if (npending > 0)
+		start_chunking(dir);
+}
+
+/*
+ * Remove a chunked segment from the archive, dropping its references to
+ * the chunks in the store. Returns 0 if there's no manifest for it.
+ */
+int
+remove_chunked_segment(const char *dir, const char *segname)
+{
+	char		manifest[MAXPGPATH];
+	ChunkManifestHeader hdr;
+	ChunkRef   *refs;
+	uint32		i;
+
+	snprintf(manifest, sizeof(manifest), "%s/%s%s", dir, segname,
+			 CHUNK_MANIFEST_SUFFIX);
+	refs = read_manifest(manifest, &hdr);
+	if (!refs)
+		return 0;
+	if (unlink(manifest) != 0)
+	{
+		fprintf(stderr, "Failed to remove %s: %m\n", manifest);
+		exit(1);
+	}
+	for (i = 0; i < hdr.nchunks; i++)
+		release_chunk(dir, &refs[i]);
+	free(refs);
+	return 1;
+}
+
+
+static void
+chunk_usage(void)
+{
+	printf("Usage: pg_streamrecv chunk -d <directory> [-S <shared store>] [-k] [-x] [-v] <first segment> [last segment]\n");
+	exit(1);
+}
+
+/*
+ * Point the chunkstore directory in the base directory to a shared store,
+ * unless it already exists.
+ */
+void
+chunkstore_link(const char *dir, const char *store)
+{
+	char		path[MAXPGPATH];
+	char		target[MAXPGPATH];
+	struct stat st;
+	ssize_t		r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, CHUNKSTORE_DIR);
+	if (lstat(path, &st) != 0)
+	{
+		if (mkdir(store, 0777) != 0 && errno != EEXIST)
+		{
+			fprintf(stderr, "Failed to create directory %s: %m\n", store);
+			exit(1);
+		}
+		if (symlink(store, path) != 0)
+		{
+			fprintf(stderr, "Failed to link %s to %s: %m\n", path, store);
+			exit(1);
+		}
+		return;
+	}
+	r = readlink(path, target, sizeof(target) - 1);
+	if (r < 0 || (target[r] = '\0', strcmp(target, store) != 0))
+	{
+		fprintf(stderr, "%s already exists and doesn't point to %s\n",
+				path, store);
+		exit(1);
+	}
+}
+
+/*
+ * "pg_streamrecv chunk" - move a range of segments in the archive to the
+ * chunk store, or with -x remove them from the archive and the store.
+ */
+int
+chunk_main(int argc, char *argv[])
+{
+	char	   *first,
+			   *last;
+	char	   *store = NULL;
+	char		segname[MAXFNAMELEN];
+	char		fn[MAXPGPATH];
+	struct stat st;
+	int			keep = 0;
+	int			remove = 0;
+	int			n = 0;
+	TimeLineID	tli,
+				lasttli;
+	uint32		log,
+				seg,
+				lastlog,
+				lastseg;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:kS:vx")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case 'S':
+				store = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'x':
+				remove = 1;
+				break;
+			default:
+				chunk_usage();
+		}
+	}
+	if (!basedir || optind >= argc || argc - optind > 2)
+		chunk_usage();
+	first = argv[optind];
+	last = (optind + 1 < argc) ? argv[optind + 1] : first;
+	if (!is_segment_name(first) || !is_segment_name(last))
+		chunk_usage();
+
+	if (store)
+		chunkstore_link(basedir, store);
+
+	XLogFromFileName(first, &tli, &log, &seg);
+	XLogFromFileName(last, &lasttli, &lastlog, &lastseg);
+	while (log < lastlog || (log == lastlog && seg <= lastseg))
+	{
+		XLogFileName(segname, tli, log, seg);
+		NextLogSeg(log, seg);
+
+		if (remove)
+		{
+			if (remove_chunked_segment(basedir, segname))
+			{
+				n++;
+				if (verbose)
+					printf("Removed %s\n", segname);
+			}
+			continue;
+		}
+
+		snprintf(fn, sizeof(fn), "%s/%s", basedir, segname);
+		if (stat(fn, &st) != 0)
+		{
+			if (verbose)
+				printf("Skipping %s, not in the archive uncompressed\n", segname);
+			continue;
+		}
+		chunk_segment(basedir, segname, keep);
+		n++;
+	}
+
+	printf("%i segments %s\n", n, remove ? "removed" : "chunked");
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * config.c - configuration file for the receiver
+ *
+ * Everything that can be given on the receiver's command line can also be
+ * set in a configuration file given with -f, in the same format as
+ * postgresql.conf:
+ *
+ *	# comment
+ *	name = value
+ *	connection = 'host=master user=replicator'
+ *
+ * Options given on the command line take precedence over the file.
+ *
+ * On SIGHUP, the file is read again and the settings that can be changed
+ * while streaming are applied right away, without disturbing the
+ * replication connection. Changes to the others are rejected with the
+ * reason they need a restart, and their old value is kept. If the file
+ * has any errors in it, none of it is applied.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pg_streamrecv.h"
+
+typedef enum
+{
+	CONFIG_BOOL,
+	CONFIG_INT,
+	CONFIG_STRING
+} ConfigType;
+
+/* Can be changed by a reload */
+#define CONFIG_RELOAD		0x01
+/* ... but not turned on or off, that is changed from or to zero */
+#define CONFIG_NOTOGGLE		0x02
+
+typedef struct ConfigSetting
+{
+	const char *name;
+	ConfigType	type;
+	void	   *var;
+	int			min;
+	int			max;
+	int			unit;			/* multiplier from the file to the variable */
+	int			flags;
+	const char *restart_reason; /* why it can't be changed by a reload */
+
+	/* Filled in at startup */
+	int			cmdline;		/* set on the command line */
+	int			boot_int;		/* value to use when not in the file */
+	char	   *boot_str;
+} ConfigSetting;
+
+static ConfigSetting settings[] = {
+	{"connection", CONFIG_STRING, &connstr, 0, 0, 1, 0,
+	"the replication connection would have to be reestablished, which retransmits the current segment"},
+	{"directory", CONFIG_STRING, &basedir, 0, 0, 1, 0,
+	"the segment being received is written there"},
+	{"chunk_store", CONFIG_STRING, &chunkstore, 0, 0, 1, 0,
+	"the chunk store is linked into the base directory at startup"},
+	{"wal_stats", CONFIG_BOOL, &walstats_enabled, 0, 1, 1, 0,
+	"the statistics for the segment being received would be incomplete"},
+	{"block_summaries", CONFIG_BOOL, &walsummary_enabled, 0, 1, 1, 0,
+	"the summary for the segment being received would be incomplete"},
+	{"record_index_kb", CONFIG_INT, &recindex_stride, 0, 16 * 1024, 1024, 0,
+	"the record index for the segment being received is built with the current stride"},
+	{"time_index_interval", CONFIG_INT, &timeindex_interval, 0, INT_MAX, 1,
+		CONFIG_RELOAD | CONFIG_NOTOGGLE,
+	"the time index must see every commit in a segment, so it can only be turned on or off at startup"},
+	{"flush_interval", CONFIG_INT, &flush_interval, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"chunk_compression", CONFIG_INT, &chunk_compress_level, 1, 9, 1,
+		CONFIG_RELOAD, NULL},
+	{"retention_age_hours", CONFIG_INT, &retention_age, 0, INT_MAX / 3600, 3600,
+		CONFIG_RELOAD, NULL},
+	{"retention_count", CONFIG_INT, &retention_count, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"retention_size_mb", CONFIG_INT, &retention_size_mb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"retention_base_backup", CONFIG_STRING, &retention_base_backup, 0, 0, 1,
+		CONFIG_RELOAD, NULL},
+	{"retention_rate", CONFIG_INT, &retention_rate, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"recompress_tiers", CONFIG_STRING, &recompress_tiers, 0, 0, 1,
+		CONFIG_RELOAD, NULL},
+	{"volume_size_mb", CONFIG_INT, &volume_size_mb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"volume_pack_hours", CONFIG_INT, &volume_pack_age, 0, INT_MAX / 3600, 3600,
+		CONFIG_RELOAD, NULL},
+	{"background_io_rate_kb", CONFIG_INT, &background_io_rate_kb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"disk_compress_free_mb", CONFIG_INT, &disk_compress_free_mb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"disk_prune_free_mb", CONFIG_INT, &disk_prune_free_mb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"disk_prune_keep", CONFIG_INT, &disk_prune_keep, 1, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"disk_throttle_free_mb", CONFIG_INT, &disk_throttle_free_mb, 0, INT_MAX, 1,
+		CONFIG_RELOAD, NULL},
+	{"verbose", CONFIG_INT, &verbose, 0, 3, 1, CONFIG_RELOAD, NULL},
+};
+
+#define NUM_SETTINGS	(sizeof(settings) / sizeof(settings[0]))
+
+typedef struct ConfigValue
+{
+	int			set;
+	int			ival;
+	char	   *sval;
+} ConfigValue;
+
+char	   *config_file = NULL;
+volatile sig_atomic_t config_reload_pending = 0;
+
+
+static ConfigSetting *
+find_setting(const char *name)
+{
+	int			i;
+
+	for (i = 0; i < NUM_SETTINGS; i++)
+	{
+		if (strcmp(settings[i].name, name) == 0)
+			return &settings[i];
+	}
+	return NULL;
+}
+
+/*
+ * Note that a setting was given on the command line, so the file doesn't
+ * override it.
+ */
+void
+config_cmdline(const char *name)
+{
+	ConfigSetting *s = find_setting(name);
+
+	if (!s)
+	{
+		fprintf(stderr, "Unknown setting %s\n", name);
+		exit(1);
+	}
+	s->cmdline = 1;
+}
+
+void
+config_reload_signal(int signo)
+{
+	config_reload_pending = 1;
+}
+
+static int
+parse_value(ConfigSetting *s, const char *str, ConfigValue *v)
+{
+	char	   *end;
+	long		l;
+
+	if (s->type == CONFIG_STRING)
+	{
+		free(v->sval);
+		v->sval = strdup(str);
+		return 1;
+	}
+
+	if (s->type == CONFIG_BOOL)
+	{
+		if (strcmp(str, "on") == 0 || strcmp(str, "true") == 0 ||
+			strcmp(str, "yes") == 0 || strcmp(str, "1") == 0)
+			v->ival = 1;
+		else if (strcmp(str, "off") == 0 || strcmp(str, "false") == 0 ||
+				 strcmp(str, "no") == 0 || strcmp(str, "0") == 0)
+			v->ival = 0;
+		else
+			return 0;
+		return 1;
+	}
+
+	errno = 0;
+	l = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || l < s->min || l > s->max)
+		return 0;
+	v->ival = l * s->unit;
+	return 1;
+}
+
+/*
+ * Read the configuration file into values. Returns 0 if there are any
+ * errors in it, after reporting all of them.
+ */
+static int
+read_config_file(const char *path, ConfigValue *values)
+{
+	char		line[1024];
+	int			lineno = 0;
+	int			ok = 1;
+	FILE	   *f;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open configuration file %s: %m\n", path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char	   *p = line;
+		char	   *name;
+		char	   *value;
+		char	   *end;
+		ConfigSetting *s;
+
+		lineno++;
+
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		name = p;
+		while (isalnum((unsigned char) *p) || *p == '_')
+			p++;
+		end = p;
+		while (isspace((unsigned char) *p))
+			p++;
+		if (*p == '=')
+			p++;
+		*end = '\0';
+		while (isspace((unsigned char) *p))
+			p++;
+
+		if (*p == '\'')
+		{
+			value = ++p;
+			end = strchr(p, '\'');
+			if (!end)
+			{
+				fprintf(stderr, "%s:%i: unterminated quoted value\n",
+						path, lineno);
+				ok = 0;
+				continue;
+			}
+			*end++ = '\0';
+		}
+		else
+		{
+			value = p;
+			while (*p && !isspace((unsigned char) *p) && *p != '#')
+				p++;
+			end = p;
+			if (*end)
+				*end++ = '\0';
+		}
+		while (isspace((unsigned char) *end))
+			end++;
+		if (*end != '\0' && *end != '#')
+		{
+			fprintf(stderr, "%s:%i: syntax error\n", path, lineno);
+			ok = 0;
+			continue;
+		}
+
+		s = find_setting(name);
+		if (!s)
+		{
+			fprintf(stderr, "%s:%i: unknown setting \"%s\"\n",
+					path, lineno, name);
+			ok = 0;
+			continue;
+		}
+		if (!parse_value(s, value, &values[s - settings]))
+		{
+			fprintf(stderr, "%s:%i: invalid value for \"%s\": \"%s\"\n",
+					path, lineno, name, value);
+			ok = 0;
+			continue;
+		}
+		values[s - settings].set = 1;
+	}
+	fclose(f);
+	return ok;
+}
+
+/*
+ * Read the configuration file and apply it. At startup, any error in the
+ * file is fatal. On reload, errors are reported and the file is ignored,
+ * and settings that can't be changed while streaming keep their values.
+ */
+void
+config_load(int reloading)
+{
+	ConfigValue values[NUM_SETTINGS];
+	int			i;
+
+	if (!reloading)
+	{
+		/* Whatever is set now, before reading the file, is the default */
+		for (i = 0; i < NUM_SETTINGS; i++)
+		{
+			if (settings[i].type == CONFIG_STRING)
+				settings[i].boot_str = *(char **) settings[i].var;
+			else
+				settings[i].boot_int = *(int *) settings[i].var;
+		}
+	}
+	if (!config_file)
+		return;
+
+	memset(values, 0, sizeof(values));
+	if (!read_config_file(config_file, values))
+	{
+		if (!reloading)
+			exit(1);
+		fprintf(stderr, "Configuration file %s contains errors, not applied\n",
+				config_file);
+		goto done;
+	}
+
+	for (i = 0; i < NUM_SETTINGS; i++)
+	{
+		ConfigSetting *s = &settings[i];
+		ConfigValue *v = &values[i];
+
+		if (s->cmdline)
+			continue;
+
+		if (s->type == CONFIG_STRING)
+		{
+			char	  **var = (char **) s->var;
+			char	   *newval = v->set ? v->sval : s->boot_str;
+
+			if ((*var == NULL && newval == NULL) ||
+				(*var && newval && strcmp(*var, newval) == 0))
+				continue;
+			if (reloading && !(s->flags & CONFIG_RELOAD))
+			{
+				fprintf(stderr, "Setting \"%s\" can't be changed without restarting, because %s\n",
+						s->name, s->restart_reason);
+				continue;
+			}
+			if (reloading && verbose)
+				printf("Setting \"%s\" changed from \"%s\" to \"%s\"\n",
+					   s->name, *var ? *var : "", newval ? newval : "");
+			*var = newval ? strdup(newval) : NULL;
+		}
+		else
+		{
+			int		   *var = (int *) s->var;
+			int			newval = v->set ? v->ival : s->boot_int;
+
+			if (*var == newval)
+				continue;
+			if (reloading &&
+				(!(s->flags & CONFIG_RELOAD) ||
+				 ((s->flags & CONFIG_NOTOGGLE) && (*var == 0) != (newval == 0))))
+			{
+				fprintf(stderr, "Setting \"%s\" can't be changed without restarting, because %s\n",
+						s->name, s->restart_reason);
+				continue;
+			}
+			if (reloading && verbose)
+				printf("Setting \"%s\" changed from %i to %i\n",
+					   s->name, *var / s->unit, newval / s->unit);
+			*var = newval;
+		}
+	}
+
+done:
+	for (i = 0; i < NUM_SETTINGS; i++)
+		free(values[i].sval);
+	if (reloading && verbose)
+		printf("Reloaded configuration file %s\n", config_file);
+}
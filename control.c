@@ -0,0 +1,664 @@
+/*
+ * control.c - control socket of a running receiver
+ *
+ * While streaming, the receiver listens on a Unix socket in the base
+ * directory for requests from other processes on the same host. Each
+ * request is a single line of text, answered with one or more lines
+ * after which the connection is closed. Errors are answered with a line
+ * starting with "ERROR". "pg_streamrecv control" sends a request and
+ * prints the answer.
+ *
+ * Connections are non-blocking, and the receiver waits for requests in
+ * the same select() as for the stream, putting each one together from
+ * whatever has arrived, so a client that connects and sends nothing can't
+ * hold up receiving. Clients that haven't sent a whole request within
+ * CONTROL_REQUEST_TIMEOUT seconds are disconnected, and so is the one
+ * that has waited longest when too many are waiting at once.
+ *
+ *	STATUS
+ *
+ * Where the stream is, how far behind the server, and how fast it's
+ * going, as "name value" lines. All of it comes from memory, so it can be
+ * polled as often as monitoring likes.
+ *
+ *	FLUSH
+ *
+ * Flush the segment being received to disk right away.
+ *
+ *	FINALIZE
+ *
+ * Copy the part of the segment received so far to the base directory
+ * with the suffix .partial, for exporting the very latest WAL without
+ * waiting for the segment to be completed.
+ *
+ *	PAUSE, RESUME
+ *
+ * Stop and start reading from the server. While paused, the server is
+ * held back by TCP flow control, and keeps the WAL not yet sent.
+ *
+ *	RESET
+ *
+ * Start the counters reported by STATUS and in the metrics over.
+ *
+ *	SUBSCRIBE
+ *
+ * Keep the connection open and get a line each time more WAL is safely on
+ * disk, so local consumers such as restore_command can block on it
+ * instead of polling the directory:
+ *
+ *	FLUSHED <location> <segment>
+ *	SEGMENT <segment>
+ *
+ * FLUSHED is sent whenever the segment being received has been flushed up
+ * to a new location, and SEGMENT when a completed segment has been moved
+ * into the base directory. The answer to the request itself is "OK"
+ * followed by the location flushed so far. Subscribers that don't keep up
+ * reading are disconnected rather than holding up the stream. The same
+ * location is also kept in the file flushed.lsn in the base directory,
+ * replaced atomically, for consumers that would rather watch a file.
+ *
+ *	HANDOFF <version> <size of state>
+ *
+ * Sent by a new receiver started with -H, to take over the stream without
+ * losing or fetching again any data, for example when upgrading to a new
+ * binary. The running receiver stops reading from the server between two
+ * blocks, and sends back a HandoffState describing where it is, along
+ * with the descriptor of the segment file it's writing using SCM_RIGHTS.
+ * The new receiver starts replication at exactly the location the old one
+ * had reached and replies "OK" once the server has accepted that, and
+ * only then does the old receiver disconnect and exit. The new receiver
+ * doesn't write to the segment file before that. If it fails before that,
+ * it replies "NO", or exits, and the old one carries on. If there's no
+ * answer within HANDOFF_TIMEOUT seconds, the old one can't tell whether
+ * the new one is about to write to the file too, and exits without
+ * writing anything more. A new receiver that then finds the connection
+ * closed when it replies carries on, as the old one has gone.
+ *
+ * The replication connection itself can't be handed over, since libpq
+ * has no way to adopt an existing socket, and the protocol state lives
+ * inside the PGconn anyway. So the new receiver connects and identifies
+ * the system before asking for the handoff, and the only gap in the
+ * stream is the time it takes to start replication.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+/* How long to wait for a client to send its request */
+#define CONTROL_REQUEST_TIMEOUT		5
+
+/* How long to wait for a new receiver to start replication */
+#define HANDOFF_TIMEOUT				60
+
+#define MAX_SUBSCRIBERS				32
+#define MAX_PENDING_CLIENTS			16
+
+static int	subscribers[MAX_SUBSCRIBERS];
+static int	nsubscribers = 0;
+
+/* Connections whose request hasn't all arrived yet */
+typedef struct ControlClient
+{
+	int			sock;
+	time_t		accepted;
+	int			len;
+	char		request[256];
+} ControlClient;
+
+static ControlClient clients[MAX_PENDING_CLIENTS];
+static int	nclients = 0;
+
+
+static int
+control_address(const char *dir, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir,
+				 CONTROL_SOCKET_FILENAME) >= sizeof(addr->sun_path))
+		return 0;
+	return 1;
+}
+
+/*
+ * Start listening on the control socket. Returns the listening socket, or
+ * -1 if it can't be set up, in which case we just go on without it.
+ */
+int
+control_listen(const char *dir)
+{
+	struct sockaddr_un addr;
+	int			sock;
+
+	if (!control_address(dir, &addr))
+	{
+		fprintf(stderr, "Path of control socket in %s is too long, not listening\n",
+				dir);
+		return -1;
+	}
+
+	/* Left behind by a receiver that has exited, or that we took over */
+	unlink(addr.sun_path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 ||
+		bind(sock, (struct sockaddr *) & addr, sizeof(addr)) != 0 ||
+		listen(sock, 4) != 0 ||
+		fcntl(sock, F_SETFL, O_NONBLOCK) != 0)
+	{
+		fprintf(stderr, "Failed to listen on control socket %s: %m\n",
+				addr.sun_path);
+		if (sock >= 0)
+			close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Accept the connections waiting on the control socket, and read what has
+ * arrived of their requests, without waiting for anything. Returns a
+ * connection with its request line in request, or -1 if no request is
+ * complete. Call until it returns -1.
+ */
+int
+control_accept(int listensock, char *request, int len)
+{
+	int			sock;
+	int			i;
+
+	while ((sock = accept(listensock, NULL, NULL)) >= 0)
+	{
+		if (fcntl(sock, F_SETFL, O_NONBLOCK) != 0)
+		{
+			close(sock);
+			continue;
+		}
+		/* Make room by dropping whoever has been waiting longest */
+		if (nclients == MAX_PENDING_CLIENTS)
+		{
+			int			oldest = 0;
+
+			for (i = 1; i < nclients; i++)
+				if (clients[i].accepted < clients[oldest].accepted)
+					oldest = i;
+			close(clients[oldest].sock);
+			clients[oldest] = clients[--nclients];
+		}
+		clients[nclients].sock = sock;
+		clients[nclients].accepted = time(NULL);
+		clients[nclients].len = 0;
+		nclients++;
+	}
+
+	for (i = 0; i < nclients;)
+	{
+		ControlClient *c = &clients[i];
+		char	   *nl;
+		int			r;
+
+		r = recv(c->sock, c->request + c->len,
+				 sizeof(c->request) - 1 - c->len, 0);
+		if (r > 0)
+			c->len += r;
+		c->request[c->len] = '\0';
+
+		nl = strchr(c->request, '\n');
+		if (nl || c->len == sizeof(c->request) - 1)
+		{
+			if (nl)
+				*nl = '\0';
+			snprintf(request, len, "%s", c->request);
+			sock = c->sock;
+			clients[i] = clients[--nclients];
+			return sock;
+		}
+		if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR) ||
+			time(NULL) - c->accepted >= CONTROL_REQUEST_TIMEOUT)
+		{
+			close(c->sock);
+			clients[i] = clients[--nclients];
+			continue;
+		}
+		i++;
+	}
+	return -1;
+}
+
+/*
+ * Add the connections waiting to send their request to fds, to wait for
+ * along with the stream. Returns the highest descriptor added, or -1.
+ */
+int
+control_wait_fds(fd_set *fds)
+{
+	int			maxfd = -1;
+	int			i;
+
+	for (i = 0; i < nclients; i++)
+	{
+		FD_SET(clients[i].sock, fds);
+		maxfd = Max(maxfd, clients[i].sock);
+	}
+	return maxfd;
+}
+
+/*
+ * Send a reply to a request on the control socket.
+ */
+void
+control_reply(int sock, const char *fmt,...)
+{
+	char		buf[1024];
+	va_list		args;
+	int			len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	/* A client that has gone away mustn't take us down with SIGPIPE */
+	if (send(sock, buf, len, MSG_NOSIGNAL) != len && verbose)
+		fprintf(stderr, "Failed to reply on control socket: %m\n");
+}
+
+/*
+ * Keep a connection on the control socket open to send notifications to.
+ * Returns 0 if there are too many subscribers already.
+ */
+int
+control_subscribe(int sock)
+{
+	if (nsubscribers >= MAX_SUBSCRIBERS)
+		return 0;
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	subscribers[nsubscribers++] = sock;
+	return 1;
+}
+
+/*
+ * Send a line to all subscribers. Those that have gone away, or have so
+ * much unread that the line doesn't fit, are disconnected.
+ */
+static void
+control_notify(const char *fmt,...)
+{
+	char		buf[256];
+	va_list		args;
+	int			len;
+	int			i;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	for (i = 0; i < nsubscribers;)
+	{
+		if (send(subscribers[i], buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+		{
+			if (verbose > 1)
+				printf("Disconnecting subscriber: %s\n",
+					   errno == EAGAIN ? "not reading" : strerror(errno));
+			close(subscribers[i]);
+			subscribers[i] = subscribers[--nsubscribers];
+			continue;
+		}
+		i++;
+	}
+}
+
+/*
+ * Record that the WAL up to flushed is on disk, in segment segname, by
+ * replacing the flushed.lsn file and telling the subscribers. If the
+ * segment has just been completed, they're told about that as well.
+ */
+void
+notify_flushed(const char *dir, XLogRecPtr flushed, const char *segname,
+			   int completed)
+{
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	FILE	   *f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, FLUSHED_LSN_FILENAME);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = fopen(tmpfn, "w");
+	if (!f)
+		fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+	else
+	{
+		fprintf(f, "%X/%08X %s\n", flushed.xlogid, flushed.xrecoff, segname);
+		if (fclose(f) != 0 || rename(tmpfn, fn) != 0)
+		{
+			fprintf(stderr, "Failed to write %s: %m\n", fn);
+			unlink(tmpfn);
+		}
+	}
+
+	/*
+	 * The file is only advisory, so not being able to write it, say with
+	 * the disk full, mustn't stop the stream. The WAL itself is on disk, so
+	 * the subscribers can still be told.
+	 */
+	control_notify("FLUSHED %X/%08X %s\n", flushed.xlogid, flushed.xrecoff,
+				   segname);
+	if (completed)
+		control_notify("SEGMENT %s\n", segname);
+}
+
+/*
+ * Send the state of the stream and the segment file to a new receiver.
+ * Returns 1 if it has taken over the stream, 0 if it hasn't and we
+ * should carry on. Exits if we can't tell.
+ */
+int
+handoff_send(int sock, HandoffState *state, int walfile)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	char		cbuf[CMSG_SPACE(sizeof(int))];
+	char		reply[3];
+	int			got = 0;
+	int			r = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = state;
+	iov.iov_len = sizeof(HandoffState);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &walfile, sizeof(int));
+
+	if (sendmsg(sock, &msg, 0) != sizeof(HandoffState))
+	{
+		fprintf(stderr, "Failed to send stream state: %m\n");
+		return 0;
+	}
+
+	/*
+	 * Wait for the new receiver to start replication. It can't get
+	 * anywhere without the server, and we can't carry on safely until we
+	 * know whether it did, but a new receiver that hangs mustn't stop us
+	 * for good either.
+	 */
+	tv.tv_sec = HANDOFF_TIMEOUT;
+	tv.tv_usec = 0;
+	if (fcntl(sock, F_SETFL, 0) != 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+	{
+		fprintf(stderr, "Failed to set up control socket for handoff: %m\n");
+		exit(1);
+	}
+	while (got < sizeof(reply))
+	{
+		r = read(sock, reply + got, sizeof(reply) - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+
+	if (got == sizeof(reply) && memcmp(reply, "OK\n", 3) == 0)
+		return 1;
+	/* Refused, or gone without writing anything */
+	if ((got == sizeof(reply) && memcmp(reply, "NO\n", 3) == 0) ||
+		(got == 0 && r == 0))
+		return 0;
+
+	/* It may have the file and be about to write to it */
+	fprintf(stderr, "New receiver did not answer the handoff, exiting without writing more\n");
+	exit(1);
+}
+
+/*
+ * Connect to the control socket of the receiver running in dir. If
+ * missing_ok is set, -1 is returned if there is no receiver running
+ * instead of failing.
+ */
+static int
+control_connect(const char *dir, int missing_ok)
+{
+	struct sockaddr_un addr;
+	int			sock;
+
+	if (!control_address(dir, &addr))
+	{
+		fprintf(stderr, "Path of control socket in %s is too long\n", dir);
+		exit(1);
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 ||
+		connect(sock, (struct sockaddr *) & addr, sizeof(addr)) != 0)
+	{
+		if (missing_ok)
+		{
+			if (sock >= 0)
+				close(sock);
+			return -1;
+		}
+		fprintf(stderr, "Failed to connect to receiver on %s: %m\n",
+				addr.sun_path);
+		exit(1);
+	}
+	return sock;
+}
+
+/*
+ * Subscribe to the notifications of the receiver running in dir. Returns
+ * the connection to read them from, or -1 if there's no receiver running.
+ */
+int
+notify_subscribe(const char *dir)
+{
+	int			sock = control_connect(dir, 1);
+
+	if (sock < 0)
+		return -1;
+	if (write(sock, "SUBSCRIBE\n", 10) != 10)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Ask the receiver running in dir to hand over its stream. Returns the
+ * descriptor of the segment file it was writing, with its state in state,
+ * and the connection to it in sock, to confirm with handoff_confirm().
+ */
+int
+handoff_request(const char *dir, HandoffState *state, int *sock)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char		cbuf[CMSG_SPACE(sizeof(int))];
+	char		request[64];
+	char	   *p = (char *) state;
+	int			got;
+	int			walfile = -1;
+
+	*sock = control_connect(dir, 0);
+
+	snprintf(request, sizeof(request), "HANDOFF %i %i\n", HANDOFF_VERSION,
+			 (int) sizeof(HandoffState));
+	if (write(*sock, request, strlen(request)) != strlen(request))
+	{
+		fprintf(stderr, "Failed to send handoff request: %m\n");
+		exit(1);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = state;
+	iov.iov_len = sizeof(HandoffState);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	got = recvmsg(*sock, &msg, 0);
+	if (got <= 0)
+	{
+		fprintf(stderr, "Failed to receive stream state: %m\n");
+		exit(1);
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&walfile, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	/* The rest of the state may come separately */
+	while (got < sizeof(HandoffState))
+	{
+		int			r = read(*sock, p + got, sizeof(HandoffState) - got);
+
+		if (r <= 0)
+			break;
+		got += r;
+	}
+
+	if (strncmp(p, "ERROR", 5) == 0)
+	{
+		p[Min(got, sizeof(HandoffState) - 1)] = '\0';
+		fprintf(stderr, "Receiver refused handoff: %s", p + 6);
+		exit(1);
+	}
+	if (got != sizeof(HandoffState) || walfile < 0 ||
+		state->magic != HANDOFF_MAGIC || state->version != HANDOFF_VERSION)
+	{
+		fprintf(stderr, "Invalid stream state received\n");
+		exit(1);
+	}
+	return walfile;
+}
+
+/*
+ * Tell the old receiver that we've taken over, so it can exit.
+ */
+void
+handoff_confirm(int sock)
+{
+	/*
+	 * If the old receiver gave up waiting for us, it has exited without
+	 * writing anything more, so the stream is ours either way.
+	 */
+	if (send(sock, "OK\n", 3, MSG_NOSIGNAL) != 3)
+		fprintf(stderr, "Old receiver did not wait for the handoff to be confirmed: %m\n");
+	close(sock);
+}
+
+/*
+ * Tell the old receiver that we won't take over after all, so it carries
+ * on. Nothing may have been written to the segment file.
+ */
+void
+handoff_refuse(int sock)
+{
+	if (send(sock, "NO\n", 3, MSG_NOSIGNAL) != 3)
+		fprintf(stderr, "Failed to refuse handoff: %m\n");
+	close(sock);
+}
+
+
+static void
+control_usage(void)
+{
+	printf("Usage: pg_streamrecv control -d <directory> <status|flush|finalize|pause|resume|reset|subscribe>\n");
+	exit(1);
+}
+
+/*
+ * Send a request to the receiver running in a directory, and print the
+ * answer.
+ */
+int
+control_main(int argc, char *argv[])
+{
+	char	   *dir = NULL;
+	char		request[64];
+	char		buf[1024];
+	int			sock;
+	int			r;
+	int			i;
+	int			c;
+	int			failed = 0;
+	int			first = 1;
+
+	while ((c = getopt(argc, argv, "d:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				dir = strdup(optarg);
+				break;
+			default:
+				control_usage();
+		}
+	}
+	if (!dir || optind != argc - 1 || strlen(argv[optind]) >= sizeof(request) - 1)
+		control_usage();
+
+	for (i = 0; argv[optind][i]; i++)
+		request[i] = toupper((unsigned char) argv[optind][i]);
+	request[i] = '\0';
+	if (strcmp(request, "HANDOFF") == 0)
+	{
+		fprintf(stderr, "To take over the stream, start a new receiver with -H\n");
+		exit(1);
+	}
+	if (strcmp(request, "SUBSCRIBE") == 0)
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	strcat(request, "\n");
+
+	sock = control_connect(dir, 0);
+	if (write(sock, request, strlen(request)) != strlen(request))
+	{
+		fprintf(stderr, "Failed to send request: %m\n");
+		exit(1);
+	}
+	while ((r = read(sock, buf, sizeof(buf))) > 0)
+	{
+		if (first && r >= 5 && strncmp(buf, "ERROR", 5) == 0)
+			failed = 1;
+		first = 0;
+		fwrite(buf, 1, r, failed ? stderr : stdout);
+	}
+	if (r < 0)
+	{
+		fprintf(stderr, "Failed to read answer: %m\n");
+		exit(1);
+	}
+	close(sock);
+	return failed;
+}
@@ -0,0 +1,52 @@
+/*
+ * crc32.c - CRC-32 calculation for pg_streamrecv
+ *
+ * This is the same CRC-32 that the backend uses for WAL records, but
+ * implemented here since the backend version is not available to
+ * frontend programs built outside the source tree.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include "pg_streamrecv.h"
+
+static uint32 crc32_table[256];
+static int	crc32_table_built = 0;
+
+static void
+build_crc32_table(void)
+{
+	uint32		i,
+				j,
+				c;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		crc32_table[i] = c;
+	}
+	crc32_table_built = 1;
+}
+
+/*
+ * Add len bytes of data to a running CRC, which should have been
+ * initialized with INIT_WALCRC.
+ */
+uint32
+walcrc_update(uint32 crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	if (!crc32_table_built)
+		build_crc32_table();
+
+	while (len-- > 0)
+		crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
@@ -0,0 +1,917 @@
+/*
+ * dedup.c - store full page images once across segments
+ *
+ * After every checkpoint, the first change to each block writes a full
+ * image of it to the WAL again, and for blocks that don't change much
+ * those images are the same or nearly so from one checkpoint to the
+ * next. "pg_streamrecv dedup" takes the page images out of completed
+ * segments and keeps each distinct one once in a content-addressed page
+ * store, leaving a reference to it in the segment.
+ *
+ * A deduplicated segment is stored gzip compressed with the suffix
+ * .dedup, and holds a list of references, each giving the location of
+ * a page image in the segment, its length and its hash, followed by the
+ * segment with the page images cut out. Page headers that fall in the
+ * middle of an image are kept in the residual data, so putting the
+ * segment back together is just a matter of copying the pieces back.
+ *
+ * Page images are identified by a 128-bit hash made up of two XXH64
+ * hashes with different seeds, and stored compressed, one file per image,
+ * under the pagestore directory. To keep up with incoming segments
+ * without needing memory in proportion to the size of the store, images
+ * known to be in the store are remembered in a fixed size cache, and the
+ * store itself is only checked on a cache miss.
+ *
+ * Page images are written to a temporary name and flushed before being
+ * renamed into place, and the .dedup segment is flushed, along with the
+ * directories of any images added for it, before the original segment
+ * is removed. A run holds a shared lock on the page store for as long as
+ * it may be adding images that no segment refers to yet.
+ *
+ * Images are not reference counted, since that would mean touching the
+ * store for every image, cached or not. Instead, "pg_streamrecv dedup
+ * -g" sweeps the store, removing every image that no .dedup segment
+ * refers to any more, holding the lock exclusively so no run is adding
+ * images meanwhile. Retention does the same after removing deduplicated
+ * segments, unless a run is going, in which case it's left for the next
+ * time.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+#define DEDUP_SEED1			UINT64CONST(0)
+#define DEDUP_SEED2			UINT64CONST(0x5047535452454356)
+
+/* Images smaller than this aren't worth a reference */
+#define DEDUP_MIN_IMAGE		512
+
+/* Cache of images known to be in the store */
+#define CACHE_WAYS			4
+
+typedef struct PageKey
+{
+	uint64		h1;
+	uint64		h2;
+} PageKey;
+
+static PageKey *cache = NULL;
+static uint32 cache_sets = 0;
+static uint32 cache_clock = 0;
+
+/* Page store subdirectories with images added since they were flushed */
+static char dirty_dirs[256];
+
+typedef struct DedupState
+{
+	uint32		segstart;		/* xrecoff of the segment start */
+	uint32		segno;
+	uint32		seglog;
+	DedupRef   *refs;
+	uint32		nrefs;
+	uint32		maxrefs;
+
+	/* Statistics */
+	uint64		images;
+	uint64		image_bytes;
+	uint64		stored;
+	uint64		stored_bytes;
+} DedupState;
+
+
+static void
+page_key(const char *image, uint32 len, PageKey *key)
+{
+	key->h1 = xxh64(image, len, DEDUP_SEED1);
+	key->h2 = xxh64(image, len, DEDUP_SEED2);
+}
+
+static void
+page_path(char *path, size_t pathlen, const char *dir, uint64 h1, uint64 h2)
+{
+	snprintf(path, pathlen, "%s/%s/%02x/%016llx%016llx", dir, PAGESTORE_DIR,
+			 (unsigned int) (h1 >> 56), (unsigned long long) h1,
+			 (unsigned long long) h2);
+}
+
+static void
+cache_init(uint32 megabytes)
+{
+	cache_sets = (uint32) (((uint64) megabytes * 1024 * 1024) /
+						   (sizeof(PageKey) * CACHE_WAYS));
+	if (cache_sets == 0)
+		cache_sets = 1;
+	cache = calloc(cache_sets * CACHE_WAYS, sizeof(PageKey));
+	if (!cache)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+/*
+ * Look up a key in the cache, adding it if add is set. Once a set is
+ * full, a new key replaces one of the old ones in round robin order.
+ */
+static int
+cache_lookup(PageKey *key, int add)
+{
+	PageKey    *set = &cache[(key->h1 % cache_sets) * CACHE_WAYS];
+	int			i;
+
+	for (i = 0; i < CACHE_WAYS; i++)
+	{
+		if (set[i].h1 == key->h1 && set[i].h2 == key->h2)
+			return 1;
+		if (set[i].h1 == 0 && set[i].h2 == 0)
+			break;
+	}
+	if (add)
+		set[i < CACHE_WAYS ? i : cache_clock++ % CACHE_WAYS] = *key;
+	return 0;
+}
+
+/*
+ * Make sure a page image is in the store. Returns 1 if it had to be
+ * added.
+ */
+static int
+store_page(const char *dir, const char *image, uint32 len, PageKey *key)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH + 16];
+	char		subdir[MAXPGPATH];
+	struct stat st;
+	Bytef		zbuf[BLCKSZ + BLCKSZ / 100 + 64];
+	uLongf		zlen = sizeof(zbuf);
+	int			f;
+
+	if (cache_lookup(key, 0))
+		return 0;
+
+	page_path(path, sizeof(path), dir, key->h1, key->h2);
+	if (stat(path, &st) == 0)
+	{
+		cache_lookup(key, 1);
+		return 0;
+	}
+
+	snprintf(subdir, sizeof(subdir), "%s/%s/%02x", dir, PAGESTORE_DIR,
+			 (unsigned int) (key->h1 >> 56));
+	if (stat(subdir, &st) != 0 && mkdir(subdir, 0777) != 0)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", subdir);
+		exit(1);
+	}
+
+	if (compress2(zbuf, &zlen, (const Bytef *) image, len, Z_BEST_SPEED) != Z_OK)
+	{
+		fprintf(stderr, "Failed to compress page image\n");
+		exit(1);
+	}
+
+	/*
+	 * Write to a temporary name of our own first, so the store never has a
+	 * torn file, even with another run adding the same image.
+	 */
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp.%i", path, (int) getpid());
+	f = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmppath);
+		exit(1);
+	}
+	if (write(f, zbuf, zlen) != zlen)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", tmppath);
+		exit(1);
+	}
+	if (fsync(f) != 0 || close(f) != 0)
+	{
+		fprintf(stderr, "Failed to fsync %s: %m\n", tmppath);
+		exit(1);
+	}
+	if (rename(tmppath, path) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmppath, path);
+		exit(1);
+	}
+	dirty_dirs[key->h1 >> 56] = 1;
+
+	cache_lookup(key, 1);
+	return 1;
+}
+
+/*
+ * Flush the page store directories that images have been added to, so
+ * they're all there after a crash before a segment refers to them.
+ */
+static void
+flush_page_dirs(const char *dir)
+{
+	char		subdir[MAXPGPATH];
+	int			i;
+
+	for (i = 0; i < 256; i++)
+	{
+		if (!dirty_dirs[i])
+			continue;
+		snprintf(subdir, sizeof(subdir), "%s/%s/%02x", dir, PAGESTORE_DIR, i);
+		if (fsync_dir(subdir) != 0)
+		{
+			fprintf(stderr, "Failed to fsync directory %s: %m\n", subdir);
+			exit(1);
+		}
+		dirty_dirs[i] = 0;
+	}
+}
+
+/*
+ * Lock the page store, shared while adding images to it, or exclusively
+ * while sweeping it. Returns the file descriptor holding the lock, or -1
+ * if there is no page store, or if wait isn't set and it's locked.
+ */
+static int
+lock_page_store(const char *dir, int how, int wait)
+{
+	char		path[MAXPGPATH];
+	int			f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, PAGESTORE_DIR);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		if (errno == ENOENT)
+			return -1;
+		fprintf(stderr, "Failed to open %s: %m\n", path);
+		exit(1);
+	}
+	if (flock(f, how | (wait ? 0 : LOCK_NB)) != 0)
+	{
+		if (errno == EWOULDBLOCK)
+		{
+			close(f);
+			return -1;
+		}
+		fprintf(stderr, "Failed to lock %s: %m\n", path);
+		exit(1);
+	}
+	return f;
+}
+
+/*
+ * Read a page image back from the store. Returns 0 if it's missing or
+ * doesn't match its hash.
+ */
+static int
+load_page(const char *dir, DedupRef *ref, char *image)
+{
+	char		path[MAXPGPATH];
+	Bytef		zbuf[BLCKSZ + BLCKSZ / 100 + 64];
+	uLongf		len = ref->len;
+	PageKey		key;
+	int			f;
+	int			r;
+
+	page_path(path, sizeof(path), dir, ref->h1, ref->h2);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		fprintf(stderr, "Page image %s is missing from the store: %m\n", path);
+		return 0;
+	}
+	r = read(f, zbuf, sizeof(zbuf));
+	close(f);
+	if (r <= 0 || uncompress((Bytef *) image, &len, zbuf, r) != Z_OK ||
+		len != ref->len)
+	{
+		fprintf(stderr, "Page image %s is corrupt\n", path);
+		return 0;
+	}
+	page_key(image, len, &key);
+	if (key.h1 != ref->h1 || key.h2 != ref->h2)
+	{
+		fprintf(stderr, "Page image %s doesn't match its hash\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Copy a page image between a segment and a contiguous buffer. The
+ * image starts at offset in the segment and continues across page
+ * boundaries the way record data does; the page headers in between are
+ * copied between the segment and the residual data at res instead.
+ * Returns the offset in the segment just past the image.
+ */
+static uint32
+move_image(char *seg, uint32 offset, char *image, uint32 len,
+		   char *res, uint32 *rpos, int expand)
+{
+	uint32		done = 0;
+
+	while (done < len)
+	{
+		uint32		n;
+
+		if (offset % XLOG_BLCKSZ == 0)
+		{
+			n = SizeOfXLogShortPHD + SizeOfXLogContRecord;
+			if (expand)
+				memcpy(seg + offset, res + *rpos, n);
+			else
+				memcpy(res + *rpos, seg + offset, n);
+			offset += n;
+			*rpos += n;
+		}
+		n = Min(len - done, XLOG_BLCKSZ - offset % XLOG_BLCKSZ);
+		if (expand)
+			memcpy(seg + offset, image + done, n);
+		else
+			memcpy(image + done, seg + offset, n);
+		offset += n;
+		done += n;
+	}
+	return offset;
+}
+
+/*
+ * Map an offset in the data of a record starting at recoff to an offset
+ * in the segment.
+ */
+static uint32
+record_offset_to_segment(uint32 recoff, uint32 off)
+{
+	uint32		pos = recoff;
+
+	while (off >= XLOG_BLCKSZ - pos % XLOG_BLCKSZ)
+	{
+		off -= XLOG_BLCKSZ - pos % XLOG_BLCKSZ;
+		pos += XLOG_BLCKSZ - pos % XLOG_BLCKSZ;
+		pos += SizeOfXLogShortPHD + SizeOfXLogContRecord;
+	}
+	return pos + off;
+}
+
+static void
+dedup_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	DedupState *ds = arg;
+	uint32		log,
+				seg,
+				recoff;
+	int			i;
+
+	XLByteToSeg(dec->recstart, log, seg);
+	if (log != ds->seglog || seg != ds->segno)
+		return;
+	recoff = dec->recstart.xrecoff - ds->segstart;
+
+	for (i = 0; i < XLR_MAX_BKP_BLOCKS; i++)
+	{
+		BkpBlock   *bkp;
+		DedupRef   *ref;
+		uint32		len;
+		char	   *image;
+
+		bkp = xlogdecode_bkp_block(record, i, &len);
+		if (!bkp)
+			continue;
+		image = (char *) bkp + sizeof(BkpBlock);
+		len -= sizeof(BkpBlock);
+		if (len < DEDUP_MIN_IMAGE)
+			continue;
+
+		if (ds->nrefs == ds->maxrefs)
+		{
+			ds->maxrefs = ds->maxrefs ? ds->maxrefs * 2 : 1024;
+			ds->refs = realloc(ds->refs, ds->maxrefs * sizeof(DedupRef));
+			if (!ds->refs)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		/* The record might continue in the next segment */
+		if (record_offset_to_segment(recoff, image - (char *) record + len - 1) >=
+			XLogSegSize)
+			continue;
+
+		ref = &ds->refs[ds->nrefs++];
+		ref->offset = record_offset_to_segment(recoff, image - (char *) record);
+		ref->len = len;
+		page_key(image, len, (PageKey *) &ref->h1);
+
+		ds->images++;
+		ds->image_bytes += len;
+		if (store_page(basedir, image, len, (PageKey *) &ref->h1))
+		{
+			ds->stored++;
+			ds->stored_bytes += len;
+		}
+	}
+}
+
+/*
+ * Deduplicate one segment, writing the result to out. Returns the number
+ * of page images referenced.
+ */
+static int
+dedup_segment(const char *segname, char *buf, char *res, DedupState *ds,
+			  gzFile out)
+{
+	XLogDecoder dec;
+	XLogRecPtr	start;
+	DedupHeader hdr;
+	TimeLineID	tli;
+	char		image[BLCKSZ];
+	uint32		pos = 0,
+				rpos = 0;
+	uint32		i;
+
+	XLogFromFileName(segname, &tli, &ds->seglog, &ds->segno);
+	ds->segstart = ds->segno * XLogSegSize;
+	ds->nrefs = 0;
+	start.xlogid = ds->seglog;
+	start.xrecoff = ds->segstart;
+
+	xlogdecode_init(&dec);
+	xlogdecode_add_consumer(&dec, dedup_record, ds);
+	xlogdecode_feed(&dec, start, buf, XLogSegSize);
+
+	/* Cut the images out, keeping everything else in order */
+	for (i = 0; i < ds->nrefs; i++)
+	{
+		DedupRef   *ref = &ds->refs[i];
+
+		memcpy(res + rpos, buf + pos, ref->offset - pos);
+		rpos += ref->offset - pos;
+		pos = move_image(buf, ref->offset, image, ref->len, res, &rpos, 0);
+	}
+	memcpy(res + rpos, buf + pos, XLogSegSize - pos);
+	rpos += XLogSegSize - pos;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DEDUP_MAGIC;
+	hdr.version = DEDUP_VERSION;
+	hdr.nrefs = ds->nrefs;
+	if (gzwrite(out, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		(ds->nrefs > 0 &&
+		 gzwrite(out, ds->refs, ds->nrefs * sizeof(DedupRef)) !=
+		 ds->nrefs * sizeof(DedupRef)) ||
+		gzwrite(out, res, rpos) != rpos)
+	{
+		fprintf(stderr, "Failed to write deduplicated segment\n");
+		exit(1);
+	}
+	return ds->nrefs;
+}
+
+/*
+ * Put a deduplicated segment back together into buf, which must be able
+ * to hold XLogSegSize bytes. Returns 0 on failure.
+ */
+int
+expand_dedup_segment(const char *dir, const char *path, char *buf)
+{
+	DedupHeader hdr;
+	DedupRef   *refs = NULL;
+	char	   *res = NULL;
+	char		image[BLCKSZ];
+	uint32		pos = 0,
+				rpos = 0,
+				reslen = 0;
+	uint32		i;
+	gzFile		gz;
+	int			r;
+	int			ok = 0;
+
+	gz = gzopen(path, "rb");
+	if (!gz)
+		return 0;
+	if (gzread(gz, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		hdr.magic != DEDUP_MAGIC || hdr.version != DEDUP_VERSION ||
+		hdr.nrefs > XLogSegSize / DEDUP_MIN_IMAGE)
+		goto done;
+
+	refs = malloc(hdr.nrefs * sizeof(DedupRef) + 1);
+	res = malloc(XLogSegSize);
+	if (!refs || !res)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (hdr.nrefs > 0 &&
+		gzread(gz, refs, hdr.nrefs * sizeof(DedupRef)) !=
+		hdr.nrefs * sizeof(DedupRef))
+		goto done;
+	while (reslen < XLogSegSize &&
+		   (r = gzread(gz, res + reslen, XLogSegSize - reslen)) > 0)
+		reslen += r;
+
+	for (i = 0; i < hdr.nrefs; i++)
+	{
+		DedupRef   *ref = &refs[i];
+
+		if (ref->offset < pos || ref->len > BLCKSZ ||
+			ref->offset - pos > reslen - rpos)
+			goto done;
+		memcpy(buf + pos, res + rpos, ref->offset - pos);
+		rpos += ref->offset - pos;
+		if (!load_page(dir, ref, image))
+			goto done;
+		pos = move_image(buf, ref->offset, image, ref->len, res, &rpos, 1);
+		if (pos > XLogSegSize || rpos > reslen)
+			goto done;
+	}
+	if (reslen - rpos != XLogSegSize - pos)
+		goto done;
+	memcpy(buf + pos, res + rpos, XLogSegSize - pos);
+	ok = 1;
+
+done:
+	gzclose(gz);
+	free(refs);
+	free(res);
+	return ok;
+}
+
+static int
+key_cmp(const void *a, const void *b)
+{
+	const PageKey *ka = a;
+	const PageKey *kb = b;
+
+	if (ka->h1 != kb->h1)
+		return (ka->h1 < kb->h1) ? -1 : 1;
+	if (ka->h2 != kb->h2)
+		return (ka->h2 < kb->h2) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Add the images a deduplicated segment refers to to keys. Returns 0 if
+ * it can't be read.
+ */
+static int
+collect_refs(const char *path, PageKey **keys, uint64 *nkeys, uint64 *maxkeys)
+{
+	DedupHeader hdr;
+	DedupRef	refs[256];
+	uint32		done = 0;
+	gzFile		gz;
+	int			ok = 0;
+
+	gz = gzopen(path, "rb");
+	if (!gz)
+		return 0;
+	if (gzread(gz, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		hdr.magic != DEDUP_MAGIC || hdr.version != DEDUP_VERSION ||
+		hdr.nrefs > XLogSegSize / DEDUP_MIN_IMAGE)
+		goto done;
+
+	while (done < hdr.nrefs)
+	{
+		uint32		n = Min(hdr.nrefs - done, lengthof(refs));
+		uint32		i;
+
+		if (gzread(gz, refs, n * sizeof(DedupRef)) != n * sizeof(DedupRef))
+			goto done;
+		if (*nkeys + n > *maxkeys)
+		{
+			*maxkeys = Max(*maxkeys * 2, *nkeys + n + 65536);
+			*keys = realloc(*keys, *maxkeys * sizeof(PageKey));
+			if (!*keys)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		for (i = 0; i < n; i++)
+		{
+			(*keys)[*nkeys].h1 = refs[i].h1;
+			(*keys)[(*nkeys)++].h2 = refs[i].h2;
+		}
+		done += n;
+	}
+	ok = 1;
+
+done:
+	gzclose(gz);
+	return ok;
+}
+
+/*
+ * Remove the images no deduplicated segment refers to from the page
+ * store, along with temporary files left behind by runs that crashed.
+ * If wait isn't set, gives up right away when a run is adding images.
+ * Returns the bytes freed.
+ */
+uint64
+dedup_sweep(const char *dir, int wait)
+{
+	PageKey    *keys = NULL;
+	uint64		nkeys = 0,
+				maxkeys = 0,
+				bytes = 0,
+				removed = 0;
+	char		path[MAXPGPATH];
+	DIR		   *d;
+	struct dirent *de;
+	int			lock;
+	int			i;
+
+	lock = lock_page_store(dir, LOCK_EX, wait);
+	if (lock == -1)
+		return 0;
+
+	/* Find every image still referred to */
+	d = opendir(dir);
+	if (!d)
+	{
+		fprintf(stderr, "Failed to open directory %s: %m\n", dir);
+		exit(1);
+	}
+	while ((de = readdir(d)) != NULL)
+	{
+		size_t		len = strlen(de->d_name);
+
+		if (len < 24 || strncmp(de->d_name + 24, DEDUP_SUFFIX,
+								strlen(DEDUP_SUFFIX)) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (len > 24 + strlen(DEDUP_SUFFIX))
+		{
+			/* Nothing is being deduplicated while we hold the lock */
+			if (strncmp(de->d_name + 24 + strlen(DEDUP_SUFFIX), ".tmp.", 5) == 0)
+				unlink(path);
+			continue;
+		}
+		errno = 0;
+		if (!collect_refs(path, &keys, &nkeys, &maxkeys))
+		{
+			if (errno == ENOENT)
+				continue;		/* removed by retention meanwhile */
+			fprintf(stderr, "Failed to read %s, not sweeping the page store\n",
+					path);
+			closedir(d);
+			free(keys);
+			close(lock);
+			return 0;
+		}
+	}
+	closedir(d);
+	if (nkeys > 0)
+		qsort(keys, nkeys, sizeof(PageKey), key_cmp);
+
+	for (i = 0; i < 256; i++)
+	{
+		char		subdir[MAXPGPATH];
+
+		snprintf(subdir, sizeof(subdir), "%s/%s/%02x", dir, PAGESTORE_DIR, i);
+		d = opendir(subdir);
+		if (!d)
+			continue;
+		while ((de = readdir(d)) != NULL)
+		{
+			PageKey		key;
+			struct stat st;
+			char		h[17];
+
+			if (de->d_name[0] == '.')
+				continue;
+			if (strlen(de->d_name) == 32)
+			{
+				memcpy(h, de->d_name, 16);
+				h[16] = '\0';
+				key.h1 = strtoull(h, NULL, 16);
+				key.h2 = strtoull(de->d_name + 16, NULL, 16);
+				if (nkeys > 0 &&
+					bsearch(&key, keys, nkeys, sizeof(PageKey), key_cmp))
+					continue;
+			}
+			else if (strstr(de->d_name, ".tmp.") == NULL)
+				continue;		/* not ours */
+			if (fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+				unlinkat(dirfd(d), de->d_name, 0) == 0)
+			{
+				bytes += st.st_size;
+				removed++;
+			}
+		}
+		closedir(d);
+	}
+
+	if (verbose)
+		printf("Removed " UINT64_FORMAT " unused page images with " UINT64_FORMAT
+			   " bytes from the page store\n", removed, bytes);
+	free(keys);
+	close(lock);
+	return bytes;
+}
+
+
+static void
+dedup_usage(void)
+{
+	printf("Usage: pg_streamrecv dedup -d <directory> [-m <cache MB>] [-k] [-v] <first segment> [last segment]\n");
+	printf("       pg_streamrecv dedup -d <directory> -g [-v]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv dedup" - move the page images from a range of segments
+ * in the archive to the page store, or with -g, sweep the page store.
+ */
+int
+dedup_main(int argc, char *argv[])
+{
+	DedupState	ds;
+	char	   *buf,
+			   *res,
+			   *check;
+	char	   *first,
+			   *last;
+	char		segname[MAXFNAMELEN];
+	char		dir[MAXPGPATH];
+	struct stat st;
+	int			cache_mb = 64;
+	int			keep = 0;
+	int			sweep = 0;
+	int			lock;
+	TimeLineID	tli,
+				lasttli;
+	uint32		log,
+				seg,
+				lastlog,
+				lastseg;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:gkm:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'g':
+				sweep = 1;
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case 'm':
+				cache_mb = atoi(optarg);
+				if (cache_mb < 1)
+					dedup_usage();
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				dedup_usage();
+		}
+	}
+	if (basedir && sweep && optind == argc)
+	{
+		dedup_sweep(basedir, 1);
+		return 0;
+	}
+	if (!basedir || sweep || optind >= argc || argc - optind > 2)
+		dedup_usage();
+	first = argv[optind];
+	last = (optind + 1 < argc) ? argv[optind + 1] : first;
+	if (!is_segment_name(first) || !is_segment_name(last))
+		dedup_usage();
+
+	snprintf(dir, sizeof(dir), "%s/%s", basedir, PAGESTORE_DIR);
+	if (stat(dir, &st) != 0 && mkdir(dir, 0777) != 0)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", dir);
+		exit(1);
+	}
+	/* Keep a sweep from removing the images we add before they're used */
+	lock = lock_page_store(basedir, LOCK_SH, 1);
+	cache_init(cache_mb);
+
+	buf = malloc(XLogSegSize);
+	res = malloc(XLogSegSize);
+	check = malloc(XLogSegSize);
+	if (!buf || !res || !check)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(&ds, 0, sizeof(ds));
+
+	XLogFromFileName(first, &tli, &log, &seg);
+	XLogFromFileName(last, &lasttli, &lastlog, &lastseg);
+	while (log < lastlog || (log == lastlog && seg <= lastseg))
+	{
+		char		fn[MAXPGPATH];
+		char		outfn[MAXPGPATH + sizeof(DEDUP_SUFFIX)];
+		char		tmpfn[MAXPGPATH + sizeof(DEDUP_SUFFIX) + 16];
+		gzFile		gz;
+		int			f;
+		int			n;
+
+		XLogFileName(segname, tli, log, seg);
+		NextLogSeg(log, seg);
+
+		snprintf(fn, sizeof(fn), "%s/%s", basedir, segname);
+		f = open(fn, O_RDONLY);
+		if (f == -1)
+		{
+			if (verbose)
+				printf("Skipping %s, not in the archive uncompressed\n", segname);
+			continue;
+		}
+		if (read(f, buf, XLogSegSize) != XLogSegSize)
+		{
+			fprintf(stderr, "Failed to read segment %s\n", fn);
+			exit(1);
+		}
+		close(f);
+
+		snprintf(outfn, sizeof(outfn), "%s%s", fn, DEDUP_SUFFIX);
+		snprintf(tmpfn, sizeof(tmpfn), "%s.tmp.%i", outfn, (int) getpid());
+		f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		gz = (f == -1) ? NULL : gzdopen(dup(f), "wb6");
+		if (!gz)
+		{
+			fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+			exit(1);
+		}
+		n = dedup_segment(segname, buf, res, &ds, gz);
+		if (gzclose(gz) != Z_OK)
+		{
+			fprintf(stderr, "Failed to write %s\n", tmpfn);
+			exit(1);
+		}
+		if (fsync(f) != 0 || close(f) != 0)
+		{
+			fprintf(stderr, "Failed to fsync %s: %m\n", tmpfn);
+			exit(1);
+		}
+
+		/* Make sure it can be put back together before dropping anything */
+		if (!expand_dedup_segment(basedir, tmpfn, check) ||
+			memcmp(check, buf, XLogSegSize) != 0)
+		{
+			fprintf(stderr, "Deduplicated segment %s doesn't match the original, keeping it as it was\n",
+					segname);
+			unlink(tmpfn);
+			continue;
+		}
+
+		/*
+		 * Both the images and the deduplicated segment have to be on disk
+		 * before the original is removed.
+		 */
+		flush_page_dirs(basedir);
+		if (rename(tmpfn, outfn) != 0)
+		{
+			fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, outfn);
+			exit(1);
+		}
+		if (fsync_dir(basedir) != 0)
+		{
+			fprintf(stderr, "Failed to fsync directory %s: %m\n", basedir);
+			exit(1);
+		}
+		if (!keep && unlink(fn) != 0)
+		{
+			fprintf(stderr, "Failed to remove %s: %m\n", fn);
+			exit(1);
+		}
+		if (verbose)
+			printf("Deduplicated %s: %i page images\n", segname, n);
+	}
+
+	printf(UINT64_FORMAT " page images with " UINT64_FORMAT " bytes, "
+		   UINT64_FORMAT " new ones with " UINT64_FORMAT " bytes added to the store\n",
+		   ds.images, ds.image_bytes, ds.stored, ds.stored_bytes);
+	close(lock);
+	free(buf);
+	free(res);
+	free(check);
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * diskspace.c - keeping the receiver going as the archive fills up
+ *
+ * If the archive filesystem fills up, the receiver can't write what it
+ * receives, and the primary has to keep the WAL instead, until it runs
+ * out of space too. To put that off for as long as possible, the free
+ * space is checked every second, and as it goes below each of these
+ * thresholds, more drastic steps are taken:
+ *
+ *	disk_compress_free_mb	compress the whole backlog at level 9 now,
+ *							rather than as it ages
+ *	disk_prune_free_mb		remove the oldest segments, down to the
+ *							newest disk_prune_keep and whatever
+ *							retention_base_backup needs, until the free
+ *							space is twice the threshold again
+ *	disk_throttle_free_mb	stop reading from the server until there is
+ *							more free space, leaving it to TCP to hold the
+ *							server back
+ *
+ * The compression and pruning run in child processes, started again
+ * every ten seconds for as long as the free space stays low. Should a
+ * write fail because the disk is full anyway, the receiver waits for
+ * space to be freed, the same as when throttled, instead of exiting.
+ *
+ * Each change of stage is logged and written to the metrics right away,
+ * along with the free space, how often each stage was entered, and how
+ * long reading was held back.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pg_streamrecv.h"
+
+/* How often to check the free space, in milliseconds */
+#define DISK_CHECK_INTERVAL		1000
+
+/* How often to start compressing or pruning again, in seconds */
+#define DISK_ACTION_INTERVAL	10
+
+#define MB(x)		((uint64) (x) * 1024 * 1024)
+
+int			disk_compress_free_mb = 0;
+int			disk_prune_free_mb = 0;
+int			disk_prune_keep = DISK_DEFAULT_PRUNE_KEEP;
+int			disk_throttle_free_mb = DISK_DEFAULT_THROTTLE_FREE_MB;
+
+static const char *stage_names[] = {"ok", "compress", "prune", "throttle"};
+
+static int	stage = DISK_STAGE_OK;
+static uint64 free_bytes = 0;
+static uint64 last_check = 0;
+static uint64 last_metrics = 0;
+static uint64 entered[DISK_STAGE_THROTTLE + 1];
+static uint64 throttled_since = 0;
+static uint64 throttled_msec = 0;
+static uint64 full_waits = 0;
+
+typedef struct DiskAction
+{
+	pid_t		pid;
+	time_t		started;
+} DiskAction;
+
+static DiskAction compress_action = {-1, 0};
+static DiskAction prune_action = {-1, 0};
+
+
+/*
+ * Free space in the filesystem of dir, for unprivileged users.
+ */
+uint64
+disk_free_space(const char *dir)
+{
+	struct statvfs st;
+
+	if (statvfs(dir, &st) != 0)
+	{
+		fprintf(stderr, "Failed to get free space of %s: %m\n", dir);
+		return UINT64CONST(0xFFFFFFFFFFFFFFFF);
+	}
+	return (uint64) st.f_bavail * st.f_frsize;
+}
+
+static int
+stage_for(uint64 free)
+{
+	if (disk_throttle_free_mb > 0 && free < MB(disk_throttle_free_mb))
+		return DISK_STAGE_THROTTLE;
+	if (disk_prune_free_mb > 0 && free < MB(disk_prune_free_mb))
+		return DISK_STAGE_PRUNE;
+	if (disk_compress_free_mb > 0 && free < MB(disk_compress_free_mb))
+		return DISK_STAGE_COMPRESS;
+	return DISK_STAGE_OK;
+}
+
+/*
+ * Start compressing or pruning in the background, unless it's already
+ * going or was started too recently.
+ */
+static void
+start_action(DiskAction *action, int which)
+{
+	int			status;
+
+	if (action->pid != -1)
+	{
+		if (waitpid(action->pid, &status, WNOHANG) == 0)
+			return;
+		action->pid = -1;
+	}
+	if (time(NULL) - action->started < DISK_ACTION_INTERVAL)
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	action->started = time(NULL);
+	action->pid = fork();
+	if (action->pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (action->pid == 0)
+	{
+		io_set_class(IO_CLASS_URGENT);
+		if (which == DISK_STAGE_COMPRESS)
+			recompress_all(basedir, 9);
+		else
+			retention_free_space(basedir, MB(disk_prune_free_mb) * 2,
+								 disk_prune_keep);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+static void
+set_stage(int newstage, uint64 now)
+{
+	int			i;
+
+	if (newstage > stage)
+	{
+		static const char *actions[] = {
+			NULL,
+			"compressing the backlog",
+			"removing the oldest segments",
+			"holding back reading from the server"
+		};
+
+		fprintf(stderr, "Free space in %s down to " UINT64_FORMAT " MB, %s\n",
+				basedir, free_bytes / MB(1), actions[newstage]);
+	}
+	else
+		fprintf(stderr, "Free space in %s back up to " UINT64_FORMAT " MB\n",
+				basedir, free_bytes / MB(1));
+
+	if (stage == DISK_STAGE_THROTTLE)
+		throttled_msec += now - throttled_since;
+	if (newstage == DISK_STAGE_THROTTLE)
+		throttled_since = now;
+	/* Dropping straight into a later stage enters the ones before it too */
+	for (i = stage + 1; i <= newstage; i++)
+		entered[i]++;
+	stage = newstage;
+	metrics_write();
+	last_metrics = now;
+}
+
+/*
+ * Check the free space in the archive, at most once a second, and take
+ * the steps for the stage it's in. Returns 1 if reading from the server
+ * should be held back.
+ */
+int
+diskspace_check(void)
+{
+	uint64		now = now_msec();
+	int			newstage;
+
+	if (now - last_check < DISK_CHECK_INTERVAL)
+		return stage == DISK_STAGE_THROTTLE;
+	last_check = now;
+
+	free_bytes = disk_free_space(basedir);
+	newstage = stage_for(free_bytes);
+	if (newstage != stage)
+		set_stage(newstage, now);
+	else if (stage == DISK_STAGE_THROTTLE &&
+			 now - last_metrics >= DISK_ACTION_INTERVAL * 1000)
+	{
+		/* No segments are completed while held back, so keep them current */
+		metrics_write();
+		last_metrics = now;
+	}
+
+	if (stage >= DISK_STAGE_COMPRESS)
+		start_action(&compress_action, DISK_STAGE_COMPRESS);
+	if (stage >= DISK_STAGE_PRUNE)
+		start_action(&prune_action, DISK_STAGE_PRUNE);
+	return stage == DISK_STAGE_THROTTLE;
+}
+
+/*
+ * Called when a write has failed because the disk is full. Wait until
+ * there's room for at least a segment, while the steps for the worst
+ * stage we're allowed to take are taken, and return so the write can be
+ * tried again.
+ */
+void
+diskspace_full(void)
+{
+	uint64		start = now_msec();
+
+	full_waits++;
+	free_bytes = disk_free_space(basedir);
+	fprintf(stderr, "Archive filesystem of %s is full, waiting for space to be freed\n",
+			basedir);
+	metrics_write();
+
+	while (free_bytes < XLogSegSize)
+	{
+		sleep(1);
+		free_bytes = disk_free_space(basedir);
+		if (disk_compress_free_mb > 0)
+			start_action(&compress_action, DISK_STAGE_COMPRESS);
+		if (disk_prune_free_mb > 0)
+			start_action(&prune_action, DISK_STAGE_PRUNE);
+	}
+	throttled_msec += now_msec() - start;
+	last_check = 0;
+	metrics_write();
+}
+
+static void
+diskspace_metrics(FILE *f)
+{
+	uint64		held = throttled_msec;
+	int			i;
+
+	if (stage == DISK_STAGE_THROTTLE)
+		held += now_msec() - throttled_since;
+
+	fprintf(f, "# TYPE pg_streamrecv_disk_free_bytes gauge\n");
+	fprintf(f, "pg_streamrecv_disk_free_bytes " UINT64_FORMAT "\n", free_bytes);
+	fprintf(f, "# TYPE pg_streamrecv_disk_pressure_stage gauge\n");
+	fprintf(f, "pg_streamrecv_disk_pressure_stage{stage=\"%s\"} %i\n",
+			stage_names[stage], stage);
+	fprintf(f, "# TYPE pg_streamrecv_disk_pressure_entered_total counter\n");
+	for (i = DISK_STAGE_COMPRESS; i <= DISK_STAGE_THROTTLE; i++)
+		fprintf(f, "pg_streamrecv_disk_pressure_entered_total{stage=\"%s\"} " UINT64_FORMAT "\n",
+				stage_names[i], entered[i]);
+	fprintf(f, "# TYPE pg_streamrecv_disk_throttled_seconds_total counter\n");
+	fprintf(f, "pg_streamrecv_disk_throttled_seconds_total %.3f\n",
+			held / 1000.0);
+	fprintf(f, "# TYPE pg_streamrecv_disk_full_total counter\n");
+	fprintf(f, "pg_streamrecv_disk_full_total " UINT64_FORMAT "\n", full_waits);
+}
+
+void
+diskspace_init(void)
+{
+	free_bytes = disk_free_space(basedir);
+	metrics_register(diskspace_metrics);
+}
@@ -0,0 +1,557 @@
+/*
+ * encrypt.c - encryption of archived segments
+ *
+ * Segments are encrypted with AES-256-GCM under a key of their own,
+ * derived from a master key kept in a file given with -K, either 32 bytes
+ * of raw key or 64 hex digits. The file starts with an EncryptedHeader
+ * holding a random salt, and the key for the file is
+ *
+ *	HMAC-SHA256(master key, "pg_streamrecv segment" || salt || segment name)
+ *
+ * so encrypting the same segment twice never uses the same key. The
+ * segment is encrypted in chunks of ENCRYPTED_CHUNK_SIZE bytes, each
+ * followed by its tag, using the number of the chunk as the IV. The
+ * header, the number of the chunk and whether it's the last one are
+ * authenticated with each chunk, so chunks can't be moved around, taken
+ * from another file, or cut off the end without it being noticed, and any
+ * part of a segment can be decrypted by reading only the chunks it's in.
+ *
+ * "pg_streamrecv encrypt" encrypts a range of segments already in the
+ * archive, using several worker processes to get through a backlog. The
+ * receiver can also encrypt segments as they're received, with a pipeline
+ * stage. Restore, serve and verify decrypt them when given the key.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+#define MAX_ENCRYPT_WORKERS		64
+
+char	   *encryption_key_file = NULL;
+
+static unsigned char master_key[32];
+static unsigned char master_keyid[8];
+static int	have_master_key = 0;
+
+
+/*
+ * Load the master key from encryption_key_file, if it hasn't been already.
+ */
+void
+encryption_load_key(void)
+{
+	unsigned char buf[80];
+	unsigned char id[SHA256_LEN];
+	int			len;
+	int			i;
+	FILE	   *f;
+
+	if (have_master_key)
+		return;
+	if (!encryption_key_file)
+	{
+		fprintf(stderr, "Encrypted segments need the key file to be given with -K\n");
+		exit(1);
+	}
+
+	f = fopen(encryption_key_file, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open key file %s: %m\n", encryption_key_file);
+		exit(1);
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+
+	while (len > 0 && isspace(buf[len - 1]))
+		len--;
+	if (len == 64)
+	{
+		for (i = 0; i < 32; i++)
+		{
+			unsigned int b;
+
+			if (!isxdigit(buf[i * 2]) || !isxdigit(buf[i * 2 + 1]) ||
+				sscanf((char *) buf + i * 2, "%2x", &b) != 1)
+				break;
+			master_key[i] = b;
+		}
+		if (i < 32)
+			len = -1;
+	}
+	else if (len == 32)
+		memcpy(master_key, buf, 32);
+	if (len != 32 && len != 64)
+	{
+		fprintf(stderr, "Key file %s must hold 32 bytes, or 64 hex digits\n",
+				encryption_key_file);
+		exit(1);
+	}
+
+	hmac_sha256(master_key, 32, "pg_streamrecv key id", 20, id);
+	memcpy(master_keyid, id, sizeof(master_keyid));
+	have_master_key = 1;
+}
+
+static void
+derive_key(const EncryptedHeader *hdr, AESKey *key)
+{
+	unsigned char info[21 + sizeof(hdr->salt) + MAXFNAMELEN];
+	unsigned char k[SHA256_LEN];
+	int			namelen = strlen(hdr->segname);
+
+	memcpy(info, "pg_streamrecv segment", 21);
+	memcpy(info + 21, hdr->salt, sizeof(hdr->salt));
+	memcpy(info + 21 + sizeof(hdr->salt), hdr->segname, namelen);
+	hmac_sha256(master_key, 32, info, 21 + sizeof(hdr->salt) + namelen, k);
+	aes256_init(key, k);
+	memset(k, 0, sizeof(k));
+}
+
+/*
+ * The IV and additional data for a chunk.
+ */
+static void
+chunk_params(const EncryptedHeader *hdr, uint64 chunkno, int last,
+			 unsigned char *iv, unsigned char *aad)
+{
+	int			i;
+
+	memset(iv, 0, AES_GCM_IV_LEN);
+	for (i = 0; i < 8; i++)
+		iv[i] = (unsigned char) (chunkno >> (i * 8));
+
+	memcpy(aad, hdr, sizeof(EncryptedHeader));
+	memcpy(aad + sizeof(EncryptedHeader), iv, 8);
+	aad[sizeof(EncryptedHeader) + 8] = last;
+}
+
+#define CHUNK_AAD_LEN	(sizeof(EncryptedHeader) + 9)
+
+/*
+ * Start writing an encrypted segment to fd.
+ */
+int
+encrypt_begin(EncryptWriter *w, int fd, const char *segname)
+{
+	int			f;
+
+	encryption_load_key();
+
+	memset(&w->hdr, 0, sizeof(EncryptedHeader));
+	w->hdr.magic = ENCRYPTED_MAGIC;
+	w->hdr.version = ENCRYPTED_VERSION;
+	w->hdr.chunksize = ENCRYPTED_CHUNK_SIZE;
+	memcpy(w->hdr.keyid, master_keyid, sizeof(w->hdr.keyid));
+	snprintf(w->hdr.segname, sizeof(w->hdr.segname), "%s", segname);
+
+	f = open("/dev/urandom", O_RDONLY);
+	if (f < 0 || read(f, w->hdr.salt, sizeof(w->hdr.salt)) != sizeof(w->hdr.salt))
+	{
+		fprintf(stderr, "Failed to read random salt: %m\n");
+		exit(1);
+	}
+	close(f);
+
+	derive_key(&w->hdr, &w->key);
+	w->fd = fd;
+	w->chunkno = 0;
+	w->used = 0;
+	return write(fd, &w->hdr, sizeof(EncryptedHeader)) == sizeof(EncryptedHeader);
+}
+
+static int
+write_chunk(EncryptWriter *w, int last)
+{
+	unsigned char iv[AES_GCM_IV_LEN];
+	unsigned char aad[CHUNK_AAD_LEN];
+	uint32		len = w->used + AES_GCM_TAG_LEN;
+
+	chunk_params(&w->hdr, w->chunkno, last, iv, aad);
+	aes_gcm_encrypt(&w->key, iv, aad, sizeof(aad), w->buf, w->buf, w->used,
+					(unsigned char *) w->buf + w->used);
+	w->chunkno++;
+	w->used = 0;
+	return write(w->fd, w->buf, len) == len;
+}
+
+int
+encrypt_write(EncryptWriter *w, const char *data, uint32 len)
+{
+	while (len > 0)
+	{
+		uint32		n;
+
+		/* Keep a full chunk back until we know whether it's the last */
+		if (w->used == ENCRYPTED_CHUNK_SIZE && !write_chunk(w, 0))
+			return 0;
+		n = Min(len, ENCRYPTED_CHUNK_SIZE - w->used);
+		memcpy(w->buf + w->used, data, n);
+		w->used += n;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/*
+ * Write the last chunk. The file descriptor is left open.
+ */
+int
+encrypt_end(EncryptWriter *w)
+{
+	int			ok = write_chunk(w, 1);
+
+	memset(&w->key, 0, sizeof(w->key));
+	return ok;
+}
+
+/*
+ * Decrypt len bytes of segment segname in an encrypted file, starting at
+ * offset, into buf. Only the chunks they're in are read. Returns 0 if the
+ * file is damaged, has been tampered with, or holds a different segment.
+ */
+int
+decrypt_segment_range(const char *path, const char *segname, uint64 offset,
+					  uint32 len, char *buf)
+{
+	EncryptedHeader hdr;
+	AESKey		key;
+	struct stat st;
+	char	   *chunk;
+	uint64		nchunks;
+	uint64		c;
+	int			ok = 0;
+	int			f;
+
+	encryption_load_key();
+
+	f = open(path, O_RDONLY);
+	if (f < 0)
+	{
+		fprintf(stderr, "Failed to open %s: %m\n", path);
+		return 0;
+	}
+	if (fstat(f, &st) != 0 ||
+		read(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		hdr.magic != ENCRYPTED_MAGIC || hdr.version != ENCRYPTED_VERSION ||
+		hdr.chunksize == 0 || hdr.chunksize > ENCRYPTED_CHUNK_SIZE ||
+		st.st_size <= sizeof(hdr))
+	{
+		fprintf(stderr, "%s is not a valid encrypted segment\n", path);
+		close(f);
+		return 0;
+	}
+	if (memcmp(hdr.keyid, master_keyid, sizeof(hdr.keyid)) != 0)
+	{
+		fprintf(stderr, "%s was encrypted with a different key\n", path);
+		close(f);
+		return 0;
+	}
+	hdr.segname[sizeof(hdr.segname) - 1] = '\0';
+
+	/* The name is authenticated, so this catches files copied or renamed */
+	if (strcmp(hdr.segname, segname) != 0)
+	{
+		fprintf(stderr, "%s holds segment %s, not %s\n", path, hdr.segname,
+				segname);
+		close(f);
+		return 0;
+	}
+	derive_key(&hdr, &key);
+
+	nchunks = (st.st_size - sizeof(hdr) + hdr.chunksize + AES_GCM_TAG_LEN - 1) /
+		(hdr.chunksize + AES_GCM_TAG_LEN);
+	chunk = malloc(hdr.chunksize + AES_GCM_TAG_LEN);
+	if (!chunk)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (c = offset / hdr.chunksize; len > 0; c++)
+	{
+		unsigned char iv[AES_GCM_IV_LEN];
+		unsigned char aad[CHUNK_AAD_LEN];
+		off_t		pos = sizeof(hdr) + c * (hdr.chunksize + AES_GCM_TAG_LEN);
+		int			r;
+		uint32		skip,
+					n;
+
+		if (c >= nchunks)
+			goto done;
+		r = pread(f, chunk, hdr.chunksize + AES_GCM_TAG_LEN, pos);
+		if (r <= AES_GCM_TAG_LEN ||
+			(c < nchunks - 1 && r != hdr.chunksize + AES_GCM_TAG_LEN))
+			goto done;
+		r -= AES_GCM_TAG_LEN;
+
+		chunk_params(&hdr, c, c == nchunks - 1, iv, aad);
+		if (!aes_gcm_decrypt(&key, iv, aad, sizeof(aad), chunk, chunk, r,
+							 (unsigned char *) chunk + r))
+			goto done;
+
+		skip = offset - c * hdr.chunksize;
+		if (skip >= r)
+			goto done;
+		n = Min(len, r - skip);
+		memcpy(buf, chunk + skip, n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+	ok = 1;
+
+done:
+	if (!ok)
+		fprintf(stderr, "%s is damaged or has been tampered with\n", path);
+	memset(&key, 0, sizeof(key));
+	free(chunk);
+	close(f);
+	return ok;
+}
+
+/*
+ * Decrypt a whole encrypted segment into buf.
+ */
+int
+expand_encrypted_segment(const char *path, const char *segname, char *buf)
+{
+	return decrypt_segment_range(path, segname, 0, XLogSegSize, buf);
+}
+
+
+/*
+ * Encrypt one segment in the archive. Returns 0 if it failed.
+ */
+static int
+encrypt_segment(const char *segname, int keep, char *buf, char *check)
+{
+	char		fn[MAXPGPATH];
+	char		outfn[MAXPGPATH + sizeof(ENCRYPTED_SUFFIX)];
+	char		tmpfn[MAXPGPATH + sizeof(ENCRYPTED_SUFFIX) + 4];
+	EncryptWriter *w;
+	struct stat st;
+	int			f;
+	int			ok;
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, segname);
+	f = open(fn, O_RDONLY);
+	if (f == -1)
+	{
+		if (verbose)
+			printf("Skipping %s, not in the archive uncompressed\n", segname);
+		return 1;
+	}
+	if (fstat(f, &st) != 0 || st.st_size != XLogSegSize ||
+		read(f, buf, XLogSegSize) != XLogSegSize)
+	{
+		fprintf(stderr, "Failed to read segment %s\n", fn);
+		close(f);
+		return 0;
+	}
+	close(f);
+
+	snprintf(outfn, sizeof(outfn), "%s%s", fn, ENCRYPTED_SUFFIX);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", outfn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+		return 0;
+	}
+	w = malloc(sizeof(EncryptWriter));
+	if (!w)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	ok = encrypt_begin(w, f, segname) &&
+		encrypt_write(w, buf, XLogSegSize) &&
+		encrypt_end(w) &&
+		fsync(f) == 0;
+	free(w);
+	if (close(f) != 0 || !ok)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", tmpfn);
+		unlink(tmpfn);
+		return 0;
+	}
+
+	/* Make sure it can be decrypted before it replaces the original */
+	if (!expand_encrypted_segment(tmpfn, segname, check) ||
+		memcmp(buf, check, XLogSegSize) != 0)
+	{
+		fprintf(stderr, "Encrypted %s does not decrypt to the original\n",
+				segname);
+		unlink(tmpfn);
+		return 0;
+	}
+
+	if (rename(tmpfn, outfn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, outfn);
+		return 0;
+	}
+	if (!keep && unlink(fn) != 0)
+	{
+		fprintf(stderr, "Failed to remove %s: %m\n", fn);
+		return 0;
+	}
+	if (verbose)
+		printf("Encrypted %s\n", segname);
+	return 1;
+}
+
+static void
+encrypt_usage(void)
+{
+	printf("Usage: pg_streamrecv encrypt -d <directory> -K <key file> [-j <workers>] [-k] [-v] <first segment> [last segment]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv encrypt" - encrypt a range of segments in the archive,
+ * with the segments shared out among a number of worker processes.
+ */
+int
+encrypt_main(int argc, char *argv[])
+{
+	char	   *first,
+			   *last;
+	pid_t		pids[MAX_ENCRYPT_WORKERS];
+	int			nworkers = 4;
+	int			keep = 0;
+	int			failed = 0;
+	TimeLineID	tli,
+				lasttli;
+	uint32		log,
+				seg,
+				lastlog,
+				lastseg;
+	int			nsegments = 0;
+	int			i;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:j:kK:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'j':
+				nworkers = atoi(optarg);
+				if (nworkers < 1 || nworkers > MAX_ENCRYPT_WORKERS)
+					encrypt_usage();
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case 'K':
+				encryption_key_file = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				encrypt_usage();
+		}
+	}
+	if (!basedir || !encryption_key_file || optind >= argc || argc - optind > 2)
+		encrypt_usage();
+	first = argv[optind];
+	last = (optind + 1 < argc) ? argv[optind + 1] : first;
+	if (!is_segment_name(first) || !is_segment_name(last))
+		encrypt_usage();
+
+	/* Fail early on a bad key, rather than in every worker */
+	encryption_load_key();
+
+	XLogFromFileName(first, &tli, &log, &seg);
+	XLogFromFileName(last, &lasttli, &lastlog, &lastseg);
+	{
+		uint32		l = log,
+					s = seg;
+
+		while (l < lastlog || (l == lastlog && s <= lastseg))
+		{
+			nsegments++;
+			NextLogSeg(l, s);
+		}
+	}
+	if (nworkers > nsegments)
+		nworkers = Max(nsegments, 1);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < nworkers; i++)
+	{
+		pids[i] = fork();
+		if (pids[i] == -1)
+		{
+			fprintf(stderr, "Failed to fork: %m\n");
+			exit(1);
+		}
+		if (pids[i] == 0)
+		{
+			char	   *buf = malloc(XLogSegSize);
+			char	   *check = malloc(XLogSegSize);
+			uint32		l = log,
+						s = seg;
+			int			n;
+			int			ok = 1;
+
+			if (!buf || !check)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+
+			/* Each worker takes every nworkers'th segment */
+			for (n = 0; n < nsegments; n++)
+			{
+				char		segname[MAXFNAMELEN];
+
+				XLogFileName(segname, tli, l, s);
+				NextLogSeg(l, s);
+				if (n % nworkers == i && !encrypt_segment(segname, keep, buf, check))
+					ok = 0;
+			}
+			exit(ok ? 0 : 1);
+		}
+	}
+
+	for (i = 0; i < nworkers; i++)
+	{
+		int			status;
+
+		while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+			;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	if (failed)
+	{
+		fprintf(stderr, "Some segments could not be encrypted\n");
+		return 1;
+	}
+	return 0;
+}
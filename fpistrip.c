@@ -0,0 +1,712 @@
+/*
+ * fpistrip.c - strip full page images from archived segments
+ *
+ * Right after a checkpoint, most of the WAL volume is full page images.
+ * These are only needed to protect against torn pages in crash recovery
+ * and while a base backup is being taken, and records where that's the
+ * case are flagged with XLR_BKP_REMOVABLE. For those, the record can be
+ * turned into an equivalent record without the page image, by taking the
+ * data that was left out of the record because the page was backed up
+ * from the page image itself, the same way pg_compresslog does it.
+ *
+ * WAL locations have to stay the same, so the shorter record is written
+ * where the original one started, and the rest of the space it took is
+ * filled with an XLOG_NOOP record, and the prev-link of the following
+ * record is updated to point at that. The result is a valid segment that
+ * can be replayed as is, where the page images have turned into runs of
+ * zeros, which is written compressed with gzip with a .stripped suffix.
+ * Expanding it again is a matter of decompressing it, which restore and
+ * serve mode do like for any other compressed segment.
+ *
+ * The data left out of a record when a page is backed up depends on the
+ * record type, so only heap inserts, updates, deletes and row locks are
+ * converted; all other records keep their page images. Those make up the
+ * bulk of the page images in most databases, though.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+#include "access/htup.h"
+#include "access/transam.h"
+#include "storage/bufpage.h"
+
+/* xl_info values for the xlog resource manager that we care about */
+#define XLOG_NOOP		0x20
+
+typedef struct StripState
+{
+	char	   *seg;			/* the segment being rewritten */
+	XLogRecPtr	segstart;
+
+	/* A converted record waiting for the start of the next record */
+	int			pending;
+	uint32		pendstart;		/* offset of the original record */
+	char	   *pendrec;
+	uint32		pendsize;
+	uint32		pendfpis;
+	uint32		pendfpi_bytes;
+
+	/* New prev-link for the next record, if the last one was converted */
+	int			haveprev;
+	XLogRecPtr	newprev;
+
+	char	   *noop;
+	uint32		noopsize;
+	char		page[BLCKSZ];
+
+	/* Statistics */
+	uint64		records;
+	uint64		converted;
+	uint64		fpis;
+	uint64		fpi_bytes;
+} StripState;
+
+
+static char *
+grow_buffer(char *buf, uint32 *size, uint32 needed)
+{
+	if (needed <= *size)
+		return buf;
+	*size = needed;
+	buf = realloc(buf, needed);
+	if (!buf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return buf;
+}
+
+static void
+compute_record_crc(XLogRecord *record)
+{
+	record->xl_crc = xlogdecode_record_crc(record);
+}
+
+static XLogRecPtr
+offset_to_ptr(StripState *st, uint32 offset)
+{
+	XLogRecPtr	ptr = st->segstart;
+
+	ptr.xrecoff += offset;
+	return ptr;
+}
+
+/*
+ * Where the next record goes after a record ending at end, following the
+ * same rules as XLogInsert: records are MAXALIGNed, and a record header
+ * is never split across pages.
+ */
+static uint32
+next_record_offset(uint32 end)
+{
+	uint32		pos = MAXALIGN(end);
+
+	if (pos % XLOG_BLCKSZ == 0)
+		return pos + SizeOfXLogShortPHD;
+	if (XLOG_BLCKSZ - pos % XLOG_BLCKSZ < SizeOfXLogRecord)
+		return pos + XLOG_BLCKSZ - pos % XLOG_BLCKSZ + SizeOfXLogShortPHD;
+	return pos;
+}
+
+/*
+ * Start a new page at offset, keeping the flags of the page header that
+ * was there, but marking whether it starts with a continuation record.
+ */
+static void
+write_page_header(StripState *st, uint32 offset, uint32 remaining)
+{
+	XLogPageHeader hdr = (XLogPageHeader) (st->seg + offset);
+
+	if (remaining > 0)
+	{
+		XLogContRecord *cont;
+
+		hdr->xlp_info |= XLP_FIRST_IS_CONTRECORD;
+		cont = (XLogContRecord *) (st->seg + offset + SizeOfXLogShortPHD);
+		cont->xl_rem_len = remaining;
+	}
+	else
+		hdr->xlp_info &= ~XLP_FIRST_IS_CONTRECORD;
+}
+
+/*
+ * Lay out a record of len bytes starting at offset, which must be where
+ * XLogInsert would have put it, splitting it across pages as needed.
+ * Returns the offset just past its end. If rec is NULL, nothing is
+ * written, which is used to find out how much space a record would take.
+ */
+static uint32
+place_record(StripState *st, uint32 offset, const char *rec, uint32 len)
+{
+	uint32		done = 0;
+
+	while (done < len)
+	{
+		uint32		n;
+
+		if (offset % XLOG_BLCKSZ == 0)
+		{
+			if (rec)
+				write_page_header(st, offset, len - done);
+			offset += SizeOfXLogShortPHD + SizeOfXLogContRecord;
+		}
+		n = Min(len - done, XLOG_BLCKSZ - offset % XLOG_BLCKSZ);
+		if (rec)
+			memcpy(st->seg + offset, rec + done, n);
+		offset += n;
+		done += n;
+	}
+	return offset;
+}
+
+/*
+ * Write the pending converted record in place of the original, followed
+ * by a no-op record filling the space up to nextstart, where the next
+ * record starts. Returns 0, leaving the segment untouched, if the space
+ * can't be filled exactly.
+ */
+static int
+flush_pending(StripState *st, uint32 nextstart)
+{
+	XLogRecord *rec = (XLogRecord *) st->pendrec;
+	XLogRecord *noop;
+	uint32		end,
+				noopstart,
+				len,
+				next;
+	int			tries;
+
+	end = place_record(st, st->pendstart, NULL, rec->xl_tot_len);
+	noopstart = next_record_offset(end);
+	if (noopstart + SizeOfXLogRecord > nextstart)
+		return 0;
+
+	/*
+	 * Find the no-op length that puts the next record right at nextstart.
+	 * Page headers in between make that a matter of trial and error.
+	 */
+	len = nextstart - noopstart;
+	for (tries = 0; tries < 16; tries++)
+	{
+		next = next_record_offset(place_record(st, noopstart, NULL, len));
+		if (next <= nextstart)
+			break;
+		len -= Min(next - nextstart, len - SizeOfXLogRecord);
+	}
+	while (next < nextstart && tries++ < 64)
+	{
+		next = next_record_offset(place_record(st, noopstart, NULL, len + 1));
+		if (next > nextstart)
+			break;
+		len++;
+	}
+	if (next_record_offset(place_record(st, noopstart, NULL, len)) != nextstart ||
+		len < SizeOfXLogRecord)
+		return 0;
+
+	st->noop = grow_buffer(st->noop, &st->noopsize, len);
+	memset(st->noop, 0, len);
+	noop = (XLogRecord *) st->noop;
+	noop->xl_prev = offset_to_ptr(st, st->pendstart);
+	noop->xl_xid = InvalidTransactionId;
+	noop->xl_tot_len = len;
+	noop->xl_len = len - SizeOfXLogRecord;
+	noop->xl_info = XLOG_NOOP;
+	noop->xl_rmid = RM_XLOG_ID;
+	compute_record_crc(noop);
+
+	place_record(st, st->pendstart, st->pendrec, rec->xl_tot_len);
+	if (noopstart % XLOG_BLCKSZ == SizeOfXLogShortPHD)
+		write_page_header(st, noopstart - SizeOfXLogShortPHD, 0);
+	place_record(st, noopstart, st->noop, len);
+
+	st->converted++;
+	st->fpis += st->pendfpis;
+	st->fpi_bytes += st->pendfpi_bytes;
+
+	st->haveprev = 1;
+	st->newprev = offset_to_ptr(st, noopstart);
+	return 1;
+}
+
+/*
+ * Get the page image from backup block i of a record into st->page.
+ */
+static BkpBlock *
+restore_page_image(StripState *st, XLogRecord *record, int i)
+{
+	BkpBlock   *bkp;
+	char	   *blk;
+	uint32		len;
+
+	bkp = xlogdecode_bkp_block(record, i, &len);
+	if (!bkp)
+		return NULL;
+	blk = (char *) bkp + sizeof(BkpBlock);
+	if (bkp->hole_length == 0)
+		memcpy(st->page, blk, BLCKSZ);
+	else
+	{
+		memcpy(st->page, blk, bkp->hole_offset);
+		memset(st->page + bkp->hole_offset, 0, bkp->hole_length);
+		memcpy(st->page + bkp->hole_offset + bkp->hole_length,
+			   blk + bkp->hole_offset,
+			   BLCKSZ - (bkp->hole_offset + bkp->hole_length));
+	}
+	return bkp;
+}
+
+/*
+ * Append the xl_heap_header and tuple data that heap_insert and
+ * log_heap_update leave out when the page is backed up, taking the tuple
+ * from the page image in backup block i.
+ */
+static int
+append_heap_tuple(StripState *st, XLogRecord *record, int i,
+				  RelFileNode *node, ItemPointerData *tid, char *out,
+				  uint32 *outlen)
+{
+	BkpBlock   *bkp;
+	OffsetNumber offnum = ItemPointerGetOffsetNumber(tid);
+	ItemId		itemid;
+	HeapTupleHeader htup;
+	xl_heap_header xlhdr;
+	uint32		off,
+				len;
+
+	bkp = restore_page_image(st, record, i);
+	if (!bkp || memcmp(&bkp->node, node, sizeof(RelFileNode)) != 0 ||
+		bkp->fork != MAIN_FORKNUM ||
+		bkp->block != ItemPointerGetBlockNumber(tid))
+		return 0;
+
+	if (((PageHeader) st->page)->pd_lower > BLCKSZ || offnum < 1 ||
+		offnum > PageGetMaxOffsetNumber(st->page))
+		return 0;
+	itemid = PageGetItemId(st->page, offnum);
+	off = ItemIdGetOffset(itemid);
+	len = ItemIdGetLength(itemid);
+	if (!ItemIdIsNormal(itemid) || off + len > BLCKSZ ||
+		len < offsetof(HeapTupleHeaderData, t_bits))
+		return 0;
+	htup = (HeapTupleHeader) (st->page + off);
+
+	xlhdr.t_infomask2 = htup->t_infomask2;
+	xlhdr.t_infomask = htup->t_infomask;
+	xlhdr.t_hoff = htup->t_hoff;
+	memcpy(out + *outlen, &xlhdr, SizeOfHeapHeader);
+	*outlen += SizeOfHeapHeader;
+	memcpy(out + *outlen, (char *) htup + offsetof(HeapTupleHeaderData, t_bits),
+		   len - offsetof(HeapTupleHeaderData, t_bits));
+	*outlen += len - offsetof(HeapTupleHeaderData, t_bits);
+	return 1;
+}
+
+/*
+ * Build the data of a record without its backup blocks into out, which
+ * has room for at least xl_len + BLCKSZ bytes. Returns 0 if the record
+ * can't be converted.
+ */
+static int
+convert_record(StripState *st, XLogRecord *record, char *out, uint32 *outlen)
+{
+	char	   *data = XLogRecGetData(record);
+	uint8		info = record->xl_info & XLOG_HEAP_OPMASK;
+	uint8		bkp = record->xl_info & XLR_BKP_BLOCK_MASK;
+
+	if (record->xl_rmid != RM_HEAP_ID)
+		return 0;
+
+	memcpy(out, data, record->xl_len);
+	*outlen = record->xl_len;
+
+	switch (info)
+	{
+		case XLOG_HEAP_DELETE:
+		case XLOG_HEAP_LOCK:
+			/* Nothing but the page itself is left out of these */
+			return bkp == XLR_SET_BKP_BLOCK(0);
+
+		case XLOG_HEAP_INSERT:
+			{
+				xl_heap_insert *xlrec = (xl_heap_insert *) data;
+
+				if (bkp != XLR_SET_BKP_BLOCK(0) ||
+					record->xl_len != SizeOfHeapInsert)
+					return 0;
+				return append_heap_tuple(st, record, 0, &xlrec->target.node,
+										 &xlrec->target.tid, out, outlen);
+			}
+
+		case XLOG_HEAP_UPDATE:
+		case XLOG_HEAP_HOT_UPDATE:
+			{
+				xl_heap_update *xlrec = (xl_heap_update *) data;
+				int			samepage;
+				int			newblock;
+
+				if (record->xl_len < SizeOfHeapUpdate)
+					return 0;
+				samepage = ItemPointerGetBlockNumber(&xlrec->target.tid) ==
+					ItemPointerGetBlockNumber(&xlrec->newtid);
+
+				/*
+				 * The old page is backup block 0, and the new one block 1
+				 * unless it's the same page. If the new page isn't backed
+				 * up, the new tuple is in the record already.
+				 */
+				if (samepage)
+				{
+					if (bkp != XLR_SET_BKP_BLOCK(0))
+						return 0;
+					newblock = 0;
+				}
+				else
+				{
+					if (bkp & ~(XLR_SET_BKP_BLOCK(0) | XLR_SET_BKP_BLOCK(1)))
+						return 0;
+					if (!(bkp & XLR_SET_BKP_BLOCK(1)))
+						return 1;
+					newblock = 1;
+				}
+				if (record->xl_len != SizeOfHeapUpdate)
+					return 0;
+				return append_heap_tuple(st, record, newblock,
+										 &xlrec->target.node, &xlrec->newtid,
+										 out, outlen);
+			}
+	}
+	return 0;
+}
+
+static void
+strip_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	StripState *st = arg;
+	uint32		start,
+				log,
+				seg,
+				seglog,
+				segno;
+	XLogRecord *newrec;
+	uint32		newlen;
+	int			i;
+
+	XLByteToSeg(dec->recstart, log, seg);
+	XLByteToSeg(st->segstart, seglog, segno);
+	if (log != seglog || seg != segno)
+		return;
+	start = dec->recstart.xrecoff - st->segstart.xrecoff;
+	st->records++;
+
+	/* Now we know where the converted record has to end */
+	if (st->pending)
+	{
+		st->pending = 0;
+		if (!flush_pending(st, start))
+			st->haveprev = 0;
+	}
+
+	/* Point this record back at the no-op before it */
+	if (st->haveprev)
+	{
+		XLogRecord *hdr = (XLogRecord *) (st->seg + start);
+
+		record->xl_prev = st->newprev;
+		compute_record_crc(record);
+		memcpy(hdr, record, SizeOfXLogRecord);
+		st->haveprev = 0;
+	}
+
+	if (!(record->xl_info & XLR_BKP_REMOVABLE) ||
+		!(record->xl_info & XLR_BKP_BLOCK_MASK))
+		return;
+
+	st->pendrec = grow_buffer(st->pendrec, &st->pendsize,
+							  SizeOfXLogRecord + record->xl_len + BLCKSZ);
+	if (!convert_record(st, record, XLogRecGetData(st->pendrec), &newlen))
+		return;
+
+	newrec = (XLogRecord *) st->pendrec;
+	memcpy(newrec, record, SizeOfXLogRecord);
+	newrec->xl_len = newlen;
+	newrec->xl_tot_len = SizeOfXLogRecord + newlen;
+	newrec->xl_info &= ~XLR_BKP_BLOCK_MASK;
+	compute_record_crc(newrec);
+	st->pending = 1;
+	st->pendstart = start;
+	st->pendfpis = 0;
+	st->pendfpi_bytes = 0;
+
+	for (i = 0; i < XLR_MAX_BKP_BLOCKS; i++)
+	{
+		uint32		len;
+
+		if (xlogdecode_bkp_block(record, i, &len))
+		{
+			st->pendfpis++;
+			st->pendfpi_bytes += len;
+		}
+	}
+}
+
+/*
+ * Check that a rewritten segment decodes the way it should, with a valid
+ * CRC on every record.
+ */
+typedef struct CheckState
+{
+	uint64		records;
+	uint64		badcrc;
+} CheckState;
+
+static void
+check_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	CheckState *cs = arg;
+	pg_crc32	crc = record->xl_crc;
+
+	compute_record_crc(record);
+	if (record->xl_crc != crc)
+		cs->badcrc++;
+	if (!(record->xl_rmid == RM_XLOG_ID &&
+		  (record->xl_info & ~XLR_INFO_MASK) == XLOG_NOOP))
+		cs->records++;
+}
+
+/*
+ * Rewrite a complete segment in buf without the removable page images.
+ * Returns the number of records converted, or -1 if the result doesn't
+ * check out, in which case buf is left as it was.
+ */
+static int
+strip_segment(const char *segname, char *buf, StripState *st)
+{
+	XLogDecoder dec;
+	CheckState	cs;
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+	uint64		converted;
+
+	XLogFromFileName(segname, &tli, &log, &seg);
+	st->segstart.xlogid = log;
+	st->segstart.xrecoff = seg * XLogSegSize;
+	st->seg = malloc(XLogSegSize);
+	if (!st->seg)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(st->seg, buf, XLogSegSize);
+	st->pending = 0;
+	st->haveprev = 0;
+	st->records = 0;
+	converted = st->converted;
+
+	xlogdecode_init(&dec);
+	xlogdecode_add_consumer(&dec, strip_record, st);
+	xlogdecode_feed(&dec, st->segstart, buf, XLogSegSize);
+
+	/*
+	 * A converted record still pending is left as it was, since the
+	 * record following it is in the next segment, and its prev-link
+	 * can't be changed from here.
+	 */
+	if (dec.desyncs > 0)
+	{
+		free(st->seg);
+		return -1;
+	}
+
+	memset(&cs, 0, sizeof(cs));
+	xlogdecode_init(&dec);
+	xlogdecode_add_consumer(&dec, check_record, &cs);
+	xlogdecode_feed(&dec, st->segstart, st->seg, XLogSegSize);
+	if (dec.desyncs > 0 || cs.badcrc > 0 || cs.records != st->records)
+	{
+		fprintf(stderr, "Rewritten segment %s failed to check out, keeping it as it was\n",
+				segname);
+		free(st->seg);
+		return -1;
+	}
+
+	memcpy(buf, st->seg, XLogSegSize);
+	free(st->seg);
+	return (int) (st->converted - converted);
+}
+
+
+static void
+strip_usage(void)
+{
+	printf("Usage: pg_streamrecv strip -d <directory> [-Z <level>] [-k] [-v] <first segment> [last segment]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv strip" - strip the removable page images from a range of
+ * segments in the archive.
+ */
+int
+strip_main(int argc, char *argv[])
+{
+	StripState	st;
+	char	   *buf;
+	char	   *first,
+			   *last;
+	char		segname[MAXFNAMELEN];
+	char		mode[8];
+	int			level = Z_BEST_COMPRESSION;
+	int			keep = 0;
+	TimeLineID	tli,
+				lasttli;
+	uint32		log,
+				seg,
+				lastlog,
+				lastseg;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:kvZ:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'Z':
+				level = atoi(optarg);
+				if (level < 1 || level > 9)
+					strip_usage();
+				break;
+			default:
+				strip_usage();
+		}
+	}
+	if (!basedir || optind >= argc || argc - optind > 2)
+		strip_usage();
+	first = argv[optind];
+	last = (optind + 1 < argc) ? argv[optind + 1] : first;
+	if (!is_segment_name(first) || !is_segment_name(last))
+		strip_usage();
+
+	buf = malloc(XLogSegSize);
+	if (!buf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(&st, 0, sizeof(st));
+	snprintf(mode, sizeof(mode), "wb%d", level);
+
+	XLogFromFileName(first, &tli, &log, &seg);
+	XLogFromFileName(last, &lasttli, &lastlog, &lastseg);
+	while (log < lastlog || (log == lastlog && seg <= lastseg))
+	{
+		char		fn[MAXPGPATH];
+		char		outfn[MAXPGPATH + sizeof(STRIPPED_SUFFIX)];
+		char		tmpfn[MAXPGPATH + sizeof(STRIPPED_SUFFIX) + 4];
+		struct stat st_in;
+		struct stat st_out;
+		uint64		fpi_bytes = st.fpi_bytes;
+		int			f;
+		int			r;
+		gzFile		gz;
+
+		XLogFileName(segname, tli, log, seg);
+		NextLogSeg(log, seg);
+
+		snprintf(fn, sizeof(fn), "%s/%s", basedir, segname);
+		f = open(fn, O_RDONLY);
+		if (f == -1)
+		{
+			if (verbose)
+				printf("Skipping %s, not in the archive uncompressed\n", segname);
+			continue;
+		}
+		if (fstat(f, &st_in) != 0 || st_in.st_size != XLogSegSize ||
+			read(f, buf, XLogSegSize) != XLogSegSize)
+		{
+			fprintf(stderr, "Failed to read segment %s\n", fn);
+			exit(1);
+		}
+		close(f);
+
+		r = strip_segment(segname, buf, &st);
+		if (r < 0)
+			continue;
+
+		snprintf(outfn, sizeof(outfn), "%s%s", fn, STRIPPED_SUFFIX);
+		snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", outfn);
+		f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		gz = (f == -1) ? NULL : gzdopen(dup(f), mode);
+		if (!gz)
+		{
+			fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+			exit(1);
+		}
+		if (gzwrite(gz, buf, XLogSegSize) != XLogSegSize || gzclose(gz) != Z_OK)
+		{
+			fprintf(stderr, "Failed to write %s\n", tmpfn);
+			exit(1);
+		}
+
+		/*
+		 * The stripped segment has to be on disk before the original is
+		 * removed, or a crash could leave neither.
+		 */
+		if (fsync(f) != 0 || close(f) != 0)
+		{
+			fprintf(stderr, "Failed to fsync %s: %m\n", tmpfn);
+			exit(1);
+		}
+		if (rename(tmpfn, outfn) != 0)
+		{
+			fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, outfn);
+			exit(1);
+		}
+		if (fsync_dir(basedir) != 0)
+		{
+			fprintf(stderr, "Failed to fsync directory %s: %m\n", basedir);
+			exit(1);
+		}
+		if (!keep && unlink(fn) != 0)
+		{
+			fprintf(stderr, "Failed to remove %s: %m\n", fn);
+			exit(1);
+		}
+
+		if (verbose && stat(outfn, &st_out) == 0)
+			printf("Stripped %s: %i records converted, %lu bytes of page images removed, %lu bytes\n",
+				   segname, r, (unsigned long) (st.fpi_bytes - fpi_bytes),
+				   (unsigned long) st_out.st_size);
+	}
+
+	printf("%lu records converted, %lu page images with %lu bytes removed\n",
+		   (unsigned long) st.converted, (unsigned long) st.fpis,
+		   (unsigned long) st.fpi_bytes);
+	free(buf);
+	return 0;
+}
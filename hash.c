@@ -0,0 +1,209 @@
+/*
+ * hash.c - fast content hashing
+ *
+ * An implementation of the XXH64 hash function by Yann Collet. It works
+ * on four independent 64-bit lanes, which modern CPUs run in parallel,
+ * so it hashes at memory speed without needing any particular vector
+ * instruction set or library.
+ *
+ * There's a one-shot version for data that's all in memory, and an
+ * incremental one for data that arrives in pieces. Both give the same
+ * result for the same data.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <string.h>
+
+#include "pg_streamrecv.h"
+
+#define PRIME64_1	UINT64CONST(0x9E3779B185EBCA87)
+#define PRIME64_2	UINT64CONST(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3	UINT64CONST(0x165667B19E3779F9)
+#define PRIME64_4	UINT64CONST(0x85EBCA77C2B2AE63)
+#define PRIME64_5	UINT64CONST(0x27D4EB2F165667C5)
+
+#define ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static inline uint64
+read64(const unsigned char *p)
+{
+	uint64		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32
+read32(const unsigned char *p)
+{
+	uint32		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64
+xxh64_round(uint64 acc, uint64 input)
+{
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64
+xxh64_merge(uint64 acc, uint64 val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64
+xxh64_finish(uint64 h, const unsigned char *p, const unsigned char *end)
+{
+	while (p + 8 <= end)
+	{
+		h ^= xxh64_round(0, read64(p));
+		h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= (uint64) read32(p) * PRIME64_1;
+		h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while (p < end)
+	{
+		h ^= (*p) * PRIME64_5;
+		h = ROTL64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint64
+xxh64_converge(uint64 v1, uint64 v2, uint64 v3, uint64 v4)
+{
+	uint64		h;
+
+	h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+	h = xxh64_merge(h, v1);
+	h = xxh64_merge(h, v2);
+	h = xxh64_merge(h, v3);
+	h = xxh64_merge(h, v4);
+	return h;
+}
+
+uint64
+xxh64(const void *data, size_t len, uint64 seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64		h;
+
+	if (len >= 32)
+	{
+		const unsigned char *limit = end - 32;
+		uint64		v1 = seed + PRIME64_1 + PRIME64_2;
+		uint64		v2 = seed + PRIME64_2;
+		uint64		v3 = seed;
+		uint64		v4 = seed - PRIME64_1;
+
+		do
+		{
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = xxh64_converge(v1, v2, v3, v4);
+	}
+	else
+		h = seed + PRIME64_5;
+
+	h += (uint64) len;
+	return xxh64_finish(h, p, end);
+}
+
+void
+xxh64_init(XXH64State *state, uint64 seed)
+{
+	memset(state, 0, sizeof(*state));
+	state->seed = seed;
+	state->v[0] = seed + PRIME64_1 + PRIME64_2;
+	state->v[1] = seed + PRIME64_2;
+	state->v[2] = seed;
+	state->v[3] = seed - PRIME64_1;
+}
+
+static inline void
+xxh64_stripe(XXH64State *state, const unsigned char *p)
+{
+	state->v[0] = xxh64_round(state->v[0], read64(p));
+	state->v[1] = xxh64_round(state->v[1], read64(p + 8));
+	state->v[2] = xxh64_round(state->v[2], read64(p + 16));
+	state->v[3] = xxh64_round(state->v[3], read64(p + 24));
+}
+
+void
+xxh64_update(XXH64State *state, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+
+	state->total += len;
+
+	/* Fill up a partial stripe from last time first */
+	if (state->used > 0)
+	{
+		size_t		n = Min(len, sizeof(state->buf) - state->used);
+
+		memcpy(state->buf + state->used, p, n);
+		state->used += n;
+		p += n;
+		if (state->used < sizeof(state->buf))
+			return;
+		xxh64_stripe(state, state->buf);
+		state->used = 0;
+	}
+
+	while (p + 32 <= end)
+	{
+		xxh64_stripe(state, p);
+		p += 32;
+	}
+
+	if (p < end)
+	{
+		memcpy(state->buf, p, end - p);
+		state->used = end - p;
+	}
+}
+
+uint64
+xxh64_final(XXH64State *state)
+{
+	uint64		h;
+
+	if (state->total >= 32)
+		h = xxh64_converge(state->v[0], state->v[1], state->v[2], state->v[3]);
+	else
+		h = state->seed + PRIME64_5;
+
+	h += state->total;
+	return xxh64_finish(h, state->buf, state->buf + state->used);
+}
@@ -0,0 +1,254 @@
+/*
+ * iosched.c - I/O priorities for the stream and for background work
+ *
+ * How much WAL can be lost is decided by how soon the receiver gets what
+ * it receives written and flushed, so that I/O should never have to wait
+ * behind compressing, pruning or copying the archive. Each process
+ * therefore gets an I/O scheduling class for what it does:
+ *
+ *	hot			the receiver itself, writing and flushing the segments.
+ *				The realtime class if we're allowed to, otherwise the
+ *				highest best-effort level.
+ *	stage		pipeline stages. The lowest best-effort level, since a
+ *				stage that falls behind can end up holding up the stream.
+ *	urgent		compressing and pruning to free up disk space. The lowest
+ *				best-effort level, and the lowest CPU priority.
+ *	idle		background passes, such as compressing aging segments and
+ *				retention. The idle class and the lowest CPU priority, so
+ *				they only use the disk when nothing else does, and limited
+ *				to background_io_rate_kb kilobytes per second between them.
+ *
+ * The classes only make a difference with I/O schedulers that support
+ * them (BFQ and the old CFQ), so the limit is also there for the others,
+ * and for storage that is shared with other hosts. It's a token bucket in
+ * shared memory, holding at most a second's worth of bytes, that all the
+ * idle processes take from as they read and write; when it's empty, they
+ * sleep until it has filled up enough again.
+ *
+ * How long each write and flush of the receiver took is kept as a
+ * histogram in the metrics, so it shows when the stream is held up by
+ * the disk, along with the bytes and the time the limit held back
+ * background work.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pg_streamrecv.h"
+
+/* From linux/ioprio.h, which isn't exported to userspace by glibc */
+#define IOPRIO_CLASS_SHIFT		13
+#define IOPRIO_CLASS_RT			1
+#define IOPRIO_CLASS_BE			2
+#define IOPRIO_CLASS_IDLE		3
+#define IOPRIO_WHO_PROCESS		1
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/* How many bytes the bucket holds, in microseconds of the rate */
+#define IO_BUCKET_USEC			1000000
+
+int			background_io_rate_kb = 0;
+
+static const char *io_ops[] = {"write", "fsync"};
+
+/* Upper bounds of the histogram buckets, in microseconds */
+static const uint64 io_buckets[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+
+#define NUM_IO_BUCKETS	(sizeof(io_buckets) / sizeof(io_buckets[0]))
+
+typedef struct IoShared
+{
+	/* When the bucket will be full again, in microseconds */
+	uint64		full_at;
+	uint64		bytes;
+	uint64		throttled_usec;
+} IoShared;
+
+static IoShared *shared = NULL;
+
+/* Whether this process takes from the bucket */
+static int	limited = 0;
+
+/* Only updated by the receiver itself */
+static uint64 hot_count[IO_HOT_FSYNC + 1][NUM_IO_BUCKETS + 1];
+static uint64 hot_usec[IO_HOT_FSYNC + 1];
+static const char *hot_class = "none";
+
+
+uint64
+now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int
+set_ioprio(int class, int level)
+{
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				   IOPRIO_PRIO_VALUE(class, level)) == 0;
+}
+
+/*
+ * Give the current process the I/O priority for the kind of work it does.
+ * Failing to is only reported, since everything works the same without.
+ */
+void
+io_set_class(int ioclass)
+{
+	switch (ioclass)
+	{
+		case IO_CLASS_HOT:
+			if (set_ioprio(IOPRIO_CLASS_RT, 0))
+				hot_class = "realtime";
+			else if (set_ioprio(IOPRIO_CLASS_BE, 0))
+				hot_class = "best-effort";
+			else if (verbose)
+				fprintf(stderr, "Failed to set I/O priority: %m\n");
+			if (verbose > 1)
+				printf("Writing segments at %s I/O priority\n", hot_class);
+			return;
+		case IO_CLASS_STAGE:
+		case IO_CLASS_URGENT:
+			if (!set_ioprio(IOPRIO_CLASS_BE, 7) && verbose)
+				fprintf(stderr, "Failed to set I/O priority: %m\n");
+			break;
+		case IO_CLASS_IDLE:
+			if (!set_ioprio(IOPRIO_CLASS_IDLE, 0) && verbose)
+				fprintf(stderr, "Failed to set idle I/O priority: %m\n");
+			limited = 1;
+			break;
+	}
+	if (ioclass != IO_CLASS_STAGE &&
+		setpriority(PRIO_PROCESS, 0, 19) != 0 && verbose)
+		fprintf(stderr, "Failed to set CPU priority: %m\n");
+}
+
+/*
+ * Account for bytes read or written by background work, and sleep as long
+ * as it takes to stay within background_io_rate_kb. Does nothing except
+ * in processes of the idle class, or without a limit.
+ */
+void
+io_throttle(uint64 bytes)
+{
+	uint64		rate = (uint64) background_io_rate_kb * 1024;
+	uint64		now,
+				full_at,
+				newfull;
+
+	if (!shared || !limited)
+		return;
+	__sync_fetch_and_add(&shared->bytes, bytes);
+	if (rate == 0)
+		return;
+
+	/*
+	 * Taking the bytes from the bucket pushes back when it's full again.
+	 * If that's more than a bucket away, it's empty, and we wait for the
+	 * difference.
+	 */
+	do
+	{
+		now = now_usec();
+		full_at = shared->full_at;
+		newfull = Max(full_at, now) + bytes * 1000000 / rate;
+	} while (!__sync_bool_compare_and_swap(&shared->full_at, full_at, newfull));
+
+	if (newfull > now + IO_BUCKET_USEC)
+	{
+		uint64		wait = newfull - now - IO_BUCKET_USEC;
+		struct timespec ts;
+
+		__sync_fetch_and_add(&shared->throttled_usec, wait);
+		ts.tv_sec = wait / 1000000;
+		ts.tv_nsec = (wait % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
+
+/*
+ * Record how long a write or flush on the hot path took, from a start
+ * time taken with now_usec().
+ */
+void
+io_hot_done(int op, uint64 start)
+{
+	uint64		usec = now_usec() - start;
+	int			i;
+
+	for (i = 0; i < NUM_IO_BUCKETS && usec > io_buckets[i]; i++)
+		;
+	hot_count[op][i]++;
+	hot_usec[op] += usec;
+}
+
+static void
+iosched_metrics(FILE *f)
+{
+	int			op;
+	int			i;
+
+	fprintf(f, "# TYPE pg_streamrecv_hot_io_seconds histogram\n");
+	for (op = 0; op <= IO_HOT_FSYNC; op++)
+	{
+		uint64		count = 0;
+
+		for (i = 0; i <= NUM_IO_BUCKETS; i++)
+		{
+			count += hot_count[op][i];
+			if (i < NUM_IO_BUCKETS)
+				fprintf(f, "pg_streamrecv_hot_io_seconds_bucket{op=\"%s\",le=\"%g\"} " UINT64_FORMAT "\n",
+						io_ops[op], io_buckets[i] / 1000000.0, count);
+			else
+				fprintf(f, "pg_streamrecv_hot_io_seconds_bucket{op=\"%s\",le=\"+Inf\"} " UINT64_FORMAT "\n",
+						io_ops[op], count);
+		}
+		fprintf(f, "pg_streamrecv_hot_io_seconds_sum{op=\"%s\"} %.6f\n",
+				io_ops[op], hot_usec[op] / 1000000.0);
+		fprintf(f, "pg_streamrecv_hot_io_seconds_count{op=\"%s\"} " UINT64_FORMAT "\n",
+				io_ops[op], count);
+	}
+	fprintf(f, "# TYPE pg_streamrecv_hot_io_class gauge\n");
+	fprintf(f, "pg_streamrecv_hot_io_class{class=\"%s\"} 1\n", hot_class);
+	fprintf(f, "# TYPE pg_streamrecv_background_io_bytes_total counter\n");
+	fprintf(f, "pg_streamrecv_background_io_bytes_total " UINT64_FORMAT "\n",
+			shared->bytes);
+	fprintf(f, "# TYPE pg_streamrecv_background_io_throttled_seconds_total counter\n");
+	fprintf(f, "pg_streamrecv_background_io_throttled_seconds_total %.3f\n",
+			shared->throttled_usec / 1000000.0);
+}
+
+/*
+ * Set up the bucket shared with the background processes, and give the
+ * receiver its priority. Must be called before any of them are started.
+ */
+void
+iosched_init(void)
+{
+	shared = mmap(NULL, sizeof(IoShared), PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	io_set_class(IO_CLASS_HOT);
+	metrics_register(iosched_metrics);
+}
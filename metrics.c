@@ -0,0 +1,67 @@
+/*
+ * metrics.c - export of runtime metrics
+ *
+ * Metrics are written to a file in the base directory in the Prometheus
+ * text format, so they can be picked up by the node exporter textfile
+ * collector or simply read by a script. The file is written to a
+ * temporary name and renamed into place, so it's always complete.
+ *
+ * Each part of the program that has something to report registers a
+ * function that prints its metrics.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pg_streamrecv.h"
+
+#define MAX_METRICS_CALLBACKS	16
+
+static MetricsCallback callbacks[MAX_METRICS_CALLBACKS];
+static int	ncallbacks = 0;
+
+
+void
+metrics_register(MetricsCallback callback)
+{
+	if (ncallbacks >= MAX_METRICS_CALLBACKS)
+	{
+		fprintf(stderr, "Too many metrics callbacks\n");
+		exit(1);
+	}
+	callbacks[ncallbacks++] = callback;
+}
+
+/*
+ * Write out the current value of all metrics.
+ */
+void
+metrics_write(void)
+{
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	FILE	   *f;
+	int			i;
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, METRICS_FILENAME);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+
+	f = fopen(tmpfn, "w");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to create metrics file %s: %m\n", tmpfn);
+		return;
+	}
+	for (i = 0; i < ncallbacks; i++)
+		callbacks[i] (f);
+	if (fclose(f) != 0 || rename(tmpfn, fn) != 0)
+		fprintf(stderr, "Failed to write metrics file %s: %m\n", fn);
+}
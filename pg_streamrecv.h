@@ -0,0 +1,802 @@
+/*
+ * pg_streamrecv.h - shared declarations for pg_streamrecv
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+#ifndef PG_STREAMRECV_H
+#define PG_STREAMRECV_H
+
+#include <signal.h>
+#include <sys/select.h>
+#include <time.h>
+
+#include "postgres.h"
+#include "access/xlog_internal.h"
+
+
+/* Options, set from the commandline or configuration file */
+extern char *connstr;
+extern char *basedir;
+extern int	verbose;
+extern int	flush_interval;
+extern int	takeover;
+
+/* Other global variables */
+extern int	timeline;
+extern char current_walfile_name[64];
+
+/*
+ * A partial segment found at startup whose retransmission didn't match is
+ * kept in the base directory with this suffix, and noted in the file
+ * "divergences" with the location where the two differ.
+ */
+#define DIVERGED_SUFFIX			".diverged"
+#define DIVERGENCES_FILENAME	"divergences"
+
+/*
+ * Copy of the part of the segment being received written so far, made on
+ * request from the control socket, and removed when the segment is done.
+ */
+#define PARTIAL_SUFFIX			".partial"
+
+
+#define ISHEX(x) ((x >= '0' && x <= '9') || (x >= 'A' && x <= 'F'))
+
+/*
+ * The receiver, in stream.c. Sinks are told about the WAL received, in
+ * the process receiving it, with any of the callbacks left NULL.
+ */
+typedef struct StreamSink
+{
+	/* A block of WAL starting at start has been written */
+	void		(*data) (void *arg, XLogRecPtr start, const char *data,
+									 uint32 len);
+	/* Everything up to flushed is on disk, the last of it in segname */
+	void		(*flush) (void *arg, XLogRecPtr flushed, const char *segname);
+	/* segname has been completed and moved into the base directory */
+	void		(*segment) (void *arg, const char *segname);
+	void	   *arg;
+} StreamSink;
+
+typedef struct StreamRecv
+{
+	struct pg_conn *conn;		/* replication connection */
+	int			walfile;		/* segment file being written, or -1 */
+	XLogRecPtr	streamstart;	/* where streaming was started */
+} StreamRecv;
+
+extern void stream_add_sink(const StreamSink *sink);
+extern StreamRecv *stream_open(void);
+extern int	stream_poll(StreamRecv *s);
+extern void stream_run(StreamRecv *s);
+extern void stream_close(StreamRecv *s);
+extern uint64 now_msec(void);
+
+/*
+ * Pipeline of stages getting the stream as it's received, each in its own
+ * process, set up with -P.
+ */
+extern void pipeline_add_stage(const char *spec);
+extern void pipeline_prepare(void);
+extern void pipeline_data(void *arg, XLogRecPtr start, const char *data,
+			  uint32 len);
+extern void pipeline_segment(void *arg, const char *segname);
+extern void pipeline_metrics(FILE *f);
+
+/* Does the filename look like a WAL segment name? */
+extern int	is_segment_name(const char *name);
+
+/* Flush a directory after changing what's in it */
+extern int	fsync_dir(const char *dir);
+
+
+/*
+ * CRC-32, using the same polynomial and conventions as the backend uses
+ * for WAL records, so it can be used both for whole segments and for
+ * checking individual records.
+ */
+#define INIT_WALCRC(crc)			((crc) = 0xFFFFFFFF)
+#define COMP_WALCRC(crc, data, len) ((crc) = walcrc_update((crc), (data), (len)))
+#define FIN_WALCRC(crc)				((crc) ^= 0xFFFFFFFF)
+
+extern uint32 walcrc_update(uint32 crc, const void *data, size_t len);
+
+
+/*
+ * Content hashes. XXH64 is a fast non-cryptographic hash, SHA-256 is used
+ * where it matters that nobody can make two segments hash the same.
+ */
+typedef struct XXH64State
+{
+	uint64		v[4];
+	uint64		seed;
+	uint64		total;
+	unsigned char buf[32];
+	uint32		used;
+} XXH64State;
+
+extern uint64 xxh64(const void *data, size_t len, uint64 seed);
+extern void xxh64_init(XXH64State *state, uint64 seed);
+extern void xxh64_update(XXH64State *state, const void *data, size_t len);
+extern uint64 xxh64_final(XXH64State *state);
+
+#define SHA256_LEN		32
+
+typedef struct SHA256State
+{
+	uint32		h[8];
+	uint64		total;
+	unsigned char buf[64];
+	uint32		used;
+} SHA256State;
+
+extern void sha256_init(SHA256State *state);
+extern void sha256_update(SHA256State *state, const void *data, size_t len);
+extern void sha256_final(SHA256State *state, unsigned char *digest);
+extern void hmac_sha256(const void *key, size_t keylen, const void *data,
+			size_t len, unsigned char *digest);
+
+/*
+ * AES-256 in GCM mode, using AES-NI and PCLMULQDQ when the CPU has them.
+ */
+#define AES_GCM_IV_LEN	12
+#define AES_GCM_TAG_LEN	16
+
+typedef struct AESKey
+{
+	unsigned char rk[240];		/* expanded round keys */
+} AESKey;
+
+extern void aes256_init(AESKey *key, const unsigned char *k);
+extern void aes_gcm_encrypt(const AESKey *key, const unsigned char *iv,
+				const void *aad, size_t aadlen, const void *in, void *out,
+				size_t len, unsigned char *tag);
+extern int	aes_gcm_decrypt(const AESKey *key, const unsigned char *iv,
+				const void *aad, size_t aadlen, const void *in, void *out,
+				size_t len, const unsigned char *tag);
+
+/*
+ * Checksums of completed segments, stored as "checksums" in the base
+ * directory. The hashes are computed as the data is received, and a
+ * line with the segment name, SHA-256 and XXH64 in hex is appended when
+ * the segment is completed, so nothing has to read the segment again to
+ * know what it should contain.
+ */
+#define CHECKSUMS_FILENAME		"checksums"
+
+typedef struct SegmentChecksum
+{
+	char		segname[MAXFNAMELEN];
+	unsigned char sha256[SHA256_LEN];
+	uint64		xxh64;
+} SegmentChecksum;
+
+extern void checksums_append(const char *dir, SegmentChecksum *cs);
+extern int	checksums_lookup(const char *dir, const char *segname,
+				 SegmentChecksum *cs);
+extern SegmentChecksum *checksums_load(const char *dir, int *n);
+extern SegmentChecksum *checksums_find(SegmentChecksum *cs, int n,
+			   const char *segname);
+extern void checksum_buffer(const char *segname, const char *buf, size_t len,
+				SegmentChecksum *cs);
+
+/*
+ * Archive index, stored as "archive.index" in the base directory.
+ *
+ * The file is a fixed header followed by one fixed-size entry for each
+ * completed segment, sorted by (startpoint, tli). Writers take an
+ * exclusive flock() on it. New entries are normally appended, and entries
+ * are updated in place, but anything else writes a new file and renames
+ * it into place, so readers can mmap the file and binary search it
+ * without any locking.
+ */
+#define ARCHIVE_INDEX_FILENAME	"archive.index"
+#define ARCHIVE_INDEX_MAGIC		0x57414c49		/* "WALI" */
+#define ARCHIVE_INDEX_VERSION	1
+
+typedef struct ArchiveIndexHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		entrysize;
+	uint32		reserved;
+} ArchiveIndexHeader;
+
+/* Values for compression */
+#define ARCHIVE_COMPRESSION_NONE	0
+#define ARCHIVE_COMPRESSION_GZIP	1	/* as <segment>.gz, at level */
+#define ARCHIVE_COMPRESSION_OTHER	2	/* stripped, deduplicated, chunked or
+										 * encrypted */
+#define ARCHIVE_COMPRESSION_PACKED	3	/* packed into a volume */
+
+/* Bits in flags */
+#define ARCHIVE_ENTRY_HAS_CRC		0x0001	/* crc field is valid */
+
+typedef struct ArchiveIndexEntry
+{
+	TimeLineID	tli;
+	uint32		flags;
+	XLogRecPtr	startpoint;		/* first byte in the segment */
+	XLogRecPtr	endpoint;		/* first byte after the segment */
+	uint64		size;			/* size of the file on disk */
+	uint32		compression;
+	uint32		crc;			/* CRC-32 of the uncompressed segment */
+	char		path[64];		/* filename, relative to basedir */
+	uint32		level;			/* compression level, 0 if not known */
+	char		reserved[20];
+} ArchiveIndexEntry;
+
+typedef struct ArchiveIndex
+{
+	int			fd;
+	char	   *map;
+	size_t		mapsize;
+	ArchiveIndexEntry *entries;
+	int			nentries;
+} ArchiveIndex;
+
+extern ArchiveIndex *archive_index_open(const char *dir);
+extern void archive_index_close(ArchiveIndex *idx);
+extern void archive_index_rebuild(const char *dir);
+extern void archive_index_check(const char *dir);
+extern void archive_index_append(const char *dir, ArchiveIndexEntry *entry);
+extern void archive_index_remove_upto(const char *dir,
+						  const ArchiveIndexEntry *upto);
+extern int	archive_index_update(const char *dir, const ArchiveIndexEntry *entry);
+extern ArchiveIndexEntry *archive_index_lookup(ArchiveIndex *idx,
+					 XLogRecPtr ptr);
+extern void archive_index_fill_entry(ArchiveIndexEntry *entry,
+						 const char *filename, uint64 size);
+
+extern int	index_main(int argc, char *argv[]);
+
+
+/*
+ * Incremental WAL record decoder
+ */
+struct XLogDecoder;
+
+typedef void (*XLogRecordCallback) (struct XLogDecoder *dec,
+									XLogRecord *record, void *arg);
+
+#define MAX_DECODE_CONSUMERS	8
+
+/* Decoder states */
+#define DS_SKIP			0		/* skipping bytes we don't care about */
+#define DS_PAGEHDR		1		/* reading a page header */
+#define DS_CONTHDR		2		/* reading a continuation record header */
+#define DS_CONTDATA		3		/* reading continuation data */
+#define DS_RECSTART		4		/* at the start of a record */
+#define DS_RECORD		5		/* reading a record */
+
+typedef struct XLogDecoder
+{
+	XLogRecPtr	pos;			/* location of the next byte to decode */
+	int			positioned;		/* has pos been set? */
+	int			state;
+	TimeLineID	tli;			/* timeline from the last page header */
+
+	/* Used in DS_SKIP */
+	uint32		skipremain;
+	int			afterskip;
+
+	/* Used in DS_PAGEHDR and DS_CONTHDR */
+	char		pagehdr[SizeOfXLogLongPHD];
+	uint32		hdrgot;
+	uint32		hdrlen;
+	uint32		contremain;
+
+	/* The record being assembled */
+	int			inrecord;
+	XLogRecPtr	recstart;
+	char	   *recbuf;
+	uint32		recbufsize;
+	uint32		recgot;
+	uint32		rectotal;		/* xl_tot_len, once the header is read */
+
+	/* Counters */
+	uint64		records;
+	uint64		desyncs;
+	uint64		contskips;		/* continuations of records not seen start */
+
+	int			stop;			/* set by a consumer to stop decoding */
+
+	struct
+	{
+		XLogRecordCallback callback;
+		void	   *arg;
+	}			consumers[MAX_DECODE_CONSUMERS];
+	int			nconsumers;
+} XLogDecoder;
+
+extern void xlogdecode_init(XLogDecoder *dec);
+extern void xlogdecode_add_consumer(XLogDecoder *dec,
+						XLogRecordCallback callback, void *arg);
+extern void xlogdecode_feed(XLogDecoder *dec, XLogRecPtr startpoint,
+				const char *data, uint32 len);
+extern void xlogdecode_start_at_record(XLogDecoder *dec, XLogRecPtr recptr);
+extern int	xlogdecode_xact_time(XLogRecord *record, TimestampTz *xact_time);
+extern BkpBlock *xlogdecode_bkp_block(XLogRecord *record, int i, uint32 *len);
+extern pg_crc32 xlogdecode_record_crc(XLogRecord *record);
+
+extern const char *const rmgr_names[];
+
+/*
+ * Commit timestamp to WAL location index, stored as "time.index" in the
+ * base directory. Holds one sample per sampling interval, plus one entry
+ * per completed segment with the range of commit timestamps in it.
+ */
+#define TIME_INDEX_FILENAME		"time.index"
+
+#define TIMEINDEX_SAMPLE		1
+#define TIMEINDEX_SEGMENT		2
+
+typedef struct TimeIndexEntry
+{
+	TimestampTz mintime;
+	TimestampTz maxtime;
+	XLogRecPtr	startpoint;		/* commit record, or segment start */
+	XLogRecPtr	endpoint;		/* end of commit record, or segment end */
+	TimeLineID	tli;
+	uint32		kind;
+} TimeIndexEntry;
+
+extern int	timeindex_interval;
+
+extern void timeindex_init(XLogDecoder *dec, XLogRecPtr startpoint);
+extern void timeindex_finish_segment(const char *segname);
+extern TimestampTz time_t_to_timestamptz(time_t t);
+extern time_t timestamptz_to_time_t(TimestampTz t);
+extern void segment_for_endpoint(char *segname, TimeLineID tli,
+					 XLogRecPtr endpoint);
+
+extern int	timeindex_main(int argc, char *argv[]);
+
+/*
+ * Record start index, one file per segment in the "recindex" directory
+ * under the base directory. Holds the offset of the first record starting
+ * in each recindex_stride sized part of the segment, so readers can start
+ * decoding anywhere in a segment without scanning it from the start.
+ */
+#define RECINDEX_DIR			"recindex"
+#define RECINDEX_MAGIC			0x57414c52		/* "WALR" */
+#define RECINDEX_VERSION		1
+
+typedef struct RecIndexHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		stride;			/* bytes between samples */
+	uint32		count;			/* number of offsets following */
+	XLogRecPtr	firstrec;		/* first record starting in the segment */
+	XLogRecPtr	lastrec;		/* last record starting in the segment */
+} RecIndexHeader;
+
+extern int	recindex_stride;
+
+extern void recindex_init(XLogDecoder *dec, XLogRecPtr startpoint);
+extern int	recindex_seek(const char *dir, const char *segname, uint32 offset,
+			  uint32 *recoffset);
+extern int	xlogread_archive(const char *dir, TimeLineID tli, XLogRecPtr from,
+				 XLogDecoder *dec);
+extern int	records_main(int argc, char *argv[]);
+
+/*
+ * Summaries of the blocks modified in each segment, one file per segment
+ * in the "summaries" directory under the base directory. Each holds a
+ * header followed by a sorted list of block references. A reference with
+ * fork BLOCKREF_ALL_FORKS and block InvalidBlockNumber stands for the whole
+ * relation.
+ */
+#define WALSUMMARY_DIR			"summaries"
+#define WALSUMMARY_MAGIC		0x57414c53		/* "WALS" */
+#define WALSUMMARY_VERSION		1
+
+#define WALSUMMARY_LOSSY		0x0001	/* not all changes could be tracked */
+
+#define BLOCKREF_ALL_FORKS		(-1)
+
+typedef struct WalSummaryHeader
+{
+	uint32		magic;
+	uint32		version;
+	XLogRecPtr	startpoint;
+	XLogRecPtr	endpoint;
+	TimeLineID	tli;
+	uint32		flags;
+	uint32		count;			/* number of BlockRefs following */
+	uint32		reserved;
+} WalSummaryHeader;
+
+typedef struct BlockRef
+{
+	RelFileNode node;
+	int32		fork;
+	BlockNumber block;
+} BlockRef;
+
+extern int	walsummary_enabled;
+
+extern void walsummary_init(XLogDecoder *dec);
+extern void walsummary_finish_segment(const char *segname);
+extern int	blocks_main(int argc, char *argv[]);
+
+/*
+ * Restoring files from the archive
+ */
+#define ARCHIVE_FILE_NOTFOUND	0
+#define ARCHIVE_FILE_PLAIN		1
+#define ARCHIVE_FILE_GZIP		2
+#define ARCHIVE_FILE_PARTIAL	3	/* partial segment in inprogress */
+#define ARCHIVE_FILE_DEDUP		4	/* page images in the page store */
+#define ARCHIVE_FILE_CHUNKED	5	/* manifest of chunks in the chunk store */
+#define ARCHIVE_FILE_ENCRYPTED	6	/* encrypted with the key from -K */
+#define ARCHIVE_FILE_PACKED		7	/* packed into a volume */
+
+extern int	locate_archive_file(const char *dir, const char *fname,
+					char *path, size_t pathlen);
+extern int	expand_archive_segment(const char *dir, int how, const char *fname,
+					   const char *path, char *buf);
+extern int	copy_fd(int src, int dest, off_t padto);
+extern int	gunzip_fd(const char *src, int dest);
+extern int	load_archive_segment(const char *dir, const char *fname, char *buf,
+					 uint32 *len);
+extern int	restore_file(const char *dir, const char *fname, const char *dest,
+			 int *partial);
+extern int	restore_main(int argc, char *argv[]);
+extern int	verify_main(int argc, char *argv[]);
+
+/*
+ * Segments with the removable full page images stripped out, stored
+ * gzip compressed with this suffix.
+ */
+#define STRIPPED_SUFFIX			".stripped"
+
+extern int	strip_main(int argc, char *argv[]);
+
+/*
+ * Segments with their page images moved to the page store, one file per
+ * distinct image in the "pagestore" directory under the base directory.
+ * Stored gzip compressed with this suffix, as a header, a DedupRef for
+ * each image taken out, and the rest of the segment.
+ */
+#define DEDUP_SUFFIX			".dedup"
+#define PAGESTORE_DIR			"pagestore"
+#define DEDUP_MAGIC				0x57414c44		/* "WALD" */
+#define DEDUP_VERSION			1
+
+typedef struct DedupHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nrefs;			/* number of DedupRefs following */
+	uint32		reserved;
+} DedupHeader;
+
+typedef struct DedupRef
+{
+	uint32		offset;			/* where the image starts in the segment */
+	uint32		len;			/* length of the image */
+	uint64		h1;				/* hash of the image */
+	uint64		h2;
+} DedupRef;
+
+extern int	expand_dedup_segment(const char *dir, const char *path, char *buf);
+extern uint64 dedup_sweep(const char *dir, int wait);
+extern int	dedup_main(int argc, char *argv[]);
+
+/*
+ * Segments split into content-defined chunks, kept in the "chunkstore"
+ * directory under the base directory, which may be shared between the
+ * archives of several clusters. A chunked segment is replaced by a
+ * manifest with this suffix, holding a header and a ChunkRef for each
+ * chunk in order.
+ */
+#define CHUNK_MANIFEST_SUFFIX	".chunks"
+#define CHUNKSTORE_DIR			"chunkstore"
+#define CHUNK_MANIFEST_MAGIC	0x57414c43		/* "WALC" */
+#define CHUNK_MANIFEST_VERSION	1
+
+typedef struct ChunkManifestHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nchunks;		/* number of ChunkRefs following */
+	uint32		reserved;
+	uint64		size;			/* total size of the segment */
+} ChunkManifestHeader;
+
+typedef struct ChunkRef
+{
+	uint32		len;
+	uint32		reserved;
+	uint64		h1;				/* hash of the chunk */
+	uint64		h2;
+} ChunkRef;
+
+extern char *chunkstore;
+extern int	chunk_compress_level;
+
+extern void chunkstore_link(const char *dir, const char *store);
+extern int	chunk_segment(const char *dir, const char *segname, int keep);
+extern void chunkstore_segment(const char *dir, const char *segname);
+extern void chunkstore_poll(const char *dir);
+extern int	remove_chunked_segment(const char *dir, const char *segname);
+extern int	expand_chunked_segment(const char *dir, const char *path, char *buf);
+extern int	chunk_main(int argc, char *argv[]);
+
+/*
+ * Segments encrypted with AES-256-GCM, with this suffix. The file is an
+ * EncryptedHeader followed by the segment in chunks of
+ * ENCRYPTED_CHUNK_SIZE bytes, each followed by its tag, so any part of it
+ * can be decrypted without reading the rest.
+ */
+#define ENCRYPTED_SUFFIX		".enc"
+#define ENCRYPTED_MAGIC			0x57414c45		/* "WALE" */
+#define ENCRYPTED_VERSION		1
+#define ENCRYPTED_CHUNK_SIZE	(64 * 1024)
+
+typedef struct EncryptedHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		chunksize;
+	uint32		reserved;
+	unsigned char keyid[8];		/* identifies the master key */
+	unsigned char salt[16];		/* the key for the file is derived with it */
+	char		segname[MAXFNAMELEN];
+} EncryptedHeader;
+
+typedef struct EncryptWriter
+{
+	int			fd;
+	EncryptedHeader hdr;
+	AESKey		key;
+	uint64		chunkno;
+	uint32		used;			/* bytes of the current chunk in buf */
+	char		buf[ENCRYPTED_CHUNK_SIZE + AES_GCM_TAG_LEN];
+} EncryptWriter;
+
+extern char *encryption_key_file;
+
+extern void encryption_load_key(void);
+extern int	encrypt_begin(EncryptWriter *w, int fd, const char *segname);
+extern int	encrypt_write(EncryptWriter *w, const char *data, uint32 len);
+extern int	encrypt_end(EncryptWriter *w);
+extern int	decrypt_segment_range(const char *path, const char *segname,
+					  uint64 offset, uint32 len, char *buf);
+extern int	expand_encrypted_segment(const char *path, const char *segname,
+						 char *buf);
+extern int	encrypt_main(int argc, char *argv[]);
+
+/*
+ * Removing old segments from the archive, by age, count, total size, or
+ * what a base backup needs.
+ */
+#define RETENTION_DEFAULT_RATE	20		/* segments per second */
+
+extern int	retention_age;		/* seconds */
+extern int	retention_count;
+extern int	retention_size_mb;
+extern char *retention_base_backup;
+extern int	retention_rate;
+
+extern void retention_init(void);
+extern int	retention_run(const char *dir, int dryrun);
+extern int	retention_free_space(const char *dir, uint64 goal, int keep);
+extern int	prune_main(int argc, char *argv[]);
+
+/*
+ * Compressing archived segments harder as they age, in tiers of
+ * "<hours>:<level>,...".
+ */
+extern char *recompress_tiers;
+
+extern void recompress_init(void);
+extern int	recompress_run(const char *dir, int dryrun);
+extern int	recompress_all(const char *dir, int level);
+extern int	recompress_main(int argc, char *argv[]);
+
+/*
+ * Completed segments packed into large volume files in the "volumes"
+ * directory under the base directory, each segment as a VolumeEntry
+ * followed by its data. A full volume is sealed with the entries of all
+ * its segments and a VolumeTrailer. The volume index holds the entries of
+ * all volumes, after an ArchiveIndexHeader, in archive index order.
+ */
+#define VOLUME_DIR				"volumes"
+#define VOLUME_SUFFIX			".vol"
+#define VOLUME_INDEX_FILENAME	"volume.index"
+#define VOLUME_MAGIC			0x57414c56		/* "WALV" */
+#define VOLUME_ENTRY_MAGIC		0x57414c45		/* "WALE" */
+#define VOLUME_TRAILER_MAGIC	0x57414c54		/* "WALT" */
+#define VOLUME_INDEX_MAGIC		0x57414c58		/* "WALX" */
+#define VOLUME_VERSION			1
+#define VOLUME_DEFAULT_SIZE_MB	4096
+
+typedef struct VolumeHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		volume;			/* number of the volume */
+	uint32		reserved;
+} VolumeHeader;
+
+typedef struct VolumeEntry
+{
+	uint32		magic;
+	TimeLineID	tli;
+	XLogRecPtr	startpoint;		/* first byte in the segment */
+	uint32		volume;			/* number of the volume holding it */
+	uint32		compression;	/* ARCHIVE_COMPRESSION_NONE or _GZIP */
+	uint64		offset;			/* of the data in the volume */
+	uint64		length;			/* of the data in the volume */
+	int64		completed;		/* modification time of the segment file */
+	uint32		crc;			/* CRC-32 of the uncompressed segment */
+	char		segname[64];	/* same as the path in the archive index */
+	uint32		check;			/* CRC-32 of the entry up to here */
+} VolumeEntry;
+
+typedef struct VolumeTrailer
+{
+	uint32		magic;
+	uint32		nentries;
+	uint64		offset;			/* of the entries before the trailer */
+	uint32		crc;			/* CRC-32 of those entries */
+	uint32		check;			/* CRC-32 of the trailer up to here */
+} VolumeTrailer;
+
+extern int	volume_size_mb;
+extern int	volume_pack_age;	/* seconds */
+
+extern void volume_init(void);
+extern int	volume_pack(const char *dir);
+extern int	volume_locate(const char *dir, const char *fname, char *path,
+			  size_t pathlen);
+extern int	volume_read_segment(const char *dir, const char *fname, char *buf);
+extern int	volume_completed(const char *dir, const char *fname, time_t *completed);
+extern int	volume_list(const char *dir, VolumeEntry **entries);
+extern uint64 volume_remove_upto(const char *dir,
+				   const ArchiveIndexEntry *upto);
+extern void volume_index_rebuild(const char *dir);
+extern int	pack_main(int argc, char *argv[]);
+extern int	unpack_main(int argc, char *argv[]);
+
+/*
+ * I/O priorities for writing the stream and for background work, and a
+ * limit on the bytes per second background work reads and writes.
+ */
+#define IO_CLASS_HOT		0	/* the receiver */
+#define IO_CLASS_STAGE		1	/* pipeline stages */
+#define IO_CLASS_URGENT		2	/* freeing up disk space */
+#define IO_CLASS_IDLE		3	/* background passes */
+
+#define IO_HOT_WRITE		0
+#define IO_HOT_FSYNC		1
+
+extern int	background_io_rate_kb;
+
+extern uint64 now_usec(void);
+extern void iosched_init(void);
+extern void io_set_class(int ioclass);
+extern void io_throttle(uint64 bytes);
+extern void io_hot_done(int op, uint64 start);
+
+/*
+ * Compressing, pruning and finally holding back reading from the server
+ * as the archive filesystem fills up.
+ */
+#define DISK_STAGE_OK			0
+#define DISK_STAGE_COMPRESS		1
+#define DISK_STAGE_PRUNE		2
+#define DISK_STAGE_THROTTLE		3
+
+#define DISK_DEFAULT_PRUNE_KEEP			16		/* segments */
+#define DISK_DEFAULT_THROTTLE_FREE_MB	64
+
+extern int	disk_compress_free_mb;
+extern int	disk_prune_free_mb;
+extern int	disk_prune_keep;
+extern int	disk_throttle_free_mb;
+
+extern uint64 disk_free_space(const char *dir);
+extern void diskspace_init(void);
+extern int	diskspace_check(void);
+extern void diskspace_full(void);
+
+/*
+ * Serving files from the archive over the network
+ */
+#define DEFAULT_SERVE_PORT		5480
+
+extern int	serve_main(int argc, char *argv[]);
+extern int	fetch_main(int argc, char *argv[]);
+
+/*
+ * Configuration file for the receiver, read at startup and again on
+ * SIGHUP. Settings given on the command line are marked with
+ * config_cmdline() so the file doesn't override them.
+ */
+extern char *config_file;
+extern volatile sig_atomic_t config_reload_pending;
+
+extern void config_cmdline(const char *name);
+extern void config_load(int reloading);
+extern void config_reload_signal(int signo);
+
+/*
+ * Control socket of a running receiver, CONTROL_SOCKET_FILENAME in the
+ * base directory. A new receiver asks the running one to hand over its
+ * stream there, and gets this state back along with the descriptor of the
+ * segment file being written.
+ */
+#define CONTROL_SOCKET_FILENAME "pg_streamrecv.sock"
+#define FLUSHED_LSN_FILENAME	"flushed.lsn"
+#define HANDOFF_MAGIC			0x57414c48		/* "WALH" */
+#define HANDOFF_VERSION			1
+
+typedef struct HandoffState
+{
+	uint32		magic;
+	uint32		version;
+	TimeLineID	timeline;
+	XLogRecPtr	position;		/* where the next byte received goes */
+	char		walfile_name[64];
+	pg_crc32	crc;			/* of the segment file so far */
+	SHA256State sha256;
+	XXH64State	xxh64;
+	uint64		bytes_received;
+	uint64		segments_completed;
+	uint64		divergences;
+	uint64		records;
+	uint64		desyncs;
+	XLogRecPtr	contrecord;		/* start of the record continuing into the
+								 * segment being written, or 0/0 */
+	char		saved_name[MAXPGPATH];	/* saved partial segment, if any */
+} HandoffState;
+
+extern int	control_listen(const char *dir);
+extern int	control_accept(int listensock, char *request, int len);
+extern int	control_wait_fds(fd_set *fds);
+extern void control_reply(int sock, const char *fmt,...)
+__attribute__((format(printf, 2, 3)));
+extern int	handoff_send(int sock, HandoffState *state, int walfile);
+extern int	handoff_request(const char *dir, HandoffState *state, int *sock);
+extern void handoff_confirm(int sock);
+extern void handoff_refuse(int sock);
+extern int	control_subscribe(int sock);
+extern void notify_flushed(const char *dir, XLogRecPtr flushed,
+			   const char *segname, int completed);
+extern int	notify_subscribe(const char *dir);
+extern int	control_main(int argc, char *argv[]);
+
+/*
+ * Metrics, written to METRICS_FILENAME in the base directory in the
+ * Prometheus text format. Each module registers a function that prints
+ * its own metrics.
+ */
+#define METRICS_FILENAME		"pg_streamrecv.prom"
+
+typedef void (*MetricsCallback) (FILE *f);
+
+extern void metrics_register(MetricsCallback callback);
+extern void metrics_write(void);
+
+/*
+ * WAL statistics per resource manager, appended to WALSTATS_FILENAME in
+ * the base directory for each completed segment.
+ */
+#define WALSTATS_FILENAME		"wal.stats"
+
+extern int	walstats_enabled;
+
+extern void walstats_init(XLogDecoder *dec);
+extern void walstats_finish_segment(const char *segname);
+extern void walstats_reset(void);
+extern int	walstats_main(int argc, char *argv[]);
+
+#endif   /* PG_STREAMRECV_H */
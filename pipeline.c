@@ -0,0 +1,907 @@
+/*
+ * pipeline.c - stages that get the stream as it's received
+ *
+ * Besides being written to the segment files in the base directory, the
+ * stream can be sent to any number of stages given with -P, each running
+ * in its own process:
+ *
+ *	compress:<directory>
+ *		Write each segment gzip compressed to the directory, as
+ *		<segment>.gz, so a second copy is ready as soon as the segment
+ *		is complete.
+ *
+ *	encrypt:<directory>
+ *		Write each segment encrypted to the directory, as <segment>.enc,
+ *		with the key given with -K. See encrypt.c.
+ *
+ *	exec:<command>
+ *		Run the command through the shell for each segment, with %f
+ *		replaced by the segment name, and write the segment to it as it
+ *		arrives. Meant for uploading, or relaying to another host with
+ *		something like "ssh standby 'cat > /archive/%f'". The command is
+ *		killed with SIGTERM if the segment is cut short, so it must not
+ *		keep what it got in that case, and is expected to exit with
+ *		status 0 once it has stored a complete one.
+ *
+ * Each block of WAL is copied once into a ring in shared memory, and all
+ * the stages read it from there. A chunk in the ring is counted as in use
+ * by each stage that still has to process it, and released once the last
+ * one is done. What a stage hasn't processed yet is its queue, and when
+ * that grows beyond its limit (-P type,<MB>:...), the stage's policy
+ * decides what happens:
+ *
+ *	block	the receiver waits for the stage to catch up, and stops
+ *			reading from the server meanwhile, so no data is lost. This is
+ *			the default.
+ *	drop	the stage gives up on the current segment, and starts over
+ *			with the next one. The stream is never held up by it.
+ *
+ * Stages only ever work on whole segments, so after starting in the
+ * middle of one, or giving up on one, they wait for the next to start. A
+ * stage whose process dies is started again, and so is a dropping stage
+ * that has stopped making progress altogether and is holding up the ring.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+#define PIPELINE_MAX_STAGES		8
+#define PIPELINE_SLOTS			4096
+#define PIPELINE_DEFAULT_QUEUE	64		/* MB */
+#define PIPELINE_MIN_RING		(16 * 1024 * 1024)
+
+/* How long a dropping stage may hold up the ring before it's restarted */
+#define PIPELINE_STUCK_TIMEOUT	60
+
+typedef enum
+{
+	STAGE_COMPRESS,
+	STAGE_ENCRYPT,
+	STAGE_EXEC
+} StageType;
+
+static const char *stage_type_names[] = {"compress", "encrypt", "exec"};
+
+typedef enum
+{
+	POLICY_BLOCK,
+	POLICY_DROP
+} StagePolicy;
+
+/* A block of WAL in the ring */
+typedef struct PipelineChunk
+{
+	XLogRecPtr	start;
+	uint64		offset;			/* of the data, counting from the start of
+								 * the stream rather than of the ring */
+	uint32		len;			/* 0 marks the end of a segment */
+	volatile uint32 stages;		/* bitmask of the stages to get it, and not
+								 * done with it yet */
+	volatile int refcount;		/* stages not done with it yet */
+} PipelineChunk;
+
+/* Per stage state in shared memory */
+typedef struct StageShared
+{
+	volatile uint64 next;		/* next chunk to look at */
+	volatile uint64 queued;		/* bytes given to it not processed yet */
+	volatile int waiting;		/* asleep waiting for a chunk */
+	uint64		bytes;
+	uint64		segments;
+	uint64		dropped;
+	uint64		failed;
+} StageShared;
+
+typedef struct PipelineRing
+{
+	volatile uint64 head;		/* chunks published so far */
+	volatile int producer_waiting;	/* receiver waiting for room */
+	StageShared stage[PIPELINE_MAX_STAGES];
+	PipelineChunk chunks[PIPELINE_SLOTS];
+	char		data[1];		/* VARIABLE LENGTH ARRAY */
+} PipelineRing;
+
+typedef struct PipelineStage
+{
+	StageType	type;
+	StagePolicy policy;
+	uint64		queue_limit;
+	char	   *arg;
+
+	/* Kept by the receiver */
+	pid_t		pid;
+	int			notify[2];		/* pipe to wake the stage up through */
+	int			dropping;		/* gave up on the current segment */
+	uint64		restarts;
+
+	/* Kept by the stage process, for the segment it's working on */
+	char		segname[MAXFNAMELEN];
+	int			open;
+	int			fd;
+	gzFile		gz;
+	EncryptWriter *enc;
+	pid_t		cmdpid;
+	char		tmpfn[MAXPGPATH];
+} PipelineStage;
+
+/* How a stage finished with a segment */
+#define SEGMENT_DONE			0
+#define SEGMENT_DROPPED			1
+#define SEGMENT_FAILED			2
+
+static PipelineStage stages[PIPELINE_MAX_STAGES];
+static int	nstages = 0;
+
+static PipelineRing *ring = NULL;
+static uint64 ring_size;
+static int	wakeup[2];			/* pipe for stages to wake the receiver */
+
+/* Receiver side position in the ring */
+static uint64 tail = 0;			/* oldest chunk not released */
+static uint64 data_head = 0;
+static uint64 data_tail = 0;
+
+static uint64 wait_msec = 0;	/* time spent waiting for stages */
+
+
+/*
+ * Add a stage given on the command line as
+ *
+ *	<type>[,block|drop][,<queue MB>]:<argument>
+ */
+void
+pipeline_add_stage(const char *spec)
+{
+	PipelineStage *st;
+	const char *colon = strchr(spec, ':');
+	char		opts[64];
+	char	   *tok;
+	int			i;
+
+	if (nstages >= PIPELINE_MAX_STAGES)
+	{
+		fprintf(stderr, "Too many pipeline stages, at most %i are supported\n",
+				PIPELINE_MAX_STAGES);
+		exit(1);
+	}
+	if (!colon || colon == spec || colon[1] == '\0' ||
+		colon - spec >= sizeof(opts))
+	{
+		fprintf(stderr, "Invalid pipeline stage \"%s\", expected <type>:<argument>\n",
+				spec);
+		exit(1);
+	}
+
+	st = &stages[nstages];
+	memset(st, 0, sizeof(PipelineStage));
+	st->policy = POLICY_BLOCK;
+	st->queue_limit = (uint64) PIPELINE_DEFAULT_QUEUE * 1024 * 1024;
+	st->arg = strdup(colon + 1);
+	st->pid = -1;
+
+	memcpy(opts, spec, colon - spec);
+	opts[colon - spec] = '\0';
+	tok = strtok(opts, ",");
+	for (i = 0; i < lengthof(stage_type_names); i++)
+	{
+		if (strcmp(tok, stage_type_names[i]) == 0)
+			break;
+	}
+	if (i == lengthof(stage_type_names))
+	{
+		fprintf(stderr, "Unknown pipeline stage type \"%s\"\n", tok);
+		exit(1);
+	}
+	st->type = i;
+
+	while ((tok = strtok(NULL, ",")) != NULL)
+	{
+		if (strcmp(tok, "block") == 0)
+			st->policy = POLICY_BLOCK;
+		else if (strcmp(tok, "drop") == 0)
+			st->policy = POLICY_DROP;
+		else if (atoi(tok) > 0)
+			st->queue_limit = (uint64) atoi(tok) * 1024 * 1024;
+		else
+		{
+			fprintf(stderr, "Invalid option \"%s\" for pipeline stage %s\n",
+					tok, stage_type_names[st->type]);
+			exit(1);
+		}
+	}
+
+	if (nstages++ == 0)
+	{
+		StreamSink	sink;
+
+		memset(&sink, 0, sizeof(sink));
+		sink.data = pipeline_data;
+		sink.segment = pipeline_segment;
+		stream_add_sink(&sink);
+		metrics_register(pipeline_metrics);
+	}
+}
+
+/*
+ * Load what the stages need before streaming starts, so that problems
+ * with it are reported right away rather than when the first data
+ * arrives.
+ */
+void
+pipeline_prepare(void)
+{
+	int			i;
+
+	for (i = 0; i < nstages; i++)
+	{
+		if (stages[i].type == STAGE_ENCRYPT)
+			encryption_load_key();
+	}
+}
+
+
+/*
+ * Code run in the stage processes
+ */
+
+static void
+wake_producer(void)
+{
+	__sync_synchronize();
+	if (ring->producer_waiting)
+	{
+		ring->producer_waiting = 0;
+		if (write(wakeup[1], "x", 1) < 0)
+		{
+			/* Full already, so it's getting woken up anyway */
+		}
+	}
+}
+
+/*
+ * Run a segment command with a pipe to its stdin.
+ */
+static void
+start_command(PipelineStage *st)
+{
+	char		cmd[MAXPGPATH * 2];
+	char	   *d = cmd;
+	const char *s;
+	int			p[2];
+
+	for (s = st->arg; *s && d < cmd + sizeof(cmd) - MAXFNAMELEN - 1; s++)
+	{
+		if (s[0] == '%' && s[1] == 'f')
+		{
+			d += sprintf(d, "%s", st->segname);
+			s++;
+		}
+		else if (s[0] == '%' && s[1] == '%')
+		{
+			*d++ = '%';
+			s++;
+		}
+		else
+			*d++ = *s;
+	}
+	*d = '\0';
+
+	if (pipe(p) != 0)
+	{
+		fprintf(stderr, "Failed to create pipe: %m\n");
+		exit(1);
+	}
+	st->cmdpid = fork();
+	if (st->cmdpid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (st->cmdpid == 0)
+	{
+		dup2(p[0], 0);
+		close(p[0]);
+		close(p[1]);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+		fprintf(stderr, "Failed to run %s: %m\n", cmd);
+		_exit(127);
+	}
+	close(p[0]);
+	st->fd = p[1];
+}
+
+static void
+stage_segment_start(PipelineStage *st, XLogRecPtr start)
+{
+	char		segname[MAXFNAMELEN];
+
+	/* Formatted from a local copy, so it can't look like it overlaps st */
+	XLogFileName(segname, timeline, start.xlogid,
+				 start.xrecoff / XLogSegSize);
+	memcpy(st->segname, segname, sizeof(segname));
+
+	if (st->type == STAGE_COMPRESS)
+	{
+		char		mode[8];
+
+		snprintf(st->tmpfn, sizeof(st->tmpfn), "%s/%s.gz.tmp", st->arg,
+				 segname);
+		st->fd = open(st->tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (st->fd < 0)
+		{
+			fprintf(stderr, "Failed to create %s: %m\n", st->tmpfn);
+			ring->stage[st - stages].failed++;
+			return;
+		}
+		snprintf(mode, sizeof(mode), "wb%i", chunk_compress_level);
+		st->gz = gzdopen(dup(st->fd), mode);
+	}
+	else if (st->type == STAGE_ENCRYPT)
+	{
+		snprintf(st->tmpfn, sizeof(st->tmpfn), "%s/%s%s.tmp", st->arg,
+				 segname, ENCRYPTED_SUFFIX);
+		st->fd = open(st->tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (st->fd < 0)
+		{
+			fprintf(stderr, "Failed to create %s: %m\n", st->tmpfn);
+			ring->stage[st - stages].failed++;
+			return;
+		}
+		if (!st->enc && !(st->enc = malloc(sizeof(EncryptWriter))))
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (!encrypt_begin(st->enc, st->fd, st->segname))
+		{
+			fprintf(stderr, "Failed to write %s: %m\n", st->tmpfn);
+			close(st->fd);
+			unlink(st->tmpfn);
+			ring->stage[st - stages].failed++;
+			return;
+		}
+	}
+	else
+		start_command(st);
+	st->open = 1;
+}
+
+/*
+ * Finish the current segment. Unless it's done, or if anything goes
+ * wrong finishing it, whatever was written is thrown away.
+ */
+static void
+stage_segment_end(PipelineStage *st, int how)
+{
+	StageShared *sh = &ring->stage[st - stages];
+	int			ok = (how == SEGMENT_DONE);
+
+	if (!st->open)
+		return;
+	st->open = 0;
+
+	if (st->type == STAGE_COMPRESS || st->type == STAGE_ENCRYPT)
+	{
+		char		fn[MAXPGPATH];
+
+		if (st->type == STAGE_COMPRESS)
+		{
+			snprintf(fn, sizeof(fn), "%s/%s.gz", st->arg, st->segname);
+			if (gzclose(st->gz) != Z_OK)
+				ok = 0;
+		}
+		else
+		{
+			snprintf(fn, sizeof(fn), "%s/%s%s", st->arg, st->segname,
+					 ENCRYPTED_SUFFIX);
+			if (!encrypt_end(st->enc))
+				ok = 0;
+		}
+		if (ok && (fsync(st->fd) != 0 || rename(st->tmpfn, fn) != 0))
+		{
+			fprintf(stderr, "Failed to write %s: %m\n", fn);
+			ok = 0;
+		}
+		close(st->fd);
+		if (!ok)
+			unlink(st->tmpfn);
+	}
+	else
+	{
+		int			status;
+
+		if (!ok)
+			kill(st->cmdpid, SIGTERM);
+		close(st->fd);
+		while (waitpid(st->cmdpid, &status, 0) == -1 && errno == EINTR)
+			;
+		if (ok && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+		{
+			fprintf(stderr, "Pipeline command for %s failed\n", st->segname);
+			ok = 0;
+		}
+	}
+
+	if (ok)
+		sh->segments++;
+	else if (how == SEGMENT_DROPPED)
+		sh->dropped++;
+	else
+		sh->failed++;
+}
+
+static void
+stage_data(PipelineStage *st, const char *data, uint32 len)
+{
+	int			ok;
+
+	if (st->type == STAGE_COMPRESS)
+		ok = gzwrite(st->gz, data, len) == len;
+	else if (st->type == STAGE_ENCRYPT)
+		ok = encrypt_write(st->enc, data, len);
+	else
+	{
+		uint32		done = 0;
+
+		ok = 1;
+		while (done < len)
+		{
+			int			r = write(st->fd, data + done, len - done);
+
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+			{
+				ok = 0;
+				break;
+			}
+			done += r;
+		}
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Pipeline stage %s failed writing %s\n",
+				stage_type_names[st->type], st->segname);
+		stage_segment_end(st, SEGMENT_FAILED);
+	}
+}
+
+/*
+ * Let go of a chunk for the stage with the given bit. Clearing the bit
+ * and dropping the reference only if it was still set means that a stage
+ * that died between the two, and the receiver cleaning up after it, can't
+ * both drop it.
+ */
+static void
+release_chunk(PipelineChunk *chunk, uint32 bit)
+{
+	if (__sync_fetch_and_and(&chunk->stages, ~bit) & bit)
+		__sync_fetch_and_sub(&chunk->refcount, 1);
+}
+
+/*
+ * Main loop of a stage process: process each chunk meant for us, sleeping
+ * when there are none. Exits when the receiver does.
+ */
+static void
+stage_main(PipelineStage *st)
+{
+	StageShared *sh = &ring->stage[st - stages];
+	uint32		bit = 1 << (st - stages);
+	uint64		next = sh->next;
+	char		c;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	st->open = 0;
+
+	while (1)
+	{
+		PipelineChunk *chunk;
+
+		if (next == ring->head)
+		{
+			sh->waiting = 1;
+			__sync_synchronize();
+			if (next == ring->head)
+			{
+				int			r = read(st->notify[0], &c, 1);
+
+				if (r == 0)
+				{
+					/* The receiver has exited */
+					stage_segment_end(st, SEGMENT_DROPPED);
+					exit(0);
+				}
+			}
+			sh->waiting = 0;
+			continue;
+		}
+
+		chunk = &ring->chunks[next % PIPELINE_SLOTS];
+		if (!(chunk->stages & bit))
+		{
+			/* Dropped, give up on this segment */
+			stage_segment_end(st, SEGMENT_DROPPED);
+		}
+		else
+		{
+			if (chunk->len == 0)
+				stage_segment_end(st, SEGMENT_DONE);
+			else
+			{
+				if (chunk->start.xrecoff % XLogSegSize == 0)
+				{
+					stage_segment_end(st, SEGMENT_DROPPED);
+					stage_segment_start(st, chunk->start);
+				}
+				if (st->open)
+					stage_data(st, ring->data + chunk->offset % ring_size,
+							   chunk->len);
+				sh->bytes += chunk->len;
+			}
+			__sync_fetch_and_sub(&sh->queued, chunk->len);
+			release_chunk(chunk, bit);
+		}
+		sh->next = ++next;
+		wake_producer();
+	}
+}
+
+
+/*
+ * Code run in the receiver
+ */
+
+static void
+start_stage(int i)
+{
+	PipelineStage *st = &stages[i];
+	int			fd;
+
+	fflush(stdout);
+	fflush(stderr);
+	st->pid = fork();
+	if (st->pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (st->pid == 0)
+	{
+		/*
+		 * Keep nothing of the receiver's open, least of all the
+		 * replication connection, nor the write end of our own pipe, or
+		 * we'd never notice the receiver exiting.
+		 */
+		for (fd = 3; fd < 1024; fd++)
+		{
+			if (fd != st->notify[0] && fd != wakeup[1])
+				close(fd);
+		}
+		fcntl(st->notify[0], F_SETFD, FD_CLOEXEC);
+		fcntl(wakeup[1], F_SETFD, FD_CLOEXEC);
+		io_set_class(IO_CLASS_STAGE);
+		stage_main(st);
+	}
+}
+
+/*
+ * Set up the ring and start the stages. Done when the first data arrives,
+ * so they know the timeline.
+ */
+static void
+pipeline_start(void)
+{
+	uint64		maxqueue = 0;
+	int			i;
+
+	for (i = 0; i < nstages; i++)
+		maxqueue = Max(maxqueue, stages[i].queue_limit);
+	ring_size = Max(maxqueue * 2, PIPELINE_MIN_RING);
+
+	ring = mmap(NULL, offsetof(PipelineRing, data) + ring_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	memset(ring, 0, offsetof(PipelineRing, data));
+
+	if (pipe(wakeup) != 0 ||
+		fcntl(wakeup[0], F_SETFL, O_NONBLOCK) != 0 ||
+		fcntl(wakeup[1], F_SETFL, O_NONBLOCK) != 0)
+	{
+		fprintf(stderr, "Failed to create pipe: %m\n");
+		exit(1);
+	}
+	for (i = 0; i < nstages; i++)
+	{
+		if (pipe(stages[i].notify) != 0 ||
+			fcntl(stages[i].notify[1], F_SETFL, O_NONBLOCK) != 0)
+		{
+			fprintf(stderr, "Failed to create pipe: %m\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nstages; i++)
+		start_stage(i);
+}
+
+/*
+ * Release the chunks all stages are done with.
+ */
+static void
+release_chunks(void)
+{
+	while (tail < ring->head && ring->chunks[tail % PIPELINE_SLOTS].refcount == 0)
+	{
+		PipelineChunk *chunk = &ring->chunks[tail % PIPELINE_SLOTS];
+
+		data_tail = chunk->offset + chunk->len;
+		tail++;
+	}
+	if (tail == ring->head)
+		data_tail = data_head;
+}
+
+/*
+ * Where the data of a chunk of len bytes would go, keeping it contiguous.
+ */
+static uint64
+chunk_offset(uint32 len)
+{
+	if (data_head % ring_size + len > ring_size)
+		return data_head + (ring_size - data_head % ring_size);
+	return data_head;
+}
+
+/*
+ * Restart a stage, after it's died or been killed. The chunks it hadn't
+ * got to yet are released, and it starts over at the head of the ring.
+ */
+static void
+restart_stage(int i)
+{
+	PipelineStage *st = &stages[i];
+	StageShared *sh = &ring->stage[i];
+	uint32		bit = 1 << i;
+	uint64		c;
+
+	for (c = sh->next; c < ring->head; c++)
+	{
+		PipelineChunk *chunk = &ring->chunks[c % PIPELINE_SLOTS];
+
+		release_chunk(chunk, bit);
+	}
+	sh->next = ring->head;
+	sh->queued = 0;
+	sh->waiting = 0;
+	st->restarts++;
+	start_stage(i);
+}
+
+/*
+ * Check on the stage processes. Those that have died are started again.
+ * If stuck is set, the ring has been held up for too long, and a dropping
+ * stage holding on to the oldest chunk in it is restarted too.
+ */
+static void
+check_stages(int stuck)
+{
+	PipelineChunk *oldest = NULL;
+	int			i;
+
+	if (stuck && tail < ring->head)
+		oldest = &ring->chunks[tail % PIPELINE_SLOTS];
+
+	for (i = 0; i < nstages; i++)
+	{
+		PipelineStage *st = &stages[i];
+
+		if (waitpid(st->pid, NULL, WNOHANG) == st->pid)
+		{
+			fprintf(stderr, "Pipeline stage %s exited, restarting it\n",
+					stage_type_names[st->type]);
+			restart_stage(i);
+		}
+		else if (oldest && (oldest->stages & (1 << i)) &&
+				 ring->stage[i].next <= tail && st->policy == POLICY_DROP)
+		{
+			fprintf(stderr, "Pipeline stage %s is not making progress, restarting it\n",
+					stage_type_names[st->type]);
+			kill(st->pid, SIGKILL);
+			while (waitpid(st->pid, NULL, 0) == -1 && errno == EINTR)
+				;
+			restart_stage(i);
+		}
+	}
+}
+
+/*
+ * Can a chunk of len bytes for the stages in mask be added to the ring?
+ */
+static int
+have_room(uint32 len, uint32 mask)
+{
+	int			i;
+
+	release_chunks();
+	if (ring->head - tail >= PIPELINE_SLOTS ||
+		chunk_offset(len) + len - data_tail > ring_size)
+		return 0;
+	for (i = 0; i < nstages; i++)
+	{
+		if ((mask & (1 << i)) && stages[i].policy == POLICY_BLOCK &&
+			ring->stage[i].queued > 0 &&
+			ring->stage[i].queued + len > stages[i].queue_limit)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Add a chunk to the ring for the stages to process, waiting for room if
+ * need be. A len of 0 marks the end of a segment.
+ */
+static void
+publish(XLogRecPtr start, const char *data, uint32 len)
+{
+	PipelineChunk *chunk;
+	uint32		mask = 0;
+	uint64		waiting_since = 0;
+	int			warned = 0;
+	int			stuck;
+	int			i;
+
+	if (!ring)
+		pipeline_start();
+
+	/* A new segment is a fresh start for the stages that gave up */
+	if (len > 0 && start.xrecoff % XLogSegSize == 0)
+	{
+		for (i = 0; i < nstages; i++)
+			stages[i].dropping = 0;
+	}
+	for (i = 0; i < nstages; i++)
+	{
+		if (stages[i].policy == POLICY_DROP &&
+			ring->stage[i].queued + len > stages[i].queue_limit)
+			stages[i].dropping = 1;
+		if (!stages[i].dropping)
+			mask |= 1 << i;
+	}
+
+	while (!have_room(len, mask))
+	{
+		struct pollfd pfd;
+		char		buf[64];
+
+		if (waiting_since == 0)
+			waiting_since = now_msec();
+		ring->producer_waiting = 1;
+		__sync_synchronize();
+		if (have_room(len, mask))
+			break;
+
+		pfd.fd = wakeup[0];
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 1000);
+		while (read(wakeup[0], buf, sizeof(buf)) > 0)
+			;
+		ring->producer_waiting = 0;
+
+		stuck = now_msec() - waiting_since > PIPELINE_STUCK_TIMEOUT * 1000;
+		check_stages(stuck);
+		if (stuck && !warned)
+		{
+			fprintf(stderr, "Still waiting for pipeline stages to catch up\n");
+			warned = 1;
+		}
+	}
+	if (waiting_since)
+		wait_msec += now_msec() - waiting_since;
+
+	data_head = chunk_offset(len);
+	chunk = &ring->chunks[ring->head % PIPELINE_SLOTS];
+	chunk->start = start;
+	chunk->offset = data_head;
+	chunk->len = len;
+	chunk->stages = mask;
+	chunk->refcount = 0;
+	if (len > 0)
+		memcpy(ring->data + data_head % ring_size, data, len);
+	data_head += len;
+	for (i = 0; i < nstages; i++)
+	{
+		if (mask & (1 << i))
+		{
+			chunk->refcount++;
+			__sync_fetch_and_add(&ring->stage[i].queued, len);
+		}
+	}
+	__sync_synchronize();
+	ring->head++;
+	__sync_synchronize();
+
+	for (i = 0; i < nstages; i++)
+	{
+		if (ring->stage[i].waiting)
+		{
+			ring->stage[i].waiting = 0;
+			if (write(stages[i].notify[1], "x", 1) < 0)
+			{
+				/* Full already, so it's getting woken up anyway */
+			}
+		}
+	}
+}
+
+void
+pipeline_data(void *arg, XLogRecPtr start, const char *data, uint32 len)
+{
+	publish(start, data, len);
+}
+
+void
+pipeline_segment(void *arg, const char *segname)
+{
+	XLogRecPtr	none = {0, 0};
+
+	if (ring)
+	{
+		publish(none, NULL, 0);
+		check_stages(0);
+	}
+}
+
+void
+pipeline_metrics(FILE *f)
+{
+	static const char *names[] = {"bytes", "segments", "dropped_segments",
+	"failed_segments", "restarts"};
+	int			m;
+	int			i;
+
+	for (m = 0; m < lengthof(names); m++)
+	{
+		fprintf(f, "# TYPE pg_streamrecv_pipeline_%s_total counter\n", names[m]);
+		for (i = 0; i < nstages; i++)
+		{
+			StageShared *sh = ring ? &ring->stage[i] : NULL;
+			uint64		v = 0;
+
+			if (m == 4)
+				v = stages[i].restarts;
+			else if (sh)
+				v = m == 0 ? sh->bytes : m == 1 ? sh->segments :
+					m == 2 ? sh->dropped : sh->failed;
+			fprintf(f, "pg_streamrecv_pipeline_%s_total{stage=\"%i\",type=\"%s\"} " UINT64_FORMAT "\n",
+					names[m], i + 1, stage_type_names[stages[i].type], v);
+		}
+	}
+	fprintf(f, "# TYPE pg_streamrecv_pipeline_wait_seconds_total counter\n");
+	fprintf(f, "pg_streamrecv_pipeline_wait_seconds_total %.3f\n",
+			wait_msec / 1000.0);
+}
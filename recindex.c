@@ -0,0 +1,392 @@
+/*
+ * recindex.c - per-segment index of where records start
+ *
+ * To start decoding WAL at an arbitrary location, a reader has to find a
+ * record boundary at or before it, which normally means decoding from the
+ * start of the segment. While streaming, we already know where every
+ * record starts, so for each segment we keep the offset of the first
+ * record starting in every recindex_stride bytes, plus the first and last
+ * record starting in the segment, and write them to a small file in the
+ * recindex directory once the segment has no more records starting in it.
+ *
+ * Readers binary search the offsets for the closest record start at or
+ * before where they want to go. xlogread_archive() does that and feeds
+ * the archive from there to a WAL decoder.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+/* Bytes between samples, 0 to disable the record index */
+int			recindex_stride = 64 * 1024;
+
+/* The segment currently being indexed */
+static int	have_segment = 0;
+static uint32 cur_log;
+static uint32 cur_seg;
+static TimeLineID cur_tli;
+static RecIndexHeader cur_hdr;
+static uint32 *cur_offsets = NULL;
+static uint32 next_sample;
+
+/*
+ * Where streaming started. Records starting before that belong to a
+ * segment that was indexed by an earlier run.
+ */
+static XLogRecPtr start_at;
+
+
+/*
+ * Write out the index for the current segment.
+ */
+static void
+recindex_write(void)
+{
+	char		segname[MAXFNAMELEN];
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	int			f;
+
+	XLogFileName(segname, cur_tli, cur_log, cur_seg);
+	snprintf(fn, sizeof(fn), "%s/%s/%s", basedir, RECINDEX_DIR, segname);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create record index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (write(f, &cur_hdr, sizeof(cur_hdr)) != sizeof(cur_hdr) ||
+		write(f, cur_offsets, cur_hdr.count * sizeof(uint32)) !=
+		cur_hdr.count * sizeof(uint32))
+	{
+		fprintf(stderr, "Failed to write record index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (fsync(f) != 0)
+	{
+		fprintf(stderr, "Failed to fsync record index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (close(f) != 0)
+	{
+		fprintf(stderr, "Failed to close record index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (rename(tmpfn, fn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, fn);
+		exit(1);
+	}
+	if (verbose > 1)
+		printf("Wrote record index for %s, %u entries\n", segname, cur_hdr.count);
+}
+
+/*
+ * Records are reported once they're complete, which for a record crossing
+ * into the next segment is after that segment has been started. So the
+ * index for a segment is written when the first record starting in a later
+ * segment shows up, rather than when the segment file is completed.
+ */
+static void
+recindex_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	uint32		log,
+				seg,
+				offset;
+
+	if (XLByteLT(dec->recstart, start_at))
+		return;
+
+	XLByteToSeg(dec->recstart, log, seg);
+	offset = dec->recstart.xrecoff % XLogSegSize;
+
+	if (!have_segment || log != cur_log || seg != cur_seg)
+	{
+		if (have_segment)
+			recindex_write();
+
+		have_segment = 1;
+		cur_log = log;
+		cur_seg = seg;
+		cur_tli = dec->tli;
+		memset(&cur_hdr, 0, sizeof(cur_hdr));
+		cur_hdr.magic = RECINDEX_MAGIC;
+		cur_hdr.version = RECINDEX_VERSION;
+		cur_hdr.stride = recindex_stride;
+		cur_hdr.firstrec = dec->recstart;
+		next_sample = 0;
+	}
+
+	if (offset >= next_sample)
+	{
+		cur_offsets[cur_hdr.count++] = offset;
+		next_sample = (offset / recindex_stride + 1) * recindex_stride;
+	}
+	cur_hdr.lastrec = dec->recstart;
+}
+
+void
+recindex_init(XLogDecoder *dec, XLogRecPtr startpoint)
+{
+	char		dir[MAXPGPATH];
+	struct stat st;
+
+	snprintf(dir, sizeof(dir), "%s/%s", basedir, RECINDEX_DIR);
+	if (stat(dir, &st) != 0 && mkdir(dir, 0777) != 0)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", dir);
+		exit(1);
+	}
+
+	/* Allocate room for every sample up front */
+	cur_offsets = malloc((XLogSegSize / recindex_stride + 1) * sizeof(uint32));
+	if (!cur_offsets)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	start_at = startpoint;
+	xlogdecode_add_consumer(dec, recindex_record, NULL);
+}
+
+/*
+ * Find the closest record start at or before offset in the given segment,
+ * using the record index. Returns 0 if there's no index for the segment,
+ * or no record starts before offset, in which case the caller has to
+ * decode from the start of the segment.
+ */
+int
+recindex_seek(const char *dir, const char *segname, uint32 offset,
+			  uint32 *recoffset)
+{
+	RecIndexHeader hdr;
+	uint32	   *offsets;
+	char		fn[MAXPGPATH];
+	int			f;
+	int			low,
+				high,
+				found = -1;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, RECINDEX_DIR, segname);
+	f = open(fn, O_RDONLY);
+	if (f == -1)
+		return 0;
+	if (read(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		hdr.magic != RECINDEX_MAGIC || hdr.version != RECINDEX_VERSION ||
+		hdr.count == 0 || hdr.count > XLogSegSize / sizeof(uint32))
+	{
+		close(f);
+		return 0;
+	}
+
+	offsets = malloc(hdr.count * sizeof(uint32));
+	if (!offsets)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (read(f, offsets, hdr.count * sizeof(uint32)) !=
+		hdr.count * sizeof(uint32))
+	{
+		free(offsets);
+		close(f);
+		return 0;
+	}
+	close(f);
+
+	low = 0;
+	high = hdr.count - 1;
+	while (low <= high)
+	{
+		int			mid = low + (high - low) / 2;
+
+		if (offsets[mid] <= offset)
+		{
+			found = mid;
+			low = mid + 1;
+		}
+		else
+			high = mid - 1;
+	}
+	if (found >= 0)
+		*recoffset = offsets[found];
+	free(offsets);
+	return found >= 0;
+}
+
+/*
+ * Feed the archive to a decoder, starting at the closest known record
+ * boundary at or before the location from, and going on through the
+ * following segments for as long as they're in the archive or until
+ * the decoder is stopped. Consumers will see records from before from,
+ * and have to skip them if they're not interested.
+ *
+ * Returns 0 if the segment holding from isn't in the archive.
+ */
+int
+xlogread_archive(const char *dir, TimeLineID tli, XLogRecPtr from,
+				 XLogDecoder *dec)
+{
+	char		segname[MAXFNAMELEN];
+	char	   *buf;
+	uint32		log,
+				seg,
+				len,
+				recoff;
+	XLogRecPtr	ptr;
+
+	buf = malloc(XLogSegSize);
+	if (!buf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	XLByteToSeg(from, log, seg);
+	XLogFileName(segname, tli, log, seg);
+	if (!load_archive_segment(dir, segname, buf, &len))
+	{
+		free(buf);
+		return 0;
+	}
+
+	ptr.xlogid = log;
+	ptr.xrecoff = seg * XLogSegSize;
+	if (recindex_seek(dir, segname, from.xrecoff % XLogSegSize, &recoff) &&
+		recoff < len)
+	{
+		ptr.xrecoff += recoff;
+		xlogdecode_start_at_record(dec, ptr);
+		xlogdecode_feed(dec, ptr, buf + recoff, len - recoff);
+	}
+	else
+		xlogdecode_feed(dec, ptr, buf, len);
+
+	while (!dec->stop && len == XLogSegSize)
+	{
+		NextLogSeg(log, seg);
+		XLogFileName(segname, tli, log, seg);
+		if (!load_archive_segment(dir, segname, buf, &len))
+			break;
+		ptr.xlogid = log;
+		ptr.xrecoff = seg * XLogSegSize;
+		xlogdecode_feed(dec, ptr, buf, len);
+	}
+
+	free(buf);
+	return 1;
+}
+
+
+/*
+ * "pg_streamrecv records" - list the records in the archive, starting
+ * at a given location.
+ */
+typedef struct RecordsState
+{
+	XLogRecPtr	from;
+	int			count;
+} RecordsState;
+
+static void
+print_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	RecordsState *state = arg;
+
+	if (XLByteLT(dec->recstart, state->from))
+		return;
+
+	printf("%X/%08X %-11s info %02X len %u tot_len %u xid %u\n",
+		   dec->recstart.xlogid, dec->recstart.xrecoff,
+		   rmgr_names[record->xl_rmid], record->xl_info,
+		   record->xl_len, record->xl_tot_len, record->xl_xid);
+
+	if (state->count > 0 && --state->count == 0)
+		dec->stop = 1;
+}
+
+static void
+records_usage(void)
+{
+	printf("Usage: pg_streamrecv records -d <directory> [-T <timeline>] [-n <count>] <location>\n");
+	exit(1);
+}
+
+int
+records_main(int argc, char *argv[])
+{
+	XLogDecoder dec;
+	RecordsState state;
+	TimeLineID	tli = 0;
+	int			c;
+
+	memset(&state, 0, sizeof(state));
+	while ((c = getopt(argc, argv, "d:n:T:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'n':
+				state.count = atoi(optarg);
+				break;
+			case 'T':
+				tli = atoi(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				records_usage();
+		}
+	}
+	if (!basedir || optind != argc - 1)
+		records_usage();
+	if (sscanf(argv[optind], "%X/%X", &state.from.xlogid,
+			   &state.from.xrecoff) != 2)
+	{
+		fprintf(stderr, "Invalid WAL location: %s\n", argv[optind]);
+		exit(1);
+	}
+
+	/* Get the timeline from the archive index, unless given */
+	if (tli == 0)
+	{
+		ArchiveIndex *idx = archive_index_open(basedir);
+		ArchiveIndexEntry *entry;
+
+		if (idx && (entry = archive_index_lookup(idx, state.from)) != NULL)
+			tli = entry->tli;
+		else
+			tli = 1;
+		if (idx)
+			archive_index_close(idx);
+	}
+
+	xlogdecode_init(&dec);
+	xlogdecode_add_consumer(&dec, print_record, &state);
+	if (!xlogread_archive(basedir, tli, state.from, &dec))
+	{
+		fprintf(stderr, "Location %s is not in the archive\n", argv[optind]);
+		exit(1);
+	}
+	return 0;
+}
@@ -0,0 +1,532 @@
+/*
+ * recompress.c - compressing archived segments harder as they age
+ *
+ * Segments are stored uncompressed when they're received, which is the
+ * cheapest to write and the fastest to restore, and the recent ones are
+ * the ones most likely to be restored. As they get older, they're
+ * rewritten gzip compressed at levels given as tiers of
+ *
+ *	<hours>:<level>[,<hours>:<level>...]
+ *
+ * so "1:1,48:9" compresses segments at level 1 once they're an hour old,
+ * and again at level 9 once they're two days old.
+ *
+ * What each segment is stored as is kept in the archive index, so a pass
+ * only has to look at the segments not already at the last tier, and
+ * only stats those to find their age. Segments stored in other forms
+ * (stripped, deduplicated, chunked or encrypted) are left alone, and
+ * marked as such in the index the first time they're seen.
+ *
+ * A segment is written compressed to a temporary file, read back and
+ * compared with the original, given the original's modification time so
+ * that its age stays the same, and renamed into place as <segment>.gz
+ * before its entry in the index is updated and any uncompressed copy is
+ * removed. Readers always find a complete copy of the segment.
+ *
+ * The receiver runs a pass in a child process each time a segment is
+ * completed, unless the previous one is still going. The pass runs in
+ * the idle I/O class (see iosched.c), so it only uses what the receiver
+ * leaves over, and within background_io_rate_kb. "pg_streamrecv recompress"
+ * runs one from the command line.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+#define MAX_TIERS				8
+
+char	   *recompress_tiers = NULL;
+
+typedef struct Tier
+{
+	int			age;			/* seconds */
+	int			level;
+} Tier;
+
+static Tier tiers[MAX_TIERS];
+static int	ntiers = 0;
+static char *parsed_tiers = NULL;	/* what tiers was parsed from */
+
+/* Counters in shared memory, since the passes run in child processes */
+typedef struct RecompressStats
+{
+	uint64		segments;
+	uint64		bytes_before;
+	uint64		bytes_after;
+} RecompressStats;
+
+static RecompressStats local_stats;
+static RecompressStats *stats = &local_stats;
+
+static pid_t recompress_pid = -1;
+
+
+/*
+ * Parse the tiers. Returns 0 if they're invalid, after complaining.
+ */
+static int
+parse_tiers(const char *spec)
+{
+	const char *p = spec;
+
+	ntiers = 0;
+	while (*p)
+	{
+		int			hours,
+					level,
+					n;
+
+		if (ntiers == MAX_TIERS ||
+			sscanf(p, "%d:%d%n", &hours, &level, &n) != 2 ||
+			hours < 0 || hours > INT_MAX / 3600 || level < 1 || level > 9 ||
+			(ntiers > 0 && (hours * 3600 <= tiers[ntiers - 1].age ||
+							level <= tiers[ntiers - 1].level)))
+		{
+			fprintf(stderr, "Invalid recompression tiers \"%s\", expected up to %i of <hours>:<level> with both increasing\n",
+					spec, MAX_TIERS);
+			ntiers = 0;
+			return 0;
+		}
+		tiers[ntiers].age = hours * 3600;
+		tiers[ntiers].level = level;
+		ntiers++;
+		p += n;
+		if (*p == ',')
+			p++;
+	}
+	return ntiers > 0;
+}
+
+/*
+ * Make sure the tiers in use are the ones in recompress_tiers, which can
+ * be changed by a reload.
+ */
+static int
+load_tiers(void)
+{
+	if (!recompress_tiers)
+		return 0;
+	if (parsed_tiers && strcmp(parsed_tiers, recompress_tiers) == 0)
+		return ntiers > 0;
+	free(parsed_tiers);
+	parsed_tiers = strdup(recompress_tiers);
+	return parse_tiers(recompress_tiers);
+}
+
+static int
+read_segment(const char *path, int how, char *buf)
+{
+	uint32		len = 0;
+	int			r;
+
+	if (how == ARCHIVE_FILE_GZIP)
+	{
+		gzFile		gz = gzopen(path, "rb");
+
+		if (!gz)
+			return 0;
+		while (len < XLogSegSize &&
+			   (r = gzread(gz, buf + len, XLogSegSize - len)) > 0)
+			len += r;
+		gzclose(gz);
+	}
+	else
+	{
+		int			f = open(path, O_RDONLY);
+
+		if (f == -1)
+			return 0;
+		while (len < XLogSegSize &&
+			   (r = read(f, buf + len, XLogSegSize - len)) > 0)
+			len += r;
+		close(f);
+	}
+	return len == XLogSegSize;
+}
+
+/*
+ * Guess the level a gzip file was written at, for segments compressed
+ * before the index recorded it. The XFL byte in the header only tells
+ * the best (9) and the fastest (1) compression apart. Returns 0 if it
+ * can't be told.
+ */
+static int
+gzip_level(const char *path)
+{
+	unsigned char hdr[10];
+	int			f = open(path, O_RDONLY);
+	int			r;
+
+	if (f == -1)
+		return 0;
+	r = read(f, hdr, sizeof(hdr));
+	close(f);
+	if (r != sizeof(hdr) || hdr[0] != 0x1f || hdr[1] != 0x8b)
+		return 0;
+	return hdr[8] == 2 ? 9 : hdr[8] == 4 ? 1 : 0;
+}
+
+/*
+ * Rewrite a segment compressed at the given level. Returns 0 if it
+ * wasn't, leaving the segment as it was.
+ */
+static int
+recompress_segment(const char *dir, ArchiveIndexEntry *entry, int how,
+				   const char *path, const struct stat *oldst, int level,
+				   char *buf, char *check)
+{
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	char		mode[8];
+	struct timeval times[2];
+	struct stat st;
+	gzFile		gz;
+	int			f;
+	int			ok;
+
+	if (!read_segment(path, how, buf))
+	{
+		fprintf(stderr, "Failed to read segment %s\n", path);
+		return 0;
+	}
+	io_throttle(oldst->st_size);
+
+	snprintf(fn, sizeof(fn), "%s/%s.gz", dir, entry->path);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmpfn);
+		return 0;
+	}
+	snprintf(mode, sizeof(mode), "wb%i", level);
+	gz = gzdopen(dup(f), mode);
+	ok = gz != NULL &&
+		gzwrite(gz, buf, XLogSegSize) == XLogSegSize;
+	if (gz && gzclose(gz) != Z_OK)
+		ok = 0;
+	if (!ok || fsync(f) != 0 || fstat(f, &st) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", tmpfn);
+		close(f);
+		unlink(tmpfn);
+		return 0;
+	}
+	close(f);
+	io_throttle(st.st_size);
+
+	if (!read_segment(tmpfn, ARCHIVE_FILE_GZIP, check) ||
+		memcmp(buf, check, XLogSegSize) != 0)
+	{
+		fprintf(stderr, "Compressed %s does not match the original\n",
+				entry->path);
+		unlink(tmpfn);
+		return 0;
+	}
+	io_throttle(st.st_size);
+
+	/* Keep the age of the segment */
+	times[0].tv_sec = oldst->st_atime;
+	times[0].tv_usec = 0;
+	times[1].tv_sec = oldst->st_mtime;
+	times[1].tv_usec = 0;
+	if (utimes(tmpfn, times) != 0)
+		fprintf(stderr, "Failed to set modification time of %s: %m\n", tmpfn);
+
+	/* Removed from the archive meanwhile? */
+	if (access(path, F_OK) != 0 || rename(tmpfn, fn) != 0)
+	{
+		unlink(tmpfn);
+		return 0;
+	}
+
+	/* The rename has to be on disk before the original can go */
+	if (fsync_dir(dir) != 0)
+	{
+		fprintf(stderr, "Failed to fsync directory %s: %m\n", dir);
+		return 0;
+	}
+
+	entry->size = st.st_size;
+	entry->compression = ARCHIVE_COMPRESSION_GZIP;
+	entry->level = level;
+	if (!archive_index_update(dir, entry) ||
+		(how == ARCHIVE_FILE_PLAIN && unlink(path) != 0 && errno == ENOENT))
+	{
+		/* Retention got to it first */
+		unlink(fn);
+		return 0;
+	}
+
+	__sync_fetch_and_add(&stats->segments, 1);
+	__sync_fetch_and_add(&stats->bytes_before, oldst->st_size);
+	__sync_fetch_and_add(&stats->bytes_after, st.st_size);
+	if (verbose > 1)
+		printf("Compressed %s at level %i, %lu to %lu bytes\n", entry->path,
+			   level, (unsigned long) oldst->st_size, (unsigned long) st.st_size);
+	return 1;
+}
+
+/*
+ * Run a pass over the archive with the current tiers.
+ */
+static int
+recompress_pass(const char *dir, int dryrun)
+{
+	ArchiveIndex *idx;
+	char	   *buf = NULL;
+	char	   *check = NULL;
+	time_t		now = time(NULL);
+	int			last = tiers[ntiers - 1].level;
+	int			n = 0;
+	int			i;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		fprintf(stderr, "No valid archive index in %s, not compressing anything\n",
+				dir);
+		return -1;
+	}
+
+	for (i = 0; i < idx->nentries; i++)
+	{
+		ArchiveIndexEntry entry = idx->entries[i];
+		char		path[MAXPGPATH];
+		struct stat st;
+		int			how;
+		int			level = 0;
+		int			t;
+
+		if (entry.compression == ARCHIVE_COMPRESSION_OTHER ||
+			entry.compression == ARCHIVE_COMPRESSION_PACKED ||
+			(entry.compression == ARCHIVE_COMPRESSION_GZIP && entry.level >= last))
+			continue;
+
+		how = locate_archive_file(dir, entry.path, path, sizeof(path));
+		if (how == ARCHIVE_FILE_NOTFOUND || how == ARCHIVE_FILE_PARTIAL)
+			continue;
+		if ((how != ARCHIVE_FILE_PLAIN && how != ARCHIVE_FILE_GZIP) ||
+			(how == ARCHIVE_FILE_GZIP && strcmp(path + strlen(path) - 3, ".gz") != 0))
+		{
+			/* Stored some other way, so don't look at it again */
+			entry.compression = how == ARCHIVE_FILE_PACKED ?
+				ARCHIVE_COMPRESSION_PACKED : ARCHIVE_COMPRESSION_OTHER;
+			if (!dryrun)
+				archive_index_update(dir, &entry);
+			continue;
+		}
+		if (stat(path, &st) != 0)
+			continue;
+		if (how == ARCHIVE_FILE_GZIP && entry.level == 0)
+		{
+			entry.compression = ARCHIVE_COMPRESSION_GZIP;
+			entry.level = gzip_level(path);
+			if (entry.level > 0 && !dryrun)
+				archive_index_update(dir, &entry);
+		}
+
+		for (t = 0; t < ntiers; t++)
+		{
+			if (now - st.st_mtime >= tiers[t].age)
+				level = tiers[t].level;
+		}
+		if (level == 0 || (how == ARCHIVE_FILE_GZIP && entry.level >= level))
+			continue;
+
+		if (dryrun)
+		{
+			printf("%s %i\n", entry.path, level);
+			continue;
+		}
+		if (!buf)
+		{
+			buf = malloc(XLogSegSize);
+			check = malloc(XLogSegSize);
+			if (!buf || !check)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		if (recompress_segment(dir, &entry, how, path, &st, level, buf, check))
+			n++;
+	}
+
+	if (n > 0 && verbose)
+		printf("Compressed %i segments in %s\n", n, dir);
+
+	free(buf);
+	free(check);
+	archive_index_close(idx);
+	return n;
+}
+
+/*
+ * Run a recompression pass over the archive. With dryrun, only list what
+ * would be compressed at which level. Returns the number of segments
+ * compressed, or -1 if the tiers are invalid.
+ */
+int
+recompress_run(const char *dir, int dryrun)
+{
+	if (!load_tiers())
+		return -1;
+	return recompress_pass(dir, dryrun);
+}
+
+/*
+ * Compress all segments at the given level now, whatever their age, for
+ * when the disk is filling up. Only meant for a process of its own, since
+ * the tiers are left changed.
+ */
+int
+recompress_all(const char *dir, int level)
+{
+	free(parsed_tiers);
+	parsed_tiers = NULL;
+	tiers[0].age = 0;
+	tiers[0].level = level;
+	ntiers = 1;
+	return recompress_pass(dir, 0);
+}
+
+/*
+ * Start a pass in the background each time a segment is completed.
+ */
+static void
+recompress_segment_done(void *arg, const char *segname)
+{
+	int			status;
+
+	if (recompress_pid != -1)
+	{
+		if (waitpid(recompress_pid, &status, WNOHANG) == 0)
+			return;
+		recompress_pid = -1;
+	}
+	if (!load_tiers())
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	recompress_pid = fork();
+	if (recompress_pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (recompress_pid == 0)
+	{
+		io_set_class(IO_CLASS_IDLE);
+		recompress_run(basedir, 0);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+static void
+recompress_metrics(FILE *f)
+{
+	fprintf(f, "# TYPE pg_streamrecv_recompressed_segments_total counter\n");
+	fprintf(f, "pg_streamrecv_recompressed_segments_total " UINT64_FORMAT "\n",
+			stats->segments);
+	fprintf(f, "# TYPE pg_streamrecv_recompressed_bytes_before_total counter\n");
+	fprintf(f, "pg_streamrecv_recompressed_bytes_before_total " UINT64_FORMAT "\n",
+			stats->bytes_before);
+	fprintf(f, "# TYPE pg_streamrecv_recompressed_bytes_after_total counter\n");
+	fprintf(f, "pg_streamrecv_recompressed_bytes_after_total " UINT64_FORMAT "\n",
+			stats->bytes_after);
+}
+
+/*
+ * Hook recompression into the receiver. The tiers can be set by a
+ * reload, so this is always done.
+ */
+void
+recompress_init(void)
+{
+	StreamSink	sink;
+	void	   *p;
+
+	if (recompress_tiers && !load_tiers())
+		exit(1);
+
+	p = mmap(NULL, sizeof(RecompressStats), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	stats = p;
+	memset(stats, 0, sizeof(RecompressStats));
+
+	memset(&sink, 0, sizeof(sink));
+	sink.segment = recompress_segment_done;
+	stream_add_sink(&sink);
+	metrics_register(recompress_metrics);
+}
+
+
+static void
+recompress_usage(void)
+{
+	printf("Usage: pg_streamrecv recompress -d <directory> -t <hours>:<level>[,...] [-n] [-v]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv recompress" - compress aging segments in the archive.
+ */
+int
+recompress_main(int argc, char *argv[])
+{
+	int			dryrun = 0;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:nt:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'n':
+				dryrun = 1;
+				break;
+			case 't':
+				recompress_tiers = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				recompress_usage();
+		}
+	}
+	if (!basedir || !recompress_tiers || optind != argc)
+		recompress_usage();
+
+	return recompress_run(basedir, dryrun) < 0 ? 1 : 0;
+}
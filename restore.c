@@ -0,0 +1,965 @@
+/*
+ * restore.c - restore_command helper serving segments from the archive
+ *
+ * "pg_streamrecv restore" is meant to be used as restore_command:
+ *
+ *	restore_command = 'pg_streamrecv restore -d /archive %f %p'
+ *
+ * It finds the requested file in the archive directory, expanding it if
+ * it has been compressed, and falls back to the partial segment in the
+ * inprogress directory for the very latest WAL.
+ *
+ * Since recovery asks for one segment at a time, waiting for each one,
+ * the time it takes to get a segment in place is what limits the speed of
+ * recovery. With -n, a helper daemon is started that stays around between
+ * calls, and prepares the next few segments in a cache directory with a
+ * number of worker processes while recovery is busy replaying. Each call
+ * then only has to ask the daemon for the segment and move it into place.
+ *
+ * A standby fed from the archive asks for the next segment before it
+ * exists, and the server then retries after a few seconds. With -w, we
+ * instead wait up to that many seconds for the segment to show up,
+ * subscribing to the notifications of the receiver so we try again the
+ * moment it has written anything, rather than polling.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+#define RESTORE_SOCKET_NAME		".s.pg_streamrecv_restore"
+#define RESTORE_IDLE_TIMEOUT	60		/* seconds before the daemon exits */
+#define RESTORE_MAX_CLIENTS		16
+#define COPY_BUF_SIZE			(1024 * 1024)
+
+/* Options */
+static int	prefetch_count = 0;
+static int	prefetch_workers = 4;
+static char *cachedir = NULL;
+static int	wait_secs = 0;
+
+/* State of a segment known to the daemon */
+#define SEG_RUNNING		1
+#define SEG_READY		2
+#define SEG_MISSING		3
+
+typedef struct CachedSegment
+{
+	char		name[MAXFNAMELEN];
+	int			state;
+	pid_t		pid;			/* worker fetching it, if running */
+} CachedSegment;
+
+
+static void
+restore_usage(void)
+{
+	printf("Usage: pg_streamrecv restore -d <directory> [-n <prefetch> -C <cachedir> [-j <workers>]] [-w <seconds>] [-K <key file>] <%%f> <%%p>\n");
+	exit(1);
+}
+
+/*
+ * Copy from an open file descriptor to another, optionally padding the
+ * output with zeroes up to padto bytes.
+ */
+int
+copy_fd(int src, int dest, off_t padto)
+{
+	static char *buf = NULL;
+	off_t		written = 0;
+	int			r;
+
+	if (!buf)
+	{
+		buf = malloc(COPY_BUF_SIZE);
+		if (!buf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	while ((r = read(src, buf, COPY_BUF_SIZE)) > 0)
+	{
+		if (write(dest, buf, r) != r)
+			return 0;
+		written += r;
+	}
+	if (r < 0)
+		return 0;
+
+	if (written < padto)
+	{
+		memset(buf, 0, COPY_BUF_SIZE);
+		while (written < padto)
+		{
+			r = Min(COPY_BUF_SIZE, padto - written);
+			if (write(dest, buf, r) != r)
+				return 0;
+			written += r;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Expand a gzip compressed file into an open file descriptor.
+ */
+int
+gunzip_fd(const char *src, int dest)
+{
+	static char *buf = NULL;
+	gzFile		gz;
+	int			r;
+
+	if (!buf)
+	{
+		buf = malloc(COPY_BUF_SIZE);
+		if (!buf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	gz = gzopen(src, "rb");
+	if (!gz)
+		return 0;
+	gzbuffer(gz, COPY_BUF_SIZE);
+	while ((r = gzread(gz, buf, COPY_BUF_SIZE)) > 0)
+	{
+		if (write(dest, buf, r) != r)
+		{
+			gzclose(gz);
+			return 0;
+		}
+	}
+	gzclose(gz);
+	return r == 0;
+}
+
+/*
+ * Find a file in the archive. The archive directory is checked for the
+ * file as is, then for a compressed, stripped, deduplicated, chunked or
+ * encrypted version of it, then the volumes for a packed segment, and
+ * finally the inprogress directory is checked for a partial segment.
+ *
+ * Returns one of the ARCHIVE_FILE_* values, with the full path of the
+ * file, or of the volume holding it, in path.
+ */
+int
+locate_archive_file(const char *dir, const char *fname, char *path,
+					size_t pathlen)
+{
+	struct stat st;
+
+	snprintf(path, pathlen, "%s/%s", dir, fname);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_PLAIN;
+
+	snprintf(path, pathlen, "%s/%s.gz", dir, fname);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_GZIP;
+
+	/* Stripped segments are valid segments, just compressed */
+	snprintf(path, pathlen, "%s/%s%s", dir, fname, STRIPPED_SUFFIX);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_GZIP;
+
+	snprintf(path, pathlen, "%s/%s%s", dir, fname, DEDUP_SUFFIX);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_DEDUP;
+
+	snprintf(path, pathlen, "%s/%s%s", dir, fname, CHUNK_MANIFEST_SUFFIX);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_CHUNKED;
+
+	snprintf(path, pathlen, "%s/%s%s", dir, fname, ENCRYPTED_SUFFIX);
+	if (stat(path, &st) == 0)
+		return ARCHIVE_FILE_ENCRYPTED;
+
+	if (volume_locate(dir, fname, path, pathlen))
+		return ARCHIVE_FILE_PACKED;
+
+	if (is_segment_name(fname))
+	{
+		/*
+		 * The latest data is in the partial segment being received. It
+		 * has to be padded to the full size, and recovery will ask for it
+		 * again if it needs more than what's in it now.
+		 */
+		snprintf(path, pathlen, "%s/inprogress/%s", dir, fname);
+		if (stat(path, &st) == 0)
+			return ARCHIVE_FILE_PARTIAL;
+	}
+	return ARCHIVE_FILE_NOTFOUND;
+}
+
+/*
+ * Put a deduplicated, chunked, encrypted or packed segment found by
+ * locate_archive_file back together into buf, which must be able to hold
+ * XLogSegSize bytes. Returns 0 if it can't be.
+ */
+int
+expand_archive_segment(const char *dir, int how, const char *fname,
+					   const char *path, char *buf)
+{
+	if (how == ARCHIVE_FILE_DEDUP)
+		return expand_dedup_segment(dir, path, buf);
+	if (how == ARCHIVE_FILE_CHUNKED)
+		return expand_chunked_segment(dir, path, buf);
+	if (how == ARCHIVE_FILE_ENCRYPTED)
+		return expand_encrypted_segment(path, fname, buf);
+	if (how == ARCHIVE_FILE_PACKED)
+		return volume_read_segment(dir, fname, buf);
+	return 0;
+}
+
+/*
+ * Read a whole segment from the archive into buf, which must be able to
+ * hold XLogSegSize bytes. For a partial segment, len is set to how much
+ * of it there is. Returns 0 if the segment isn't in the archive.
+ */
+int
+load_archive_segment(const char *dir, const char *fname, char *buf,
+					 uint32 *len)
+{
+	char		path[MAXPGPATH];
+	int			how;
+	int			r;
+
+	how = locate_archive_file(dir, fname, path, sizeof(path));
+	if (how == ARCHIVE_FILE_NOTFOUND)
+		return 0;
+
+	*len = 0;
+	if (how == ARCHIVE_FILE_DEDUP || how == ARCHIVE_FILE_CHUNKED ||
+		how == ARCHIVE_FILE_ENCRYPTED || how == ARCHIVE_FILE_PACKED)
+	{
+		if (!expand_archive_segment(dir, how, fname, path, buf))
+		{
+			fprintf(stderr, "Failed to put %s back together\n", path);
+			exit(1);
+		}
+		*len = XLogSegSize;
+	}
+	else if (how == ARCHIVE_FILE_GZIP)
+	{
+		gzFile		gz = gzopen(path, "rb");
+
+		if (!gz)
+		{
+			fprintf(stderr, "Failed to open %s: %m\n", path);
+			exit(1);
+		}
+		while (*len < XLogSegSize &&
+			   (r = gzread(gz, buf + *len, XLogSegSize - *len)) > 0)
+			*len += r;
+		gzclose(gz);
+	}
+	else
+	{
+		int			f = open(path, O_RDONLY);
+
+		if (f == -1)
+		{
+			fprintf(stderr, "Failed to open %s: %m\n", path);
+			exit(1);
+		}
+		while (*len < XLogSegSize &&
+			   (r = read(f, buf + *len, XLogSegSize - *len)) > 0)
+			*len += r;
+		close(f);
+	}
+
+	if (how != ARCHIVE_FILE_PARTIAL && *len != XLogSegSize)
+	{
+		fprintf(stderr, "Segment %s is only %u bytes\n", path, *len);
+		exit(1);
+	}
+	return 1;
+}
+
+/*
+ * Restore a file from the archive into dest.
+ *
+ * If partial is not NULL, it's set to whether what was restored was a
+ * partial segment.
+ *
+ * Returns 1 if the file was restored, 0 if it isn't in the archive.
+ * Errors writing dest are fatal.
+ */
+int
+restore_file(const char *dir, const char *fname, const char *dest,
+			 int *partial)
+{
+	char		src[MAXPGPATH];
+	char		tmp[MAXPGPATH];
+	int			in = -1,
+				out;
+	int			ok;
+	off_t		padto = 0;
+	int			how;
+
+	how = locate_archive_file(dir, fname, src, sizeof(src));
+	if (how == ARCHIVE_FILE_NOTFOUND)
+		return 0;
+	if (how == ARCHIVE_FILE_PARTIAL)
+		padto = XLogSegSize;
+	if (partial)
+		*partial = (how == ARCHIVE_FILE_PARTIAL);
+
+	if (how == ARCHIVE_FILE_PLAIN || how == ARCHIVE_FILE_PARTIAL)
+	{
+		in = open(src, O_RDONLY);
+		if (in == -1)
+		{
+			/* Could have been moved out of inprogress since the stat */
+			if (how == ARCHIVE_FILE_PARTIAL)
+				return restore_file(dir, fname, dest, partial);
+			fprintf(stderr, "Failed to open %s: %m\n", src);
+			exit(1);
+		}
+	}
+
+	/*
+	 * Write to a temporary file and rename it in place, so nobody looking
+	 * at dest sees a half-written file.
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmp);
+		exit(1);
+	}
+
+	if (how == ARCHIVE_FILE_GZIP)
+		ok = gunzip_fd(src, out);
+	else if (how == ARCHIVE_FILE_DEDUP || how == ARCHIVE_FILE_CHUNKED ||
+			 how == ARCHIVE_FILE_ENCRYPTED || how == ARCHIVE_FILE_PACKED)
+	{
+		char	   *buf = malloc(XLogSegSize);
+
+		if (!buf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		ok = expand_archive_segment(dir, how, fname, src, buf) &&
+			write(out, buf, XLogSegSize) == XLogSegSize;
+		free(buf);
+	}
+	else
+	{
+		ok = copy_fd(in, out, padto);
+		close(in);
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to restore %s to %s: %m\n", src, tmp);
+		exit(1);
+	}
+	if (close(out) != 0 || rename(tmp, dest) != 0)
+	{
+		fprintf(stderr, "Failed to move %s into place as %s: %m\n", tmp, dest);
+		exit(1);
+	}
+
+	if (verbose)
+		printf("Restored %s from %s\n", fname, src);
+	return 1;
+}
+
+/*
+ * Move a file into place, copying it if it's on a different filesystem.
+ */
+static void
+move_file(const char *src, const char *dest)
+{
+	int			in,
+				out;
+
+	if (rename(src, dest) == 0)
+		return;
+	if (errno != EXDEV)
+	{
+		fprintf(stderr, "Failed to move %s to %s: %m\n", src, dest);
+		exit(1);
+	}
+
+	in = open(src, O_RDONLY);
+	out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (in == -1 || out == -1 || !copy_fd(in, out, 0) || close(out) != 0)
+	{
+		fprintf(stderr, "Failed to copy %s to %s: %m\n", src, dest);
+		exit(1);
+	}
+	close(in);
+	unlink(src);
+}
+
+
+/*
+ * The prefetching daemon.
+ */
+static CachedSegment *segments = NULL;
+static int	nsegments = 0;
+
+static CachedSegment *
+find_segment(const char *name)
+{
+	int			i;
+
+	for (i = 0; i < nsegments; i++)
+	{
+		if (strcmp(segments[i].name, name) == 0)
+			return &segments[i];
+	}
+	return NULL;
+}
+
+static int
+running_workers(void)
+{
+	int			i,
+				n = 0;
+
+	for (i = 0; i < nsegments; i++)
+		if (segments[i].state == SEG_RUNNING)
+			n++;
+	return n;
+}
+
+/*
+ * Forget about a segment, removing it from the cache if it's there.
+ */
+static void
+forget_segment(CachedSegment *seg)
+{
+	char		fn[MAXPGPATH];
+
+	if (seg->state == SEG_RUNNING)
+	{
+		kill(seg->pid, SIGTERM);
+		waitpid(seg->pid, NULL, 0);
+	}
+	snprintf(fn, sizeof(fn), "%s/%s", cachedir, seg->name);
+	unlink(fn);
+	snprintf(fn, sizeof(fn), "%s/%s.tmp", cachedir, seg->name);
+	unlink(fn);
+
+	*seg = segments[--nsegments];
+}
+
+/*
+ * Start fetching a segment into the cache in a worker process.
+ */
+static void
+start_fetch(const char *name)
+{
+	CachedSegment *seg;
+	char		dest[MAXPGPATH];
+	pid_t		pid;
+
+	if (find_segment(name))
+		return;
+
+	snprintf(dest, sizeof(dest), "%s/%s", cachedir, name);
+	pid = fork();
+	if (pid < 0)
+	{
+		fprintf(stderr, "Failed to fork restore worker: %m\n");
+		exit(1);
+	}
+	if (pid == 0)
+	{
+		int			partial;
+
+		if (!restore_file(basedir, name, dest, &partial))
+			exit(1);
+		if (partial)
+		{
+			/* Never cache a partial segment, it's still growing */
+			unlink(dest);
+			exit(1);
+		}
+		exit(0);
+	}
+
+	segments = realloc(segments, (nsegments + 1) * sizeof(CachedSegment));
+	if (!segments)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	seg = &segments[nsegments++];
+	memset(seg, 0, sizeof(CachedSegment));
+	strcpy(seg->name, name);
+	seg->state = SEG_RUNNING;
+	seg->pid = pid;
+}
+
+/*
+ * Schedule prefetching of the segments following the one just
+ * requested, and throw away anything before it that's still cached.
+ */
+static void
+schedule_prefetch(const char *requested)
+{
+	char		name[MAXFNAMELEN];
+	uint32		tli,
+				log,
+				seg,
+				rtli,
+				rlog,
+				rseg;
+	int			i;
+
+	XLogFromFileName(requested, &rtli, &rlog, &rseg);
+	for (i = nsegments - 1; i >= 0; i--)
+	{
+		XLogFromFileName(segments[i].name, &tli, &log, &seg);
+		if (tli != rtli || log < rlog || (log == rlog && seg < rseg))
+			forget_segment(&segments[i]);
+	}
+
+	log = rlog;
+	seg = rseg;
+	for (i = 0; i < prefetch_count && running_workers() < prefetch_workers; i++)
+	{
+		NextLogSeg(log, seg);
+		XLogFileName(name, rtli, log, seg);
+		start_fetch(name);
+	}
+}
+
+static void
+reap_workers(void)
+{
+	pid_t		pid;
+	int			status;
+	int			i;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		for (i = 0; i < nsegments; i++)
+		{
+			if (segments[i].state == SEG_RUNNING && segments[i].pid == pid)
+			{
+				segments[i].state =
+					(WIFEXITED(status) && WEXITSTATUS(status) == 0) ?
+					SEG_READY : SEG_MISSING;
+				if (verbose > 1)
+					printf("Prefetch of %s %s\n", segments[i].name,
+						   segments[i].state == SEG_READY ? "done" : "failed");
+				break;
+			}
+		}
+	}
+}
+
+static int
+open_socket(struct sockaddr_un *addr)
+{
+	int			sock;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", cachedir,
+			 RESTORE_SOCKET_NAME);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+	{
+		fprintf(stderr, "Failed to create socket: %m\n");
+		exit(1);
+	}
+	return sock;
+}
+
+/* Only here to make select() return when a worker exits */
+static void
+sigchld_handler(int signum)
+{
+}
+
+/*
+ * Main loop of the daemon. Clients send "FETCH <segment>\n" and get back
+ * "OK\n" once the segment is in the cache directory, or "NOTFOUND\n".
+ */
+static void
+restore_daemon(int listensock)
+{
+	int			clients[RESTORE_MAX_CLIENTS];
+	char		waiting[RESTORE_MAX_CLIENTS][MAXFNAMELEN];
+	int			nclients = 0;
+	time_t		last_activity = time(NULL);
+	struct sigaction sa;
+	int			i;
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	while (time(NULL) - last_activity < RESTORE_IDLE_TIMEOUT)
+	{
+		fd_set		fds;
+		struct timeval tv;
+		int			maxfd = listensock;
+
+		FD_ZERO(&fds);
+		FD_SET(listensock, &fds);
+		for (i = 0; i < nclients; i++)
+		{
+			if (waiting[i][0] == '\0')
+			{
+				FD_SET(clients[i], &fds);
+				maxfd = Max(maxfd, clients[i]);
+			}
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (select(maxfd + 1, &fds, NULL, NULL, &tv) < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "select() failed: %m\n");
+			exit(1);
+		}
+
+		reap_workers();
+
+		if (FD_ISSET(listensock, &fds))
+		{
+			int			c = accept(listensock, NULL, NULL);
+
+			if (c >= 0 && nclients < RESTORE_MAX_CLIENTS)
+			{
+				clients[nclients] = c;
+				waiting[nclients][0] = '\0';
+				nclients++;
+			}
+			else if (c >= 0)
+				close(c);
+			last_activity = time(NULL);
+		}
+
+		for (i = 0; i < nclients; i++)
+		{
+			CachedSegment *seg;
+			const char *reply = NULL;
+
+			if (waiting[i][0] == '\0' && FD_ISSET(clients[i], &fds))
+			{
+				char		buf[128];
+				int			r = read(clients[i], buf, sizeof(buf) - 1);
+
+				if (r <= 0)
+				{
+					close(clients[i]);
+					clients[i] = clients[--nclients];
+					memmove(waiting[i], waiting[nclients], MAXFNAMELEN);
+					i--;
+					continue;
+				}
+				buf[r] = '\0';
+				if (strncmp(buf, "FETCH ", 6) != 0 || r < 30 ||
+					!is_segment_name(strtok(buf + 6, "\n")))
+					reply = "ERROR\n";
+				else
+				{
+					strcpy(waiting[i], buf + 6);
+					start_fetch(waiting[i]);
+					schedule_prefetch(waiting[i]);
+				}
+				last_activity = time(NULL);
+			}
+
+			if (waiting[i][0] != '\0')
+			{
+				seg = find_segment(waiting[i]);
+				if (!seg || seg->state == SEG_MISSING)
+					reply = "NOTFOUND\n";
+				else if (seg->state == SEG_READY)
+					reply = "OK\n";
+
+				if (reply && seg)
+				{
+					/* The client takes the file, or retries later */
+					*seg = segments[--nsegments];
+				}
+			}
+
+			if (reply)
+			{
+				if (write(clients[i], reply, strlen(reply)) < 0)
+				{
+					/* client went away, nothing to do */
+				}
+				waiting[i][0] = '\0';
+			}
+		}
+	}
+
+	if (verbose)
+		printf("Restore daemon idle, exiting\n");
+	while (nsegments > 0)
+		forget_segment(&segments[0]);
+}
+
+/*
+ * Start the daemon in the background, detached from recovery.
+ */
+static void
+start_daemon(void)
+{
+	struct sockaddr_un addr;
+	int			sock;
+	pid_t		pid;
+
+	pid = fork();
+	if (pid < 0)
+	{
+		fprintf(stderr, "Failed to fork restore daemon: %m\n");
+		exit(1);
+	}
+	if (pid > 0)
+	{
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	/* Double fork so the daemon isn't a child of the startup process */
+	setsid();
+	if (fork() != 0)
+		_exit(0);
+
+	sock = open_socket(&addr);
+	unlink(addr.sun_path);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(sock, RESTORE_MAX_CLIENTS) != 0)
+	{
+		/* Most likely another daemon beat us to it */
+		_exit(0);
+	}
+
+	restore_daemon(sock);
+	close(sock);
+	unlink(addr.sun_path);
+	_exit(0);
+}
+
+/*
+ * Ask the daemon for a segment. Returns 1 if it's now in the cache,
+ * 0 if it's not in the archive, and -1 if the daemon could not be
+ * reached.
+ */
+static int
+fetch_from_daemon(const char *fname)
+{
+	struct sockaddr_un addr;
+	char		buf[64];
+	int			sock;
+	int			r;
+
+	sock = open_socket(&addr);
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "FETCH %s\n", fname);
+	if (write(sock, buf, strlen(buf)) != strlen(buf))
+	{
+		close(sock);
+		return -1;
+	}
+	r = read(sock, buf, sizeof(buf) - 1);
+	close(sock);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+	if (strcmp(buf, "OK\n") == 0)
+		return 1;
+	if (strcmp(buf, "NOTFOUND\n") == 0)
+		return 0;
+	return -1;
+}
+
+/*
+ * Wait for a segment that isn't there yet, for up to wait_secs seconds.
+ * Each time the receiver tells us it has flushed more WAL or completed a
+ * segment, try again to restore it. If there's no receiver running to
+ * tell us, check once a second instead.
+ */
+static int
+wait_for_segment(const char *fname, const char *dest)
+{
+	time_t		deadline = time(NULL) + wait_secs;
+	int			sock = notify_subscribe(basedir);
+	char		buf[1024];
+	int			found = 0;
+
+	if (verbose)
+		printf("Waiting up to %i seconds for %s\n", wait_secs, fname);
+
+	/* Subscribed before looking, so nothing written meanwhile is missed */
+	while (!(found = restore_file(basedir, fname, dest, NULL)))
+	{
+		time_t		now = time(NULL);
+		struct timeval tv;
+		fd_set		fds;
+
+		if (now >= deadline)
+			break;
+		if (sock < 0)
+		{
+			sleep(1);
+			continue;
+		}
+
+		FD_ZERO(&fds);
+		FD_SET(sock, &fds);
+		tv.tv_sec = deadline - now;
+		tv.tv_usec = 0;
+		if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+
+		/* Which event it was doesn't matter, just look again */
+		if (read(sock, buf, sizeof(buf)) <= 0)
+		{
+			/* The receiver went away, maybe to be replaced */
+			close(sock);
+			sock = notify_subscribe(basedir);
+			if (sock < 0)
+				sleep(1);
+		}
+	}
+	if (sock >= 0)
+		close(sock);
+	return found;
+}
+
+/*
+ * Restore a file directly from the archive, waiting for it if -w was
+ * given and it's a segment.
+ */
+static int
+restore_direct(const char *fname, const char *dest)
+{
+	if (restore_file(basedir, fname, dest, NULL))
+		return 1;
+	if (wait_secs > 0 && is_segment_name(fname))
+		return wait_for_segment(fname, dest);
+	return 0;
+}
+
+/*
+ * "pg_streamrecv restore" - restore_command implementation
+ */
+int
+restore_main(int argc, char *argv[])
+{
+	char	   *fname;
+	char	   *dest;
+	char		cached[MAXPGPATH];
+	int			c;
+	int			r;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:n:j:C:K:vw:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'n':
+				prefetch_count = atoi(optarg);
+				break;
+			case 'j':
+				prefetch_workers = atoi(optarg);
+				break;
+			case 'C':
+				cachedir = strdup(optarg);
+				break;
+			case 'K':
+				encryption_key_file = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'w':
+				wait_secs = atoi(optarg);
+				break;
+			default:
+				restore_usage();
+		}
+	}
+	if (!basedir || optind != argc - 2)
+		restore_usage();
+	if (prefetch_count > 0 && !cachedir)
+	{
+		fprintf(stderr, "Prefetching requires a cache directory (-C)\n");
+		exit(1);
+	}
+	if (prefetch_workers < 1)
+		prefetch_workers = 1;
+
+	fname = argv[optind];
+	dest = argv[optind + 1];
+
+	/*
+	 * History and backup history files, and anything else that isn't a
+	 * plain segment, are always restored directly.
+	 */
+	if (prefetch_count == 0 || !is_segment_name(fname))
+		return restore_direct(fname, dest) ? 0 : 1;
+
+	for (i = 0; i < 2; i++)
+	{
+		r = fetch_from_daemon(fname);
+		if (r >= 0)
+			break;
+		start_daemon();
+
+		/* Give the daemon a moment to start listening */
+		usleep(50000);
+	}
+
+	if (r == 1)
+	{
+		snprintf(cached, sizeof(cached), "%s/%s", cachedir, fname);
+		move_file(cached, dest);
+		if (verbose)
+			printf("Restored %s from prefetch cache\n", fname);
+		return 0;
+	}
+
+	/*
+	 * Not found by the daemon, or the daemon isn't working. Either way,
+	 * try directly, which also gets us the partial segment if there is one.
+	 */
+	return restore_direct(fname, dest) ? 0 : 1;
+}
@@ -0,0 +1,571 @@
+/*
+ * retention.c - removing old segments from the archive
+ *
+ * Segments are removed from the oldest end of the archive, as given by
+ * the archive index, so deciding what to remove never needs a directory
+ * listing. A segment is removed when any of these limits is exceeded:
+ *
+ *	retention_age_hours		the segment was completed longer ago than this
+ *	retention_count			there are more segments than this
+ *	retention_size_mb		the segments take up more space than this
+ *
+ * Only the segments that might go are looked at for the age limit, and
+ * only the ones that are kept for the size limit, so the work done is
+ * bounded by the limits rather than by the size of the archive.
+ *
+ * retention_base_backup protects the WAL needed to restore a base
+ * backup: nothing from its starting location on is ever removed. It's a
+ * location in the X/X format, or a backup history file or backup_label
+ * to read "START WAL LOCATION" from, which is read again on every pass
+ * so that it can be replaced whenever a new backup has been taken. If it
+ * can't be read, nothing is removed at all. Given on its own, without
+ * any limits, everything before the backup is removed. The newest
+ * segment is always kept.
+ *
+ * Segments are removed in every form they are stored in, along with
+ * their record index and block summary, in batches, sleeping between
+ * batches so that no more than retention_rate segments are removed per
+ * second. The files are removed before the entries in the index, so if
+ * we crash in between, the next pass finds the entries and cleans up.
+ * Page images left unused by removing deduplicated segments are swept
+ * from the page store at the end of the pass.
+ *
+ * The receiver runs a pass in a child process each time a segment is
+ * completed, unless the previous one is still going, so the unlinks
+ * never hold up the stream. "pg_streamrecv prune" runs one from the
+ * command line.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+/* Segments removed between sleeps */
+#define RETENTION_BATCH			16
+
+int			retention_age = 0;
+int			retention_count = 0;
+int			retention_size_mb = 0;
+char	   *retention_base_backup = NULL;
+int			retention_rate = RETENTION_DEFAULT_RATE;
+
+/* Counters in shared memory, since the passes run in child processes */
+typedef struct RetentionStats
+{
+	uint64		passes;
+	uint64		segments;
+	uint64		bytes;
+	uint64		emergency;		/* segments removed to free up space */
+} RetentionStats;
+
+static RetentionStats local_stats;
+static RetentionStats *stats = &local_stats;
+
+static pid_t retention_pid = -1;
+
+/* Set when a deduplicated segment has been removed */
+static int	removed_dedup = 0;
+
+
+static int
+retention_enabled(void)
+{
+	return retention_age > 0 || retention_count > 0 ||
+		retention_size_mb > 0 || retention_base_backup != NULL;
+}
+
+/*
+ * Get the starting location of the base backup to keep the WAL for.
+ * Returns 0 if it can't be determined.
+ */
+static int
+base_backup_location(const char *dir, const char *spec, XLogRecPtr *ptr)
+{
+	char		fn[MAXPGPATH];
+	char		line[1024];
+	int			found = 0;
+	FILE	   *f;
+
+	if (spec[0] == '/')
+		snprintf(fn, sizeof(fn), "%s", spec);
+	else
+		snprintf(fn, sizeof(fn), "%s/%s", dir, spec);
+
+	f = fopen(fn, "r");
+	if (!f)
+	{
+		int			n;
+
+		if (errno == ENOENT &&
+			sscanf(spec, "%X/%X%n", &ptr->xlogid, &ptr->xrecoff, &n) == 2 &&
+			spec[n] == '\0')
+			return 1;
+		fprintf(stderr, "Failed to open base backup file %s: %m\n", fn);
+		return 0;
+	}
+	while (!found && fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "START WAL LOCATION: %X/%X",
+				   &ptr->xlogid, &ptr->xrecoff) == 2)
+			found = 1;
+	}
+	fclose(f);
+
+	if (!found)
+		fprintf(stderr, "No START WAL LOCATION in base backup file %s\n", fn);
+	return found;
+}
+
+/*
+ * Get the size and completion time of a segment in whatever form it's in.
+ * A packed segment shares its volume's stat with all the others in it, so
+ * its size comes from the index and its time from the volume index.
+ * Returns 0 if it isn't there.
+ */
+static int
+segment_info(const char *dir, ArchiveIndexEntry *entry, uint64 *size,
+			 time_t *completed)
+{
+	char		path[MAXPGPATH];
+	struct stat st;
+	int			how;
+
+	if (entry->compression == ARCHIVE_COMPRESSION_PACKED)
+	{
+		*size = entry->size;
+		return volume_completed(dir, entry->path, completed);
+	}
+
+	how = locate_archive_file(dir, entry->path, path, sizeof(path));
+	if (how == ARCHIVE_FILE_NOTFOUND || how == ARCHIVE_FILE_PARTIAL)
+		return 0;
+	if (stat(path, &st) != 0)
+		return 0;
+	*size = st.st_size;
+	*completed = st.st_mtime;
+	return 1;
+}
+
+/*
+ * How many of the oldest segments in the index may be removed at most,
+ * keeping the newest one and whatever the base backup needs. Returns -1
+ * if that can't be worked out.
+ */
+static int
+retention_limit(const char *dir, ArchiveIndex *idx)
+{
+	XLogRecPtr	ptr;
+	int			i;
+
+	if (!retention_base_backup)
+		return Max(idx->nentries - 1, 0);
+	if (!base_backup_location(dir, retention_base_backup, &ptr))
+		return -1;
+	for (i = 0; i < idx->nentries - 1; i++)
+	{
+		if (!XLByteLE(idx->entries[i].endpoint, ptr))
+			break;
+	}
+	return i;
+}
+
+/*
+ * Work out how many of the oldest segments in the index can be removed.
+ * Returns -1 if that can't be worked out.
+ */
+static int
+retention_plan(const char *dir, ArchiveIndex *idx)
+{
+	uint64		size;
+	time_t		completed;
+	int			limit = retention_limit(dir, idx);
+	int			n = 0;
+	int			i;
+
+	if (limit < 0)
+		return -1;
+	if (retention_age == 0 && retention_count == 0 && retention_size_mb == 0)
+		return limit;
+
+	if (retention_count > 0 && idx->nentries > retention_count)
+		n = idx->nentries - retention_count;
+
+	if (retention_age > 0)
+	{
+		time_t		cutoff = time(NULL) - retention_age;
+
+		/* Segments missing from the archive are left over from a crash */
+		for (i = n; i < limit; i++)
+		{
+			if (segment_info(dir, &idx->entries[i], &size, &completed) &&
+				completed > cutoff)
+				break;
+		}
+		n = i;
+	}
+
+	if (retention_size_mb > 0)
+	{
+		uint64		maxsize = (uint64) retention_size_mb * 1024 * 1024;
+		uint64		total = 0;
+
+		/* Add up the newest segments until they don't fit any more */
+		for (i = idx->nentries - 1; i >= n; i--)
+		{
+			if (segment_info(dir, &idx->entries[i], &size, &completed))
+				total += size;
+			if (total > maxsize)
+				break;
+		}
+		n = Max(n, i + 1);
+	}
+
+	return Min(n, limit);
+}
+
+static int
+remove_file(const char *fn, uint64 *bytes)
+{
+	struct stat st;
+
+	if (stat(fn, &st) != 0)
+		return 0;
+	if (unlink(fn) != 0)
+	{
+		fprintf(stderr, "Failed to remove %s: %m\n", fn);
+		return 0;
+	}
+	*bytes += st.st_size;
+	return 1;
+}
+
+/*
+ * Remove a segment from the archive, in all the forms it's stored in,
+ * along with the files kept about it. Returns the bytes freed.
+ */
+static uint64
+remove_segment(const char *dir, const char *segname)
+{
+	static const char *const suffixes[] = {
+		"", ".gz", STRIPPED_SUFFIX, DEDUP_SUFFIX, ENCRYPTED_SUFFIX, NULL
+	};
+	char		fn[MAXPGPATH];
+	struct stat st;
+	uint64		bytes = 0;
+	int			i;
+
+	for (i = 0; suffixes[i]; i++)
+	{
+		snprintf(fn, sizeof(fn), "%s/%s%s", dir, segname, suffixes[i]);
+		if (remove_file(fn, &bytes) &&
+			strcmp(suffixes[i], DEDUP_SUFFIX) == 0)
+			removed_dedup = 1;
+	}
+
+	/* Chunks still used by other segments stay, so only count the manifest */
+	snprintf(fn, sizeof(fn), "%s/%s%s", dir, segname, CHUNK_MANIFEST_SUFFIX);
+	if (stat(fn, &st) == 0 && remove_chunked_segment(dir, segname))
+		bytes += st.st_size;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, RECINDEX_DIR, segname);
+	remove_file(fn, &bytes);
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, WALSUMMARY_DIR, segname);
+	remove_file(fn, &bytes);
+
+	return bytes;
+}
+
+/*
+ * Run a retention pass over the archive. With dryrun, only list what
+ * would be removed. Returns the number of segments removed, or -1 if
+ * what to remove couldn't be worked out.
+ */
+int
+retention_run(const char *dir, int dryrun)
+{
+	ArchiveIndex *idx;
+	uint64		bytes = 0;
+	int			batch = RETENTION_BATCH;
+	int			n;
+	int			i,
+				j;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		fprintf(stderr, "No valid archive index in %s, not removing anything\n",
+				dir);
+		return -1;
+	}
+
+	if (retention_rate > 0 && retention_rate < batch)
+		batch = retention_rate;
+
+	n = retention_plan(dir, idx);
+	for (i = 0; i < n; i = j)
+	{
+		uint64		start = now_msec();
+		int64		wait;
+
+		for (j = i; j < n && j < i + batch; j++)
+		{
+			if (dryrun)
+			{
+				printf("%s\n", idx->entries[j].path);
+				continue;
+			}
+			bytes += remove_segment(dir, idx->entries[j].path);
+			if (verbose > 1)
+				printf("Removed segment %s\n", idx->entries[j].path);
+		}
+		if (dryrun)
+			continue;
+		archive_index_remove_upto(dir, &idx->entries[j - 1]);
+		bytes += volume_remove_upto(dir, &idx->entries[j - 1]);
+
+		if (retention_rate > 0 && j < n)
+		{
+			wait = (int64) (j - i) * 1000 / retention_rate -
+				(int64) (now_msec() - start);
+			if (wait > 0)
+				usleep(wait * 1000);
+		}
+	}
+
+	/* The page images only they used can go now */
+	if (removed_dedup)
+	{
+		bytes += dedup_sweep(dir, 0);
+		removed_dedup = 0;
+	}
+
+	if (n > 0 && !dryrun)
+	{
+		__sync_fetch_and_add(&stats->segments, n);
+		__sync_fetch_and_add(&stats->bytes, bytes);
+		if (verbose)
+			printf("Removed %i segments from %s through %s, " UINT64_FORMAT " MB\n",
+				   n, idx->entries[0].path, idx->entries[n - 1].path,
+				   bytes / (1024 * 1024));
+	}
+	__sync_fetch_and_add(&stats->passes, 1);
+
+	archive_index_close(idx);
+	return n;
+}
+
+/*
+ * Remove the oldest segments until there is at least goal bytes of free
+ * space, for when the disk is about to fill up. The newest keep segments,
+ * and whatever the base backup needs, are still kept, and there's no rate
+ * limit. Returns the number of segments removed, or -1 if what may be
+ * removed couldn't be worked out.
+ */
+int
+retention_free_space(const char *dir, uint64 goal, int keep)
+{
+	ArchiveIndex *idx;
+	uint64		bytes = 0;
+	int			limit;
+	int			n = 0;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		fprintf(stderr, "No valid archive index in %s, not removing anything\n",
+				dir);
+		return -1;
+	}
+	limit = retention_limit(dir, idx);
+	if (limit > idx->nentries - keep)
+		limit = Max(idx->nentries - keep, 0);
+
+	while (n < limit && disk_free_space(dir) < goal)
+	{
+		int			j;
+
+		for (j = n; j < limit && j < n + RETENTION_BATCH; j++)
+		{
+			bytes += remove_segment(dir, idx->entries[j].path);
+			if (verbose > 1)
+				printf("Removed segment %s\n", idx->entries[j].path);
+		}
+		archive_index_remove_upto(dir, &idx->entries[j - 1]);
+		bytes += volume_remove_upto(dir, &idx->entries[j - 1]);
+		if (removed_dedup)
+		{
+			bytes += dedup_sweep(dir, 0);
+			removed_dedup = 0;
+		}
+		n = j;
+	}
+
+	if (n > 0)
+	{
+		__sync_fetch_and_add(&stats->segments, n);
+		__sync_fetch_and_add(&stats->bytes, bytes);
+		__sync_fetch_and_add(&stats->emergency, n);
+		fprintf(stderr, "Removed %i segments from %s through %s to free up space, " UINT64_FORMAT " MB\n",
+				n, idx->entries[0].path, idx->entries[n - 1].path,
+				bytes / (1024 * 1024));
+	}
+	else if (limit >= 0 && disk_free_space(dir) < goal)
+		fprintf(stderr, "No more segments can be removed from %s to free up space\n",
+				dir);
+
+	archive_index_close(idx);
+	return limit < 0 ? -1 : n;
+}
+
+/*
+ * Start a pass in the background each time a segment is completed.
+ */
+static void
+retention_segment(void *arg, const char *segname)
+{
+	int			status;
+
+	if (retention_pid != -1)
+	{
+		if (waitpid(retention_pid, &status, WNOHANG) == 0)
+			return;
+		retention_pid = -1;
+	}
+	if (!retention_enabled())
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	retention_pid = fork();
+	if (retention_pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (retention_pid == 0)
+	{
+		io_set_class(IO_CLASS_IDLE);
+		retention_run(basedir, 0);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+static void
+retention_metrics(FILE *f)
+{
+	fprintf(f, "# TYPE pg_streamrecv_retention_passes_total counter\n");
+	fprintf(f, "pg_streamrecv_retention_passes_total " UINT64_FORMAT "\n",
+			stats->passes);
+	fprintf(f, "# TYPE pg_streamrecv_retention_removed_segments_total counter\n");
+	fprintf(f, "pg_streamrecv_retention_removed_segments_total " UINT64_FORMAT "\n",
+			stats->segments);
+	fprintf(f, "# TYPE pg_streamrecv_retention_removed_bytes_total counter\n");
+	fprintf(f, "pg_streamrecv_retention_removed_bytes_total " UINT64_FORMAT "\n",
+			stats->bytes);
+	fprintf(f, "# TYPE pg_streamrecv_retention_emergency_removed_segments_total counter\n");
+	fprintf(f, "pg_streamrecv_retention_emergency_removed_segments_total " UINT64_FORMAT "\n",
+			stats->emergency);
+}
+
+/*
+ * Hook retention into the receiver. Retention can be turned on by a
+ * reload, so this is always done.
+ */
+void
+retention_init(void)
+{
+	StreamSink	sink;
+	void	   *p;
+
+	p = mmap(NULL, sizeof(RetentionStats), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	stats = p;
+	memset(stats, 0, sizeof(RetentionStats));
+
+	memset(&sink, 0, sizeof(sink));
+	sink.segment = retention_segment;
+	stream_add_sink(&sink);
+	metrics_register(retention_metrics);
+}
+
+
+static void
+prune_usage(void)
+{
+	printf("Usage: pg_streamrecv prune -d <directory> [-a <hours>] [-c <count>] [-s <MB>] [-b <base backup>] [-r <segments/s>] [-n] [-v]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv prune" - remove old segments from the archive.
+ */
+int
+prune_main(int argc, char *argv[])
+{
+	int			dryrun = 0;
+	int			c;
+
+	while ((c = getopt(argc, argv, "a:b:c:d:nr:s:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				retention_age = atoi(optarg) * 3600;
+				break;
+			case 'b':
+				retention_base_backup = strdup(optarg);
+				break;
+			case 'c':
+				retention_count = atoi(optarg);
+				break;
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'n':
+				dryrun = 1;
+				break;
+			case 'r':
+				retention_rate = atoi(optarg);
+				break;
+			case 's':
+				retention_size_mb = atoi(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				prune_usage();
+		}
+	}
+	if (!basedir || optind != argc)
+		prune_usage();
+	if (!retention_enabled())
+	{
+		fprintf(stderr, "Nothing to do, give at least one of -a, -c, -s and -b\n");
+		exit(1);
+	}
+
+	return retention_run(basedir, dryrun) < 0 ? 1 : 0;
+}
@@ -0,0 +1,655 @@
+/*
+ * serve.c - serve segments from the archive to remote standbys
+ *
+ * "pg_streamrecv serve" listens on a TCP port and hands out files from
+ * the archive directory, so standbys can fetch WAL from the receiver host
+ * without spawning scp or rsync for every segment. "pg_streamrecv fetch"
+ * is the matching client, suitable for use in restore_command.
+ *
+ * The protocol is line based. The client sends one or more requests,
+ * without having to wait for the answers in between:
+ *
+ *	GET <filename>
+ *	GETLSN <location>
+ *	QUIT
+ *
+ * and for each request the server answers with either
+ *
+ *	OK <size> <filename>
+ *
+ * followed by exactly size bytes of file contents, or with
+ *
+ *	NOTFOUND
+ *	ERROR <message>
+ *
+ * Plain files are sent with sendfile(), so they're never copied through
+ * userspace. Compressed segments are expanded on the fly, and the partial
+ * segment being received is padded to full size, just like the restore
+ * mode does.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+#define SEND_BUF_SIZE		(256 * 1024)
+#define MAX_LINE			256
+
+/* Buffered reading from a socket */
+typedef struct SockReader
+{
+	int			fd;
+	char		buf[8192];
+	int			len;
+	int			pos;
+} SockReader;
+
+static char *listenhost = "localhost";
+static char *port = NULL;
+
+
+static int
+sockreader_fill(SockReader *r)
+{
+	if (r->pos < r->len)
+		return 1;
+	r->len = read(r->fd, r->buf, sizeof(r->buf));
+	r->pos = 0;
+	return r->len > 0;
+}
+
+/*
+ * Read one line, without the newline. Returns 0 on EOF.
+ */
+static int
+sockreader_line(SockReader *r, char *line, int maxlen)
+{
+	int			n = 0;
+
+	while (1)
+	{
+		if (!sockreader_fill(r))
+			return 0;
+		if (r->buf[r->pos] == '\n')
+		{
+			r->pos++;
+			line[n] = '\0';
+			return 1;
+		}
+		if (n < maxlen - 1)
+			line[n++] = r->buf[r->pos];
+		r->pos++;
+	}
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		r = write(fd, buf, len);
+
+		if (r <= 0)
+			return 0;
+		buf += r;
+		len -= r;
+	}
+	return 1;
+}
+
+static int
+send_line(int sock, const char *fmt, const char *arg)
+{
+	char		buf[MAX_LINE * 2];
+
+	snprintf(buf, sizeof(buf), fmt, arg);
+	return write_all(sock, buf, strlen(buf));
+}
+
+/*
+ * Check that the client is asking for something that could be in the
+ * archive, and not trying to escape from it.
+ */
+static int
+valid_filename(const char *fname)
+{
+	const char *p;
+
+	if (fname[0] == '\0' || fname[0] == '.' || strlen(fname) >= MAXFNAMELEN)
+		return 0;
+	for (p = fname; *p; p++)
+	{
+		if (!ISHEX(*p) && *p != '.' && !(*p >= 'a' && *p <= 'z'))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Send a file from the archive. Returns 0 if the connection should be
+ * dropped, since the client can't be told about errors once the file
+ * contents have started.
+ */
+static int
+send_file(int sock, const char *fname)
+{
+	char		path[MAXPGPATH];
+	char		hdr[MAX_LINE];
+	static char *buf = NULL;
+	struct stat st;
+	off_t		offset = 0;
+	off_t		size;
+	off_t		sent;
+	int			how;
+	int			f;
+
+	if (!buf)
+	{
+		buf = malloc(SEND_BUF_SIZE);
+		if (!buf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	how = locate_archive_file(basedir, fname, path, sizeof(path));
+	if (how == ARCHIVE_FILE_NOTFOUND)
+		return send_line(sock, "NOTFOUND\n", NULL);
+
+	if (how == ARCHIVE_FILE_DEDUP || how == ARCHIVE_FILE_CHUNKED ||
+		how == ARCHIVE_FILE_ENCRYPTED || how == ARCHIVE_FILE_PACKED)
+	{
+		char	   *seg = malloc(XLogSegSize);
+		int			ok;
+
+		if (!seg)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (!expand_archive_segment(basedir, how, fname, path, seg))
+		{
+			free(seg);
+			return send_line(sock, "ERROR could not put file back together\n",
+							 NULL);
+		}
+		snprintf(hdr, sizeof(hdr), "OK %u %s\n", (unsigned int) XLogSegSize,
+				 fname);
+		ok = write_all(sock, hdr, strlen(hdr)) &&
+			write_all(sock, seg, XLogSegSize);
+		free(seg);
+		return ok;
+	}
+
+	f = open(path, O_RDONLY);
+	if (f == -1 || fstat(f, &st) != 0)
+	{
+		/* Partial segment may just have been moved into place */
+		if (f == -1 && how == ARCHIVE_FILE_PARTIAL)
+			return send_file(sock, fname);
+		return send_line(sock, "ERROR could not open file\n", NULL);
+	}
+
+	if (how == ARCHIVE_FILE_GZIP)
+	{
+		gzFile		gz;
+		uint32		isize;
+		int			r;
+
+		/*
+		 * The uncompressed size is in the last four bytes of the gzip
+		 * trailer, which is fine for anything the size of a segment.
+		 */
+		if (pread(f, &isize, sizeof(isize), st.st_size - sizeof(isize)) !=
+			sizeof(isize))
+		{
+			close(f);
+			return send_line(sock, "ERROR could not read compressed file\n",
+							 NULL);
+		}
+		gz = gzdopen(f, "rb");
+		if (!gz)
+		{
+			close(f);
+			return send_line(sock, "ERROR could not read compressed file\n",
+							 NULL);
+		}
+		snprintf(hdr, sizeof(hdr), "OK %u %s\n", isize, fname);
+		if (!write_all(sock, hdr, strlen(hdr)))
+		{
+			gzclose(gz);
+			return 0;
+		}
+		sent = 0;
+		while ((r = gzread(gz, buf, SEND_BUF_SIZE)) > 0)
+		{
+			if (!write_all(sock, buf, r))
+				break;
+			sent += r;
+		}
+		gzclose(gz);
+		return sent == isize;
+	}
+
+	/*
+	 * A partial segment is still being written to, so only send as much
+	 * as it had when we looked, and pad the rest.
+	 */
+	size = st.st_size;
+	if (how == ARCHIVE_FILE_PARTIAL && size > XLogSegSize)
+		size = XLogSegSize;
+
+	snprintf(hdr, sizeof(hdr), "OK %lu %s\n",
+			 (unsigned long) (how == ARCHIVE_FILE_PARTIAL ? XLogSegSize : size),
+			 fname);
+	if (!write_all(sock, hdr, strlen(hdr)))
+	{
+		close(f);
+		return 0;
+	}
+
+	while (offset < size)
+	{
+		ssize_t		r = sendfile(sock, f, &offset, size - offset);
+
+		if (r <= 0)
+		{
+			close(f);
+			return 0;
+		}
+	}
+	close(f);
+
+	if (how == ARCHIVE_FILE_PARTIAL)
+	{
+		memset(buf, 0, SEND_BUF_SIZE);
+		for (sent = size; sent < XLogSegSize; sent += SEND_BUF_SIZE)
+		{
+			if (!write_all(sock, buf, Min(SEND_BUF_SIZE, XLogSegSize - sent)))
+				return 0;
+		}
+	}
+
+	if (verbose > 1)
+		printf("Sent %s\n", fname);
+	return 1;
+}
+
+/*
+ * Handle all requests on one connection.
+ */
+static void
+serve_connection(int sock)
+{
+	SockReader reader;
+	char		line[MAX_LINE];
+	int			one = 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = sock;
+
+	while (sockreader_line(&reader, line, sizeof(line)))
+	{
+		int			ok;
+
+		if (strncmp(line, "GET ", 4) == 0)
+		{
+			if (!valid_filename(line + 4))
+				ok = send_line(sock, "ERROR invalid filename\n", NULL);
+			else
+				ok = send_file(sock, line + 4);
+		}
+		else if (strncmp(line, "GETLSN ", 7) == 0)
+		{
+			ArchiveIndex *idx;
+			ArchiveIndexEntry *entry;
+			XLogRecPtr	ptr;
+			char		fname[MAXFNAMELEN];
+
+			if (sscanf(line + 7, "%X/%X", &ptr.xlogid, &ptr.xrecoff) != 2)
+				ok = send_line(sock, "ERROR invalid location\n", NULL);
+			else if ((idx = archive_index_open(basedir)) == NULL)
+				ok = send_line(sock, "ERROR no archive index\n", NULL);
+			else
+			{
+				entry = archive_index_lookup(idx, ptr);
+				if (entry)
+				{
+					strcpy(fname, entry->path);
+					archive_index_close(idx);
+					ok = send_file(sock, fname);
+				}
+				else
+				{
+					archive_index_close(idx);
+					ok = send_line(sock, "NOTFOUND\n", NULL);
+				}
+			}
+		}
+		else if (strcmp(line, "QUIT") == 0)
+			break;
+		else
+			ok = send_line(sock, "ERROR invalid request\n", NULL);
+
+		if (!ok)
+			break;
+	}
+	close(sock);
+}
+
+static void
+serve_usage(void)
+{
+	printf("Usage: pg_streamrecv serve -d <directory> [-h <listen address>] [-p <port>] [-K <key file>] [-v]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv serve" - serve archive files over TCP
+ */
+int
+serve_main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs,
+			   *addr;
+	char		defport[16];
+	int			listensock = -1;
+	int			one = 1;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:h:K:p:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'h':
+				listenhost = strdup(optarg);
+				break;
+			case 'K':
+				encryption_key_file = strdup(optarg);
+				break;
+			case 'p':
+				port = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				serve_usage();
+		}
+	}
+	if (!basedir || optind != argc)
+		serve_usage();
+	if (!port)
+	{
+		sprintf(defport, "%i", DEFAULT_SERVE_PORT);
+		port = defport;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(strcmp(listenhost, "*") == 0 ? NULL : listenhost, port,
+					&hints, &addrs) != 0)
+	{
+		fprintf(stderr, "Could not resolve listen address %s\n", listenhost);
+		exit(1);
+	}
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		listensock = socket(addr->ai_family, addr->ai_socktype,
+							addr->ai_protocol);
+		if (listensock < 0)
+			continue;
+		setsockopt(listensock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(listensock, addr->ai_addr, addr->ai_addrlen) == 0 &&
+			listen(listensock, 64) == 0)
+			break;
+		close(listensock);
+		listensock = -1;
+	}
+	freeaddrinfo(addrs);
+	if (listensock < 0)
+	{
+		fprintf(stderr, "Could not listen on %s port %s: %m\n",
+				listenhost, port);
+		exit(1);
+	}
+
+	if (verbose)
+		printf("Serving %s on %s port %s\n", basedir, listenhost, port);
+	fflush(stdout);
+
+	/* Children are reaped automatically */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1)
+	{
+		int			sock = accept(listensock, NULL, NULL);
+		pid_t		pid;
+
+		if (sock < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "accept() failed: %m\n");
+			exit(1);
+		}
+
+		pid = fork();
+		if (pid < 0)
+		{
+			fprintf(stderr, "Failed to fork: %m\n");
+			close(sock);
+			continue;
+		}
+		if (pid == 0)
+		{
+			close(listensock);
+			serve_connection(sock);
+			exit(0);
+		}
+		close(sock);
+	}
+	return 0;
+}
+
+
+static void
+fetch_usage(void)
+{
+	printf("Usage: pg_streamrecv fetch [-h <host>] [-p <port>] <filename|location> <destination> [...]\n");
+	exit(1);
+}
+
+/*
+ * Receive one answer from the server into dest. Returns 1 if the file
+ * was received, 0 if it wasn't found.
+ */
+static int
+fetch_one(SockReader *reader, const char *dest)
+{
+	char		line[MAX_LINE];
+	char		tmp[MAXPGPATH];
+	char		fname[MAXFNAMELEN];
+	unsigned long size;
+	int			out;
+
+	if (!sockreader_line(reader, line, sizeof(line)))
+	{
+		fprintf(stderr, "Connection closed by server\n");
+		exit(1);
+	}
+	if (strcmp(line, "NOTFOUND") == 0)
+		return 0;
+	if (sscanf(line, "OK %lu %63s", &size, fname) != 2)
+	{
+		fprintf(stderr, "Error from server: %s\n", line);
+		exit(1);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out == -1)
+	{
+		fprintf(stderr, "Failed to create %s: %m\n", tmp);
+		exit(1);
+	}
+	while (size > 0)
+	{
+		int			n;
+
+		if (!sockreader_fill(reader))
+		{
+			fprintf(stderr, "Connection closed while receiving %s\n", fname);
+			exit(1);
+		}
+		n = Min(size, reader->len - reader->pos);
+		if (!write_all(out, reader->buf + reader->pos, n))
+		{
+			fprintf(stderr, "Failed to write %s: %m\n", tmp);
+			exit(1);
+		}
+		reader->pos += n;
+		size -= n;
+	}
+	if (close(out) != 0 || rename(tmp, dest) != 0)
+	{
+		fprintf(stderr, "Failed to move %s into place as %s: %m\n", tmp, dest);
+		exit(1);
+	}
+	if (verbose)
+		printf("Fetched %s into %s\n", fname, dest);
+	return 1;
+}
+
+/*
+ * "pg_streamrecv fetch" - client for the serve mode. All requests are
+ * sent at once, and the answers are read back as they come.
+ */
+int
+fetch_main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs,
+			   *addr;
+	SockReader reader;
+	char	   *host = "localhost";
+	char		defport[16];
+	char		buf[MAX_LINE];
+	int			sock = -1;
+	int			allfound = 1;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "h:p:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'h':
+				host = strdup(optarg);
+				break;
+			case 'p':
+				port = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				fetch_usage();
+		}
+	}
+	if (optind == argc || (argc - optind) % 2 != 0)
+		fetch_usage();
+	if (!port)
+	{
+		sprintf(defport, "%i", DEFAULT_SERVE_PORT);
+		port = defport;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "Could not resolve host %s\n", host);
+		exit(1);
+	}
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	if (sock < 0)
+	{
+		fprintf(stderr, "Could not connect to %s port %s: %m\n", host, port);
+		exit(1);
+	}
+
+	for (i = optind; i < argc; i += 2)
+	{
+		if (strchr(argv[i], '/'))
+			snprintf(buf, sizeof(buf), "GETLSN %s\n", argv[i]);
+		else
+			snprintf(buf, sizeof(buf), "GET %s\n", argv[i]);
+		if (!write_all(sock, buf, strlen(buf)))
+		{
+			fprintf(stderr, "Failed to send request: %m\n");
+			exit(1);
+		}
+	}
+	if (!write_all(sock, "QUIT\n", 5))
+	{
+		fprintf(stderr, "Failed to send request: %m\n");
+		exit(1);
+	}
+
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = sock;
+	for (i = optind; i < argc; i += 2)
+	{
+		if (!fetch_one(&reader, argv[i + 1]))
+		{
+			if (verbose)
+				printf("%s not found\n", argv[i]);
+			allfound = 0;
+		}
+	}
+	close(sock);
+
+	return allfound ? 0 : 1;
+}
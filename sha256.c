@@ -0,0 +1,326 @@
+/*
+ * sha256.c - SHA-256 for segment checksums
+ *
+ * A plain C implementation of SHA-256 as specified in FIPS 180-4, so we
+ * don't need a crypto library just for checksums. On x86-64 CPUs with the
+ * SHA extensions, blocks are processed with the SHA-NI instructions
+ * instead, which is several times faster. Which one to use is decided at
+ * runtime the first time a hash is computed, the same way the backend
+ * picks its CRC implementation, so the same binary runs everywhere.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <string.h>
+
+#include "pg_streamrecv.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && __GNUC__ >= 5
+#define USE_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_choose(uint32 *h, const unsigned char *p, size_t n);
+
+static void (*sha256_blocks) (uint32 *h, const unsigned char *p, size_t n) =
+	sha256_blocks_choose;
+
+
+static void
+sha256_blocks_c(uint32 *h, const unsigned char *p, size_t nblocks)
+{
+	uint32		w[64];
+	uint32		a,
+				b,
+				c,
+				d,
+				e,
+				f,
+				g,
+				hh;
+	int			i;
+
+	while (nblocks-- > 0)
+	{
+		for (i = 0; i < 16; i++)
+			w[i] = ((uint32) p[i * 4] << 24) | ((uint32) p[i * 4 + 1] << 16) |
+				((uint32) p[i * 4 + 2] << 8) | (uint32) p[i * 4 + 3];
+		for (i = 16; i < 64; i++)
+		{
+			uint32		s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32		s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = h[0];
+		b = h[1];
+		c = h[2];
+		d = h[3];
+		e = h[4];
+		f = h[5];
+		g = h[6];
+		hh = h[7];
+		for (i = 0; i < 64; i++)
+		{
+			uint32		s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+			uint32		ch = (e & f) ^ (~e & g);
+			uint32		t1 = hh + s1 + ch + sha256_k[i] + w[i];
+			uint32		s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+			uint32		maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32		t2 = s0 + maj;
+
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+
+		p += 64;
+	}
+}
+
+#ifdef USE_SHA_NI
+/*
+ * The SHA-NI instructions work on the state in the order ABEF and CDGH,
+ * and do two rounds at a time with sha256rnds2. The message schedule is
+ * kept in four registers of four words each, the last 16 words.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha256_blocks_shani(uint32 *h, const unsigned char *p, size_t nblocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+										0x0405060700010203ULL);
+	__m128i		state0,
+				state1,
+				tmp,
+				msg,
+				abef,
+				cdgh;
+	__m128i		w[4];
+	int			i;
+
+	tmp = _mm_loadu_si128((const __m128i *) &h[0]);
+	state1 = _mm_loadu_si128((const __m128i *) &h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);				/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);		/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);		/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	while (nblocks-- > 0)
+	{
+		abef = state0;
+		cdgh = state1;
+
+		for (i = 0; i < 16; i++)
+		{
+			if (i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + i * 16)),
+										mask);
+			else
+				w[i & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+								  _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)),
+					w[(i + 3) & 3]);
+
+			msg = _mm_add_epi32(w[i & 3],
+								_mm_loadu_si128((const __m128i *) &sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		p += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);			/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);		/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);		/* HGFE */
+	_mm_storeu_si128((__m128i *) &h[0], state0);
+	_mm_storeu_si128((__m128i *) &h[4], state1);
+}
+
+static int
+have_sha_ni(void)
+{
+	unsigned int eax,
+				ebx,
+				ecx,
+				edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) != 0;
+}
+#endif
+
+static void
+sha256_blocks_choose(uint32 *h, const unsigned char *p, size_t nblocks)
+{
+#ifdef USE_SHA_NI
+	if (have_sha_ni())
+		sha256_blocks = sha256_blocks_shani;
+	else
+#endif
+		sha256_blocks = sha256_blocks_c;
+	sha256_blocks(h, p, nblocks);
+}
+
+void
+sha256_init(SHA256State *state)
+{
+	static const uint32 iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(state->h, iv, sizeof(iv));
+	state->total = 0;
+	state->used = 0;
+}
+
+void
+sha256_update(SHA256State *state, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	state->total += len;
+
+	if (state->used > 0)
+	{
+		size_t		n = Min(len, sizeof(state->buf) - state->used);
+
+		memcpy(state->buf + state->used, p, n);
+		state->used += n;
+		p += n;
+		len -= n;
+		if (state->used < sizeof(state->buf))
+			return;
+		sha256_blocks(state->h, state->buf, 1);
+		state->used = 0;
+	}
+
+	if (len >= 64)
+	{
+		sha256_blocks(state->h, p, len / 64);
+		p += len & ~(size_t) 63;
+		len &= 63;
+	}
+
+	if (len > 0)
+	{
+		memcpy(state->buf, p, len);
+		state->used = len;
+	}
+}
+
+void
+sha256_final(SHA256State *state, unsigned char *digest)
+{
+	uint64		bits = state->total * 8;
+	int			i;
+
+	state->buf[state->used++] = 0x80;
+	if (state->used > 56)
+	{
+		memset(state->buf + state->used, 0, 64 - state->used);
+		sha256_blocks(state->h, state->buf, 1);
+		state->used = 0;
+	}
+	memset(state->buf + state->used, 0, 56 - state->used);
+	for (i = 0; i < 8; i++)
+		state->buf[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+	sha256_blocks(state->h, state->buf, 1);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i * 4] = (unsigned char) (state->h[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char) (state->h[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char) (state->h[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char) state->h[i];
+	}
+}
+
+/*
+ * HMAC-SHA256 as in RFC 2104, for deriving keys.
+ */
+void
+hmac_sha256(const void *key, size_t keylen, const void *data, size_t len,
+			unsigned char *digest)
+{
+	SHA256State sha;
+	unsigned char k[64];
+	unsigned char pad[64];
+	unsigned char inner[SHA256_LEN];
+	int			i;
+
+	memset(k, 0, sizeof(k));
+	if (keylen > sizeof(k))
+	{
+		sha256_init(&sha);
+		sha256_update(&sha, key, keylen);
+		sha256_final(&sha, k);
+	}
+	else
+		memcpy(k, key, keylen);
+
+	for (i = 0; i < 64; i++)
+		pad[i] = k[i] ^ 0x36;
+	sha256_init(&sha);
+	sha256_update(&sha, pad, sizeof(pad));
+	sha256_update(&sha, data, len);
+	sha256_final(&sha, inner);
+
+	for (i = 0; i < 64; i++)
+		pad[i] = k[i] ^ 0x5c;
+	sha256_init(&sha);
+	sha256_update(&sha, pad, sizeof(pad));
+	sha256_update(&sha, inner, sizeof(inner));
+	sha256_final(&sha, digest);
+}
@@ -0,0 +1,1723 @@
+
+/*
+ * stream.c - receive a PostgreSQL 9.0+ replication stream and store it in
+ *			  files like a standard log archive directory
+ *
+ * This is the receiver itself, built into libpgstreamrecv along with
+ * everything else but the command line, so other programs can run it in
+ * process instead of starting pg_streamrecv and watching the directory:
+ *
+ *	StreamRecv *s;
+ *
+ *	connstr = "host=master user=replicator";
+ *	basedir = "/var/lib/pgsql/walarchive";
+ *	stream_add_sink(&my_sink);
+ *	s = stream_open();
+ *	stream_run(s);
+ *	stream_close(s);
+ *
+ * The segment files in the base directory are always written, since the
+ * indexes, the control socket and restarting all depend on them. Sinks
+ * added with stream_add_sink() get each block of WAL as soon as it has
+ * been written, and are told when it has been flushed and when a segment
+ * has been completed. stream_poll() handles one block at a time, for
+ * callers that have other things to do in between.
+ *
+ * The stream is configured through the same global variables as the
+ * command line and configuration file set, so there can only be one per
+ * process, and errors are fatal just like in the rest of pg_streamrecv.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/select.h>
+#include <sys/time.h>
+
+
+#include "pg_streamrecv.h"
+
+#include <libpq-fe.h>
+
+/* Options, set from the commandline or configuration file */
+char	   *connstr = NULL;
+char	   *basedir = NULL;
+int			verbose = 0;
+int			flush_interval = 0;
+int			takeover = 0;
+
+
+/* Other global variables */
+int			timeline;
+char		current_walfile_name[64];
+uint32		current_walfile_crc;
+SHA256State current_walfile_sha256;
+XXH64State	current_walfile_xxh64;
+uint64		bytes_received = 0;
+uint64		segments_completed = 0;
+uint64		divergences = 0;
+
+/* When the oldest data not yet flushed to disk was written, or 0 */
+uint64		unflushed_since = 0;
+
+/* Listening control socket, or -1 */
+int			control_sock = -1;
+
+/* Reading from the server paused from the control socket */
+int			paused = 0;
+
+/* Reading from the server held back because the disk is nearly full */
+static int	throttled = 0;
+
+/*
+ * How far we've written and flushed, and where the server said its WAL
+ * ended and when, as of the last block received. Kept for the status
+ * request on the control socket.
+ */
+XLogRecPtr	written_upto = {0, 0};
+XLogRecPtr	flushed_upto = {0, 0};
+XLogRecPtr	server_walend = {0, 0};
+TimestampTz server_sendtime = 0;
+uint64		last_data_time = 0;
+
+/* Throughput over the last second or more */
+uint64		rate_start_time = 0;
+uint64		rate_start_bytes = 0;
+double		throughput = 0;
+
+/*
+ * Partial segment found at startup and saved aside. It's compared with
+ * the retransmission of the same segment as that arrives, and removed as
+ * soon as all of it has been seen to match.
+ */
+char	   *saved_name = NULL;
+char	   *saved_data = NULL;
+uint32		saved_len;
+uint32		saved_checked;		/* seen to match up to here */
+XLogRecPtr	saved_start;
+
+/* Decoder for WAL records, if anything is interested in them */
+XLogDecoder decoder;
+
+/*
+ * Start of the record that continues into the segment being written, if
+ * the decoder saw it, so a receiver taking over can decode it too.
+ */
+XLogRecPtr	contrecord_start = {0, 0};
+
+/* Sinks added by stream_add_sink() */
+static StreamSink *sinks = NULL;
+static int	nsinks = 0;
+
+
+#define STREAMING_HEADER_SIZE (1+8+8+8)
+
+
+/*
+ * Check if a filename looks like a WAL segment, that is 24 hex digits.
+ */
+int
+is_segment_name(const char *name)
+{
+	int			i;
+
+	if (strlen(name) != 24)
+		return 0;
+	for (i = 0; i < 24; i++)
+	{
+		if (!ISHEX(name[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Flush a directory, so the files that were created, renamed or removed
+ * in it survive a crash. Returns -1 with errno set if it can't be done.
+ */
+int
+fsync_dir(const char *dir)
+{
+	int			f = open(dir, O_RDONLY);
+	int			r;
+
+	if (f == -1)
+		return -1;
+	r = fsync(f);
+	if (r != 0)
+	{
+		int			save_errno = errno;
+
+		close(f);
+		errno = save_errno;
+		return -1;
+	}
+	return close(f);
+}
+
+/*
+ * Initiate streaming replication at exactly the given point, which is
+ * how a receiver taking over from another one continues mid-segment.
+ */
+PGresult *
+start_streaming_at(PGconn *conn, XLogRecPtr startpoint)
+{
+	char		buf[64];
+
+	sprintf(buf, "START_REPLICATION %X/%X", startpoint.xlogid,
+			startpoint.xrecoff);
+	return PQexec(conn, buf);
+}
+
+/*
+ * Initiate streaming replication at the given point in the WAL,
+ * rounded off to the beginning of the segment it's in. The rounded
+ * off location is returned in startpoint.
+ */
+PGresult *
+start_streaming(PGconn *conn, char *xlogpos, XLogRecPtr *startpoint)
+{
+	unsigned int uxlogid;
+	unsigned int uxrecoff;
+
+	if (sscanf(xlogpos, "%X/%X", &uxlogid, &uxrecoff) != 2)
+	{
+		fprintf(stderr, "Invalid format of current xlog location: %s\n",
+				xlogpos);
+		exit(1);
+	}
+
+	/*
+	 * Round off so we always start at the beginning of a file.
+	 */
+	if (uxrecoff % XLogSegSize != 0)
+		uxrecoff -= uxrecoff % XLogSegSize;
+
+	if (verbose > 1)
+	{
+		printf("Current location %s, starting replication from %X/%X\n",
+			   xlogpos, uxlogid, uxrecoff);
+	}
+
+	startpoint->xlogid = uxlogid;
+	startpoint->xrecoff = uxrecoff;
+	return start_streaming_at(conn, *startpoint);
+}
+
+/*
+ * Open a new WAL file in the inprogress directory, corresponding to
+ * the WAL location in startpoint.
+ */
+static int
+open_walfile(XLogRecPtr startpoint)
+{
+	int			f;
+	char		fn[256];
+
+	XLogFileName(current_walfile_name, timeline,
+				 startpoint.xlogid, startpoint.xrecoff / XLogSegSize);
+
+	if (verbose)
+		printf("Opening segment %s\n", current_walfile_name);
+
+	sprintf(fn, "%s/inprogress/%s", basedir, current_walfile_name);
+	f = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to open wal segment %s: %m", fn);
+		exit(1);
+	}
+	INIT_WALCRC(current_walfile_crc);
+	sha256_init(&current_walfile_sha256);
+	xxh64_init(&current_walfile_xxh64, 0);
+	return f;
+}
+
+/*
+ * Move the current file from inprogress to the base directory, and
+ * add it to the archive index.
+ * (assumes the file has been closed)
+ */
+static void
+rename_current_walfile()
+{
+	char		src[256];
+	char		dest[256];
+	ArchiveIndexEntry entry;
+	SegmentChecksum cs;
+
+	if (verbose > 1)
+		printf("Moving file %s into place\n", current_walfile_name);
+
+	sprintf(src, "%s/inprogress/%s", basedir, current_walfile_name);
+	sprintf(dest, "%s/%s", basedir, current_walfile_name);
+	if (rename(src, dest) != 0)
+	{
+		fprintf(stderr, "Failed to move WAL segment %s: %m",
+				current_walfile_name);
+		exit(1);
+	}
+
+	archive_index_fill_entry(&entry, current_walfile_name, XLogSegSize);
+	FIN_WALCRC(current_walfile_crc);
+	entry.crc = current_walfile_crc;
+	entry.flags |= ARCHIVE_ENTRY_HAS_CRC;
+	archive_index_append(basedir, &entry);
+
+	sprintf(dest, "%s/%s%s", basedir, current_walfile_name, PARTIAL_SUFFIX);
+	if (unlink(dest) != 0 && errno != ENOENT)
+		fprintf(stderr, "Failed to remove %s: %m\n", dest);
+
+	snprintf(cs.segname, sizeof(cs.segname), "%s", current_walfile_name);
+	sha256_final(&current_walfile_sha256, cs.sha256);
+	cs.xxh64 = xxh64_final(&current_walfile_xxh64);
+	checksums_append(basedir, &cs);
+
+	if (timeindex_interval > 0)
+		timeindex_finish_segment(current_walfile_name);
+	if (walstats_enabled)
+		walstats_finish_segment(current_walfile_name);
+	if (walsummary_enabled)
+		walsummary_finish_segment(current_walfile_name);
+	if (chunkstore)
+		chunkstore_segment(basedir, current_walfile_name);
+
+	segments_completed++;
+	metrics_write();
+}
+
+/*
+ * Read the saved partial segment into memory, to compare with what the
+ * server sends.
+ */
+static void
+load_saved_segment(const char *path, const char *segname)
+{
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+	int			f;
+	int			r;
+
+	saved_name = strdup(path);
+	saved_data = malloc(XLogSegSize);
+	if (!saved_name || !saved_data)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to open file %s: %m\n", path);
+		exit(1);
+	}
+	saved_len = 0;
+	saved_checked = 0;
+	while (saved_len < XLogSegSize &&
+		   (r = read(f, saved_data + saved_len, XLogSegSize - saved_len)) > 0)
+		saved_len += r;
+	if (r < 0)
+	{
+		fprintf(stderr, "Failed to read file %s: %m\n", path);
+		exit(1);
+	}
+	close(f);
+
+	XLogFromFileName(segname, &tli, &log, &seg);
+	saved_start.xlogid = log;
+	saved_start.xrecoff = seg * XLogSegSize;
+}
+
+static void
+forget_saved_segment(void)
+{
+	free(saved_name);
+	free(saved_data);
+	saved_name = NULL;
+	saved_data = NULL;
+}
+
+/*
+ * The retransmitted segment doesn't match the saved one, most likely
+ * because the server has switched to a new timeline. Keep the saved
+ * segment in the base directory with the suffix .diverged, and note where
+ * the two went different ways in the divergences file.
+ */
+static void
+saved_segment_diverged(XLogRecPtr where, int known)
+{
+	char		dest[MAXPGPATH];
+	char		fn[MAXPGPATH];
+	const char *base = strrchr(saved_name, '/') + 1;
+	struct stat st;
+	FILE	   *f;
+	int			i;
+
+	/* Don't overwrite one kept from an earlier divergence */
+	snprintf(dest, sizeof(dest), "%s/%.24s%s", basedir, base, DIVERGED_SUFFIX);
+	for (i = 1; stat(dest, &st) == 0; i++)
+		snprintf(dest, sizeof(dest), "%s/%.24s%s.%i", basedir, base,
+				 DIVERGED_SUFFIX, i);
+	if (rename(saved_name, dest) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", saved_name, dest);
+		exit(1);
+	}
+	if (known)
+		fprintf(stderr, "Received WAL diverges from saved partial segment at %X/%08X, kept it as %s\n",
+				where.xlogid, where.xrecoff, dest);
+	else
+		fprintf(stderr, "Saved partial segment was not sent again, kept it as %s\n",
+				dest);
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, DIVERGENCES_FILENAME);
+	f = fopen(fn, "a");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open %s: %m\n", fn);
+		exit(1);
+	}
+	if (known)
+		fprintf(f, "%.24s %s %X/%08X\n", base, current_walfile_name,
+				where.xlogid, where.xrecoff);
+	else
+		fprintf(f, "%.24s - -\n", base);
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", fn);
+		exit(1);
+	}
+
+	divergences++;
+	metrics_write();
+	forget_saved_segment();
+}
+
+/*
+ * Is everything in the saved partial segment from offset from on zeroes?
+ * Then the end of it just never made it to disk before the crash.
+ */
+static int
+saved_rest_is_zero(uint32 from)
+{
+	for (; from < saved_len; from++)
+		if (saved_data[from] != 0)
+			return 0;
+	return 1;
+}
+
+static void
+saved_segment_matched(void)
+{
+	printf("Removing file %s from inprogress directory - retransmission matches it.\n",
+		   saved_name);
+	if (unlink(saved_name) != 0)
+	{
+		fprintf(stderr, "Failed to remove file %s: %m\n", saved_name);
+		exit(1);
+	}
+	forget_saved_segment();
+}
+
+/*
+ * Compare a block of received data with the saved partial segment.
+ */
+static void
+compare_saved_segment(XLogRecPtr startpoint, const char *data, uint32 len)
+{
+	uint32		xlogoff = startpoint.xrecoff % XLogSegSize;
+	uint32		n;
+
+	if (startpoint.xlogid != saved_start.xlogid ||
+		startpoint.xrecoff - xlogoff != saved_start.xrecoff)
+		return;
+
+	/* Past the end of the saved file, which is then all there */
+	if (xlogoff < saved_len)
+	{
+		n = Min(len, saved_len - xlogoff);
+		if (memcmp(data, saved_data + xlogoff, n) != 0)
+		{
+			uint32		i = 0;
+
+			while (data[i] == saved_data[xlogoff + i])
+				i++;
+			if (!saved_rest_is_zero(xlogoff + i))
+			{
+				startpoint.xrecoff += i;
+				saved_segment_diverged(startpoint, 1);
+				return;
+			}
+		}
+		else if (xlogoff + n < saved_len)
+		{
+			saved_checked = xlogoff + n;
+			return;
+		}
+	}
+
+	saved_segment_matched();
+}
+
+uint64
+now_msec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * Tell everyone interested that the WAL up to flushed_upto is on disk. If
+ * completed is set, the current segment has also just been completed and
+ * moved into the base directory.
+ */
+static void
+stream_flushed(int completed)
+{
+	int			i;
+
+	notify_flushed(basedir, flushed_upto, current_walfile_name, completed);
+	for (i = 0; i < nsinks; i++)
+	{
+		if (sinks[i].flush)
+			sinks[i].flush(sinks[i].arg, flushed_upto, current_walfile_name);
+		if (completed && sinks[i].segment)
+			sinks[i].segment(sinks[i].arg, current_walfile_name);
+	}
+}
+
+/*
+ * Flush the current file if flush_interval has passed since the oldest
+ * data in it that isn't on disk yet was received.
+ */
+static void
+flush_walfile_if_due(int walfile)
+{
+	uint64		start;
+
+	if (unflushed_since == 0 || walfile < 0 ||
+		now_msec() - unflushed_since < flush_interval)
+		return;
+	start = now_usec();
+	if (fsync(walfile) != 0)
+	{
+		fprintf(stderr, "Failed to fsync file %s: %m\n", current_walfile_name);
+		exit(1);
+	}
+	io_hot_done(IO_HOT_FSYNC, start);
+	unflushed_since = 0;
+	flushed_upto = written_upto;
+	stream_flushed(0);
+}
+
+/*
+ * Wait for more data to arrive on the replication connection. SIGHUP is
+ * only let through while waiting, so a reload requested just before we
+ * start waiting isn't missed. If there's data waiting to be flushed, wait
+ * no longer than until it's due.
+ */
+static void
+wait_for_stream(PGconn *conn, int walfile)
+{
+	int			sock = PQsocket(conn);
+	int			maxfd;
+	fd_set		fds;
+	sigset_t	block,
+				orig;
+	struct timespec timeout;
+	struct timespec *tp = NULL;
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGHUP);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+	if (!config_reload_pending)
+	{
+		if (unflushed_since != 0)
+		{
+			uint64		waited = now_msec() - unflushed_since;
+			uint64		left = waited < flush_interval ? flush_interval - waited : 0;
+
+			timeout.tv_sec = left / 1000;
+			timeout.tv_nsec = (left % 1000) * 1000000;
+			tp = &timeout;
+		}
+		if (tp == NULL || timeout.tv_sec >= 1)
+		{
+			/* Look at the free space again in a second, even when idle */
+			timeout.tv_sec = 1;
+			timeout.tv_nsec = 0;
+			tp = &timeout;
+		}
+		FD_ZERO(&fds);
+		if (!paused && !throttled)
+			FD_SET(sock, &fds);
+		maxfd = sock;
+		if (control_sock >= 0)
+		{
+			FD_SET(control_sock, &fds);
+			maxfd = Max(maxfd, control_sock);
+			maxfd = Max(maxfd, control_wait_fds(&fds));
+		}
+		if (pselect(maxfd + 1, &fds, NULL, NULL, tp, &orig) < 0 &&
+			errno != EINTR)
+		{
+			fprintf(stderr, "select() failed: %m\n");
+			exit(1);
+		}
+	}
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+
+	flush_walfile_if_due(walfile);
+
+	/* While paused or throttled, leave it to TCP to hold back the server */
+	if (!paused && !throttled && !PQconsumeInput(conn))
+	{
+		fprintf(stderr, "Error reading copy data: %s\n", PQerrorMessage(conn));
+		exit(1);
+	}
+}
+
+static void
+stream_metrics(FILE *f)
+{
+	fprintf(f, "# TYPE pg_streamrecv_received_bytes_total counter\n");
+	fprintf(f, "pg_streamrecv_received_bytes_total " UINT64_FORMAT "\n",
+			bytes_received);
+	fprintf(f, "# TYPE pg_streamrecv_segments_total counter\n");
+	fprintf(f, "pg_streamrecv_segments_total " UINT64_FORMAT "\n",
+			segments_completed);
+	fprintf(f, "# TYPE pg_streamrecv_decoded_records_total counter\n");
+	fprintf(f, "pg_streamrecv_decoded_records_total " UINT64_FORMAT "\n",
+			decoder.records);
+	fprintf(f, "# TYPE pg_streamrecv_divergences_total counter\n");
+	fprintf(f, "pg_streamrecv_divergences_total " UINT64_FORMAT "\n",
+			divergences);
+	fprintf(f, "# TYPE pg_streamrecv_decoder_desyncs_total counter\n");
+	fprintf(f, "pg_streamrecv_decoder_desyncs_total " UINT64_FORMAT "\n",
+			decoder.desyncs);
+}
+
+/*
+ * Nothing found in the archive directory, so connect to the master and
+ * ask for the current xlog location, to derive the streaming start point
+ * from that.
+ */
+static char *
+get_current_xlog_location(void)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+	char		buf[128];
+	char	   *current_xlog;
+
+	sprintf(buf, "%s dbname=postgres", connstr);
+	if (verbose > 1)
+		printf("Connecting to '%s'\n", buf);
+
+	conn = PQconnectdb(buf);
+	if (!conn || PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "Failed to connect to server: %s\n",
+				PQerrorMessage(conn));
+		exit(1);
+	}
+
+	/*
+	 * Get the current xlog location
+	 */
+	res = PQexec(conn, "SELECT pg_current_xlog_location()");
+	if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "Failed to get current xlog location: %s\n",
+				PQresultErrorMessage(res));
+		exit(1);
+	}
+	current_xlog = strdup(PQgetvalue(res, 0, 0));
+	if (verbose)
+		printf("Current xlog location: %s\n", current_xlog);
+	PQclear(res);
+	PQfinish(conn);
+	return current_xlog;
+}
+
+/*
+ * Start of the segment currently being written.
+ */
+static XLogRecPtr
+current_walfile_start(void)
+{
+	XLogRecPtr	start;
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+
+	XLogFromFileName(current_walfile_name, &tli, &log, &seg);
+	start.xlogid = log;
+	start.xrecoff = seg * XLogSegSize;
+	return start;
+}
+
+/*
+ * A new receiver has asked on the control socket to take over the
+ * stream. Send it where we are and the file we're writing, and if it
+ * takes over, leave it to carry on.
+ */
+static void
+hand_off_stream(int client, PGconn *conn, int walfile)
+{
+	HandoffState state;
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+	off_t		offset;
+
+	if (walfile < 0)
+	{
+		control_reply(client, "ERROR no segment is being received yet\n");
+		close(client);
+		return;
+	}
+
+	/* Where the next byte received will go */
+	offset = lseek(walfile, 0, SEEK_CUR);
+	XLogFromFileName(current_walfile_name, &tli, &log, &seg);
+	if (offset == XLogSegSize)
+	{
+		NextLogSeg(log, seg);
+		offset = 0;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.magic = HANDOFF_MAGIC;
+	state.version = HANDOFF_VERSION;
+	state.timeline = timeline;
+	state.position.xlogid = log;
+	state.position.xrecoff = seg * XLogSegSize + offset;
+	snprintf(state.walfile_name, sizeof(state.walfile_name), "%s",
+			 current_walfile_name);
+	state.crc = current_walfile_crc;
+	state.sha256 = current_walfile_sha256;
+	state.xxh64 = current_walfile_xxh64;
+	state.bytes_received = bytes_received;
+	state.segments_completed = segments_completed;
+	state.divergences = divergences;
+	state.records = decoder.records;
+	state.desyncs = decoder.desyncs;
+	state.contrecord = contrecord_start;
+	if (saved_name)
+		snprintf(state.saved_name, sizeof(state.saved_name), "%s", saved_name);
+
+	if (verbose)
+		printf("Handing over stream at %X/%08X\n",
+			   state.position.xlogid, state.position.xrecoff);
+	if (!handoff_send(client, &state, walfile))
+	{
+		fprintf(stderr, "New receiver did not take over the stream, carrying on\n");
+		close(client);
+		return;
+	}
+
+	printf("Stream handed over at %X/%08X\n",
+		   state.position.xlogid, state.position.xrecoff);
+	PQfinish(conn);
+	exit(0);
+}
+
+/*
+ * WAL location as a byte position, for doing arithmetic on.
+ */
+static uint64
+xlog_bytes(XLogRecPtr ptr)
+{
+	return (uint64) ptr.xlogid * XLogFileSize + ptr.xrecoff;
+}
+
+static void
+update_throughput(uint64 now)
+{
+	if (now - rate_start_time < 1000)
+		return;
+	throughput = (double) (bytes_received - rate_start_bytes) * 1000 /
+		(now - rate_start_time);
+	rate_start_time = now;
+	rate_start_bytes = bytes_received;
+}
+
+/*
+ * Report the state of the stream. This is meant to be polled by
+ * monitoring, so it's all from memory.
+ */
+static void
+control_status(int client)
+{
+	uint64		now = now_msec();
+	uint64		lag = 0;
+
+	update_throughput(now);
+	if (xlog_bytes(server_walend) > xlog_bytes(written_upto))
+		lag = xlog_bytes(server_walend) - xlog_bytes(written_upto);
+
+	control_reply(client,
+				  "mode %s\n"
+				  "timeline %u\n"
+				  "segment %s\n"
+				  "received %X/%08X\n"
+				  "flushed %X/%08X\n"
+				  "server_end %X/%08X\n"
+				  "lag_bytes " UINT64_FORMAT "\n"
+				  "idle_ms " UINT64_FORMAT "\n"
+				  "throughput_bytes_per_sec %.0f\n"
+				  "bytes_received " UINT64_FORMAT "\n"
+				  "segments_completed " UINT64_FORMAT "\n"
+				  "records " UINT64_FORMAT "\n"
+				  "divergences " UINT64_FORMAT "\n",
+				  paused ? "paused" : throttled ? "throttled" : "streaming",
+				  timeline,
+				  current_walfile_name[0] ? current_walfile_name : "-",
+				  written_upto.xlogid, written_upto.xrecoff,
+				  flushed_upto.xlogid, flushed_upto.xrecoff,
+				  server_walend.xlogid, server_walend.xrecoff,
+				  lag,
+				  last_data_time ? now - last_data_time : 0,
+				  throughput,
+				  bytes_received,
+				  segments_completed,
+				  decoder.records,
+				  divergences);
+	if (server_sendtime != 0)
+		control_reply(client, "lag_seconds %li\n",
+					  (long) (time(NULL) - timestamptz_to_time_t(server_sendtime)));
+}
+
+/*
+ * Copy what has been received of the current segment so far to the base
+ * directory with the suffix .partial, not padded, for whoever needs the
+ * very latest WAL as a file now rather than when the segment is done.
+ */
+static void
+export_partial_segment(int client, int walfile)
+{
+	char		src[MAXPGPATH];
+	char		dest[MAXPGPATH];
+	char		tmp[MAXPGPATH + 4];
+	char		buf[XLOG_BLCKSZ * 8];
+	off_t		len;
+	off_t		done = 0;
+	int			in,
+				out;
+
+	if (walfile < 0)
+	{
+		control_reply(client, "ERROR no segment is being received yet\n");
+		return;
+	}
+
+	len = lseek(walfile, 0, SEEK_CUR);
+	snprintf(src, sizeof(src), "%s/inprogress/%s", basedir, current_walfile_name);
+	snprintf(dest, sizeof(dest), "%s/%s%s", basedir, current_walfile_name,
+			 PARTIAL_SUFFIX);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+
+	in = open(src, O_RDONLY);
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (in == -1 || out == -1)
+	{
+		control_reply(client, "ERROR failed to open %s: %m\n",
+					  in == -1 ? src : tmp);
+		goto fail;
+	}
+	while (done < len)
+	{
+		int			r = read(in, buf, Min(sizeof(buf), len - done));
+
+		if (r <= 0 || write(out, buf, r) != r)
+		{
+			control_reply(client, "ERROR failed to copy %s: %m\n", src);
+			goto fail;
+		}
+		done += r;
+	}
+	if (fsync(out) != 0 || close(out) != 0)
+	{
+		out = -1;
+		control_reply(client, "ERROR failed to write %s: %m\n", tmp);
+		goto fail;
+	}
+	close(in);
+	if (rename(tmp, dest) != 0)
+	{
+		control_reply(client, "ERROR failed to rename %s: %m\n", tmp);
+		unlink(tmp);
+		return;
+	}
+	control_reply(client, "OK %s %li\n", dest, (long) len);
+	return;
+
+fail:
+	if (in != -1)
+		close(in);
+	if (out != -1)
+		close(out);
+	unlink(tmp);
+}
+
+/*
+ * Serve any requests waiting on the control socket.
+ */
+static void
+handle_control_requests(PGconn *conn, int walfile)
+{
+	char		request[256];
+	int			client;
+	int			version,
+				size;
+
+	while ((client = control_accept(control_sock, request, sizeof(request))) >= 0)
+	{
+		if (sscanf(request, "HANDOFF %i %i", &version, &size) == 2)
+		{
+			if (version == HANDOFF_VERSION && size == sizeof(HandoffState))
+			{
+				hand_off_stream(client, conn, walfile);
+				continue;
+			}
+			control_reply(client, "ERROR unsupported handoff version %i\n",
+						  version);
+		}
+		else if (strcmp(request, "STATUS") == 0)
+			control_status(client);
+		else if (strcmp(request, "FLUSH") == 0)
+		{
+			if (walfile >= 0 && fsync(walfile) != 0)
+				control_reply(client, "ERROR failed to fsync %s: %m\n",
+							  current_walfile_name);
+			else
+			{
+				unflushed_since = 0;
+				flushed_upto = written_upto;
+				stream_flushed(0);
+				control_reply(client, "OK flushed to %X/%08X\n",
+							  flushed_upto.xlogid, flushed_upto.xrecoff);
+			}
+		}
+		else if (strcmp(request, "SUBSCRIBE") == 0)
+		{
+			if (control_subscribe(client))
+			{
+				control_reply(client, "OK %X/%08X %s\n",
+							  flushed_upto.xlogid, flushed_upto.xrecoff,
+							  current_walfile_name);
+				continue;
+			}
+			control_reply(client, "ERROR too many subscribers\n");
+		}
+		else if (strcmp(request, "FINALIZE") == 0)
+			export_partial_segment(client, walfile);
+		else if (strcmp(request, "PAUSE") == 0)
+		{
+			paused = 1;
+			control_reply(client, "OK paused at %X/%08X\n",
+						  written_upto.xlogid, written_upto.xrecoff);
+		}
+		else if (strcmp(request, "RESUME") == 0)
+		{
+			paused = 0;
+			control_reply(client, "OK resumed at %X/%08X\n",
+						  written_upto.xlogid, written_upto.xrecoff);
+		}
+		else if (strcmp(request, "RESET") == 0)
+		{
+			bytes_received = 0;
+			segments_completed = 0;
+			divergences = 0;
+			decoder.records = 0;
+			if (walstats_enabled)
+				walstats_reset();
+			rate_start_time = now_msec();
+			rate_start_bytes = 0;
+			throughput = 0;
+			control_reply(client, "OK\n");
+		}
+		else
+			control_reply(client, "ERROR unknown request\n");
+		close(client);
+	}
+}
+
+/*
+ * Take over the stream from the receiver running in the base directory.
+ * Returns the segment file it was writing, and sets up everything else to
+ * carry on writing it. The state it sent is returned in state, and the
+ * connection to it in sock.
+ */
+static int
+take_over_stream(HandoffState *state, int *sock)
+{
+	int			walfile = handoff_request(basedir, state, sock);
+
+	if (state->timeline != timeline)
+	{
+		fprintf(stderr, "Receiver to take over from is on timeline %u, but the server is on timeline %u\n",
+				state->timeline, timeline);
+		handoff_refuse(*sock);
+		exit(1);
+	}
+
+	snprintf(current_walfile_name, sizeof(current_walfile_name), "%s",
+			 state->walfile_name);
+	current_walfile_crc = state->crc;
+	current_walfile_sha256 = state->sha256;
+	current_walfile_xxh64 = state->xxh64;
+	bytes_received = state->bytes_received;
+	segments_completed = state->segments_completed;
+	divergences = state->divergences;
+	if (state->saved_name[0])
+		load_saved_segment(state->saved_name,
+						   strrchr(state->saved_name, '/') + 1);
+	if (flush_interval > 0)
+		unflushed_since = now_msec();
+	written_upto = state->position;
+	flushed_upto = current_walfile_start();
+
+	if (verbose)
+		printf("Took over stream at %X/%08X, writing %s\n",
+			   state->position.xlogid, state->position.xrecoff,
+			   current_walfile_name);
+	return walfile;
+}
+
+/*
+ * Give a block of WAL that has been written to the sinks.
+ */
+static void
+feed_sinks(XLogRecPtr start, const char *data, uint32 len)
+{
+	int			i;
+
+	for (i = 0; i < nsinks; i++)
+	{
+		if (sinks[i].data)
+			sinks[i].data(sinks[i].arg, start, data, len);
+	}
+}
+
+/*
+ * Feed what the receiver we took over from had written of the current
+ * segment to the decoder, so it ends up in the same state as if we had
+ * received it ourselves, and to the sinks, so pipeline stages get the
+ * whole segment rather than skipping it. It's read back from the file,
+ * which is most likely still in the page cache, rather than fetched
+ * again. If a record continues into the segment from an earlier one, that
+ * is read from the archive starting at contrecord, so the record isn't
+ * lost.
+ */
+static void
+replay_current_segment(XLogRecPtr contrecord)
+{
+	char		fn[MAXPGPATH];
+	char		buf[XLOG_BLCKSZ * 8];
+	XLogRecPtr	pos = current_walfile_start();
+	int			f;
+	int			r;
+
+	if (contrecord.xlogid != 0 || contrecord.xrecoff != 0)
+	{
+		char	   *segbuf = malloc(XLogSegSize);
+		XLogRecPtr	ptr = contrecord;
+
+		if (!segbuf)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		xlogdecode_start_at_record(&decoder, ptr);
+		while (XLByteLT(ptr, pos))
+		{
+			char		segname[MAXFNAMELEN];
+			uint32		log,
+						seg,
+						len,
+						off = ptr.xrecoff % XLogSegSize;
+
+			XLByteToSeg(ptr, log, seg);
+			XLogFileName(segname, timeline, log, seg);
+			if (!load_archive_segment(basedir, segname, segbuf, &len) ||
+				len <= off)
+				break;
+			xlogdecode_feed(&decoder, ptr, segbuf + off, len - off);
+			ptr.xrecoff += len - off;
+			if (ptr.xrecoff >= XLogFileSize)
+			{
+				ptr.xlogid++;
+				ptr.xrecoff = 0;
+			}
+		}
+		free(segbuf);
+	}
+
+	snprintf(fn, sizeof(fn), "%s/inprogress/%s", basedir, current_walfile_name);
+	f = open(fn, O_RDONLY);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to open file %s: %m\n", fn);
+		exit(1);
+	}
+	while ((r = read(f, buf, sizeof(buf))) > 0)
+	{
+		xlogdecode_feed(&decoder, pos, buf, r);
+		feed_sinks(pos, buf, r);
+		pos.xrecoff += r;
+	}
+	if (r < 0)
+	{
+		fprintf(stderr, "Failed to read file %s: %m\n", fn);
+		exit(1);
+	}
+	close(f);
+}
+
+/*
+ * Convert a WAL filename to a log position in the %X/%X format.
+ * Optionally add one segment to the position before converting
+ * it, thus pointing at the next segment.
+ */
+static char *
+filename_to_logpos(char *filename, int add_segment)
+{
+	char		buf[64];
+	uint32		tli,
+				log,
+				seg;
+
+	XLogFromFileName(filename, &tli, &log, &seg);
+	if (add_segment)
+		NextLogSeg(log, seg);
+	sprintf(buf, "%X/%X", log, seg * XLogSegSize);
+	return strdup(buf);
+}
+
+
+/*
+ * Figure out where to start replicating from, by looking at these
+ * options:
+ *
+ * 1. If there is an in-progress file, start from the start of that file
+ * 2. Look for the latest file in the archive location, start after that
+ * 3. Start from the beginning of current WAL segment with a warning
+ */
+static char *
+get_streaming_start_point()
+{
+	DIR		   *dir;
+	struct dirent *dirent;
+	char		buf[256];
+	char	   *filename = NULL;
+	struct stat st;
+	int			i;
+	ArchiveIndex *idx;
+
+	/*
+	 * Start by checking if there is a file in the inprogress directory.
+	 */
+	sprintf(buf, "%s/inprogress", basedir);
+	dir = opendir(buf);
+	if (!dir)
+	{
+		fprintf(stderr, "Failed to open inprogress directory %s: %m", buf);
+		exit(1);
+	}
+
+	while ((dirent = readdir(dir)) != NULL)
+	{
+		char		fn[256];
+
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+		if (filename)
+		{
+			fprintf(stderr,
+					"In progress directory contains more than one file!\n");
+			exit(1);
+		}
+		sprintf(fn, "%s/%s", buf, dirent->d_name);
+		if (stat(fn, &st) != 0)
+		{
+			fprintf(stderr, "Failed to stat file %s: %m", fn);
+			exit(1);
+		}
+		if (!S_ISREG(st.st_mode))
+		{
+			fprintf(stderr,
+					"In progress directory contains non-file entry %s\n",
+					dirent->d_name);
+			exit(1);
+		}
+
+		filename = strdup(dirent->d_name);
+	}
+	closedir(dir);
+
+	if (filename != NULL)
+	{
+		/*
+		 * Something exists in the inprogress directory, try
+		 * to figure out what it is. It can be:
+		 * 1. a started segment file
+		 * 2. a segment file saved away
+		 * 3. something unknown
+		 */
+		if (strlen(filename) == 24)
+		{
+			/*
+			 * Looks like a segment, double-check characters
+			 */
+			char		src[256];
+			char		dest[256];
+
+			for (i = 0; i < 24; i++)
+			{
+				if (!ISHEX(filename[i]))
+				{
+					fprintf(stderr,
+							"Unknown file '%s' found in inprogress directory.\n",
+							filename);
+					exit(1);
+				}
+			}
+
+			/*
+			 * Indeed we have a partial segment. Let's save it away. 
+			 */
+			fprintf(stderr,
+					"Partial segment %s found. Saving aside, and attempting re-request.\n",
+					filename);
+			sprintf(src, "%s/inprogress/%s", basedir, filename);
+			sprintf(dest, "%s/inprogress/%s.save", basedir, filename);
+			if (rename(src, dest) != 0)
+			{
+				fprintf(stderr, "Failed to rename %s to %s: %m\n", src, dest);
+				exit(1);
+			}
+
+			/*
+			 * Keep the contents of this partial segment so we can check the
+			 * retransmission of the segment against it, and remove it once
+			 * it has passed the point we were at before.
+			 */
+			load_saved_segment(dest, filename);
+
+			/*
+			 * Existing file moved away. Now return the WAL location at the
+			 * start of this segment to re-transfer it.
+			 */
+			return filename_to_logpos(filename, 0);
+		}
+		else if (strlen(filename) == 29)
+		{
+			/*
+			 * Segment with ".save" at the end?
+			 */
+			if (strcmp(filename + 24, ".save") == 0)
+			{
+				fprintf(stderr,
+						"A file called '%s' exists in the inprogress directory.\n",
+						filename);
+				fprintf(stderr,
+						"This file is left over from a previous attempt to recover,\n");
+				fprintf(stderr,
+						"and you will need to figure out manually if you should delete\n");
+				fprintf(stderr,
+						"this file, or try to use it for manual recovery.\n");
+				exit(1);
+			}
+		}
+		fprintf(stderr, "Unknown file '%s' found in inprogress directory.\n",
+				filename);
+		exit(1);
+	}
+
+
+	/*
+	 * No file found in the inprogress directory. Let's see if we can find
+	 * something in the main archive directory. The archive index is sorted,
+	 * so the last entry in it is the latest segment we have.
+	 */
+	idx = archive_index_open(basedir);
+	if (!idx)
+	{
+		fprintf(stderr, "Failed to open archive index in %s\n", basedir);
+		exit(1);
+	}
+	if (idx->nentries > 0)
+	{
+		/*
+		 * Found a segment, convert it to a WAL location and request the
+		 * segment following it.
+		 */
+		filename = filename_to_logpos(idx->entries[idx->nentries - 1].path, 1);
+		archive_index_close(idx);
+		return filename;
+	}
+	archive_index_close(idx);
+
+	/*
+	 * Nothing found, create sometihng new
+	 */
+	fprintf(stderr,
+			"Nothing found in archive directory, starting streaming from current position.\n");
+	return NULL;
+}
+
+
+/*
+ * Add a sink to be given the WAL as it's received. The sink is copied, so
+ * it doesn't need to stay around.
+ */
+void
+stream_add_sink(const StreamSink *sink)
+{
+	sinks = realloc(sinks, (nsinks + 1) * sizeof(StreamSink));
+	if (!sinks)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	sinks[nsinks++] = *sink;
+}
+
+/*
+ * Connect to the server and start streaming into the base directory,
+ * from where the files already there end, or from where the server is now
+ * if there are none. With takeover set, take over from the receiver
+ * already running in the base directory instead.
+ */
+StreamRecv *
+stream_open(void)
+{
+	StreamRecv *s;
+	PGconn	   *conn;
+	PGresult   *res;
+	char		buf[128];
+	char	   *current_xlog = NULL;
+	struct stat st;
+	HandoffState handoff;
+	int			handoffsock = -1;
+
+	s = malloc(sizeof(StreamRecv));
+	if (!s)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	s->walfile = -1;
+
+	/*
+	 * Verify that the archive dir exists
+	 */
+	if (stat(basedir, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "Base directory %s does not exist\n", basedir);
+		exit(1);
+	}
+
+	/*
+	 * Create inprogress directory if it does not exist
+	 */
+	sprintf(buf, "%s/inprogress", basedir);
+	if (stat(buf, &st) != 0)
+	{
+		/*
+		 * Not there
+		 */
+		if (mkdir(buf, 0777) != 0)
+		{
+			fprintf(stderr, "failed to create directory %s: %m", buf);
+			exit(1);
+		}
+	}
+	else
+	{
+		if (!S_ISDIR(st.st_mode))
+		{
+			fprintf(stderr, "%s is not a directory.\n", buf);
+			exit(1);
+		}
+	}
+
+	/*
+	 * Completed segments go to the chunk store, if we have one
+	 */
+	if (chunkstore)
+		chunkstore_link(basedir, chunkstore);
+
+	/*
+	 * When taking over from a running receiver, it decides where we start,
+	 * and has kept the archive index up to date.
+	 */
+	if (!takeover)
+	{
+		/*
+		 * Bring the archive index up to date with what's in the directory
+		 */
+		archive_index_check(basedir);
+
+		/*
+		 * Figure out where to start if there are existing files
+		 * available, and otherwise from where the master is now.
+		 */
+		current_xlog = get_streaming_start_point();
+		if (current_xlog == NULL)
+			current_xlog = get_current_xlog_location();
+	}
+
+
+	/*
+	 * Connect in replication mode to the server
+	 */
+	sprintf(buf, "%s dbname=replication replication=true", connstr);
+	if (verbose > 1)
+		printf("Connecting to '%s'\n", buf);
+	conn = PQconnectdb(buf);
+	if (!conn || PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "Failed to connect to server for replication: %s\n",
+				PQerrorMessage(conn));
+		exit(1);
+	}
+	s->conn = conn;
+
+	/*
+	 * Identify the server and get the timeline
+	 */
+	res = PQexec(conn, "IDENTIFY_SYSTEM");
+	if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "Failed to identify system: %s\n",
+				PQresultErrorMessage(res));
+		exit(1);
+	}
+	if (verbose)
+	{
+		printf("Systemid: %s\n", PQgetvalue(res, 0, 0));
+		printf("Timeline: %s\n", PQgetvalue(res, 0, 1));
+	}
+	timeline = atoi(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	/*
+	 * Start streaming the log
+	 */
+	if (takeover)
+	{
+		s->walfile = take_over_stream(&handoff, &handoffsock);
+		s->streamstart = current_walfile_start();
+		res = start_streaming_at(conn, handoff.position);
+	}
+	else
+		res = start_streaming(conn, current_xlog, &s->streamstart);
+	if (!res || PQresultStatus(res) != PGRES_COPY_OUT)
+	{
+		fprintf(stderr, "Failed to start replication: %s\n",
+				PQresultErrorMessage(res));
+		if (takeover)
+			handoff_refuse(handoffsock);
+		exit(1);
+	}
+	PQclear(res);
+	if (takeover)
+		handoff_confirm(handoffsock);
+
+	/*
+	 * Set up decoding of the WAL records as they arrive, for the
+	 * features that need it.
+	 */
+	xlogdecode_init(&decoder);
+	if (takeover)
+		decoder.desyncs = handoff.desyncs;
+	if (timeindex_interval > 0)
+		timeindex_init(&decoder, s->streamstart);
+	if (recindex_stride > 0)
+		recindex_init(&decoder, s->streamstart);
+	if (walstats_enabled)
+		walstats_init(&decoder);
+	if (walsummary_enabled)
+		walsummary_init(&decoder);
+	metrics_register(stream_metrics);
+
+	if (takeover)
+	{
+		replay_current_segment(handoff.contrecord);
+
+		/* The records replayed were counted by the old receiver already */
+		decoder.records = handoff.records;
+	}
+
+	/*
+	 * Listen for requests from other processes, like a new receiver
+	 * wanting to take over.
+	 */
+	control_sock = control_listen(basedir);
+	rate_start_time = now_msec();
+
+	return s;
+}
+
+/*
+ * Receive and store the next block of WAL, waiting for it if there is
+ * none yet, and handle anything else that has come up meanwhile. Returns
+ * 0 once the server has ended the stream, 1 otherwise.
+ */
+int
+stream_poll(StreamRecv *s)
+{
+	PGconn	   *conn = s->conn;
+	int			walfile = s->walfile;
+	char	   *copybuf = NULL;
+	XLogRecPtr	startpoint;
+	int			xlogoff;
+	int			r;
+	int			i;
+	uint64		iostart;
+
+	if (config_reload_pending)
+	{
+		config_reload_pending = 0;
+		config_load(1);
+	}
+	if (control_sock >= 0)
+		handle_control_requests(conn, walfile);
+	throttled = diskspace_check();
+	if (chunkstore)
+		chunkstore_poll(basedir);
+	if (paused || throttled)
+	{
+		wait_for_stream(conn, walfile);
+		return 1;
+	}
+
+	r = PQgetCopyData(conn, &copybuf, 1);
+	if (r == 0)
+	{
+		wait_for_stream(conn, walfile);
+		return 1;
+	}
+	if (r == -1)
+		return 0;
+	if (r == -2)
+	{
+		fprintf(stderr, "Error reading copy data: %s\n", PQerrorMessage(conn));
+		exit(1);
+	}
+	if (r < STREAMING_HEADER_SIZE + 1)
+	{
+		fprintf(stderr, "Received %i bytes in a copy data block, shorter than the required %i\n", r, STREAMING_HEADER_SIZE + 1);
+		exit(1);
+	}
+	if (copybuf[0] != 'w')
+	{
+		fprintf(stderr, "Received invalid copy data type: %c\n",
+				copybuf[0]);
+		exit(1);
+	}
+	memcpy(&startpoint, copybuf + 1, 8);	/* sizeof(XlogRecPtr) == 8 */
+	memcpy(&server_walend, copybuf + 9, 8);
+	memcpy(&server_sendtime, copybuf + 17, 8);
+
+	/*
+	 * Figure out how far into this logfile this block should go
+	 */
+	xlogoff = startpoint.xrecoff % XLogSegSize;
+
+	if (walfile > -1)
+	{
+		if (xlogoff == 0)
+		{
+			/*
+			 * Switched to a new file. Verify size of the old one
+			 */
+			if (lseek(walfile, 0, SEEK_CUR) != XLogSegSize)
+			{
+				fprintf(stderr,
+						"Received record at offset 0 while file size still only %li\n",
+						lseek(walfile, 0, SEEK_CUR));
+				exit(1);
+			}
+
+			/*
+			 * Offset zero in a new file - close the old one.
+			 * Always fsync the old file, so we can get a write-ordering
+			 * guarantee against the new file.
+			 */
+			iostart = now_usec();
+			fsync(walfile);
+			io_hot_done(IO_HOT_FSYNC, iostart);
+			close(walfile);
+			unflushed_since = 0;
+			flushed_upto = written_upto;
+			if (decoder.inrecord)
+				contrecord_start = decoder.recstart;
+			else
+				contrecord_start.xlogid = contrecord_start.xrecoff = 0;
+			/*
+			 * A saved copy of the segment just completed that has nothing
+			 * but zeroes past what was compared, if anything, matches.
+			 */
+			if (saved_name &&
+				strncmp(strrchr(saved_name, '/') + 1, current_walfile_name,
+						24) == 0 &&
+				saved_rest_is_zero(saved_checked))
+				saved_segment_matched();
+			else if (saved_name)
+				saved_segment_diverged(startpoint, 0);
+			rename_current_walfile();
+			stream_flushed(1);
+			walfile = open_walfile(startpoint);
+		}
+		else
+		{
+			/*
+			 * Not a new segment, so verify that position in file matches
+			 */
+			if (lseek(walfile, 0, SEEK_CUR) != xlogoff)
+			{
+				fprintf(stderr,
+						"Received xlog record for offset %i but writing at offset %li\n",
+						xlogoff, lseek(walfile, 0, SEEK_CUR));
+				exit(1);
+			}
+			/*
+			 * Position matches, so just write the data out further down
+			 */
+		}
+	}
+	else
+	{
+		/*
+		 * No current walfile - open a new one
+		 */
+		if (xlogoff != 0)
+		{
+			fprintf(stderr,
+					"Received xlog record for offset %i with no file open - needs to start at xlog boundary!\n",
+					xlogoff);
+			exit(1);
+		}
+		walfile = open_walfile(startpoint);
+	}
+	if (verbose > 1)
+		printf("Received one batch, size %i\n", r - STREAMING_HEADER_SIZE);
+	for (i = STREAMING_HEADER_SIZE; i < r;)
+	{
+		ssize_t		w;
+
+		iostart = now_usec();
+		w = write(walfile, copybuf + i, r - i);
+		io_hot_done(IO_HOT_WRITE, iostart);
+		if (w > 0)
+			i += w;
+		else if (w < 0 && errno == ENOSPC)
+		{
+			/* Wait for room rather than give up on the block */
+			diskspace_full();
+		}
+		else if (w < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "Failed to write %i bytes to file %s: %m",
+					r - STREAMING_HEADER_SIZE, current_walfile_name);
+			exit(1);
+		}
+	}
+	written_upto = startpoint;
+	written_upto.xrecoff += r - STREAMING_HEADER_SIZE;
+	if (written_upto.xrecoff >= XLogFileSize)
+	{
+		written_upto.xlogid++;
+		written_upto.xrecoff = 0;
+	}
+	if (flush_interval > 0)
+	{
+		if (unflushed_since == 0)
+			unflushed_since = now_msec();
+		flush_walfile_if_due(walfile);
+	}
+	COMP_WALCRC(current_walfile_crc, copybuf + STREAMING_HEADER_SIZE,
+				r - STREAMING_HEADER_SIZE);
+	sha256_update(&current_walfile_sha256, copybuf + STREAMING_HEADER_SIZE,
+				  r - STREAMING_HEADER_SIZE);
+	xxh64_update(&current_walfile_xxh64, copybuf + STREAMING_HEADER_SIZE,
+				 r - STREAMING_HEADER_SIZE);
+	bytes_received += r - STREAMING_HEADER_SIZE;
+	last_data_time = now_msec();
+	update_throughput(last_data_time);
+	if (decoder.nconsumers > 0)
+		xlogdecode_feed(&decoder, startpoint, copybuf + STREAMING_HEADER_SIZE,
+						r - STREAMING_HEADER_SIZE);
+
+	/*
+	 * If there is a saved away partial segment, check the data
+	 * received against it. It's removed once all of it has been
+	 * received again, or moved out of the way if it doesn't match.
+	 */
+	if (saved_name)
+		compare_saved_segment(startpoint, copybuf + STREAMING_HEADER_SIZE,
+							  r - STREAMING_HEADER_SIZE);
+	feed_sinks(startpoint, copybuf + STREAMING_HEADER_SIZE,
+			   r - STREAMING_HEADER_SIZE);
+	PQfreemem(copybuf);
+
+	s->walfile = walfile;
+	return 1;
+}
+
+/*
+ * Receive the stream until the server ends it.
+ */
+void
+stream_run(StreamRecv *s)
+{
+	while (stream_poll(s))
+		;
+}
+
+/*
+ * Check how the stream ended, and disconnect.
+ */
+void
+stream_close(StreamRecv *s)
+{
+	PGresult   *res;
+
+	/*
+	 * End of copy data, check the final result. In case the server shut
+	 * down, it will send a proper "command ok" result. If something
+	 * went wrong, it will send an error message that should show up
+	 * here.
+	 */
+	res = PQgetResult(s->conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "Replication error: %s\n", PQresultErrorMessage(res));
+		exit(1);
+	}
+	PQfinish(s->conn);
+
+	if (verbose)
+		printf("Replication stream finished.\n");
+
+	free(s);
+}
@@ -0,0 +1,434 @@
+/*
+ * timeindex.c - commit timestamp to WAL location index
+ *
+ * Transaction commit and abort records are picked out of the stream by
+ * the WAL decoder as they arrive. For each segment we remember the range
+ * of commit timestamps in it, plus a sample of the timestamp and location
+ * of a commit every timeindex_interval milliseconds. Both are appended to
+ * the time index when the segment is completed, so the index only ever
+ * covers segments that are in the archive.
+ *
+ * With this, finding the segments needed to recover to a given point in
+ * time is a binary search in the index, rather than a matter of replaying
+ * WAL until the target is passed.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+
+/* Seconds between the Unix epoch and the PostgreSQL epoch (2000-01-01) */
+#define POSTGRES_EPOCH_OFFSET	946684800
+
+/* Sampling interval in milliseconds, 0 to disable the time index */
+int			timeindex_interval = 1000;
+
+/* Samples and timestamp range for the segment currently being received */
+static TimeIndexEntry *pending = NULL;
+static int	npending = 0;
+static int	maxpending = 0;
+static TimestampTz segment_mintime;
+static TimestampTz segment_maxtime;
+static int	segment_has_commits = 0;
+static TimestampTz last_sample_time;
+static int	have_sample = 0;
+
+
+TimestampTz
+time_t_to_timestamptz(time_t t)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+	return ((TimestampTz) t - POSTGRES_EPOCH_OFFSET) * 1000000;
+#else
+	return (TimestampTz) t - POSTGRES_EPOCH_OFFSET;
+#endif
+}
+
+time_t
+timestamptz_to_time_t(TimestampTz t)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+	return (time_t) (t / 1000000 + POSTGRES_EPOCH_OFFSET);
+#else
+	return (time_t) (t + POSTGRES_EPOCH_OFFSET);
+#endif
+}
+
+static TimestampTz
+interval_to_timestamptz(int msec)
+{
+#ifdef HAVE_INT64_TIMESTAMP
+	return (TimestampTz) msec * 1000;
+#else
+	return (TimestampTz) msec / 1000.0;
+#endif
+}
+
+/*
+ * Get the name of the segment holding the last byte before endpoint.
+ */
+void
+segment_for_endpoint(char *segname, TimeLineID tli, XLogRecPtr endpoint)
+{
+	uint32		log,
+				seg;
+
+	XLByteToSeg(endpoint, log, seg);
+	if (endpoint.xrecoff % XLogSegSize == 0)
+		PrevLogSeg(log, seg);
+	XLogFileName(segname, tli, log, seg);
+}
+
+static void
+timeindex_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	TimestampTz xact_time;
+	TimeIndexEntry *entry;
+
+	if (!xlogdecode_xact_time(record, &xact_time))
+		return;
+
+	if (!segment_has_commits)
+	{
+		segment_mintime = segment_maxtime = xact_time;
+		segment_has_commits = 1;
+	}
+	else
+	{
+		if (xact_time < segment_mintime)
+			segment_mintime = xact_time;
+		if (xact_time > segment_maxtime)
+			segment_maxtime = xact_time;
+	}
+
+	if (have_sample &&
+		xact_time < last_sample_time + interval_to_timestamptz(timeindex_interval))
+		return;
+
+	if (npending == maxpending)
+	{
+		maxpending = maxpending ? maxpending * 2 : 256;
+		pending = realloc(pending, maxpending * sizeof(TimeIndexEntry));
+		if (!pending)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	entry = &pending[npending++];
+	memset(entry, 0, sizeof(TimeIndexEntry));
+	entry->mintime = entry->maxtime = xact_time;
+	entry->startpoint = dec->recstart;
+	entry->endpoint = dec->pos;
+	entry->tli = dec->tli;
+	entry->kind = TIMEINDEX_SAMPLE;
+
+	last_sample_time = xact_time;
+	have_sample = 1;
+}
+
+/*
+ * Start maintaining the time index. Anything in the index at or after
+ * startpoint is from a segment that is about to be received again, so
+ * it's removed first. Sampling carries on from the last sample left, the
+ * same as if we had never stopped.
+ */
+void
+timeindex_init(XLogDecoder *dec, XLogRecPtr startpoint)
+{
+	char		fn[MAXPGPATH];
+	TimeIndexEntry entry;
+	struct stat st;
+	off_t		keep;
+	off_t		pos;
+	int			f;
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, TIME_INDEX_FILENAME);
+	f = open(fn, O_RDONLY);
+	if (f != -1)
+	{
+		if (fstat(f, &st) != 0)
+		{
+			fprintf(stderr, "Failed to stat %s: %m\n", fn);
+			exit(1);
+		}
+
+		/* Cut off partial entries, and then anything past startpoint */
+		keep = st.st_size - st.st_size % sizeof(TimeIndexEntry);
+		while (keep > 0)
+		{
+			if (pread(f, &entry, sizeof(entry), keep - sizeof(entry)) != sizeof(entry))
+			{
+				fprintf(stderr, "Failed to read %s: %m\n", fn);
+				exit(1);
+			}
+			if (XLByteLT(entry.startpoint, startpoint))
+				break;
+			keep -= sizeof(entry);
+		}
+		for (pos = keep; pos > 0 && !have_sample; pos -= sizeof(entry))
+		{
+			if (pread(f, &entry, sizeof(entry), pos - sizeof(entry)) != sizeof(entry))
+			{
+				fprintf(stderr, "Failed to read %s: %m\n", fn);
+				exit(1);
+			}
+			if (entry.kind == TIMEINDEX_SAMPLE)
+			{
+				last_sample_time = entry.mintime;
+				have_sample = 1;
+			}
+		}
+		close(f);
+
+		if (keep != st.st_size)
+		{
+			if (verbose)
+				printf("Removing %i entries past %X/%08X from time index\n",
+					   (int) ((st.st_size - keep) / sizeof(entry)),
+					   startpoint.xlogid, startpoint.xrecoff);
+			if (truncate(fn, keep) != 0)
+			{
+				fprintf(stderr, "Failed to truncate %s: %m\n", fn);
+				exit(1);
+			}
+		}
+	}
+
+	xlogdecode_add_consumer(dec, timeindex_record, NULL);
+}
+
+/*
+ * Write out the samples and timestamp range collected for the segment
+ * that was just completed.
+ */
+void
+timeindex_finish_segment(const char *segname)
+{
+	char		fn[MAXPGPATH];
+	ArchiveIndexEntry seginfo;
+	int			f;
+
+	if (segment_has_commits)
+	{
+		if (npending == maxpending)
+		{
+			maxpending = maxpending ? maxpending * 2 : 256;
+			pending = realloc(pending, maxpending * sizeof(TimeIndexEntry));
+			if (!pending)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		archive_index_fill_entry(&seginfo, segname, XLogSegSize);
+		memset(&pending[npending], 0, sizeof(TimeIndexEntry));
+		pending[npending].mintime = segment_mintime;
+		pending[npending].maxtime = segment_maxtime;
+		pending[npending].startpoint = seginfo.startpoint;
+		pending[npending].endpoint = seginfo.endpoint;
+		pending[npending].tli = seginfo.tli;
+		pending[npending].kind = TIMEINDEX_SEGMENT;
+		npending++;
+	}
+
+	if (npending > 0)
+	{
+		snprintf(fn, sizeof(fn), "%s/%s", basedir, TIME_INDEX_FILENAME);
+		f = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (f == -1)
+		{
+			fprintf(stderr, "Failed to open %s: %m\n", fn);
+			exit(1);
+		}
+		if (write(f, pending, npending * sizeof(TimeIndexEntry)) !=
+			npending * sizeof(TimeIndexEntry))
+		{
+			fprintf(stderr, "Failed to write to %s: %m\n", fn);
+			exit(1);
+		}
+		if (fsync(f) != 0)
+		{
+			fprintf(stderr, "Failed to fsync %s: %m\n", fn);
+			exit(1);
+		}
+		close(f);
+	}
+
+	npending = 0;
+	segment_has_commits = 0;
+}
+
+
+static void
+timeindex_usage(void)
+{
+	printf("Usage: pg_streamrecv timeindex -d <directory> [time ...]\n");
+	printf("  time is either 'YYYY-MM-DD HH:MM:SS' in local time, or @<unix time>\n");
+	exit(1);
+}
+
+static time_t
+parse_time(const char *str)
+{
+	struct tm	tm;
+	char		extra;
+
+	if (str[0] == '@')
+		return (time_t) strtol(str + 1, NULL, 10);
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str, "%d-%d-%d %d:%d:%d%c", &tm.tm_year, &tm.tm_mon,
+			   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+			   &extra) != 6)
+	{
+		fprintf(stderr, "Invalid time: %s\n", str);
+		exit(1);
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static void
+print_time(TimestampTz t)
+{
+	time_t		tt = timestamptz_to_time_t(t);
+	char		buf[64];
+
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&tt));
+	printf("%s", buf);
+}
+
+/*
+ * "pg_streamrecv timeindex" - list the time index, or find out how far
+ * into the archive recovery has to go to reach the given times.
+ */
+int
+timeindex_main(int argc, char *argv[])
+{
+	char		fn[MAXPGPATH];
+	char		segname[MAXFNAMELEN];
+	TimeIndexEntry *entries;
+	struct stat st;
+	int			nentries;
+	int			f;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				timeindex_usage();
+		}
+	}
+	if (!basedir)
+		timeindex_usage();
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, TIME_INDEX_FILENAME);
+	f = open(fn, O_RDONLY);
+	if (f == -1 || fstat(f, &st) != 0)
+	{
+		fprintf(stderr, "Failed to open time index %s: %m\n", fn);
+		exit(1);
+	}
+	nentries = st.st_size / sizeof(TimeIndexEntry);
+	if (nentries == 0)
+	{
+		fprintf(stderr, "Time index %s is empty\n", fn);
+		exit(1);
+	}
+	entries = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+	if (entries == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map time index %s: %m\n", fn);
+		exit(1);
+	}
+
+	if (optind == argc)
+	{
+		for (i = 0; i < nentries; i++)
+		{
+			segment_for_endpoint(segname, entries[i].tli, entries[i].endpoint);
+			if (entries[i].kind == TIMEINDEX_SEGMENT)
+			{
+				printf("%s ", segname);
+				print_time(entries[i].mintime);
+				printf(" - ");
+				print_time(entries[i].maxtime);
+				printf("\n");
+			}
+			else
+			{
+				printf("  %X/%08X ", entries[i].endpoint.xlogid,
+					   entries[i].endpoint.xrecoff);
+				print_time(entries[i].maxtime);
+				printf("\n");
+			}
+		}
+	}
+
+	for (i = optind; i < argc; i++)
+	{
+		TimestampTz target = time_t_to_timestamptz(parse_time(argv[i]));
+		int			low = 0,
+					high = nentries - 1,
+					found = -1;
+
+		/*
+		 * Find the first entry with a commit at or after the target. Commit
+		 * timestamps are only very nearly in WAL order, which is close
+		 * enough for choosing what segments to restore.
+		 */
+		while (low <= high)
+		{
+			int			mid = low + (high - low) / 2;
+
+			if (entries[mid].maxtime >= target)
+			{
+				found = mid;
+				high = mid - 1;
+			}
+			else
+				low = mid + 1;
+		}
+
+		if (found < 0)
+		{
+			printf("%s: not reached in the archive yet\n", argv[i]);
+			continue;
+		}
+		segment_for_endpoint(segname, entries[found].tli,
+							 entries[found].endpoint);
+		printf("%s: needs WAL up to %X/%08X, segment %s\n", argv[i],
+			   entries[found].endpoint.xlogid, entries[found].endpoint.xrecoff,
+			   segname);
+	}
+
+	munmap(entries, st.st_size);
+	close(f);
+	return 0;
+}
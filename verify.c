@@ -0,0 +1,796 @@
+/*
+ * verify.c - scrub the archive for damaged and missing segments
+ *
+ * "pg_streamrecv verify" reads every segment in the archive and checks
+ * that it still holds what was received: the page headers are valid and
+ * their addresses follow on from each other, every record has the right
+ * CRC, and the segment hashes to what's in the checksums file. Gaps in
+ * the sequence of segments on each timeline are reported as well, and
+ * can optionally be filled by asking the primary for the segments again.
+ *
+ * To get through a large archive in reasonable time, segments are handed
+ * out to a pool of worker processes, the same way restore mode prefetches
+ * segments in the background. Uncompressed segments are read with large
+ * sequential reads, each worker tells the kernel to start reading the
+ * next segment it will work on while it checks the current one, and
+ * segments are dropped from the page cache once checked so a scrub
+ * doesn't push everything else out of it.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <getopt.h>
+#include <libpq-fe.h>
+
+#include "pg_streamrecv.h"
+
+/* xl_info value for the xlog resource manager that we care about */
+#define XLOG_SWITCH			0x40
+
+#define VERIFY_READ_SIZE	(1024 * 1024)
+#define MAX_VERIFY_WORKERS	64
+
+/* Result of checking a segment, in shared memory */
+#define SEGMENT_UNCHECKED	0
+#define SEGMENT_OK			1
+#define SEGMENT_BAD			2
+
+typedef struct VerifyShared
+{
+	volatile uint32 next;		/* next segment to hand out */
+	volatile char result[1];	/* one per segment, VARIABLE LENGTH */
+} VerifyShared;
+
+typedef struct SegmentCheck
+{
+	const char *segname;
+	XLogRecPtr	segstart;
+	uint32		switch_end;		/* offset just past a switch record */
+	uint64		records;
+	uint64		badcrc;
+	XLogRecPtr	firstbad;
+} SegmentCheck;
+
+static char **segments = NULL;
+static int	nsegments = 0;
+static SegmentChecksum *checksums = NULL;
+static int	nchecksums = 0;
+static uint64 sysid = 0;
+
+
+static int
+segment_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void
+add_segment(const char *name)
+{
+	static int	maxsegments = 0;
+
+	if (nsegments == maxsegments)
+	{
+		maxsegments = maxsegments ? maxsegments * 2 : 1024;
+		segments = realloc(segments, maxsegments * sizeof(char *));
+		if (!segments)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	segments[nsegments] = strdup(name);
+	if (!segments[nsegments])
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	nsegments++;
+}
+
+/*
+ * Find all segments in the archive directory, in whatever form they are
+ * stored, and those packed into volumes.
+ */
+static void
+list_directory(const char *dir)
+{
+	static const char *const suffixes[] = {
+		"", ".gz", STRIPPED_SUFFIX, DEDUP_SUFFIX, CHUNK_MANIFEST_SUFFIX,
+		ENCRYPTED_SUFFIX, NULL
+	};
+	DIR		   *d;
+	struct dirent *dirent;
+	char		name[MAXFNAMELEN];
+	VolumeEntry *packed;
+	int			npacked;
+	int			i,
+				j;
+
+	d = opendir(dir);
+	if (!d)
+	{
+		fprintf(stderr, "Failed to open directory %s: %m\n", dir);
+		exit(1);
+	}
+	while ((dirent = readdir(d)) != NULL)
+	{
+		if (strlen(dirent->d_name) < 24)
+			continue;
+		memcpy(name, dirent->d_name, 24);
+		name[24] = '\0';
+		if (!is_segment_name(name))
+			continue;
+		for (i = 0; suffixes[i]; i++)
+			if (strcmp(dirent->d_name + 24, suffixes[i]) == 0)
+				break;
+		if (suffixes[i])
+			add_segment(name);
+	}
+	closedir(d);
+
+	npacked = volume_list(dir, &packed);
+	for (i = 0; i < npacked; i++)
+		add_segment(packed[i].segname);
+	if (npacked >= 0)
+		free(packed);
+
+	if (nsegments == 0)
+		return;
+	qsort(segments, nsegments, sizeof(char *), segment_name_cmp);
+
+	/* The same segment could be there in more than one form */
+	for (i = 1, j = 1; i < nsegments; i++)
+	{
+		if (strcmp(segments[i], segments[j - 1]) == 0)
+			free(segments[i]);
+		else
+			segments[j++] = segments[i];
+	}
+	nsegments = j;
+}
+
+static void
+list_archive_index(const char *dir)
+{
+	ArchiveIndex *idx;
+	int			i;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		fprintf(stderr, "Failed to open the archive index in %s\n", dir);
+		exit(1);
+	}
+	for (i = 0; i < idx->nentries; i++)
+		add_segment(idx->entries[i].path);
+	archive_index_close(idx);
+	if (nsegments > 0)
+		qsort(segments, nsegments, sizeof(char *), segment_name_cmp);
+}
+
+/*
+ * Start the kernel reading a segment we'll want soon, if it's stored
+ * uncompressed.
+ */
+static void
+prefetch_segment(const char *segname)
+{
+	char		path[MAXPGPATH];
+	int			f;
+
+	snprintf(path, sizeof(path), "%s/%s", basedir, segname);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+		return;
+	(void) posix_fadvise(f, 0, 0, POSIX_FADV_WILLNEED);
+	close(f);
+}
+
+/*
+ * Read a segment into buf. Uncompressed segments are read directly, in
+ * large chunks, and dropped from the page cache afterwards. Anything else
+ * goes through the same code restore uses.
+ */
+static int
+read_segment(const char *segname, char *buf)
+{
+	char		path[MAXPGPATH];
+	uint32		len = 0;
+	int			r;
+	int			f;
+
+	snprintf(path, sizeof(path), "%s/%s", basedir, segname);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		if (errno != ENOENT)
+			return 0;
+		return load_archive_segment(basedir, segname, buf, &len) &&
+			len == XLogSegSize;
+	}
+
+	(void) posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (len < XLogSegSize &&
+		   (r = read(f, buf + len, Min(VERIFY_READ_SIZE, XLogSegSize - len))) > 0)
+		len += r;
+	(void) posix_fadvise(f, 0, 0, POSIX_FADV_DONTNEED);
+	close(f);
+	return len == XLogSegSize;
+}
+
+static void
+report(const char *segname, const char *fmt,...)
+{
+	char		line[512];
+	int			n;
+	va_list		args;
+
+	/* One write per line, so lines from different workers don't mix */
+	n = snprintf(line, sizeof(line), "%s: ", segname);
+	va_start(args, fmt);
+	n += vsnprintf(line + n, sizeof(line) - n - 1, fmt, args);
+	va_end(args);
+	if (n > sizeof(line) - 2)
+		n = sizeof(line) - 2;
+	line[n++] = '\n';
+	if (write(1, line, n) != n)
+	{
+		/* Nothing more useful to do about it */
+	}
+}
+
+static void
+check_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	SegmentCheck *sc = arg;
+
+	/* Only whole records that start in this segment */
+	if (dec->recstart.xlogid != sc->segstart.xlogid ||
+		dec->recstart.xrecoff < sc->segstart.xrecoff)
+		return;
+
+	sc->records++;
+	if (xlogdecode_record_crc(record) != record->xl_crc)
+	{
+		if (sc->badcrc++ == 0)
+			sc->firstbad = dec->recstart;
+	}
+	if (record->xl_rmid == RM_XLOG_ID &&
+		(record->xl_info & ~XLR_INFO_MASK) == XLOG_SWITCH &&
+		dec->pos.xlogid == sc->segstart.xlogid &&
+		dec->pos.xrecoff > sc->segstart.xrecoff)
+		sc->switch_end = dec->pos.xrecoff - sc->segstart.xrecoff;
+}
+
+/*
+ * Check the page headers in a segment. Pages after a switch record are
+ * left as they were when the segment was recycled, so they're not
+ * checked.
+ */
+static int
+check_pages(const char *buf, SegmentCheck *sc, TimeLineID tli)
+{
+	TimeLineID	prevtli = 0;
+	uint32		off;
+
+	for (off = 0; off < sc->switch_end; off += XLOG_BLCKSZ)
+	{
+		XLogPageHeader hdr = (XLogPageHeader) (buf + off);
+
+		if (hdr->xlp_magic != XLOG_PAGE_MAGIC)
+		{
+			report(sc->segname, "invalid page magic %04X at offset %u",
+				   hdr->xlp_magic, off);
+			return 0;
+		}
+		if (hdr->xlp_info & ~XLP_ALL_FLAGS)
+		{
+			report(sc->segname, "invalid page info flags %04X at offset %u",
+				   hdr->xlp_info, off);
+			return 0;
+		}
+		if (hdr->xlp_pageaddr.xlogid != sc->segstart.xlogid ||
+			hdr->xlp_pageaddr.xrecoff != sc->segstart.xrecoff + off)
+		{
+			report(sc->segname, "page at offset %u has address %X/%08X, expected %X/%08X",
+				   off, hdr->xlp_pageaddr.xlogid, hdr->xlp_pageaddr.xrecoff,
+				   sc->segstart.xlogid, sc->segstart.xrecoff + off);
+			return 0;
+		}
+		if (hdr->xlp_tli > tli || hdr->xlp_tli < prevtli)
+		{
+			report(sc->segname, "page at offset %u has timeline %u",
+				   off, hdr->xlp_tli);
+			return 0;
+		}
+		prevtli = hdr->xlp_tli;
+
+		if (off == 0)
+		{
+			XLogLongPageHeader lhdr = (XLogLongPageHeader) hdr;
+
+			if (!(hdr->xlp_info & XLP_LONG_HEADER) ||
+				lhdr->xlp_seg_size != XLogSegSize ||
+				lhdr->xlp_xlog_blcksz != XLOG_BLCKSZ)
+			{
+				report(sc->segname, "invalid long page header");
+				return 0;
+			}
+			if (sysid != 0 && lhdr->xlp_sysid != sysid)
+			{
+				report(sc->segname, "belongs to system " UINT64_FORMAT ", not " UINT64_FORMAT,
+					   lhdr->xlp_sysid, sysid);
+				return 0;
+			}
+		}
+		else if (hdr->xlp_info & XLP_LONG_HEADER)
+		{
+			report(sc->segname, "long page header at offset %u", off);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+check_segment(const char *segname, char *buf)
+{
+	XLogDecoder dec;
+	SegmentCheck sc;
+	SegmentChecksum *expected;
+	SegmentChecksum actual;
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+
+	if (!read_segment(segname, buf))
+	{
+		report(segname, "could not be read");
+		return 0;
+	}
+
+	memset(&sc, 0, sizeof(sc));
+	sc.segname = segname;
+	XLogFromFileName(segname, &tli, &log, &seg);
+	sc.segstart.xlogid = log;
+	sc.segstart.xrecoff = seg * XLogSegSize;
+	sc.switch_end = XLogSegSize;
+
+	xlogdecode_init(&dec);
+	xlogdecode_add_consumer(&dec, check_record, &sc);
+	xlogdecode_feed(&dec, sc.segstart, buf, XLogSegSize);
+	if (sc.switch_end < XLogSegSize)
+		sc.switch_end = (sc.switch_end + XLOG_BLCKSZ - 1) & ~(XLOG_BLCKSZ - 1);
+
+	if (!check_pages(buf, &sc, tli))
+		return 0;
+	if (dec.desyncs > 0)
+	{
+		report(segname, "WAL decoder lost sync " UINT64_FORMAT " times",
+			   dec.desyncs);
+		return 0;
+	}
+	if (sc.badcrc > 0)
+	{
+		report(segname, UINT64_FORMAT " of " UINT64_FORMAT " records have an invalid CRC, first at %X/%08X",
+			   sc.badcrc, sc.records, sc.firstbad.xlogid, sc.firstbad.xrecoff);
+		return 0;
+	}
+
+	expected = checksums_find(checksums, nchecksums, segname);
+	if (expected)
+	{
+		checksum_buffer(segname, buf, XLogSegSize, &actual);
+		if (actual.xxh64 != expected->xxh64 ||
+			memcmp(actual.sha256, expected->sha256, SHA256_LEN) != 0)
+		{
+			report(segname, "doesn't match its checksum");
+			return 0;
+		}
+	}
+
+	if (verbose)
+		report(segname, "ok, " UINT64_FORMAT " records%s", sc.records,
+			   expected ? ", checksum matches" : "");
+	return 1;
+}
+
+/*
+ * Worker process. Takes segments from the shared counter until there are
+ * none left, always asking for the next one before checking the current
+ * one, so it can be read ahead.
+ */
+static void
+verify_worker(VerifyShared *shared)
+{
+	char	   *buf = malloc(XLogSegSize);
+	uint32		cur,
+				next;
+
+	if (!buf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		_exit(1);
+	}
+
+	next = __sync_fetch_and_add(&shared->next, 1);
+	while (next < (uint32) nsegments)
+	{
+		cur = next;
+		next = __sync_fetch_and_add(&shared->next, 1);
+		if (next < (uint32) nsegments)
+			prefetch_segment(segments[next]);
+
+		shared->result[cur] =
+			check_segment(segments[cur], buf) ? SEGMENT_OK : SEGMENT_BAD;
+	}
+	_exit(0);
+}
+
+/*
+ * Get the system identifier from the first uncompressed segment, to
+ * check all the others against.
+ */
+static void
+find_sysid(void)
+{
+	char		path[MAXPGPATH];
+	char		page[XLOG_BLCKSZ];
+	XLogLongPageHeader lhdr = (XLogLongPageHeader) page;
+	int			i;
+
+	for (i = 0; i < nsegments; i++)
+	{
+		int			f;
+		int			r;
+
+		snprintf(path, sizeof(path), "%s/%s", basedir, segments[i]);
+		f = open(path, O_RDONLY);
+		if (f == -1)
+			continue;
+		r = read(f, page, sizeof(page));
+		close(f);
+		if (r == sizeof(page) &&
+			lhdr->std.xlp_magic == XLOG_PAGE_MAGIC &&
+			(lhdr->std.xlp_info & XLP_LONG_HEADER))
+		{
+			sysid = lhdr->xlp_sysid;
+			return;
+		}
+	}
+}
+
+/*
+ * Ask the primary for a segment again, over a replication connection,
+ * and put it in the archive. Returns 0 if the primary couldn't send it.
+ */
+static int
+refetch_segment(const char *connstr, const char *segname)
+{
+	char		buf[MAXPGPATH + 64];
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	char	   *seg;
+	PGconn	   *conn;
+	PGresult   *res;
+	SegmentChecksum cs;
+	ArchiveIndexEntry entry;
+	TimeLineID	tli;
+	uint32		log,
+				segno,
+				got = 0;
+	int			f;
+
+	XLogFromFileName(segname, &tli, &log, &segno);
+
+	snprintf(buf, sizeof(buf), "%s dbname=replication replication=true",
+			 connstr);
+	conn = PQconnectdb(buf);
+	if (!conn || PQstatus(conn) != CONNECTION_OK)
+	{
+		fprintf(stderr, "Failed to connect to server for replication: %s\n",
+				PQerrorMessage(conn));
+		exit(1);
+	}
+
+	res = PQexec(conn, "IDENTIFY_SYSTEM");
+	if (!res || PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "Failed to identify system: %s\n",
+				PQresultErrorMessage(res));
+		exit(1);
+	}
+	if (atoi(PQgetvalue(res, 0, 1)) != tli)
+	{
+		printf("%s: can't be requested, the primary is on timeline %s\n",
+			   segname, PQgetvalue(res, 0, 1));
+		PQclear(res);
+		PQfinish(conn);
+		return 0;
+	}
+	PQclear(res);
+
+	snprintf(buf, sizeof(buf), "START_REPLICATION %X/%X", log,
+			 segno * XLogSegSize);
+	res = PQexec(conn, buf);
+	if (!res || PQresultStatus(res) != PGRES_COPY_OUT)
+	{
+		printf("%s: the primary can't send it: %s", segname,
+			   PQresultErrorMessage(res));
+		PQclear(res);
+		PQfinish(conn);
+		return 0;
+	}
+	PQclear(res);
+
+	seg = malloc(XLogSegSize);
+	if (!seg)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	while (got < XLogSegSize)
+	{
+		char	   *copybuf = NULL;
+		XLogRecPtr	startpoint;
+		int			r = PQgetCopyData(conn, &copybuf, 0);
+		uint32		n;
+
+		if (r < 0)
+			break;
+		if (r < 1 + 8 + 8 + 8 + 1 || copybuf[0] != 'w')
+		{
+			PQfreemem(copybuf);
+			break;
+		}
+		memcpy(&startpoint, copybuf + 1, 8);
+		if (startpoint.xlogid != log ||
+			startpoint.xrecoff != segno * XLogSegSize + got)
+		{
+			PQfreemem(copybuf);
+			break;
+		}
+		n = Min(r - (1 + 8 + 8 + 8), XLogSegSize - got);
+		memcpy(seg + got, copybuf + 1 + 8 + 8 + 8, n);
+		got += n;
+		PQfreemem(copybuf);
+	}
+	PQfinish(conn);
+	if (got < XLogSegSize)
+	{
+		printf("%s: the primary stopped sending it after %u bytes\n",
+			   segname, got);
+		free(seg);
+		return 0;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, segname);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1 || write(f, seg, XLogSegSize) != XLogSegSize ||
+		fsync(f) != 0 || close(f) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (rename(tmpfn, fn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, fn);
+		exit(1);
+	}
+
+	checksum_buffer(segname, seg, XLogSegSize, &cs);
+	checksums_append(basedir, &cs);
+	archive_index_fill_entry(&entry, segname, XLogSegSize);
+	INIT_WALCRC(entry.crc);
+	COMP_WALCRC(entry.crc, seg, XLogSegSize);
+	FIN_WALCRC(entry.crc);
+	entry.flags |= ARCHIVE_ENTRY_HAS_CRC;
+	archive_index_append(basedir, &entry);
+
+	free(seg);
+	printf("%s: fetched again from the primary\n", segname);
+	return 1;
+}
+
+/*
+ * Report the segments missing between the ones found, on each timeline.
+ * Returns the number missing.
+ */
+static int
+find_gaps(const char *connstr, int *refetched)
+{
+	int			missing = 0;
+	int			i;
+
+	for (i = 1; i < nsegments; i++)
+	{
+		TimeLineID	tli,
+					prevtli;
+		uint32		log,
+					seg,
+					prevlog,
+					prevseg;
+		char		segname[MAXFNAMELEN];
+
+		XLogFromFileName(segments[i - 1], &prevtli, &prevlog, &prevseg);
+		XLogFromFileName(segments[i], &tli, &log, &seg);
+		if (tli != prevtli)
+			continue;
+
+		NextLogSeg(prevlog, prevseg);
+		while (prevlog < log || (prevlog == log && prevseg < seg))
+		{
+			XLogFileName(segname, tli, prevlog, prevseg);
+			printf("%s: missing\n", segname);
+			missing++;
+			if (connstr && refetch_segment(connstr, segname))
+				(*refetched)++;
+			NextLogSeg(prevlog, prevseg);
+		}
+	}
+	return missing;
+}
+
+
+static void
+verify_usage(void)
+{
+	printf("Usage: pg_streamrecv verify -d <directory> [-i] [-j <workers>] [-c <connectionstring>] [-K <key file>] [-v] [first segment [last segment]]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv verify" - check all segments in the archive, or a range
+ * of them.
+ */
+int
+verify_main(int argc, char *argv[])
+{
+	VerifyShared *shared;
+	size_t		sharedsize;
+	pid_t		pids[MAX_VERIFY_WORKERS];
+	char	   *first = NULL;
+	char	   *last = NULL;
+	char	   *refetch_conn = NULL;
+	int			use_index = 0;
+	int			nworkers = 4;
+	int			bad = 0,
+				unchecked = 0,
+				missing,
+				refetched = 0;
+	int			i,
+				j;
+	int			c;
+
+	while ((c = getopt(argc, argv, "c:d:ij:K:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'c':
+				refetch_conn = strdup(optarg);
+				break;
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'i':
+				use_index = 1;
+				break;
+			case 'j':
+				nworkers = atoi(optarg);
+				if (nworkers < 1 || nworkers > MAX_VERIFY_WORKERS)
+					verify_usage();
+				break;
+			case 'K':
+				encryption_key_file = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				verify_usage();
+		}
+	}
+	if (!basedir || argc - optind > 2)
+		verify_usage();
+	if (optind < argc)
+		first = argv[optind];
+	if (optind + 1 < argc)
+		last = argv[optind + 1];
+	if ((first && !is_segment_name(first)) || (last && !is_segment_name(last)))
+		verify_usage();
+
+	if (use_index)
+		list_archive_index(basedir);
+	else
+		list_directory(basedir);
+
+	/* Only keep the requested range */
+	for (i = 0, j = 0; i < nsegments; i++)
+	{
+		if ((first && strcmp(segments[i], first) < 0) ||
+			(last && strcmp(segments[i], last) > 0))
+			free(segments[i]);
+		else
+			segments[j++] = segments[i];
+	}
+	nsegments = j;
+	if (nsegments == 0)
+	{
+		printf("No segments to verify\n");
+		return 0;
+	}
+
+	checksums = checksums_load(basedir, &nchecksums);
+	find_sysid();
+
+	sharedsize = offsetof(VerifyShared, result) + nsegments;
+	shared = mmap(NULL, sharedsize, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	memset(shared, 0, sharedsize);
+
+	fflush(stdout);
+	fflush(stderr);
+	if (nworkers > nsegments)
+		nworkers = nsegments;
+	for (i = 0; i < nworkers; i++)
+	{
+		pids[i] = fork();
+		if (pids[i] == -1)
+		{
+			fprintf(stderr, "Failed to fork: %m\n");
+			exit(1);
+		}
+		if (pids[i] == 0)
+			verify_worker(shared);
+	}
+	for (i = 0; i < nworkers; i++)
+		while (waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+			;
+
+	for (i = 0; i < nsegments; i++)
+	{
+		if (shared->result[i] == SEGMENT_BAD)
+			bad++;
+		else if (shared->result[i] == SEGMENT_UNCHECKED)
+		{
+			/* The worker died on it */
+			printf("%s: could not be checked\n", segments[i]);
+			unchecked++;
+		}
+	}
+	munmap(shared, sharedsize);
+
+	missing = find_gaps(refetch_conn, &refetched);
+
+	printf("%i segments checked, %i bad, %i could not be checked, %i missing",
+		   nsegments, bad, unchecked, missing);
+	if (refetch_conn)
+		printf(", %i fetched again", refetched);
+	printf("\n");
+
+	return (bad + unchecked + missing - refetched) > 0 ? 1 : 0;
+}
@@ -0,0 +1,1354 @@
+/*
+ * volume.c - packing completed segments into large volume files
+ *
+ * An archive of a million segments is a million files, which is hard on
+ * filesystem metadata, on backup software, and on object stores charging
+ * per object. Instead, completed segments can be appended to volume
+ * files of volume_size_mb each in the "volumes" directory, as they are
+ * stored (plain or gzip compressed), each one preceded by a VolumeEntry
+ * saying what it is and where its data is. Once a volume is full, it's
+ * sealed by appending the entries of all its segments and a trailer, so
+ * a volume can be read on its own.
+ *
+ * The volume index, "volume.index", has the entries of all volumes in
+ * the same order as the archive index, so a segment is found with a
+ * binary search by its location, and read with a single pread() from its
+ * volume. locate_archive_file() looks there for segments that aren't
+ * stored as files, so restoring, serving and verifying work the same for
+ * packed segments.
+ *
+ * Packing a segment writes it to the end of the current volume and
+ * flushes it, then appends its entry to the volume index and flushes
+ * that, and only then updates the archive index and removes the file.
+ * Every entry has its own CRC, so after a crash the last entry of the
+ * index is either complete or ignored, and anything in the volume after
+ * the last entry in the index is cut off before the next segment is
+ * appended. A segment whose file is still there after being packed has
+ * its file removed by the next pass. Only one process packs at a time,
+ * holding a lock on the volume index.
+ *
+ * Retention frees up space a whole volume at a time, once all segments
+ * in it have been removed from the archive index. The volume index is
+ * then rewritten without them and renamed into place, before the volumes
+ * are removed. The volume being filled is never removed.
+ *
+ * The receiver packs the segments older than volume_pack_age in a child
+ * process each time a segment is completed, in the idle I/O class.
+ * "pg_streamrecv pack" does the same from the command line, and can
+ * rebuild the volume index from the volumes, and "pg_streamrecv unpack"
+ * gets a segment out of a volume by name or location.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <getopt.h>
+#include <zlib.h>
+
+#include "pg_streamrecv.h"
+
+/* Room for a gzip compressed segment that didn't compress */
+#define MAX_STORED_SIZE		(XLogSegSize + 65536)
+
+int			volume_size_mb = 0;
+int			volume_pack_age = 0;
+
+typedef struct VolumeStats
+{
+	uint64		segments;
+	uint64		bytes;
+	uint64		volumes;
+	uint64		removed;
+} VolumeStats;
+
+/* In shared memory in the receiver, so the children can count */
+static VolumeStats local_stats;
+static VolumeStats *stats = &local_stats;
+static pid_t pack_pid = -1;
+
+/* State of a pass packing segments */
+typedef struct Packer
+{
+	const char *dir;
+	int			index;			/* the volume index, locked */
+	off_t		indexend;
+	VolumeEntry last;			/* last entry in the index, if any */
+	int			nentries;
+	uint32		volume;			/* number of the volume being filled */
+	int			fd;				/* that volume, or -1 if not open yet */
+	uint64		end;			/* where the next entry goes in it */
+	char	   *data;			/* the segment as stored */
+	char	   *seg;			/* the segment uncompressed */
+} Packer;
+
+
+static void
+volume_path(char *path, size_t len, const char *dir, uint32 volume)
+{
+	snprintf(path, len, "%s/%s/%08X%s", dir, VOLUME_DIR, volume, VOLUME_SUFFIX);
+}
+
+static uint32
+crc_of(const void *data, size_t len)
+{
+	uint32		crc;
+
+	INIT_WALCRC(crc);
+	COMP_WALCRC(crc, data, len);
+	FIN_WALCRC(crc);
+	return crc;
+}
+
+static int
+entry_valid(const VolumeEntry *e)
+{
+	return e->magic == VOLUME_ENTRY_MAGIC &&
+		e->check == crc_of(e, offsetof(VolumeEntry, check));
+}
+
+/*
+ * Compare an entry with a segment in archive index order, by location
+ * first, then by timeline.
+ */
+static int
+entry_cmp(const VolumeEntry *e, XLogRecPtr startpoint, TimeLineID tli)
+{
+	if (XLByteLT(e->startpoint, startpoint))
+		return -1;
+	if (XLByteLT(startpoint, e->startpoint))
+		return 1;
+	if (e->tli != tli)
+		return (e->tli < tli) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Open the volume index and lock it. Since the index is replaced by
+ * renaming a new one into place, make sure what got locked is still the
+ * current file. Returns -1 if there is no index.
+ */
+static int
+open_index_locked(const char *fn, int create)
+{
+	struct stat st1,
+				st2;
+	int			f;
+
+	while (1)
+	{
+		f = open(fn, O_RDWR | (create ? O_CREAT : 0), 0666);
+		if (f == -1)
+		{
+			if (errno == ENOENT)
+				return -1;
+			fprintf(stderr, "Failed to open volume index %s: %m\n", fn);
+			exit(1);
+		}
+		if (flock(f, LOCK_EX) != 0)
+		{
+			fprintf(stderr, "Failed to lock volume index %s: %m\n", fn);
+			exit(1);
+		}
+		if (fstat(f, &st1) == 0 && stat(fn, &st2) == 0 &&
+			st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+			return f;
+		close(f);
+	}
+}
+
+/*
+ * Write a new volume index with the given entries to a temporary file,
+ * and rename it into place, so readers never see a half-written index.
+ */
+static void
+write_index(const char *dir, VolumeEntry *entries, int nentries)
+{
+	ArchiveIndexHeader hdr;
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	int			f;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create volume index %s: %m\n", tmpfn);
+		exit(1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = VOLUME_INDEX_MAGIC;
+	hdr.version = VOLUME_VERSION;
+	hdr.entrysize = sizeof(VolumeEntry);
+	if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		(nentries > 0 &&
+		 write(f, entries, nentries * sizeof(VolumeEntry)) !=
+		 nentries * sizeof(VolumeEntry)))
+	{
+		fprintf(stderr, "Failed to write volume index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (fsync(f) != 0)
+	{
+		fprintf(stderr, "Failed to fsync volume index %s: %m\n", tmpfn);
+		exit(1);
+	}
+	close(f);
+
+	if (rename(tmpfn, fn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, fn);
+		exit(1);
+	}
+}
+
+static int
+header_valid(const ArchiveIndexHeader *hdr)
+{
+	return hdr->magic == VOLUME_INDEX_MAGIC &&
+		hdr->version == VOLUME_VERSION &&
+		hdr->entrysize == sizeof(VolumeEntry);
+}
+
+/*
+ * Read all the entries of the volume index into a malloc'd array, up to
+ * the last complete one. Returns -1 if there is no valid index.
+ */
+static int
+read_index(int f, VolumeEntry **entries)
+{
+	ArchiveIndexHeader hdr;
+	off_t		size = lseek(f, 0, SEEK_END);
+	int			n;
+
+	if (size < sizeof(hdr) ||
+		pread(f, &hdr, sizeof(hdr), 0) != sizeof(hdr) || !header_valid(&hdr))
+		return -1;
+
+	n = (size - sizeof(hdr)) / sizeof(VolumeEntry);
+	*entries = malloc(Max(n, 1) * sizeof(VolumeEntry));
+	if (!*entries)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (n > 0 &&
+		pread(f, *entries, n * sizeof(VolumeEntry), sizeof(hdr)) !=
+		n * sizeof(VolumeEntry))
+	{
+		fprintf(stderr, "Failed to read volume index: %m\n");
+		exit(1);
+	}
+	while (n > 0 && !entry_valid(&(*entries)[n - 1]))
+		n--;
+	return n;
+}
+
+/*
+ * Read the entries of all packed segments into a malloc'd array. Returns
+ * the number of them, or -1 if there is no valid volume index.
+ */
+int
+volume_list(const char *dir, VolumeEntry **entries)
+{
+	char		fn[MAXPGPATH];
+	int			f;
+	int			n;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	f = open(fn, O_RDONLY);
+	if (f == -1)
+		return -1;
+	n = read_index(f, entries);
+	close(f);
+	return n;
+}
+
+/*
+ * Find the entry of a segment in the volume index. Returns 0 if it isn't
+ * in a volume.
+ */
+static int
+lookup_entry(const char *dir, const char *fname, VolumeEntry *entry)
+{
+	ArchiveIndexHeader *hdr;
+	VolumeEntry *entries;
+	XLogRecPtr	startpoint;
+	TimeLineID	tli;
+	uint32		log,
+				seg;
+	char		fn[MAXPGPATH];
+	struct stat st;
+	char	   *map;
+	int			f;
+	int			lo,
+				hi;
+	int			found = 0;
+
+	if (!is_segment_name(fname))
+		return 0;
+	XLogFromFileName(fname, &tli, &log, &seg);
+	startpoint.xlogid = log;
+	startpoint.xrecoff = seg * XLogSegSize;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	f = open(fn, O_RDONLY);
+	if (f == -1)
+		return 0;
+	if (fstat(f, &st) != 0 || st.st_size < sizeof(ArchiveIndexHeader))
+	{
+		close(f);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+	close(f);
+	if (map == MAP_FAILED)
+		return 0;
+
+	hdr = (ArchiveIndexHeader *) map;
+	entries = (VolumeEntry *) (map + sizeof(ArchiveIndexHeader));
+	lo = 0;
+	hi = header_valid(hdr) ?
+		(st.st_size - sizeof(ArchiveIndexHeader)) / sizeof(VolumeEntry) : 0;
+	/* A torn last entry doesn't count */
+	if (hi > 0 && !entry_valid(&entries[hi - 1]))
+		hi--;
+	while (lo < hi)
+	{
+		int			mid = (lo + hi) / 2;
+		int			cmp = entry_cmp(&entries[mid], startpoint, tli);
+
+		if (cmp == 0)
+		{
+			if (entry_valid(&entries[mid]) &&
+				strcmp(entries[mid].segname, fname) == 0)
+			{
+				*entry = entries[mid];
+				found = 1;
+			}
+			break;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	munmap(map, st.st_size);
+	return found;
+}
+
+/*
+ * If a segment is packed into a volume, set path to the volume and return
+ * 1.
+ */
+int
+volume_locate(const char *dir, const char *fname, char *path, size_t pathlen)
+{
+	VolumeEntry entry;
+
+	if (!lookup_entry(dir, fname, &entry))
+		return 0;
+	volume_path(path, pathlen, dir, entry.volume);
+	return 1;
+}
+
+/*
+ * If a segment is packed into a volume, set completed to when it was
+ * completed, since the volume's own modification time says nothing about
+ * that, and return 1.
+ */
+int
+volume_completed(const char *dir, const char *fname, time_t *completed)
+{
+	VolumeEntry entry;
+
+	if (!lookup_entry(dir, fname, &entry))
+		return 0;
+	*completed = (time_t) entry.completed;
+	return 1;
+}
+
+/*
+ * Expand a gzip compressed segment in memory. Returns 0 unless it comes
+ * out as a whole segment.
+ */
+static int
+gunzip_segment(char *data, uint64 len, char *buf)
+{
+	z_stream	zs;
+	int			r;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return 0;
+	zs.next_in = (Bytef *) data;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *) buf;
+	zs.avail_out = XLogSegSize;
+	r = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return r == Z_STREAM_END && zs.total_out == XLogSegSize;
+}
+
+/*
+ * Read a packed segment into buf, which must be able to hold XLogSegSize
+ * bytes, with a single read from its volume. Returns 0 if it isn't in a
+ * volume or can't be read back intact.
+ */
+int
+volume_read_segment(const char *dir, const char *fname, char *buf)
+{
+	VolumeEntry entry;
+	char		path[MAXPGPATH];
+	char	   *data;
+	int			f;
+	int			ok;
+
+	if (!lookup_entry(dir, fname, &entry))
+		return 0;
+	if (entry.length > MAX_STORED_SIZE ||
+		(entry.compression == ARCHIVE_COMPRESSION_NONE &&
+		 entry.length != XLogSegSize))
+	{
+		fprintf(stderr, "Invalid length " UINT64_FORMAT " of %s in volume index\n",
+				entry.length, fname);
+		return 0;
+	}
+
+	volume_path(path, sizeof(path), dir, entry.volume);
+	f = open(path, O_RDONLY);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to open volume %s: %m\n", path);
+		return 0;
+	}
+
+	data = buf;
+	if (entry.compression == ARCHIVE_COMPRESSION_GZIP)
+	{
+		data = malloc(entry.length);
+		if (!data)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	ok = pread(f, data, entry.length, entry.offset) == entry.length;
+	close(f);
+	if (ok && entry.compression == ARCHIVE_COMPRESSION_GZIP)
+		ok = gunzip_segment(data, entry.length, buf);
+	if (data != buf)
+		free(data);
+
+	if (!ok || crc_of(buf, XLogSegSize) != entry.crc)
+	{
+		fprintf(stderr, "Segment %s in volume %s is damaged\n", fname, path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read the entries of the segments in a volume into a malloc'd array.
+ * If the volume is sealed, they're taken from the end of it, otherwise
+ * from in front of each segment, up to the first one that isn't whole.
+ * Sets *sealed, and *end to where the next segment would go. Returns the
+ * number of entries.
+ */
+static int
+read_volume(int f, uint32 volume, VolumeEntry **entries, int *sealed,
+			uint64 *end)
+{
+	VolumeHeader vhdr;
+	VolumeTrailer trailer;
+	uint64		size = lseek(f, 0, SEEK_END);
+	uint64		off = sizeof(VolumeHeader);
+	int			n = 0,
+				max = 16;
+
+	*sealed = 0;
+	*end = off;
+	*entries = NULL;
+	if (pread(f, &vhdr, sizeof(vhdr), 0) != sizeof(vhdr) ||
+		vhdr.magic != VOLUME_MAGIC || vhdr.volume != volume)
+		return -1;
+
+	if (size >= off + sizeof(trailer) &&
+		pread(f, &trailer, sizeof(trailer), size - sizeof(trailer)) == sizeof(trailer) &&
+		trailer.magic == VOLUME_TRAILER_MAGIC &&
+		trailer.check == crc_of(&trailer, offsetof(VolumeTrailer, check)) &&
+		trailer.offset + (uint64) trailer.nentries * sizeof(VolumeEntry) +
+		sizeof(trailer) == size)
+	{
+		*entries = malloc(Max(trailer.nentries, 1) * sizeof(VolumeEntry));
+		if (!*entries)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (pread(f, *entries, trailer.nentries * sizeof(VolumeEntry),
+				  trailer.offset) == trailer.nentries * sizeof(VolumeEntry) &&
+			crc_of(*entries, trailer.nentries * sizeof(VolumeEntry)) == trailer.crc)
+		{
+			*sealed = 1;
+			*end = trailer.offset;
+			return trailer.nentries;
+		}
+		free(*entries);
+	}
+
+	*entries = malloc(max * sizeof(VolumeEntry));
+	while (*entries && off + sizeof(VolumeEntry) <= size)
+	{
+		VolumeEntry *e;
+
+		if (n == max)
+		{
+			max *= 2;
+			*entries = realloc(*entries, max * sizeof(VolumeEntry));
+			if (!*entries)
+				break;
+		}
+		e = &(*entries)[n];
+		if (pread(f, e, sizeof(VolumeEntry), off) != sizeof(VolumeEntry) ||
+			!entry_valid(e) || e->volume != volume ||
+			e->offset != off + sizeof(VolumeEntry) ||
+			e->offset + e->length > size)
+			break;
+		off = e->offset + e->length;
+		n++;
+	}
+	if (!*entries)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	*end = off;
+	return n;
+}
+
+/*
+ * Numbers of the volumes in the volume directory, sorted.
+ */
+static int
+uint32_cmp(const void *a, const void *b)
+{
+	uint32		ua = *(const uint32 *) a;
+	uint32		ub = *(const uint32 *) b;
+
+	return ua < ub ? -1 : ua > ub ? 1 : 0;
+}
+
+static int
+list_volumes(const char *dir, uint32 **volumes)
+{
+	char		fn[MAXPGPATH];
+	struct dirent *dirent;
+	DIR		   *d;
+	int			n = 0,
+				max = 0;
+
+	*volumes = NULL;
+	snprintf(fn, sizeof(fn), "%s/%s", dir, VOLUME_DIR);
+	d = opendir(fn);
+	if (!d)
+		return 0;
+	while ((dirent = readdir(d)) != NULL)
+	{
+		unsigned int volume;
+		char		suffix[8];
+
+		if (strlen(dirent->d_name) != 8 + strlen(VOLUME_SUFFIX) ||
+			sscanf(dirent->d_name, "%8X%7s", &volume, suffix) != 2 ||
+			strcmp(suffix, VOLUME_SUFFIX) != 0)
+			continue;
+		if (n == max)
+		{
+			max = max ? max * 2 : 64;
+			*volumes = realloc(*volumes, max * sizeof(uint32));
+			if (!*volumes)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		(*volumes)[n++] = volume;
+	}
+	closedir(d);
+	qsort(*volumes, n, sizeof(uint32), uint32_cmp);
+	return n;
+}
+
+/*
+ * Rebuild the volume index from the volumes, for when it's lost or
+ * damaged.
+ */
+void
+volume_index_rebuild(const char *dir)
+{
+	VolumeEntry *all = NULL;
+	uint32	   *volumes;
+	char		fn[MAXPGPATH];
+	int			nvolumes;
+	int			nentries = 0;
+	int			lock;
+	int			i;
+
+	if (verbose)
+		printf("Rebuilding volume index in %s/%s\n", dir, VOLUME_DIR);
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	lock = open_index_locked(fn, 0);
+
+	nvolumes = list_volumes(dir, &volumes);
+	for (i = 0; i < nvolumes; i++)
+	{
+		VolumeEntry *entries;
+		uint64		end;
+		int			sealed;
+		int			f;
+		int			n;
+
+		volume_path(fn, sizeof(fn), dir, volumes[i]);
+		f = open(fn, O_RDONLY);
+		if (f == -1)
+		{
+			fprintf(stderr, "Failed to open volume %s: %m\n", fn);
+			exit(1);
+		}
+		n = read_volume(f, volumes[i], &entries, &sealed, &end);
+		close(f);
+		if (n < 0)
+		{
+			fprintf(stderr, "%s is not a valid volume, skipping\n", fn);
+			continue;
+		}
+		if (n > 0)
+		{
+			all = realloc(all, (nentries + n) * sizeof(VolumeEntry));
+			if (!all)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			memcpy(all + nentries, entries, n * sizeof(VolumeEntry));
+			nentries += n;
+		}
+		free(entries);
+	}
+
+	write_index(dir, all, nentries);
+	if (lock != -1)
+		close(lock);
+
+	if (verbose)
+		printf("Volume index rebuilt with %i segments in %i volumes\n",
+			   nentries, nvolumes);
+	free(all);
+	free(volumes);
+}
+
+/*
+ * Lock the volume index and find where the next segment goes, cleaning
+ * up after a crash if needed. Returns 0 if packing isn't possible.
+ */
+static int
+pack_open(const char *dir, Packer *p)
+{
+	ArchiveIndexHeader hdr;
+	char		fn[MAXPGPATH];
+	uint32	   *volumes;
+	uint32		highest = 0;
+	off_t		size;
+	int			nvolumes;
+
+	memset(p, 0, sizeof(Packer));
+	p->dir = dir;
+	p->fd = -1;
+
+	snprintf(fn, sizeof(fn), "%s/%s", dir, VOLUME_DIR);
+	if (mkdir(fn, 0777) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", fn);
+		return 0;
+	}
+
+	/* Volumes without an index, so it must have been lost */
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	nvolumes = list_volumes(dir, &volumes);
+	if (nvolumes > 0)
+		highest = volumes[nvolumes - 1];
+	free(volumes);
+	if (nvolumes > 0 && access(fn, F_OK) != 0)
+		volume_index_rebuild(dir);
+
+	p->index = open_index_locked(fn, 1);
+	size = lseek(p->index, 0, SEEK_END);
+	if (size == 0)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = VOLUME_INDEX_MAGIC;
+		hdr.version = VOLUME_VERSION;
+		hdr.entrysize = sizeof(VolumeEntry);
+		if (write(p->index, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			fsync(p->index) != 0)
+		{
+			fprintf(stderr, "Failed to write volume index %s: %m\n", fn);
+			exit(1);
+		}
+		size = sizeof(hdr);
+	}
+	if (size < sizeof(hdr) ||
+		pread(p->index, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		!header_valid(&hdr))
+	{
+		fprintf(stderr, "Invalid volume index %s, rebuild it with \"pg_streamrecv pack -r\"\n",
+				fn);
+		close(p->index);
+		return 0;
+	}
+
+	/* Cut off a partially written entry at the end */
+	p->nentries = (size - sizeof(hdr)) / sizeof(VolumeEntry);
+	while (p->nentries > 0)
+	{
+		if (pread(p->index, &p->last, sizeof(VolumeEntry),
+				  sizeof(hdr) + (p->nentries - 1) * sizeof(VolumeEntry)) ==
+			sizeof(VolumeEntry) && entry_valid(&p->last))
+			break;
+		p->nentries--;
+	}
+	p->indexend = sizeof(hdr) + p->nentries * sizeof(VolumeEntry);
+	if (p->indexend != size && ftruncate(p->index, p->indexend) != 0)
+	{
+		fprintf(stderr, "Failed to truncate volume index %s: %m\n", fn);
+		exit(1);
+	}
+
+	if (p->nentries == 0)
+	{
+		/* Carry on after any volumes left from an index that was lost */
+		p->volume = highest + 1;
+		return 1;
+	}
+
+	/*
+	 * Carry on filling the volume the last segment went into, unless it
+	 * was sealed. Anything after the last segment is from a crash.
+	 */
+	p->volume = p->last.volume;
+	volume_path(fn, sizeof(fn), dir, p->volume);
+	p->fd = open(fn, O_RDWR);
+	if (p->fd == -1)
+	{
+		fprintf(stderr, "Failed to open volume %s: %m\n", fn);
+		close(p->index);
+		return 0;
+	}
+	p->end = p->last.offset + p->last.length;
+	size = lseek(p->fd, 0, SEEK_END);
+	if (size < p->end)
+	{
+		fprintf(stderr, "Volume %s is shorter than its index says\n", fn);
+		close(p->fd);
+		close(p->index);
+		return 0;
+	}
+	if (size > p->end)
+	{
+		VolumeEntry *entries;
+		uint64		end;
+		int			sealed;
+
+		read_volume(p->fd, p->volume, &entries, &sealed, &end);
+		free(entries);
+		if (sealed)
+		{
+			close(p->fd);
+			p->fd = -1;
+			p->volume++;
+		}
+		else if (ftruncate(p->fd, p->end) != 0)
+		{
+			fprintf(stderr, "Failed to truncate volume %s: %m\n", fn);
+			exit(1);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Seal the volume being filled by appending the entries of its segments
+ * and the trailer.
+ */
+static void
+seal_volume(Packer *p)
+{
+	VolumeTrailer trailer;
+	VolumeEntry *entries;
+	char		fn[MAXPGPATH];
+	uint64		end;
+	int			sealed;
+	int			n;
+
+	volume_path(fn, sizeof(fn), p->dir, p->volume);
+	n = read_volume(p->fd, p->volume, &entries, &sealed, &end);
+	if (n < 0 || end != p->end)
+	{
+		fprintf(stderr, "Volume %s changed while being filled\n", fn);
+		exit(1);
+	}
+
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = VOLUME_TRAILER_MAGIC;
+	trailer.nentries = n;
+	trailer.offset = p->end;
+	trailer.crc = crc_of(entries, n * sizeof(VolumeEntry));
+	trailer.check = crc_of(&trailer, offsetof(VolumeTrailer, check));
+	if (pwrite(p->fd, entries, n * sizeof(VolumeEntry), p->end) !=
+		n * sizeof(VolumeEntry) ||
+		pwrite(p->fd, &trailer, sizeof(trailer),
+			   p->end + n * sizeof(VolumeEntry)) != sizeof(trailer) ||
+		fsync(p->fd) != 0)
+	{
+		fprintf(stderr, "Failed to seal volume %s: %m\n", fn);
+		exit(1);
+	}
+	free(entries);
+	close(p->fd);
+	p->fd = -1;
+	p->volume++;
+
+	if (verbose)
+		printf("Sealed volume %s with %i segments\n", fn, n);
+}
+
+static void
+new_volume(Packer *p)
+{
+	VolumeHeader vhdr;
+	char		fn[MAXPGPATH];
+
+	/* A volume with this number can only be left over from a crash */
+	volume_path(fn, sizeof(fn), p->dir, p->volume);
+	p->fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (p->fd == -1)
+	{
+		fprintf(stderr, "Failed to create volume %s: %m\n", fn);
+		exit(1);
+	}
+	memset(&vhdr, 0, sizeof(vhdr));
+	vhdr.magic = VOLUME_MAGIC;
+	vhdr.version = VOLUME_VERSION;
+	vhdr.volume = p->volume;
+	if (write(p->fd, &vhdr, sizeof(vhdr)) != sizeof(vhdr))
+	{
+		fprintf(stderr, "Failed to write volume %s: %m\n", fn);
+		exit(1);
+	}
+	p->end = sizeof(vhdr);
+	__sync_fetch_and_add(&stats->volumes, 1);
+}
+
+/*
+ * Read a segment file the way it's stored. Returns its length, or -1.
+ */
+static int64
+read_stored(const char *path, char *buf)
+{
+	int64		len = 0;
+	int			f;
+	int			r;
+
+	f = open(path, O_RDONLY);
+	if (f == -1)
+		return -1;
+	while (len < MAX_STORED_SIZE &&
+		   (r = read(f, buf + len, MAX_STORED_SIZE - len)) > 0)
+		len += r;
+	close(f);
+	return len < MAX_STORED_SIZE ? len : -1;
+}
+
+/*
+ * Pack one segment into the current volume. Returns 0 if it wasn't.
+ */
+static int
+pack_segment(Packer *p, ArchiveIndexEntry *ae, int how, const char *path,
+			 time_t completed)
+{
+	VolumeEntry e;
+	uint64		volsize = (uint64) volume_size_mb * 1024 * 1024;
+	int64		len;
+	int			gz = (how == ARCHIVE_FILE_GZIP);
+
+	len = read_stored(path, p->data);
+	if (len < 0)
+		return 0;
+
+	/* Make sure it's whole before the file goes */
+	if (gz ? !gunzip_segment(p->data, len, p->seg) : len != XLogSegSize)
+	{
+		fprintf(stderr, "Segment %s is not whole, not packing it\n", path);
+		return 0;
+	}
+
+	if (p->fd != -1 && p->end > sizeof(VolumeHeader) &&
+		p->end + sizeof(VolumeEntry) + len > volsize)
+		seal_volume(p);
+	if (p->fd == -1)
+		new_volume(p);
+
+	memset(&e, 0, sizeof(e));
+	e.magic = VOLUME_ENTRY_MAGIC;
+	e.tli = ae->tli;
+	e.startpoint = ae->startpoint;
+	e.volume = p->volume;
+	e.compression = gz ? ARCHIVE_COMPRESSION_GZIP : ARCHIVE_COMPRESSION_NONE;
+	e.offset = p->end + sizeof(VolumeEntry);
+	e.length = len;
+	e.completed = completed;
+	e.crc = crc_of(gz ? p->seg : p->data, XLogSegSize);
+	memcpy(e.segname, ae->path, sizeof(e.segname));
+	e.check = crc_of(&e, offsetof(VolumeEntry, check));
+
+	/* The segment must be on disk before the index says it's there */
+	if (pwrite(p->fd, &e, sizeof(e), p->end) != sizeof(e) ||
+		pwrite(p->fd, p->data, len, e.offset) != len ||
+		fdatasync(p->fd) != 0)
+	{
+		fprintf(stderr, "Failed to write to volume %08X: %m\n", p->volume);
+		exit(1);
+	}
+	if (pwrite(p->index, &e, sizeof(e), p->indexend) != sizeof(e) ||
+		fsync(p->index) != 0)
+	{
+		fprintf(stderr, "Failed to append to volume index: %m\n");
+		exit(1);
+	}
+	p->indexend += sizeof(e);
+	p->end = e.offset + e.length;
+	p->last = e;
+	p->nentries++;
+
+	ae->compression = ARCHIVE_COMPRESSION_PACKED;
+	ae->size = len;
+	ae->crc = e.crc;
+	ae->flags |= ARCHIVE_ENTRY_HAS_CRC;
+	archive_index_update(p->dir, ae);
+	if (unlink(path) != 0)
+		fprintf(stderr, "Failed to remove packed segment %s: %m\n", path);
+
+	__sync_fetch_and_add(&stats->segments, 1);
+	__sync_fetch_and_add(&stats->bytes, len);
+	io_throttle(2 * len);
+	if (verbose > 1)
+		printf("Packed %s into volume %08X at " UINT64_FORMAT "\n",
+			   ae->path, p->volume, e.offset);
+	return 1;
+}
+
+/*
+ * Pack all segments in the archive old enough into volumes. Returns the
+ * number packed, or -1 on failure.
+ */
+int
+volume_pack(const char *dir)
+{
+	ArchiveIndex *idx;
+	Packer		p;
+	time_t		now = time(NULL);
+	int			n = 0;
+	int			i;
+
+	idx = archive_index_open(dir);
+	if (!idx)
+	{
+		fprintf(stderr, "No valid archive index in %s, not packing anything\n",
+				dir);
+		return -1;
+	}
+	if (!pack_open(dir, &p))
+	{
+		archive_index_close(idx);
+		return -1;
+	}
+	p.data = malloc(MAX_STORED_SIZE);
+	p.seg = malloc(XLogSegSize);
+	if (!p.data || !p.seg)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < idx->nentries; i++)
+	{
+		ArchiveIndexEntry entry = idx->entries[i];
+		VolumeEntry packed;
+		char		path[MAXPGPATH];
+		struct stat st;
+		int			how;
+
+		if (entry.compression == ARCHIVE_COMPRESSION_PACKED)
+			continue;
+		how = locate_archive_file(dir, entry.path, path, sizeof(path));
+		if (how != ARCHIVE_FILE_PLAIN && how != ARCHIVE_FILE_GZIP)
+			continue;
+		if (stat(path, &st) != 0)
+			continue;
+		if (now - st.st_mtime < volume_pack_age)
+			break;
+
+		if (p.nentries > 0 &&
+			entry_cmp(&p.last, entry.startpoint, entry.tli) >= 0)
+		{
+			/* Packed before a crash, but the file is still there */
+			if (lookup_entry(dir, entry.path, &packed))
+			{
+				entry.compression = ARCHIVE_COMPRESSION_PACKED;
+				entry.size = packed.length;
+				archive_index_update(dir, &entry);
+				unlink(path);
+			}
+			else if (verbose)
+				printf("Segment %s is out of order, not packing it\n",
+					   entry.path);
+			continue;
+		}
+		n += pack_segment(&p, &entry, how, path, st.st_mtime);
+	}
+
+	if (p.fd != -1)
+		close(p.fd);
+	close(p.index);
+	free(p.data);
+	free(p.seg);
+	archive_index_close(idx);
+
+	if (n > 0 && verbose)
+		printf("Packed %i segments in %s\n", n, dir);
+	return n;
+}
+
+/*
+ * Remove the volumes all of whose segments sort before or at upto, once
+ * those have been removed from the archive index, except for the volume
+ * being filled. Returns the bytes freed.
+ */
+uint64
+volume_remove_upto(const char *dir, const ArchiveIndexEntry *upto)
+{
+	VolumeEntry *entries;
+	char		fn[MAXPGPATH];
+	uint32	   *volumes;
+	uint64		bytes = 0;
+	int			nvolumes;
+	int			f;
+	int			n;
+	int			keep = 0;
+	int			i;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", dir, VOLUME_DIR, VOLUME_INDEX_FILENAME);
+	f = open_index_locked(fn, 0);
+	if (f == -1)
+		return 0;
+	n = read_index(f, &entries);
+	if (n <= 0)
+	{
+		if (n == 0)
+			free(entries);
+		close(f);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (entries[i].volume == entries[n - 1].volume)
+			break;
+		if (i + 1 < n && entries[i + 1].volume == entries[i].volume)
+			continue;
+		/* Last segment of a volume */
+		if (entry_cmp(&entries[i], upto->startpoint, upto->tli) > 0)
+			break;
+		keep = i + 1;
+	}
+	if (keep == 0)
+	{
+		free(entries);
+		close(f);
+		return 0;
+	}
+
+	/* Nobody must find the segments before the volumes go */
+	write_index(dir, entries + keep, n - keep);
+	close(f);
+
+	nvolumes = list_volumes(dir, &volumes);
+	for (i = 0; i < nvolumes && volumes[i] < entries[keep].volume; i++)
+	{
+		struct stat st;
+
+		volume_path(fn, sizeof(fn), dir, volumes[i]);
+		if (stat(fn, &st) == 0 && unlink(fn) == 0)
+		{
+			bytes += st.st_size;
+			__sync_fetch_and_add(&stats->removed, 1);
+			if (verbose > 1)
+				printf("Removed volume %s\n", fn);
+		}
+	}
+	free(volumes);
+	free(entries);
+	return bytes;
+}
+
+/*
+ * Start a pass in the background each time a segment is completed.
+ */
+static void
+volume_segment_done(void *arg, const char *segname)
+{
+	int			status;
+
+	if (pack_pid != -1)
+	{
+		if (waitpid(pack_pid, &status, WNOHANG) == 0)
+			return;
+		pack_pid = -1;
+	}
+	if (volume_size_mb == 0)
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+	pack_pid = fork();
+	if (pack_pid == -1)
+	{
+		fprintf(stderr, "Failed to fork: %m\n");
+		exit(1);
+	}
+	if (pack_pid == 0)
+	{
+		io_set_class(IO_CLASS_IDLE);
+		volume_pack(basedir);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+static void
+volume_metrics(FILE *f)
+{
+	fprintf(f, "# TYPE pg_streamrecv_volume_packed_segments_total counter\n");
+	fprintf(f, "pg_streamrecv_volume_packed_segments_total " UINT64_FORMAT "\n",
+			stats->segments);
+	fprintf(f, "# TYPE pg_streamrecv_volume_packed_bytes_total counter\n");
+	fprintf(f, "pg_streamrecv_volume_packed_bytes_total " UINT64_FORMAT "\n",
+			stats->bytes);
+	fprintf(f, "# TYPE pg_streamrecv_volumes_created_total counter\n");
+	fprintf(f, "pg_streamrecv_volumes_created_total " UINT64_FORMAT "\n",
+			stats->volumes);
+	fprintf(f, "# TYPE pg_streamrecv_volumes_removed_total counter\n");
+	fprintf(f, "pg_streamrecv_volumes_removed_total " UINT64_FORMAT "\n",
+			stats->removed);
+}
+
+void
+volume_init(void)
+{
+	StreamSink	sink;
+	void	   *p;
+
+	p = mmap(NULL, sizeof(VolumeStats), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to allocate shared memory: %m\n");
+		exit(1);
+	}
+	stats = p;
+	memset(stats, 0, sizeof(VolumeStats));
+
+	memset(&sink, 0, sizeof(sink));
+	sink.segment = volume_segment_done;
+	stream_add_sink(&sink);
+	metrics_register(volume_metrics);
+}
+
+
+static void
+pack_usage(void)
+{
+	printf("Usage: pg_streamrecv pack -d <directory> [-s <volume MB>] [-a <hours>] [-l] [-r] [-v]\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv pack" - pack segments into volumes, list the packed
+ * segments, or rebuild the volume index.
+ */
+int
+pack_main(int argc, char *argv[])
+{
+	int			list = 0;
+	int			rebuild = 0;
+	int			c;
+
+	volume_size_mb = VOLUME_DEFAULT_SIZE_MB;
+	while ((c = getopt(argc, argv, "a:d:lrs:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				volume_pack_age = atoi(optarg) * 3600;
+				break;
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'l':
+				list = 1;
+				break;
+			case 'r':
+				rebuild = 1;
+				break;
+			case 's':
+				volume_size_mb = atoi(optarg);
+				if (volume_size_mb < 1)
+					pack_usage();
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				pack_usage();
+		}
+	}
+	if (!basedir || optind != argc)
+		pack_usage();
+	if (rebuild)
+	{
+		volume_index_rebuild(basedir);
+		return 0;
+	}
+	if (list)
+	{
+		VolumeEntry *entries;
+		int			n;
+		int			i;
+
+		n = volume_list(basedir, &entries);
+		if (n < 0)
+		{
+			fprintf(stderr, "No valid volume index in %s\n", basedir);
+			return 1;
+		}
+		for (i = 0; i < n; i++)
+			printf("%s %08X%s " UINT64_FORMAT " " UINT64_FORMAT " %s\n",
+				   entries[i].segname, entries[i].volume, VOLUME_SUFFIX,
+				   entries[i].offset, entries[i].length,
+				   entries[i].compression == ARCHIVE_COMPRESSION_GZIP ? "gzip" : "plain");
+		free(entries);
+		return 0;
+	}
+	return volume_pack(basedir) < 0 ? 1 : 0;
+}
+
+static void
+unpack_usage(void)
+{
+	printf("Usage: pg_streamrecv unpack -d <directory> <segment|location> <destination>\n");
+	exit(1);
+}
+
+/*
+ * "pg_streamrecv unpack" - get a packed segment out of its volume, by
+ * name or by a location in it.
+ */
+int
+unpack_main(int argc, char *argv[])
+{
+	char		fname[MAXFNAMELEN];
+	char		tmp[MAXPGPATH];
+	const char *dest;
+	XLogRecPtr	ptr;
+	char	   *buf;
+	int			f;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				unpack_usage();
+		}
+	}
+	if (!basedir || optind != argc - 2)
+		unpack_usage();
+	dest = argv[optind + 1];
+
+	if (sscanf(argv[optind], "%X/%X", &ptr.xlogid, &ptr.xrecoff) == 2)
+	{
+		ArchiveIndex *idx = archive_index_open(basedir);
+		ArchiveIndexEntry *entry = idx ? archive_index_lookup(idx, ptr) : NULL;
+
+		if (!entry)
+		{
+			fprintf(stderr, "Location %s is not in the archive\n", argv[optind]);
+			return 1;
+		}
+		snprintf(fname, sizeof(fname), "%s", entry->path);
+		archive_index_close(idx);
+	}
+	else
+		snprintf(fname, sizeof(fname), "%s", argv[optind]);
+
+	buf = malloc(XLogSegSize);
+	if (!buf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (!volume_read_segment(basedir, fname, buf))
+	{
+		fprintf(stderr, "Segment %s is not in a volume\n", fname);
+		return 1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dest);
+	f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (f == -1 || write(f, buf, XLogSegSize) != XLogSegSize ||
+		close(f) != 0 || rename(tmp, dest) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", dest);
+		return 1;
+	}
+	if (verbose)
+		printf("Unpacked %s to %s\n", fname, dest);
+	free(buf);
+	return 0;
+}
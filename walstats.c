@@ -0,0 +1,357 @@
+/*
+ * walstats.c - WAL statistics per resource manager
+ *
+ * Every record seen by the WAL decoder is counted by resource manager,
+ * along with its size and the number and size of the full page images in
+ * it, and commits and aborts are counted for the transaction rate. This
+ * is all done with fixed counters, so it costs next to nothing per record.
+ *
+ * When a segment is completed, its numbers are appended to the file
+ * wal.stats in the base directory, and the running totals are exported
+ * as metrics. "pg_streamrecv walstats" sums up wal.stats over a range of
+ * segments, much like pg_xlogdump --stats would, without reading any WAL.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+#include "access/xact.h"
+
+typedef struct RmgrStats
+{
+	uint64		records;
+	uint64		bytes;
+	uint64		fpis;
+	uint64		fpi_bytes;
+} RmgrStats;
+
+typedef struct XactStats
+{
+	uint64		commits;
+	uint64		aborts;
+	TimestampTz first;
+	TimestampTz last;
+} XactStats;
+
+int			walstats_enabled = 0;
+
+static RmgrStats total_stats[RM_MAX_ID + 1];
+static RmgrStats segment_stats[RM_MAX_ID + 1];
+static XactStats total_xacts;
+static XactStats segment_xacts;
+
+
+static void
+count_xact(XactStats *xs, TimestampTz t, int commit)
+{
+	if (xs->commits + xs->aborts == 0 || t < xs->first)
+		xs->first = t;
+	if (xs->commits + xs->aborts == 0 || t > xs->last)
+		xs->last = t;
+	if (commit)
+		xs->commits++;
+	else
+		xs->aborts++;
+}
+
+static void
+walstats_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	RmgrStats  *s = &segment_stats[record->xl_rmid];
+	TimestampTz xact_time;
+	uint32		len;
+	int			i;
+
+	s->records++;
+	s->bytes += record->xl_tot_len;
+
+	if (record->xl_info & XLR_BKP_BLOCK_MASK)
+	{
+		for (i = 0; i < XLR_MAX_BKP_BLOCKS; i++)
+		{
+			if (xlogdecode_bkp_block(record, i, &len))
+			{
+				s->fpis++;
+				s->fpi_bytes += len;
+			}
+		}
+	}
+
+	if (xlogdecode_xact_time(record, &xact_time))
+	{
+		uint8		info = record->xl_info & ~XLR_INFO_MASK;
+		int			commit = (info == XLOG_XACT_COMMIT ||
+							  info == XLOG_XACT_COMMIT_PREPARED);
+
+		count_xact(&segment_xacts, xact_time, commit);
+	}
+}
+
+static void
+walstats_metrics(FILE *f)
+{
+	int			i;
+
+	fprintf(f, "# TYPE pg_streamrecv_wal_records_total counter\n");
+	for (i = 0; i <= RM_MAX_ID; i++)
+		fprintf(f, "pg_streamrecv_wal_records_total{rmgr=\"%s\"} " UINT64_FORMAT "\n",
+				rmgr_names[i], total_stats[i].records);
+	fprintf(f, "# TYPE pg_streamrecv_wal_record_bytes_total counter\n");
+	for (i = 0; i <= RM_MAX_ID; i++)
+		fprintf(f, "pg_streamrecv_wal_record_bytes_total{rmgr=\"%s\"} " UINT64_FORMAT "\n",
+				rmgr_names[i], total_stats[i].bytes);
+	fprintf(f, "# TYPE pg_streamrecv_wal_fpi_total counter\n");
+	for (i = 0; i <= RM_MAX_ID; i++)
+		fprintf(f, "pg_streamrecv_wal_fpi_total{rmgr=\"%s\"} " UINT64_FORMAT "\n",
+				rmgr_names[i], total_stats[i].fpis);
+	fprintf(f, "# TYPE pg_streamrecv_wal_fpi_bytes_total counter\n");
+	for (i = 0; i <= RM_MAX_ID; i++)
+		fprintf(f, "pg_streamrecv_wal_fpi_bytes_total{rmgr=\"%s\"} " UINT64_FORMAT "\n",
+				rmgr_names[i], total_stats[i].fpi_bytes);
+	fprintf(f, "# TYPE pg_streamrecv_commits_total counter\n");
+	fprintf(f, "pg_streamrecv_commits_total " UINT64_FORMAT "\n",
+			total_xacts.commits);
+	fprintf(f, "# TYPE pg_streamrecv_aborts_total counter\n");
+	fprintf(f, "pg_streamrecv_aborts_total " UINT64_FORMAT "\n",
+			total_xacts.aborts);
+}
+
+/*
+ * Start the running totals over, on request from the control socket.
+ * Statistics for the segment being received are kept.
+ */
+void
+walstats_reset(void)
+{
+	memset(total_stats, 0, sizeof(total_stats));
+	memset(&total_xacts, 0, sizeof(total_xacts));
+}
+
+void
+walstats_init(XLogDecoder *dec)
+{
+	memset(total_stats, 0, sizeof(total_stats));
+	memset(segment_stats, 0, sizeof(segment_stats));
+	memset(&total_xacts, 0, sizeof(total_xacts));
+	memset(&segment_xacts, 0, sizeof(segment_xacts));
+
+	xlogdecode_add_consumer(dec, walstats_record, NULL);
+	metrics_register(walstats_metrics);
+}
+
+/*
+ * Append the statistics for the segment just completed to wal.stats,
+ * and add them to the running totals.
+ */
+void
+walstats_finish_segment(const char *segname)
+{
+	char		fn[MAXPGPATH];
+	FILE	   *f;
+	int			i;
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, WALSTATS_FILENAME);
+	f = fopen(fn, "a");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open %s: %m\n", fn);
+		exit(1);
+	}
+
+	for (i = 0; i <= RM_MAX_ID; i++)
+	{
+		RmgrStats  *s = &segment_stats[i];
+
+		if (s->records > 0)
+			fprintf(f, "%s %s " UINT64_FORMAT " " UINT64_FORMAT " "
+					UINT64_FORMAT " " UINT64_FORMAT "\n",
+					segname, rmgr_names[i], s->records, s->bytes,
+					s->fpis, s->fpi_bytes);
+
+		total_stats[i].records += s->records;
+		total_stats[i].bytes += s->bytes;
+		total_stats[i].fpis += s->fpis;
+		total_stats[i].fpi_bytes += s->fpi_bytes;
+	}
+	if (segment_xacts.commits + segment_xacts.aborts > 0)
+	{
+		fprintf(f, "%s xacts " UINT64_FORMAT " " UINT64_FORMAT " %ld %ld\n",
+				segname, segment_xacts.commits, segment_xacts.aborts,
+				(long) timestamptz_to_time_t(segment_xacts.first),
+				(long) timestamptz_to_time_t(segment_xacts.last));
+		total_xacts.commits += segment_xacts.commits;
+		total_xacts.aborts += segment_xacts.aborts;
+	}
+
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Failed to write %s: %m\n", fn);
+		exit(1);
+	}
+
+	memset(segment_stats, 0, sizeof(segment_stats));
+	memset(&segment_xacts, 0, sizeof(segment_xacts));
+}
+
+
+static void
+walstats_usage(void)
+{
+	printf("Usage: pg_streamrecv walstats -d <directory> [first segment [last segment]]\n");
+	exit(1);
+}
+
+static double
+pct(uint64 part, uint64 whole)
+{
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * "pg_streamrecv walstats" - summarize the statistics for a range of
+ * segments.
+ */
+int
+walstats_main(int argc, char *argv[])
+{
+	char		fn[MAXPGPATH];
+	char		line[256];
+	char	   *first = NULL;
+	char	   *last = NULL;
+	RmgrStats	stats[RM_MAX_ID + 1];
+	RmgrStats	sum;
+	uint64		commits = 0,
+				aborts = 0;
+	long		firsttime = 0,
+				lasttime = 0;
+	int			nsegments = 0;
+	char		prevseg[MAXFNAMELEN] = "";
+	FILE	   *f;
+	int			c;
+	int			i;
+
+	while ((c = getopt(argc, argv, "d:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			default:
+				walstats_usage();
+		}
+	}
+	if (!basedir || argc - optind > 2)
+		walstats_usage();
+	if (optind < argc)
+		first = argv[optind];
+	if (optind + 1 < argc)
+		last = argv[optind + 1];
+
+	snprintf(fn, sizeof(fn), "%s/%s", basedir, WALSTATS_FILENAME);
+	f = fopen(fn, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to open %s: %m\n", fn);
+		exit(1);
+	}
+
+	memset(stats, 0, sizeof(stats));
+	while (fgets(line, sizeof(line), f))
+	{
+		char		segname[MAXFNAMELEN];
+		char		what[32];
+		unsigned long long a,
+					b,
+					cc,
+					d;
+
+		if (sscanf(line, "%63s %31s %llu %llu %llu %llu", segname, what,
+				   &a, &b, &cc, &d) != 6)
+			continue;
+		if ((first && strcmp(segname, first) < 0) ||
+			(last && strcmp(segname, last) > 0))
+			continue;
+		if (strcmp(segname, prevseg) != 0)
+		{
+			nsegments++;
+			strcpy(prevseg, segname);
+		}
+
+		if (strcmp(what, "xacts") == 0)
+		{
+			commits += a;
+			aborts += b;
+			if (firsttime == 0 || (long) cc < firsttime)
+				firsttime = cc;
+			if ((long) d > lasttime)
+				lasttime = d;
+			continue;
+		}
+		for (i = 0; i <= RM_MAX_ID; i++)
+		{
+			if (strcmp(what, rmgr_names[i]) == 0)
+			{
+				stats[i].records += a;
+				stats[i].bytes += b;
+				stats[i].fpis += cc;
+				stats[i].fpi_bytes += d;
+				break;
+			}
+		}
+	}
+	fclose(f);
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i <= RM_MAX_ID; i++)
+	{
+		sum.records += stats[i].records;
+		sum.bytes += stats[i].bytes;
+		sum.fpis += stats[i].fpis;
+		sum.fpi_bytes += stats[i].fpi_bytes;
+	}
+
+	printf("%i segments\n\n", nsegments);
+	printf("%-12s %12s %7s %14s %7s %10s %14s %7s\n", "Type", "N", "(%)",
+		   "Record size", "(%)", "FPIs", "FPI size", "(%)");
+	for (i = 0; i <= RM_MAX_ID; i++)
+	{
+		if (stats[i].records == 0)
+			continue;
+		printf("%-12s %12llu %6.2f%% %14llu %6.2f%% %10llu %14llu %6.2f%%\n",
+			   rmgr_names[i],
+			   (unsigned long long) stats[i].records,
+			   pct(stats[i].records, sum.records),
+			   (unsigned long long) stats[i].bytes,
+			   pct(stats[i].bytes, sum.bytes),
+			   (unsigned long long) stats[i].fpis,
+			   (unsigned long long) stats[i].fpi_bytes,
+			   pct(stats[i].fpi_bytes, sum.fpi_bytes));
+	}
+	printf("%-12s %12llu %7s %14llu %7s %10llu %14llu\n", "Total",
+		   (unsigned long long) sum.records, "",
+		   (unsigned long long) sum.bytes, "",
+		   (unsigned long long) sum.fpis,
+		   (unsigned long long) sum.fpi_bytes);
+	printf("\nFull page images are %.2f%% of the WAL volume\n",
+		   pct(sum.fpi_bytes, sum.bytes));
+	printf("%llu commits, %llu aborts", (unsigned long long) commits,
+		   (unsigned long long) aborts);
+	if (lasttime > firsttime)
+		printf(", %.2f transactions per second",
+			   (double) (commits + aborts) / (lasttime - firsttime));
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,609 @@
+/*
+ * walsummary.c - summaries of the blocks modified by the WAL
+ *
+ * An incremental backup only needs the relation blocks that have changed
+ * since the previous backup. Rather than reading the WAL again to find
+ * them, the block references in each record are picked out as the WAL is
+ * received, and for each completed segment a sorted list of the blocks
+ * modified in it is written to a file in the summaries directory. The
+ * blocks changed between two WAL locations are then the union of the
+ * summaries for the segments in between.
+ *
+ * Full page images always name the block they are for. Beyond that, we
+ * know the layout of the heap and btree records, which make up most of
+ * the WAL. For other records that start with a RelFileNode the whole
+ * relation is marked as changed, and a segment holding anything we can't
+ * attribute to a relation at all (such as CREATE DATABASE) is marked as
+ * lossy, meaning its summary can't be used for an incremental backup.
+ *
+ * The free space map isn't WAL-logged, and the visibility map is changed
+ * as a side effect of heap records, so only the main fork is tracked
+ * precisely; backup tools should copy the other forks in full.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include "pg_streamrecv.h"
+#include "access/htup.h"
+#include "access/nbtree.h"
+#include "catalog/storage.h"
+
+int			walsummary_enabled = 0;
+
+/* Block references collected for the segment currently being received */
+static BlockRef *refs = NULL;
+static uint32 nrefs = 0;
+static uint32 maxrefs = 0;
+static int	segment_lossy = 0;
+static uint64 desyncs_at_start = 0;
+static uint64 contskips_at_start = 0;
+static XLogDecoder *summary_decoder = NULL;
+
+
+static void
+add_block(RelFileNode *node, int fork, BlockNumber block)
+{
+	BlockRef   *ref;
+
+	/* Records touching the same block in a row are common, skip those */
+	if (nrefs > 0)
+	{
+		ref = &refs[nrefs - 1];
+		if (ref->block == block && ref->fork == fork &&
+			memcmp(&ref->node, node, sizeof(RelFileNode)) == 0)
+			return;
+	}
+
+	if (nrefs == maxrefs)
+	{
+		maxrefs = maxrefs ? maxrefs * 2 : 16384;
+		refs = realloc(refs, maxrefs * sizeof(BlockRef));
+		if (!refs)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	ref = &refs[nrefs++];
+	ref->node = *node;
+	ref->fork = fork;
+	ref->block = block;
+}
+
+/*
+ * Mark every block in every fork of a relation as changed.
+ */
+static void
+add_relation(RelFileNode *node)
+{
+	add_block(node, BLOCKREF_ALL_FORKS, InvalidBlockNumber);
+}
+
+static void
+summarize_heap(XLogRecord *record, char *data)
+{
+	uint8		info = record->xl_info & XLOG_HEAP_OPMASK;
+	xl_heaptid *target = (xl_heaptid *) data;
+
+	if (info == XLOG_HEAP_NEWPAGE)
+	{
+		xl_heap_newpage *xlrec = (xl_heap_newpage *) data;
+
+		if (record->xl_len < sizeof(xl_heap_newpage))
+		{
+			segment_lossy = 1;
+			return;
+		}
+		add_block(&xlrec->node, xlrec->forknum, xlrec->blkno);
+		return;
+	}
+
+	if (record->xl_len < sizeof(xl_heaptid))
+	{
+		segment_lossy = 1;
+		return;
+	}
+	add_block(&target->node, MAIN_FORKNUM,
+			  ItemPointerGetBlockNumber(&target->tid));
+
+	if (info == XLOG_HEAP_UPDATE || info == XLOG_HEAP_HOT_UPDATE ||
+		info == XLOG_HEAP_MOVE)
+	{
+		xl_heap_update *xlrec = (xl_heap_update *) data;
+
+		if (record->xl_len < sizeof(xl_heap_update))
+		{
+			segment_lossy = 1;
+			return;
+		}
+		add_block(&target->node, MAIN_FORKNUM,
+				  ItemPointerGetBlockNumber(&xlrec->newtid));
+	}
+}
+
+static void
+summarize_heap2(XLogRecord *record, char *data)
+{
+	uint8		info = record->xl_info & XLOG_HEAP_OPMASK;
+
+	if (info == XLOG_HEAP2_CLEANUP_INFO)
+		return;
+
+	/* freeze, clean and clean_move all start with the node and block */
+	if (record->xl_len < sizeof(RelFileNode) + sizeof(BlockNumber))
+	{
+		segment_lossy = 1;
+		return;
+	}
+	add_block((RelFileNode *) data, MAIN_FORKNUM,
+			  *(BlockNumber *) (data + sizeof(RelFileNode)));
+}
+
+static void
+summarize_btree(XLogRecord *record, char *data)
+{
+	uint8		info = record->xl_info & ~XLR_INFO_MASK;
+	RelFileNode *node = (RelFileNode *) data;
+
+	switch (info)
+	{
+		case XLOG_BTREE_INSERT_LEAF:
+		case XLOG_BTREE_INSERT_UPPER:
+		case XLOG_BTREE_INSERT_META:
+			{
+				xl_btreetid *target = (xl_btreetid *) data;
+
+				if (record->xl_len < sizeof(xl_btreetid))
+					break;
+				add_block(node, MAIN_FORKNUM,
+						  ItemPointerGetBlockNumber(&target->tid));
+				if (info == XLOG_BTREE_INSERT_META)
+					add_block(node, MAIN_FORKNUM, BTREE_METAPAGE);
+				return;
+			}
+		case XLOG_BTREE_SPLIT_L:
+		case XLOG_BTREE_SPLIT_R:
+		case XLOG_BTREE_SPLIT_L_ROOT:
+		case XLOG_BTREE_SPLIT_R_ROOT:
+			{
+				xl_btree_split *xlrec = (xl_btree_split *) data;
+
+				if (record->xl_len < sizeof(xl_btree_split))
+					break;
+				add_block(node, MAIN_FORKNUM, xlrec->leftsib);
+				add_block(node, MAIN_FORKNUM, xlrec->rightsib);
+				if (xlrec->rnext != P_NONE)
+					add_block(node, MAIN_FORKNUM, xlrec->rnext);
+				return;
+			}
+		case XLOG_BTREE_DELETE:
+		case XLOG_BTREE_VACUUM:
+			if (record->xl_len < sizeof(RelFileNode) + sizeof(BlockNumber))
+				break;
+			add_block(node, MAIN_FORKNUM,
+					  *(BlockNumber *) (data + sizeof(RelFileNode)));
+			return;
+		case XLOG_BTREE_DELETE_PAGE:
+		case XLOG_BTREE_DELETE_PAGE_META:
+		case XLOG_BTREE_DELETE_PAGE_HALF:
+			{
+				xl_btree_delete_page *xlrec = (xl_btree_delete_page *) data;
+
+				if (record->xl_len < sizeof(xl_btree_delete_page))
+					break;
+				add_block(node, MAIN_FORKNUM,
+						  ItemPointerGetBlockNumber(&xlrec->target.tid));
+				add_block(node, MAIN_FORKNUM, xlrec->deadblk);
+				if (xlrec->leftblk != P_NONE)
+					add_block(node, MAIN_FORKNUM, xlrec->leftblk);
+				add_block(node, MAIN_FORKNUM, xlrec->rightblk);
+				if (info == XLOG_BTREE_DELETE_PAGE_META)
+					add_block(node, MAIN_FORKNUM, BTREE_METAPAGE);
+				return;
+			}
+		case XLOG_BTREE_NEWROOT:
+			{
+				xl_btree_newroot *xlrec = (xl_btree_newroot *) data;
+
+				if (record->xl_len < sizeof(xl_btree_newroot))
+					break;
+				add_block(node, MAIN_FORKNUM, xlrec->rootblk);
+				add_block(node, MAIN_FORKNUM, BTREE_METAPAGE);
+				return;
+			}
+		case XLOG_BTREE_REUSE_PAGE:
+			/* Only used for conflict processing on standbys */
+			return;
+	}
+
+	/* Unknown or short record, so fall back to the whole relation */
+	if (record->xl_len >= sizeof(RelFileNode))
+		add_relation(node);
+	else
+		segment_lossy = 1;
+}
+
+static void
+walsummary_record(XLogDecoder *dec, XLogRecord *record, void *arg)
+{
+	char	   *data = XLogRecGetData(record);
+	BkpBlock   *bkp;
+	uint32		len;
+	int			i;
+
+	if (record->xl_info & XLR_BKP_BLOCK_MASK)
+	{
+		for (i = 0; i < XLR_MAX_BKP_BLOCKS; i++)
+		{
+			if ((bkp = xlogdecode_bkp_block(record, i, &len)) != NULL)
+				add_block(&bkp->node, bkp->fork, bkp->block);
+		}
+	}
+
+	switch (record->xl_rmid)
+	{
+		case RM_HEAP_ID:
+			summarize_heap(record, data);
+			break;
+		case RM_HEAP2_ID:
+			summarize_heap2(record, data);
+			break;
+		case RM_BTREE_ID:
+			summarize_btree(record, data);
+			break;
+		case RM_SMGR_ID:
+			/* Creation or truncation of a relation */
+			if ((record->xl_info & ~XLR_INFO_MASK) == XLOG_SMGR_TRUNCATE &&
+				record->xl_len >= sizeof(xl_smgr_truncate))
+				add_relation(&((xl_smgr_truncate *) data)->rnode);
+			else if (record->xl_len >= sizeof(xl_smgr_create))
+				add_relation(&((xl_smgr_create *) data)->rnode);
+			else
+				segment_lossy = 1;
+			break;
+		case RM_GIN_ID:
+		case RM_GIST_ID:
+		case RM_SEQ_ID:
+			/* These all start with the RelFileNode */
+			if (record->xl_len >= sizeof(RelFileNode))
+				add_relation((RelFileNode *) data);
+			else
+				segment_lossy = 1;
+			break;
+		case RM_XLOG_ID:
+		case RM_XACT_ID:
+		case RM_CLOG_ID:
+		case RM_TBLSPC_ID:
+		case RM_MULTIXACT_ID:
+		case RM_RELMAP_ID:
+		case RM_STANDBY_ID:
+			/* No relation blocks in these */
+			break;
+		default:
+			segment_lossy = 1;
+			break;
+	}
+}
+
+void
+walsummary_init(XLogDecoder *dec)
+{
+	char		dir[MAXPGPATH];
+	struct stat st;
+
+	snprintf(dir, sizeof(dir), "%s/%s", basedir, WALSUMMARY_DIR);
+	if (stat(dir, &st) != 0 && mkdir(dir, 0777) != 0)
+	{
+		fprintf(stderr, "Failed to create directory %s: %m\n", dir);
+		exit(1);
+	}
+
+	summary_decoder = dec;
+	desyncs_at_start = dec->desyncs;
+	contskips_at_start = dec->contskips;
+	xlogdecode_add_consumer(dec, walsummary_record, NULL);
+}
+
+static int
+blockref_cmp(const void *a, const void *b)
+{
+	const BlockRef *ra = a;
+	const BlockRef *rb = b;
+
+	if (ra->node.spcNode != rb->node.spcNode)
+		return ra->node.spcNode < rb->node.spcNode ? -1 : 1;
+	if (ra->node.dbNode != rb->node.dbNode)
+		return ra->node.dbNode < rb->node.dbNode ? -1 : 1;
+	if (ra->node.relNode != rb->node.relNode)
+		return ra->node.relNode < rb->node.relNode ? -1 : 1;
+	if (ra->fork != rb->fork)
+		return ra->fork < rb->fork ? -1 : 1;
+	if (ra->block != rb->block)
+		return ra->block < rb->block ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort the references and remove duplicates, returning the new count.
+ */
+static uint32
+sort_blockrefs(BlockRef *r, uint32 n)
+{
+	uint32		i,
+				out;
+
+	if (n == 0)
+		return 0;
+	qsort(r, n, sizeof(BlockRef), blockref_cmp);
+	for (i = 1, out = 1; i < n; i++)
+	{
+		if (blockref_cmp(&r[i], &r[out - 1]) != 0)
+			r[out++] = r[i];
+	}
+	return out;
+}
+
+/*
+ * Write out the summary for the segment that was just completed.
+ */
+void
+walsummary_finish_segment(const char *segname)
+{
+	char		fn[MAXPGPATH];
+	char		tmpfn[MAXPGPATH + 4];
+	ArchiveIndexEntry seginfo;
+	WalSummaryHeader hdr;
+	int			f;
+
+	/*
+	 * If the decoder lost track of the stream, or skipped the rest of a
+	 * record it never saw the start of, which happens for the first
+	 * segment received, we don't know all the blocks touched.
+	 */
+	if (summary_decoder->desyncs != desyncs_at_start ||
+		summary_decoder->contskips != contskips_at_start)
+		segment_lossy = 1;
+
+	nrefs = sort_blockrefs(refs, nrefs);
+
+	archive_index_fill_entry(&seginfo, segname, XLogSegSize);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = WALSUMMARY_MAGIC;
+	hdr.version = WALSUMMARY_VERSION;
+	hdr.startpoint = seginfo.startpoint;
+	hdr.endpoint = seginfo.endpoint;
+	hdr.tli = seginfo.tli;
+	hdr.flags = segment_lossy ? WALSUMMARY_LOSSY : 0;
+	hdr.count = nrefs;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s", basedir, WALSUMMARY_DIR, segname);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	f = open(tmpfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f == -1)
+	{
+		fprintf(stderr, "Failed to create summary %s: %m\n", tmpfn);
+		exit(1);
+	}
+	if (write(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		write(f, refs, nrefs * sizeof(BlockRef)) != nrefs * sizeof(BlockRef))
+	{
+		fprintf(stderr, "Failed to write summary %s: %m\n", tmpfn);
+		exit(1);
+	}
+	close(f);
+	if (rename(tmpfn, fn) != 0)
+	{
+		fprintf(stderr, "Failed to rename %s to %s: %m\n", tmpfn, fn);
+		exit(1);
+	}
+	if (verbose > 1)
+		printf("Wrote summary for %s, %u blocks%s\n", segname, nrefs,
+			   segment_lossy ? " (lossy)" : "");
+
+	nrefs = 0;
+	segment_lossy = 0;
+	desyncs_at_start = summary_decoder->desyncs;
+	contskips_at_start = summary_decoder->contskips;
+}
+
+
+static void
+blocks_usage(void)
+{
+	printf("Usage: pg_streamrecv blocks -d <directory> [-T <timeline>] <start location> <end location>\n");
+	exit(1);
+}
+
+static const char *
+fork_name(int fork)
+{
+	switch (fork)
+	{
+		case MAIN_FORKNUM:
+			return "main";
+		case FSM_FORKNUM:
+			return "fsm";
+		case VISIBILITYMAP_FORKNUM:
+			return "vm";
+		case BLOCKREF_ALL_FORKS:
+			return "*";
+	}
+	return "?";
+}
+
+static void
+print_blockrefs(BlockRef *r, uint32 n)
+{
+	uint32		i = 0;
+
+	while (i < n)
+	{
+		RelFileNode *node = &r[i].node;
+		int			fork = r[i].fork;
+
+		printf("%u/%u/%u %s ", node->spcNode, node->dbNode, node->relNode,
+			   fork_name(fork));
+		if (r[i].block == InvalidBlockNumber)
+		{
+			/* The whole relation, skip anything else for it */
+			printf("all\n");
+			while (i < n && memcmp(&r[i].node, node, sizeof(RelFileNode)) == 0)
+				i++;
+			continue;
+		}
+
+		/* Print runs of consecutive blocks as ranges */
+		while (i < n && r[i].fork == fork &&
+			   memcmp(&r[i].node, node, sizeof(RelFileNode)) == 0)
+		{
+			BlockNumber first = r[i].block;
+			BlockNumber last = first;
+
+			while (i + 1 < n && r[i + 1].fork == fork &&
+				   memcmp(&r[i + 1].node, node, sizeof(RelFileNode)) == 0 &&
+				   r[i + 1].block == last + 1)
+			{
+				i++;
+				last++;
+			}
+			i++;
+			if (first == last)
+				printf("%u", first);
+			else
+				printf("%u-%u", first, last);
+			if (i < n && r[i].fork == fork &&
+				memcmp(&r[i].node, node, sizeof(RelFileNode)) == 0)
+				printf(",");
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * "pg_streamrecv blocks" - list the blocks changed between two WAL
+ * locations, from the summaries of the segments in between.
+ */
+int
+blocks_main(int argc, char *argv[])
+{
+	XLogRecPtr	start,
+				end;
+	TimeLineID	tli = 0;
+	BlockRef   *all = NULL;
+	uint32		nall = 0;
+	uint32		log,
+				seg,
+				endlog,
+				endseg;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:T:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				basedir = strdup(optarg);
+				break;
+			case 'T':
+				tli = atoi(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			default:
+				blocks_usage();
+		}
+	}
+	if (!basedir || optind != argc - 2)
+		blocks_usage();
+	if (sscanf(argv[optind], "%X/%X", &start.xlogid, &start.xrecoff) != 2 ||
+		sscanf(argv[optind + 1], "%X/%X", &end.xlogid, &end.xrecoff) != 2 ||
+		!XLByteLT(start, end))
+	{
+		fprintf(stderr, "Invalid WAL range: %s - %s\n", argv[optind],
+				argv[optind + 1]);
+		exit(1);
+	}
+
+	/* Get the timeline from the archive index, unless given */
+	if (tli == 0)
+	{
+		ArchiveIndex *idx = archive_index_open(basedir);
+		ArchiveIndexEntry *entry;
+
+		if (idx && (entry = archive_index_lookup(idx, start)) != NULL)
+			tli = entry->tli;
+		else
+			tli = 1;
+		if (idx)
+			archive_index_close(idx);
+	}
+
+	XLByteToSeg(start, log, seg);
+	XLByteToPrevSeg(end, endlog, endseg);
+	while (log < endlog || (log == endlog && seg <= endseg))
+	{
+		char		segname[MAXFNAMELEN];
+		char		fn[MAXPGPATH];
+		WalSummaryHeader hdr;
+		int			f;
+
+		XLogFileName(segname, tli, log, seg);
+		snprintf(fn, sizeof(fn), "%s/%s/%s", basedir, WALSUMMARY_DIR, segname);
+		f = open(fn, O_RDONLY);
+		if (f == -1)
+		{
+			fprintf(stderr, "No summary for segment %s: %m\n", segname);
+			exit(1);
+		}
+		if (read(f, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			hdr.magic != WALSUMMARY_MAGIC || hdr.version != WALSUMMARY_VERSION)
+		{
+			fprintf(stderr, "Invalid summary file %s\n", fn);
+			exit(1);
+		}
+		if (hdr.flags & WALSUMMARY_LOSSY)
+		{
+			fprintf(stderr, "Summary for segment %s is incomplete\n", segname);
+			exit(1);
+		}
+
+		all = realloc(all, (nall + hdr.count) * sizeof(BlockRef));
+		if (!all && nall + hdr.count > 0)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		if (read(f, all + nall, hdr.count * sizeof(BlockRef)) !=
+			hdr.count * sizeof(BlockRef))
+		{
+			fprintf(stderr, "Failed to read summary file %s\n", fn);
+			exit(1);
+		}
+		close(f);
+		nall += hdr.count;
+
+		if (verbose)
+			fprintf(stderr, "Read summary for %s, %u blocks\n", segname,
+					hdr.count);
+		NextLogSeg(log, seg);
+	}
+
+	nall = sort_blockrefs(all, nall);
+	print_blockrefs(all, nall);
+	free(all);
+	return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * xlogdecode.c - incremental decoder for WAL records in the replication
+ *				  stream
+ *
+ * The decoder is fed the same bytes that are written to the segment
+ * files, in whatever chunks they arrive in, and reassembles complete WAL
+ * records from them. Each complete record is handed to the registered
+ * consumers. Records that fit on a single page are still copied into the
+ * record buffer, but the buffer is only ever grown, so decoding doesn't
+ * allocate anything per record.
+ *
+ * If the decoder gets confused by what it sees (which should only happen
+ * if the stream doesn't start at a record boundary) it skips ahead to the
+ * next page header and picks up from there.
+ *
+ *
+ * Copyright (c) 2010 PostgreSQL Global Development Group
+ * Copyright (c) 2010 Magnus Hagander <magnus@hagander.net>
+ *
+ * This software is released under the PostgreSQL Licence
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pg_streamrecv.h"
+#include "access/xact.h"
+
+/* xl_info values for the xlog resource manager that we care about */
+#define XLOG_SWITCH		0x40
+
+/* Sanity limit for the total length of a record */
+#define MAX_RECORD_LEN	(1024 * 1024 * 1024)
+
+const char *const rmgr_names[RM_MAX_ID + 1] = {
+	"XLOG", "Transaction", "Storage", "CLOG", "Database", "Tablespace",
+	"MultiXact", "RelMap", "Standby", "Heap2", "Heap", "Btree", "Hash",
+	"Gin", "Gist", "Sequence"
+};
+
+
+static void
+advance(XLogDecoder *dec, uint32 n)
+{
+	dec->pos.xrecoff += n;
+	if (dec->pos.xrecoff >= XLogFileSize)
+	{
+		dec->pos.xlogid++;
+		dec->pos.xrecoff -= XLogFileSize;
+	}
+}
+
+/*
+ * Skip the given number of bytes, then continue in the given state.
+ */
+static void
+skip(XLogDecoder *dec, uint32 n, int nextstate)
+{
+	dec->state = DS_SKIP;
+	dec->skipremain = n;
+	dec->afterskip = nextstate;
+}
+
+/*
+ * Lost track of the stream. Throw away any partial record and resync
+ * at the next page header.
+ */
+static void
+desync(XLogDecoder *dec, const char *reason)
+{
+	if (verbose > 1)
+		printf("WAL decoder lost sync at %X/%08X: %s\n",
+			   dec->pos.xlogid, dec->pos.xrecoff, reason);
+	dec->inrecord = 0;
+	dec->desyncs++;
+	skip(dec, XLOG_BLCKSZ - dec->pos.xrecoff % XLOG_BLCKSZ, DS_RECSTART);
+}
+
+/*
+ * Go to the start of the next record, which is always MAXALIGNed.
+ */
+static void
+skip_to_next_record(XLogDecoder *dec)
+{
+	uint32		pageoff = dec->pos.xrecoff % XLOG_BLCKSZ;
+
+	skip(dec, MAXALIGN(pageoff) - pageoff, DS_RECSTART);
+}
+
+static void
+record_done(XLogDecoder *dec)
+{
+	XLogRecord *record = (XLogRecord *) dec->recbuf;
+	int			i;
+
+	dec->inrecord = 0;
+	dec->records++;
+	for (i = 0; i < dec->nconsumers; i++)
+		dec->consumers[i].callback(dec, record, dec->consumers[i].arg);
+
+	if (record->xl_rmid == RM_XLOG_ID &&
+		(record->xl_info & ~XLR_INFO_MASK) == XLOG_SWITCH)
+	{
+		/* The rest of the segment is unused after a switch */
+		skip(dec, (XLogSegSize - dec->pos.xrecoff % XLogSegSize) % XLogSegSize,
+			 DS_RECSTART);
+		return;
+	}
+	skip_to_next_record(dec);
+}
+
+static void
+page_header_done(XLogDecoder *dec)
+{
+	XLogPageHeader hdr = (XLogPageHeader) dec->pagehdr;
+	uint32		pagestart = dec->pos.xrecoff - dec->hdrlen;
+
+	if (hdr->xlp_magic != XLOG_PAGE_MAGIC ||
+		hdr->xlp_pageaddr.xlogid != dec->pos.xlogid ||
+		hdr->xlp_pageaddr.xrecoff != pagestart)
+	{
+		desync(dec, "invalid page header");
+		return;
+	}
+	dec->tli = hdr->xlp_tli;
+
+	if (hdr->xlp_info & XLP_FIRST_IS_CONTRECORD)
+	{
+		dec->state = DS_CONTHDR;
+		dec->hdrgot = 0;
+		return;
+	}
+
+	if (dec->inrecord)
+	{
+		desync(dec, "continuation record expected");
+		return;
+	}
+	dec->state = DS_RECSTART;
+}
+
+/*
+ * Make sure the record buffer can hold len bytes.
+ */
+static void
+enlarge_recbuf(XLogDecoder *dec, uint32 len)
+{
+	if (len <= dec->recbufsize)
+		return;
+	dec->recbufsize = Max(len, Max(dec->recbufsize * 2, BLCKSZ));
+	dec->recbuf = realloc(dec->recbuf, dec->recbufsize);
+	if (!dec->recbuf)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+}
+
+void
+xlogdecode_init(XLogDecoder *dec)
+{
+	memset(dec, 0, sizeof(XLogDecoder));
+	enlarge_recbuf(dec, BLCKSZ);
+	dec->positioned = 0;
+}
+
+void
+xlogdecode_add_consumer(XLogDecoder *dec, XLogRecordCallback callback,
+						void *arg)
+{
+	if (dec->nconsumers >= MAX_DECODE_CONSUMERS)
+	{
+		fprintf(stderr, "Too many WAL decoder consumers\n");
+		exit(1);
+	}
+	dec->consumers[dec->nconsumers].callback = callback;
+	dec->consumers[dec->nconsumers].arg = arg;
+	dec->nconsumers++;
+}
+
+/*
+ * Feed a chunk of WAL starting at startpoint to the decoder. If the
+ * chunk doesn't follow on from the previous one, decoding restarts at
+ * the next page boundary. A consumer can set dec->stop to have the rest
+ * of the chunk ignored.
+ */
+void
+xlogdecode_feed(XLogDecoder *dec, XLogRecPtr startpoint, const char *data,
+				uint32 len)
+{
+	if (!dec->positioned || !XLByteEQ(dec->pos, startpoint))
+	{
+		dec->pos = startpoint;
+		dec->positioned = 1;
+		dec->inrecord = 0;
+		skip(dec, (XLOG_BLCKSZ - startpoint.xrecoff % XLOG_BLCKSZ) % XLOG_BLCKSZ,
+			 DS_RECSTART);
+	}
+
+	while (len > 0 && !dec->stop)
+	{
+		uint32		pageoff = dec->pos.xrecoff % XLOG_BLCKSZ;
+		uint32		n;
+
+		if (pageoff == 0 && dec->state != DS_PAGEHDR && dec->state != DS_SKIP)
+		{
+			dec->state = DS_PAGEHDR;
+			dec->hdrgot = 0;
+			dec->hdrlen = (dec->pos.xrecoff % XLogSegSize == 0) ?
+				SizeOfXLogLongPHD : SizeOfXLogShortPHD;
+		}
+
+		switch (dec->state)
+		{
+			case DS_SKIP:
+				n = Min(len, dec->skipremain);
+				dec->skipremain -= n;
+				if (dec->skipremain == 0)
+					dec->state = dec->afterskip;
+				break;
+
+			case DS_PAGEHDR:
+				n = Min(len, dec->hdrlen - dec->hdrgot);
+				memcpy(dec->pagehdr + dec->hdrgot, data, n);
+				dec->hdrgot += n;
+				if (dec->hdrgot == dec->hdrlen)
+				{
+					advance(dec, n);
+					data += n;
+					len -= n;
+					page_header_done(dec);
+					continue;
+				}
+				break;
+
+			case DS_CONTHDR:
+				n = Min(len, SizeOfXLogContRecord - dec->hdrgot);
+				memcpy(dec->pagehdr + dec->hdrgot, data, n);
+				dec->hdrgot += n;
+				if (dec->hdrgot == SizeOfXLogContRecord)
+				{
+					uint32		rem_len;
+
+					memcpy(&rem_len, dec->pagehdr, sizeof(uint32));
+					advance(dec, n);
+					data += n;
+					len -= n;
+
+					if (dec->inrecord && rem_len != dec->rectotal - dec->recgot)
+					{
+						desync(dec, "continuation record has wrong length");
+						continue;
+					}
+					if (!dec->inrecord)
+						dec->contskips++;
+					/*
+					 * An empty remainder is handled by the DS_CONTDATA case
+					 * on the next round.
+					 */
+					dec->state = DS_CONTDATA;
+					dec->contremain = Min(rem_len,
+						XLOG_BLCKSZ - dec->pos.xrecoff % XLOG_BLCKSZ);
+					continue;
+				}
+				break;
+
+			case DS_CONTDATA:
+				n = Min(len, dec->contremain);
+				if (dec->inrecord)
+				{
+					memcpy(dec->recbuf + dec->recgot, data, n);
+					dec->recgot += n;
+				}
+				dec->contremain -= n;
+				if (dec->contremain == 0)
+				{
+					advance(dec, n);
+					data += n;
+					len -= n;
+					if (dec->inrecord && dec->recgot == dec->rectotal)
+						record_done(dec);
+					else if (dec->pos.xrecoff % XLOG_BLCKSZ != 0)
+					{
+						if (dec->inrecord)
+							desync(dec, "continuation record too short");
+						else
+							skip_to_next_record(dec);
+					}
+					/* otherwise the record goes on on the next page */
+					continue;
+				}
+				break;
+
+			case DS_RECSTART:
+				if (XLOG_BLCKSZ - pageoff < SizeOfXLogRecord)
+				{
+					/* Records never start this close to the end of a page */
+					skip(dec, XLOG_BLCKSZ - pageoff, DS_RECSTART);
+					continue;
+				}
+				dec->state = DS_RECORD;
+				dec->inrecord = 1;
+				dec->recstart = dec->pos;
+				dec->recgot = 0;
+				dec->rectotal = 0;
+				continue;
+
+			case DS_RECORD:
+				if (dec->rectotal == 0)
+				{
+					XLogRecord *record = (XLogRecord *) dec->recbuf;
+
+					/* The record header is never split across pages */
+					n = Min(len, SizeOfXLogRecord - dec->recgot);
+					memcpy(dec->recbuf + dec->recgot, data, n);
+					dec->recgot += n;
+					if (dec->recgot < SizeOfXLogRecord)
+						break;
+
+					advance(dec, n);
+					data += n;
+					len -= n;
+					if (record->xl_tot_len < SizeOfXLogRecord + record->xl_len ||
+						record->xl_tot_len > MAX_RECORD_LEN ||
+						record->xl_rmid > RM_MAX_ID)
+					{
+						desync(dec, "invalid record header");
+						continue;
+					}
+					enlarge_recbuf(dec, record->xl_tot_len);
+					dec->rectotal = ((XLogRecord *) dec->recbuf)->xl_tot_len;
+					if (dec->recgot == dec->rectotal)
+						record_done(dec);
+					continue;
+				}
+
+				n = Min(len, Min(dec->rectotal - dec->recgot,
+								 XLOG_BLCKSZ - pageoff));
+				memcpy(dec->recbuf + dec->recgot, data, n);
+				dec->recgot += n;
+				if (dec->recgot == dec->rectotal)
+				{
+					advance(dec, n);
+					data += n;
+					len -= n;
+					record_done(dec);
+					continue;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "Invalid WAL decoder state %i\n", dec->state);
+				exit(1);
+		}
+
+		advance(dec, n);
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Position the decoder at a known record boundary, for reading WAL from
+ * somewhere other than the start of a page. The next chunk fed must
+ * start at recptr.
+ */
+void
+xlogdecode_start_at_record(XLogDecoder *dec, XLogRecPtr recptr)
+{
+	dec->pos = recptr;
+	dec->positioned = 1;
+	dec->inrecord = 0;
+	if (recptr.xrecoff % XLOG_BLCKSZ == 0)
+		dec->state = DS_RECSTART;	/* page header is handled first */
+	else
+		skip_to_next_record(dec);
+}
+
+/*
+ * Get the commit or abort timestamp from a transaction record. Returns
+ * 0 if it's not a record that has one.
+ */
+int
+xlogdecode_xact_time(XLogRecord *record, TimestampTz *xact_time)
+{
+	char	   *data = XLogRecGetData(record);
+	uint32		offset;
+
+	if (record->xl_rmid != RM_XACT_ID)
+		return 0;
+
+	switch (record->xl_info & ~XLR_INFO_MASK)
+	{
+		case XLOG_XACT_COMMIT:
+			offset = offsetof(xl_xact_commit, xact_time);
+			break;
+		case XLOG_XACT_ABORT:
+			offset = offsetof(xl_xact_abort, xact_time);
+			break;
+		case XLOG_XACT_COMMIT_PREPARED:
+			offset = offsetof(xl_xact_commit_prepared, crec) +
+				offsetof(xl_xact_commit, xact_time);
+			break;
+		case XLOG_XACT_ABORT_PREPARED:
+			offset = offsetof(xl_xact_abort_prepared, arec) +
+				offsetof(xl_xact_abort, xact_time);
+			break;
+		default:
+			return 0;
+	}
+	if (record->xl_len < offset + sizeof(TimestampTz))
+		return 0;
+	memcpy(xact_time, data + offset, sizeof(TimestampTz));
+	return 1;
+}
+
+/*
+ * Get the backup block number i from a record, if it has one. Returns
+ * a pointer to the block header, which is followed by the page image
+ * with the hole left out, or NULL if the record doesn't have that block.
+ * The total size of header and image is returned in len.
+ */
+BkpBlock *
+xlogdecode_bkp_block(XLogRecord *record, int i, uint32 *len)
+{
+	char	   *blk = XLogRecGetData(record) + record->xl_len;
+	char	   *end = (char *) record + record->xl_tot_len;
+	BkpBlock	bkpb;
+	int			j;
+
+	for (j = 0; j <= i; j++)
+	{
+		if (!(record->xl_info & XLR_SET_BKP_BLOCK(j)))
+		{
+			if (j == i)
+				return NULL;
+			continue;
+		}
+		if (blk + sizeof(BkpBlock) > end)
+			return NULL;
+		memcpy(&bkpb, blk, sizeof(BkpBlock));
+		if (bkpb.hole_offset + bkpb.hole_length > BLCKSZ)
+			return NULL;
+		*len = sizeof(BkpBlock) + BLCKSZ - bkpb.hole_length;
+		if (blk + *len > end)
+			return NULL;
+		if (j == i)
+			return (BkpBlock *) blk;
+		blk += *len;
+	}
+	return NULL;
+}
+
+/*
+ * Compute the CRC of a complete record the way the backend does, over the
+ * data and backup blocks first and then the header without the CRC field.
+ */
+pg_crc32
+xlogdecode_record_crc(XLogRecord *record)
+{
+	pg_crc32	crc;
+
+	INIT_WALCRC(crc);
+	COMP_WALCRC(crc, XLogRecGetData(record),
+				record->xl_tot_len - SizeOfXLogRecord);
+	COMP_WALCRC(crc, (char *) record + sizeof(pg_crc32),
+				SizeOfXLogRecord - sizeof(pg_crc32));
+	FIN_WALCRC(crc);
+	return crc;
+}